@@ -0,0 +1,173 @@
+#!/usr/bin/perl
+use strict;
+use warnings;
+use FindBin;
+use lib "$FindBin::Bin/lib";
+use Getopt::Long;
+use JSON::PP;
+use Config;
+use POSIX qw(strftime);
+use RSBench;
+use RSBench::Footprint;
+
+GetOptions(
+    'b|backends=s'      => \my $Backends,
+    'k|kinds=s'         => \my $Kinds,
+    'n|count=s'         => \my $Count,
+    'keys-per-value=i'  => \my $KeysPerValue,
+    'o|output=s'        => \my $Output,
+    'limits=s'          => \my $Limits,
+    'save-limits=s'     => \my $SaveLimits,
+    'slack=f'           => \my $Slack,
+    'l|list'            => \my $List,
+    'h|help'            => \my $Help,
+) or usage(1);
+
+usage(0) if $Help;
+
+if($List) {
+    print "Backends: @RSBench::BackendOrder\n";
+    print "Kinds:    @RSBench::Footprint::KindOrder\n";
+    exit(0);
+}
+
+my @backends = $Backends ? split(/,/, $Backends) : @RSBench::BackendOrder;
+my @kinds = $Kinds ? split(/,/, $Kinds) : @RSBench::Footprint::KindOrder;
+$Count = $Count ? parse_size($Count) : 100_000;
+$KeysPerValue ||= 4;
+$Slack = 10 unless defined $Slack;
+
+foreach my $kname (@kinds) {
+    die "Unknown kind '$kname'" unless $RSBench::Footprint::Kinds{$kname};
+}
+
+#A missing limits file is an error, lest the check silently pass. Checked
+#before measuring, unless this run is recording it
+if($Limits && !-e $Limits && !($SaveLimits && $SaveLimits eq $Limits)) {
+    die "No limits recorded in $Limits, use --save-limits to record them\n";
+}
+
+my @results;
+foreach my $bname (@backends) {
+    if(!RSBench::backend_available($bname)) {
+        warn "Skipping unavailable backend $bname: $@";
+        next;
+    }
+    foreach my $kname (@kinds) {
+        next unless RSBench::Footprint::applicable($bname, $kname);
+        my $res = RSBench::Footprint::measure(
+            backend => $bname, kind => $kname,
+            count => $Count, keys_per_value => $KeysPerValue);
+        printf STDERR ("%-10s %-12s %10d %10s rss/entry %10s est/entry\n",
+            $bname, $kname, $Count,
+            fmt_bytes($res->{rss_per_entry}),
+            fmt_bytes($res->{estimate_per_entry}));
+        push @results, $res;
+    }
+}
+
+my $doc = {
+    meta => {
+        date        => strftime("%Y-%m-%dT%H:%M:%SZ", gmtime),
+        perl        => sprintf("%vd", $^V),
+        archname    => $Config{archname},
+        ref_store   => scalar eval { require Ref::Store; $Ref::Store::VERSION },
+        count       => $Count,
+    },
+    results => \@results,
+};
+
+my $json = JSON::PP->new->canonical->pretty;
+if($Output) {
+    write_file($Output, $json->encode($doc));
+} elsif(!$Limits && !$SaveLimits) {
+    print $json->encode($doc);
+}
+
+#Limits are keyed by backend and kind. Both the RSS and the estimate are
+#checked, where a limit for them was recorded
+if($SaveLimits) {
+    my %limits;
+    foreach my $res (@results) {
+        foreach my $field (qw(rss_per_entry estimate_per_entry)) {
+            next unless defined $res->{$field};
+            $limits{$res->{backend}}->{$res->{kind}}->{$field} =
+                int($res->{$field} * (1 + $Slack / 100) + 1);
+        }
+    }
+    write_file($SaveLimits, $json->encode(\%limits));
+    print STDERR "Limits written to $SaveLimits ($Slack% slack)\n";
+}
+
+if($Limits) {
+    my $limits = do {
+        open my $fh, "<", $Limits or die "Couldn't open $Limits: $!";
+        local $/;
+        JSON::PP->new->decode(scalar <$fh>);
+    };
+    my $failed = 0;
+    foreach my $res (@results) {
+        my $limit = $limits->{$res->{backend}}->{$res->{kind}} or next;
+        foreach my $field (sort keys %$limit) {
+            next unless defined $res->{$field};
+            next if $res->{$field} <= $limit->{$field};
+            printf STDERR ("FAIL %s %s: %s is %.1f bytes, limit %d\n",
+                $res->{backend}, $res->{kind}, $field,
+                $res->{$field}, $limit->{$field});
+            $failed++;
+        }
+    }
+    if($failed) {
+        exit(1);
+    }
+    print STDERR "All footprints within $Limits\n";
+}
+
+sub write_file {
+    my ($path,$content) = @_;
+    open my $fh, ">", $path or die "Couldn't open $path: $!";
+    print $fh $content;
+    close($fh);
+}
+
+sub fmt_bytes {
+    my $n = shift;
+    return defined $n ? sprintf("%.1f", $n) : "-";
+}
+
+sub parse_size {
+    my $s = shift;
+    my %mult = (k => 1e3, m => 1e6);
+    $s =~ /^(\d+)([km]?)$/i or die "Bad count '$s'";
+    return $1 * ($2 ? $mult{lc $2} : 1);
+}
+
+sub usage {
+    my $status = shift;
+    print <<"USAGE";
+$0 [options]
+
+Loads tables with each kind of entry, and reports the bytes used per entry,
+both as the growth of the process' resident set and as estimated by the
+backend itself (memory_usage). Each measurement runs in its own process.
+
+  -b, --backends        Comma-separated backends (default: all available)
+  -k, --kinds           Comma-separated entry kinds (default: all)
+  -n, --count           Entries per table, with optional k/m suffix
+                        (default: 100k)
+      --keys-per-value  Keys per value for the multi_key kind (default: 4)
+  -o, --output          Write JSON to this file
+      --limits          Fail if any bytes/entry exceeds the limits in this file
+      --save-limits     Record the current footprint as limits in this file
+      --slack           Headroom added by --save-limits, in percent
+                        (default: 10)
+  -l, --list            List backends and entry kinds
+
+From the build directory, `make footprint` checks against
+bench/footprint-limits.json, and fails if no limits have been recorded there.
+Record them with:
+
+  make footprint FOOTPRINT_ARGS="--save-limits bench/footprint-limits.json"
+USAGE
+    exit($status);
+}
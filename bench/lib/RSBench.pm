@@ -0,0 +1,422 @@
+package RSBench::Value;
+use strict;
+use warnings;
+
+sub new {
+    my ($cls,$id) = @_;
+    my $v = $id;
+    bless \$v, $cls;
+}
+
+package RSBench::Key;
+our @ISA = qw(RSBench::Value);
+
+package RSBench::Baseline::Hash;
+#Plain hashes with weakened values, maintaining a reverse index by hand. This
+#is roughly what one would write without Ref::Store
+use strict;
+use warnings;
+use Scalar::Util qw(weaken);
+
+sub new {
+    my $cls = shift;
+    bless { fwd => {}, rev => {}, attr => {} }, $cls;
+}
+
+sub store {
+    my ($self,$k,$v) = @_;
+    weaken($self->{fwd}->{$k} = $v);
+    $self->{rev}->{$v+0}->{$k} = 1;
+}
+
+sub fetch {
+    $_[0]->{fwd}->{$_[1]};
+}
+
+sub unlink {
+    my ($self,$k) = @_;
+    my $v = delete $self->{fwd}->{$k};
+    delete $self->{rev}->{$v+0}->{$k} if $v;
+    return $v;
+}
+
+sub purge {
+    my ($self,$v) = @_;
+    my $keys = delete $self->{rev}->{$v+0} or return;
+    delete @{$self->{fwd}}{keys %$keys};
+    delete $_->{$v+0} for values %{$self->{attr}};
+    return $v;
+}
+
+sub register_kt { }
+
+sub store_a {
+    my ($self,$attr,$t,$v) = @_;
+    weaken($self->{attr}->{"$t#$attr"}->{$v+0} = $v);
+}
+
+sub fetch_a {
+    my ($self,$attr,$t) = @_;
+    my $h = $self->{attr}->{"$t#$attr"} or return;
+    return values %$h;
+}
+
+sub iterate {
+    my $self = shift;
+    my $n = 0;
+    while (my ($k,$v) = each %{$self->{fwd}}) {
+        $n++;
+    }
+    return $n;
+}
+
+package RSBench::Baseline::FieldHash;
+#Hash::Util::FieldHash: garbage-collected object keys, but no reverse lookups
+use strict;
+use warnings;
+use Hash::Util::FieldHash qw(fieldhash);
+use Scalar::Util qw(weaken);
+
+sub new {
+    my $cls = shift;
+    fieldhash my %fwd;
+    bless { fwd => \%fwd }, $cls;
+}
+
+sub store {
+    my ($self,$k,$v) = @_;
+    weaken($self->{fwd}->{$k} = $v);
+}
+
+sub fetch {
+    $_[0]->{fwd}->{$_[1]};
+}
+
+sub unlink {
+    delete $_[0]->{fwd}->{$_[1]};
+}
+
+sub iterate {
+    my $self = shift;
+    my $n = 0;
+    while (my ($k,$v) = each %{$self->{fwd}}) {
+        $n++;
+    }
+    return $n;
+}
+
+package RSBench;
+use strict;
+use warnings;
+use Config;
+use Time::HiRes qw(time);
+
+our %Backends = (
+    XS          => { class => 'Ref::Store::XS', threads => 1 },
+    PP          => { class => 'Ref::Store::PP' },
+    Sweeping    => { class => 'Ref::Store::Sweeping', sweep => 1 },
+    hash        => { class => 'RSBench::Baseline::Hash', baseline => 1,
+                     threads => 1 },
+    fieldhash   => { class => 'RSBench::Baseline::FieldHash', baseline => 1,
+                     threads => 1 },
+);
+
+our @BackendOrder = qw(XS PP Sweeping hash fieldhash);
+
+#Each workload has an optional setup, which returns the state passed to the
+#timed 'run' sub. 'run' returns the number of operations performed. Baselines
+#are only run for workloads whose 'needs' methods they implement, and no
+#backend is run for a workload whose 'requires' methods it lacks.
+our %Workloads;
+our @WorkloadOrder;
+
+sub workload {
+    my ($name,%spec) = @_;
+    $Workloads{$name} = \%spec;
+    push @WorkloadOrder, $name;
+}
+
+sub populate {
+    my ($table,$n,%opts) = @_;
+    my @values = map { RSBench::Value->new($_) } (1..$n);
+    my @keys;
+    foreach my $i (0..$n-1) {
+        $table->store("k$i", $values[$i]);
+    }
+    if($opts{objkeys}) {
+        @keys = map { RSBench::Key->new($_) } (1..$n);
+        $table->store($keys[$_], $values[$_]) for (0..$n-1);
+    }
+    if($opts{attrs}) {
+        $table->register_kt('bench');
+        $table->store_a($_ % 16, 'bench', $values[$_]) for (0..$n-1);
+    }
+    return { table => $table, values => \@values, keys => \@keys };
+}
+
+workload key_store => (
+    needs => [qw(store)],
+    run => sub {
+        my ($st,$n) = @_;
+        my $t = $st->{table};
+        my $values = $st->{values};
+        $t->store("k$_", $values->[$_]) for (0..$n-1);
+        return $n;
+    },
+    setup => sub {
+        my ($t,$n) = @_;
+        return { table => $t,
+                 values => [ map { RSBench::Value->new($_) } (1..$n) ] };
+    },
+);
+
+workload objkey_store => (
+    needs => [qw(store)],
+    setup => sub {
+        my ($t,$n) = @_;
+        return { table => $t,
+                 keys   => [ map { RSBench::Key->new($_) } (1..$n) ],
+                 values => [ map { RSBench::Value->new($_) } (1..$n) ] };
+    },
+    run => sub {
+        my ($st,$n) = @_;
+        my ($t,$keys,$values) = @{$st}{qw(table keys values)};
+        $t->store($keys->[$_], $values->[$_]) for (0..$n-1);
+        return $n;
+    },
+);
+
+workload objkey_fetch => (
+    needs => [qw(store fetch)],
+    setup => sub {
+        my ($t,$n) = @_;
+        return populate($t, $n, objkeys => 1);
+    },
+    run => sub {
+        my ($st,$n) = @_;
+        my ($t,$keys) = @{$st}{qw(table keys)};
+        my $found = 0;
+        $t->fetch($keys->[$_]) && $found++ for (0..$n-1);
+        die "Object key fetch returned $found/$n" unless $found == $n;
+        return $n;
+    },
+);
+
+workload attr_store => (
+    needs => [qw(store_a)],
+    setup => sub {
+        my ($t,$n) = @_;
+        $t->register_kt('bench');
+        return { table => $t,
+                 values => [ map { RSBench::Value->new($_) } (1..$n) ] };
+    },
+    run => sub {
+        my ($st,$n) = @_;
+        my ($t,$values) = @{$st}{qw(table values)};
+        $t->store_a($_ % 16, 'bench', $values->[$_]) for (0..$n-1);
+        return $n;
+    },
+);
+
+workload attr_fetch => (
+    needs => [qw(store_a fetch_a)],
+    setup => sub {
+        my ($t,$n) = @_;
+        return populate($t, $n, attrs => 1);
+    },
+    run => sub {
+        my ($st,$n) = @_;
+        my $t = $st->{table};
+        my $total = 0;
+        $total += () = $t->fetch_a($_, 'bench') for (0..15);
+        die "Attribute fetch returned $total/$n" unless $total == $n;
+        return 16;
+    },
+);
+
+workload fetch_hit => (
+    needs => [qw(fetch)],
+    setup => sub { populate($_[0], $_[1]) },
+    run => sub {
+        my ($st,$n) = @_;
+        my $t = $st->{table};
+        my $found = 0;
+        $t->fetch("k$_") && $found++ for (0..$n-1);
+        die "Fetch returned $found/$n" unless $found == $n;
+        return $n;
+    },
+);
+
+#Fetching into an existing variable, for backends which support it
+workload fetch_into => (
+    needs => [qw(fetch_into)],
+    requires => [qw(fetch_into)],
+    setup => sub { populate($_[0], $_[1]) },
+    run => sub {
+        my ($st,$n) = @_;
+        my $t = $st->{table};
+        my ($found,$v) = (0);
+        $t->fetch_into("k$_", $v) && $found++ for (0..$n-1);
+        die "Fetch returned $found/$n" unless $found == $n;
+        return $n;
+    },
+);
+
+workload fetch_miss => (
+    needs => [qw(fetch)],
+    setup => sub { populate($_[0], $_[1]) },
+    run => sub {
+        my ($st,$n) = @_;
+        my $t = $st->{table};
+        $t->fetch("missing$_") for (0..$n-1);
+        return $n;
+    },
+);
+
+workload unlink => (
+    needs => [qw(unlink)],
+    setup => sub { populate($_[0], $_[1]) },
+    run => sub {
+        my ($st,$n) = @_;
+        my $t = $st->{table};
+        $t->unlink("k$_") for (0..$n-1);
+        return $n;
+    },
+);
+
+workload purge => (
+    needs => [qw(purge store_a)],
+    setup => sub { populate($_[0], $_[1], attrs => 1) },
+    run => sub {
+        my ($st,$n) = @_;
+        my ($t,$values) = @{$st}{qw(table values)};
+        $t->purge($_) for @$values;
+        return $n;
+    },
+);
+
+#Values going out of scope, and the back-deletes this triggers
+workload cascade => (
+    needs => [qw(store_a)],
+    setup => sub { populate($_[0], $_[1], attrs => 1) },
+    run => sub {
+        my ($st,$n,$backend) = @_;
+        @{$st->{values}} = ();
+        if($backend->{sweep}) {
+            $st->{table}->sweep();
+        }
+        return $n;
+    },
+);
+
+workload iterate => (
+    needs => [qw(iterate)],
+    setup => sub { populate($_[0], $_[1]) },
+    run => sub {
+        my ($st,$n) = @_;
+        my $t = $st->{table};
+        if($t->can('iterate')) {
+            return $t->iterate();
+        }
+        my $count = 0;
+        $t->iterinit(OnlyKeys => 1);
+        while (my @ent = $t->iter()) {
+            $count++;
+        }
+        $t->iterdone();
+        return $count;
+    },
+);
+
+#Cost of duplicating a populated table into a new thread
+workload thread_clone => (
+    needs => [],
+    threads => 1,
+    setup => sub { populate($_[0], $_[1]) },
+    run => sub {
+        my ($st,$n) = @_;
+        my $thr = threads->create(sub { 1 });
+        $thr->join();
+        return 1;
+    },
+);
+
+sub have_threads {
+    return $Config{useithreads} && eval { require threads; 1 };
+}
+
+sub backend_available {
+    my $name = shift;
+    my $spec = $Backends{$name} or die "Unknown backend '$name'";
+    return 1 if $spec->{baseline};
+    return eval "require $spec->{class}; 1";
+}
+
+sub applicable {
+    my ($bname,$wname) = @_;
+    my $backend = $Backends{$bname};
+    my $wl = $Workloads{$wname};
+    if($wl->{threads} && !($backend->{threads} && have_threads())) {
+        return 0;
+    }
+    if($backend->{baseline}) {
+        foreach my $meth (@{$wl->{needs}}) {
+            return 0 unless $backend->{class}->can($meth);
+        }
+    }
+    foreach my $meth (@{$wl->{requires} || []}) {
+        return 0 unless $backend->{class}->can($meth);
+    }
+    return 1;
+}
+
+sub _median {
+    my @sorted = sort { $a <=> $b } @_;
+    return $sorted[int(@sorted/2)];
+}
+
+#Runs a single workload/backend/size combination, returning a result hash
+sub measure {
+    my (%opts) = @_;
+    my ($bname,$wname,$size,$repeat) = @opts{qw(backend workload size repeat)};
+    my $backend = $Backends{$bname};
+    my $wl = $Workloads{$wname};
+    my (@times,$ops);
+
+    foreach (1..$repeat) {
+        my $table = $backend->{class}->new();
+        my $st = $wl->{setup} ? $wl->{setup}->($table, $size)
+                              : { table => $table };
+        my $begin = time();
+        $ops = $wl->{run}->($st, $size, $backend);
+        push @times, time() - $begin;
+        undef $st;
+    }
+
+    my $min = (sort { $a <=> $b } @times)[0];
+    return {
+        backend     => $bname,
+        workload    => $wname,
+        size        => $size,
+        ops         => $ops,
+        repeat      => $repeat,
+        min_sec     => $min,
+        median_sec  => _median(@times),
+        ops_per_sec => $min > 0 ? $ops / $min : undef,
+    };
+}
+
+1;
+
+__END__
+
+=head1 NAME
+
+RSBench - Benchmark workloads for Ref::Store
+
+=head1 DESCRIPTION
+
+Workloads and baseline backends used by F<bench/run.pl>. See that script for
+usage.
+
+=cut
@@ -0,0 +1,196 @@
+package RSBench::Footprint;
+use strict;
+use warnings;
+use POSIX qw();
+use JSON::PP;
+use RSBench;
+
+#Each kind loads 'count' entries into a table. 'prepare' creates everything the
+#table doesn't own (values, key and attribute objects) before the first
+#measurement, and 'load' then stores them. Kinds are skipped for backends
+#lacking any of the 'needs' methods.
+our %Kinds;
+our @KindOrder;
+
+sub kind {
+    my ($name,%spec) = @_;
+    $Kinds{$name} = \%spec;
+    push @KindOrder, $name;
+}
+
+sub _values {
+    my $n = shift;
+    return [ map { RSBench::Value->new($_) } (1..$n) ];
+}
+
+kind string_key => (
+    needs => [qw(store)],
+    prepare => sub { { values => _values($_[0]) } },
+    load => sub {
+        my ($t,$st) = @_;
+        my $values = $st->{values};
+        $t->store("k$_", $values->[$_]) for (0..$#$values);
+    },
+);
+
+kind object_key => (
+    needs => [qw(store)],
+    prepare => sub {
+        my $n = shift;
+        return { values => _values($n),
+                 keys => [ map { RSBench::Key->new($_) } (1..$n) ] };
+    },
+    load => sub {
+        my ($t,$st) = @_;
+        my ($keys,$values) = @{$st}{qw(keys values)};
+        $t->store($keys->[$_], $values->[$_]) for (0..$#$values);
+    },
+);
+
+kind typed_key => (
+    needs => [qw(store_kt)],
+    prepare => sub { { values => _values($_[0]) } },
+    load => sub {
+        my ($t,$st) = @_;
+        my $values = $st->{values};
+        $t->register_kt('bench');
+        $t->store_kt($_, 'bench', $values->[$_]) for (0..$#$values);
+    },
+);
+
+#One value per attribute, so that attribute objects are counted as well as
+#their memberships
+kind scalar_attr => (
+    needs => [qw(store_a)],
+    prepare => sub { { values => _values($_[0]) } },
+    load => sub {
+        my ($t,$st) = @_;
+        my $values = $st->{values};
+        $t->register_kt('bench');
+        $t->store_a($_, 'bench', $values->[$_]) for (0..$#$values);
+    },
+);
+
+kind object_attr => (
+    needs => [qw(store_a)],
+    prepare => sub {
+        my $n = shift;
+        return { values => _values($n),
+                 attrs => [ map { RSBench::Key->new($_) } (1..$n) ] };
+    },
+    load => sub {
+        my ($t,$st) = @_;
+        my ($attrs,$values) = @{$st}{qw(attrs values)};
+        $t->register_kt('bench');
+        $t->store_a($attrs->[$_], 'bench', $values->[$_]) for (0..$#$values);
+    },
+);
+
+#Entries are values here, each stored under 'keys_per_value' string keys
+kind multi_key => (
+    needs => [qw(store)],
+    prepare => sub { { values => _values($_[0]) } },
+    load => sub {
+        my ($t,$st,$kpv) = @_;
+        my $values = $st->{values};
+        foreach my $i (0..$#$values) {
+            $t->store("k$i.$_", $values->[$i]) for (1..$kpv);
+        }
+    },
+);
+
+#Resident set size in bytes, or undef where we don't know how to get it
+sub rss {
+    if(open my $fh, "<", "/proc/self/statm") {
+        my (undef,$pages) = split(' ', scalar <$fh>);
+        return $pages * POSIX::sysconf(POSIX::_SC_PAGESIZE());
+    }
+    my $kb = `ps -o rss= -p $$ 2>/dev/null`;
+    return $kb =~ /(\d+)/ ? $1 * 1024 : undef;
+}
+
+sub applicable {
+    my ($bname,$kname) = @_;
+    my $class = $RSBench::Backends{$bname}->{class};
+    foreach my $meth (@{$Kinds{$kname}->{needs}}) {
+        return 0 unless $class->can($meth);
+    }
+    return 1;
+}
+
+#Loads a table and returns a result hash. Runs in a child process where
+#possible, so that memory freed by earlier measurements isn't reused
+sub measure {
+    my (%opts) = @_;
+    my $pid = $^O eq 'MSWin32' ? undef : open(my $fh, "-|");
+    if(!defined $pid) {
+        return _measure(%opts);
+    }
+    if($pid) {
+        local $/;
+        my $out = <$fh>;
+        close($fh) or die "Footprint child for $opts{kind} failed: $?";
+        return JSON::PP->new->decode($out);
+    }
+    my $res = eval { _measure(%opts) };
+    if(!$res) {
+        print STDERR $@;
+        POSIX::_exit(1);
+    }
+    print JSON::PP->new->canonical->encode($res);
+    close(STDOUT);
+    POSIX::_exit(0);
+}
+
+sub _measure {
+    my (%opts) = @_;
+    my ($bname,$kname,$count,$kpv) = @opts{qw(backend kind count keys_per_value)};
+    my $backend = $RSBench::Backends{$bname};
+    my $kind = $Kinds{$kname};
+    my $st = $kind->{prepare}->($count);
+
+    my $rss_begin = rss();
+    my $table = $backend->{class}->new();
+    my $stats_begin = $table->can('stats') ? $table->stats : undef;
+    $kind->{load}->($table, $st, $kpv);
+    my $rss_end = rss();
+
+    my $res = {
+        backend     => $bname,
+        kind        => $kname,
+        count       => $count,
+    };
+    $res->{keys_per_value} = $kpv if $kname eq 'multi_key';
+    if(defined $rss_begin && defined $rss_end) {
+        $res->{rss_bytes} = $rss_end - $rss_begin;
+        $res->{rss_per_entry} = ($rss_end - $rss_begin) / $count;
+    }
+    #The backend's own accounting of what the table holds
+    if($table->can('memory_usage')) {
+        my $usage = $table->memory_usage;
+        $res->{estimate_bytes} = $usage->{total};
+        $res->{estimate_per_entry} = $usage->{total} / $count;
+    }
+    if($stats_begin) {
+        my $stats = $table->stats;
+        my $actions = ($stats->{actions_created} - $stats->{actions_freed})
+            - ($stats_begin->{actions_created} - $stats_begin->{actions_freed});
+        $res->{actions_per_entry} = $actions / $count;
+    }
+    return $res;
+}
+
+1;
+
+__END__
+
+=head1 NAME
+
+RSBench::Footprint - Memory footprint measurements for Ref::Store
+
+=head1 DESCRIPTION
+
+Entry kinds and measurements used by F<bench/footprint.pl>. See that script for
+usage.
+
+=cut
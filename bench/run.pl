@@ -0,0 +1,112 @@
+#!/usr/bin/perl
+use strict;
+use warnings;
+use FindBin;
+use lib "$FindBin::Bin/lib";
+use Getopt::Long;
+use JSON::PP;
+use Config;
+use POSIX qw(strftime);
+use RSBench;
+
+GetOptions(
+    'b|backends=s'  => \my $Backends,
+    'w|workloads=s' => \my $Workloads,
+    's|sizes=s'     => \my $Sizes,
+    'r|repeat=i'    => \my $Repeat,
+    'o|output=s'    => \my $Output,
+    'l|list'        => \my $List,
+    'h|help'        => \my $Help,
+) or usage(1);
+
+usage(0) if $Help;
+
+if($List) {
+    print "Backends:  @RSBench::BackendOrder\n";
+    print "Workloads: @RSBench::WorkloadOrder\n";
+    exit(0);
+}
+
+my @backends = $Backends ? split(/,/, $Backends) : @RSBench::BackendOrder;
+my @workloads = $Workloads ? split(/,/, $Workloads) : @RSBench::WorkloadOrder;
+my @sizes = map { parse_size($_) } split(/,/, $Sizes || "1k,10k,100k");
+$Repeat ||= 3;
+
+foreach my $wname (@workloads) {
+    die "Unknown workload '$wname'" unless $RSBench::Workloads{$wname};
+}
+
+#Threads must be loaded before any tables are created, so they get cloned
+if(grep { $_ eq 'thread_clone' } @workloads) {
+    RSBench::have_threads();
+}
+
+my @results;
+foreach my $bname (@backends) {
+    if(!RSBench::backend_available($bname)) {
+        warn "Skipping unavailable backend $bname: $@";
+        next;
+    }
+    foreach my $wname (@workloads) {
+        next unless RSBench::applicable($bname, $wname);
+        foreach my $size (@sizes) {
+            my $res = RSBench::measure(
+                backend => $bname, workload => $wname,
+                size => $size, repeat => $Repeat);
+            printf STDERR ("%-10s %-14s %10d %10.4fs %12.0f ops/s\n",
+                $bname, $wname, $size, $res->{min_sec},
+                $res->{ops_per_sec} || 0);
+            push @results, $res;
+        }
+    }
+}
+
+my $doc = {
+    meta => {
+        date        => strftime("%Y-%m-%dT%H:%M:%SZ", gmtime),
+        perl        => sprintf("%vd", $^V),
+        archname    => $Config{archname},
+        ithreads    => $Config{useithreads} ? JSON::PP::true : JSON::PP::false,
+        ref_store   => scalar eval { require Ref::Store; $Ref::Store::VERSION },
+        repeat      => $Repeat,
+    },
+    results => \@results,
+};
+
+my $json = JSON::PP->new->canonical->pretty->encode($doc);
+if($Output) {
+    open my $fh, ">", $Output or die "Couldn't open $Output: $!";
+    print $fh $json;
+    close($fh);
+} else {
+    print $json;
+}
+
+sub parse_size {
+    my $s = shift;
+    my %mult = (k => 1e3, m => 1e6);
+    $s =~ /^(\d+)([km]?)$/i or die "Bad size '$s'";
+    return $1 * ($2 ? $mult{lc $2} : 1);
+}
+
+sub usage {
+    my $status = shift;
+    print <<"USAGE";
+$0 [options]
+
+Runs the Ref::Store benchmark suite, and prints the results as JSON.
+
+  -b, --backends    Comma-separated backends (default: all available)
+  -w, --workloads   Comma-separated workloads (default: all)
+  -s, --sizes       Comma-separated table sizes, with optional k/m suffix
+                    (default: 1k,10k,100k; up to 10m is reasonable)
+  -r, --repeat      Repetitions per measurement, the fastest is reported
+                    (default: 3)
+  -o, --output      Write JSON to this file instead of standard output
+  -l, --list        List backends and workloads
+
+From the build directory, `make bench BENCH_ARGS="..."` runs this against
+the freshly built module.
+USAGE
+    exit($status);
+}
@@ -0,0 +1,121 @@
+////////////////////////////////////////////////////////////////////////////////
+/// Exported C API                                                           ///
+////////////////////////////////////////////////////////////////////////////////
+
+/*Stack-free wrappers for the function table described in hr_api.h, and its
+ publication through PL_modglobal*/
+
+#include "hreg.h"
+#include "hrpriv.h"
+#include "hrdefs.h"
+#include "lib/Ref/Store/XS/hr_api.h"
+
+#define API_FLAG(flags, api_flag, opt) (((flags) & (api_flag)) ? (opt) : 0)
+
+static void
+api_store(SV *table, SV *key, SV *value, int flags)
+{
+    dTHX;
+    if(!SvROK(value)) {
+        die("Value must be reference");
+    }
+    HR_store_sk_real(aTHX_ table, key, value, 0,
+        API_FLAG(flags, HR_API_STRONG_KEY, STORE_OPT_STRONG_KEY)
+        | API_FLAG(flags, HR_API_STRONG_VALUE, STORE_OPT_STRONG_VALUE));
+}
+
+static SV*
+api_fetch(SV *table, SV *key)
+{
+    dTHX;
+    SV *ret = HR_fetch_sk_real(aTHX_ table, key);
+    return (ret && ret != &PL_sv_undef) ? ret : NULL;
+}
+
+static SV*
+api_unlink(SV *table, SV *key)
+{
+    dTHX;
+    SV *ret = HR_unlink_sk_real(aTHX_ table, key);
+    return ret != &PL_sv_undef ? ret : NULL;
+}
+
+static void
+api_purge(SV *table, SV *value)
+{
+    dTHX;
+    SV *ret = HR_purge_real(aTHX_ table, value);
+    if(ret != &PL_sv_undef) {
+        SvREFCNT_dec(ret);
+    }
+}
+
+static void
+api_store_a(SV *table, SV *attr, char *t, SV *value, int flags)
+{
+    dTHX;
+    if(!SvROK(value)) {
+        die("Value must be reference");
+    }
+    hrattr_store(aTHX_ table, attr, t, value,
+        API_FLAG(flags, HR_API_STRONG_ATTR, STORE_OPT_STRONG_ATTR)
+        | API_FLAG(flags, HR_API_STRONG_VALUE, STORE_OPT_STRONG_VALUE));
+}
+
+static UV
+api_fetch_a(SV *table, SV *attr, char *t, AV *dest)
+{
+    dTHX;
+    SV *dest_ref;
+    UV ret;
+    RV_Newtmp(dest_ref, (SV*)dest);
+    ret = hrattr_fetch_into(aTHX_ table, attr, t, dest_ref);
+    RV_Freetmp(dest_ref);
+    return ret;
+}
+
+static void
+api_add_callback(SV *objref, HR_API_Callback fn, void *arg)
+{
+    dTHX;
+    HR_Action actions[] = {
+        HR_DREF_FLDS_arg_for_cfunc(arg, fn),
+        HR_ACTION_LIST_TERMINATOR
+    };
+    HR_add_actions_real(aTHX_ objref, actions);
+}
+
+static void
+api_del_callback(SV *objref, HR_API_Callback fn, void *arg)
+{
+    dTHX;
+    HR_del_actions_real(aTHX_ objref, (SV*)fn, arg,
+                              HR_KEY_TYPE_PTR|HR_KEY_SFLAG_HASHREF_OPAQUE);
+}
+
+static HR_API hr_api = {
+    .version                = HR_API_VERSION,
+    .store                  = api_store,
+    .fetch                  = api_fetch,
+    .unlink                 = api_unlink,
+    .purge                  = api_purge,
+    .store_a                = api_store_a,
+    .fetch_a                = api_fetch_a,
+    .add_action_ptr         = HR_PL_add_action_ptr,
+    .add_action_str         = HR_PL_add_action_str,
+    .del_action_ptr         = HR_PL_del_action_ptr,
+    .del_action_str         = HR_PL_del_action_str,
+    .del_action_container   = HR_PL_del_action_container,
+    .add_callback           = api_add_callback,
+    .del_callback           = api_del_callback
+};
+
+/*Called when Ref::Store::XS is loaded. PL_modglobal is per interpreter, and
+ is carried over into new threads*/
+UV HRA_api_publish()
+{
+    dTHX;
+    hv_store(PL_modglobal, HR_API_MODGLOBAL_KEY,
+             sizeof(HR_API_MODGLOBAL_KEY) - 1, newSViv(PTR2IV(&hr_api)), 0);
+    return HR_API_VERSION;
+}
@@ -0,0 +1,840 @@
+////////////////////////////////////////////////////////////////////////////////
+/// Dense value IDs and attribute bitmaps                                    ///
+////////////////////////////////////////////////////////////////////////////////
+
+/*With attribute bitmaps enabled, every value stored under an attribute is
+ given a small integer ID, and each attribute keeps the IDs of its values in
+ a compressed bitmap alongside its value hash. The hash remains the primary
+ record; the bitmap lets intersections, unions and counts over several
+ attributes work a word (or a sorted array) at a time, rather than with one
+ hash lookup per value.
+
+ Bitmaps are split into containers by the upper 16 bits of an ID, in the
+ manner of Roaring bitmaps. A container holding up to RB_ARRAY_MAX IDs is a
+ sorted array of their lower halves; a fuller one is a plain 2^16 bit map.
+
+ IDs are tied to their values by a CFUNC action. A value purged from the
+ table has already had its bits cleared, so its ID is reused immediately.
+ When a value is destroyed, its attribute hash entries go away through their
+ own actions and the bitmaps are not told; its ID is marked dead instead.
+ Queries mask out dead IDs, and once enough have accumulated they are
+ cleared from every bitmap and recycled*/
+
+#include "hreg.h"
+#include "hrpriv.h"
+#include "hrdefs.h"
+
+#define RB_ARRAY_MAX    4096
+#define RB_WORDS        1024
+#define VID_SWEEP_MIN   256
+
+typedef struct {
+    U16     key;        /*Upper 16 bits of the IDs held*/
+    U16     is_bits;
+    U32     card;
+    U32     alloc;      /*Array capacity*/
+    union {
+        U16 *arr;
+        U64 *bits;
+    } d;
+} hr_rb_cont;
+
+struct HR_Bitmap {
+    hr_rb_cont  *conts; /*Sorted by key*/
+    U32         ncont;
+    U32         alloc;
+    HR_ValueIDs *vids;  /*NULL for temporaries*/
+    HR_Bitmap   *prev;
+    HR_Bitmap   *next;
+};
+
+typedef struct {
+    HR_ValueIDs *vids;
+    SV          *value; /*Not refcounted*/
+    U32         id;
+} hr_vid_ent;
+
+struct HR_ValueIDs {
+    hr_vid_ent  **ents;     /*Indexed by ID. NULL for free and dead IDs*/
+    U32         next_id;
+    U32         alloc;
+    U32         *free_ids;
+    U32         nfree;
+    U32         free_alloc;
+    HR_Bitmap   dead;
+    U32         ndead;
+    HR_Bitmap   *bitmaps;   /*Every attribute bitmap using these IDs*/
+    UV          refcount;   /*The table info, bitmaps and ID entries*/
+};
+
+#ifdef __GNUC__
+#define rb_popcount(w)  __builtin_popcountll(w)
+#define rb_ctz(w)       __builtin_ctzll(w)
+#else
+static int
+rb_popcount(U64 w)
+{
+    int n = 0;
+    for(; w; w &= w - 1) {
+        n++;
+    }
+    return n;
+}
+
+static int
+rb_ctz(U64 w)
+{
+    int n = 0;
+    for(; !(w & 1); w >>= 1) {
+        n++;
+    }
+    return n;
+}
+#endif
+
+enum {
+    RB_AND,
+    RB_OR,
+    RB_ANDNOT
+};
+
+////////////////////////////////////////////////////////////////////////////////
+/// Containers                                                               ///
+////////////////////////////////////////////////////////////////////////////////
+
+static void
+rb_cont_free(hr_rb_cont *c)
+{
+    if(c->is_bits) {
+        Safefree(c->d.bits);
+    } else {
+        Safefree(c->d.arr);
+    }
+}
+
+/*Position of low in an array container, or where it would go*/
+static int
+rb_arr_find(hr_rb_cont *c, U16 low, U32 *pos)
+{
+    U32 lo = 0, hi = c->card, mid;
+    while(lo < hi) {
+        mid = (lo + hi) / 2;
+        if(c->d.arr[mid] < low) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    *pos = lo;
+    return lo < c->card && c->d.arr[lo] == low;
+}
+
+static void
+rb_cont_words(hr_rb_cont *c, U64 *words)
+{
+    U32 i;
+    if(c->is_bits) {
+        Copy(c->d.bits, words, RB_WORDS, U64);
+        return;
+    }
+    Zero(words, RB_WORDS, U64);
+    for(i = 0; i < c->card; i++) {
+        words[c->d.arr[i] >> 6] |= (U64)1 << (c->d.arr[i] & 63);
+    }
+}
+
+/*Sets the container's contents from a word array, choosing its form*/
+static void
+rb_cont_from_words(hr_rb_cont *c, U64 *words, U32 card)
+{
+    U32 i, n = 0;
+    U64 w;
+
+    c->card = card;
+    if(card > RB_ARRAY_MAX) {
+        c->is_bits = 1;
+        Newx(c->d.bits, RB_WORDS, U64);
+        Copy(words, c->d.bits, RB_WORDS, U64);
+        return;
+    }
+    c->is_bits = 0;
+    c->alloc = card;
+    Newx(c->d.arr, card ? card : 1, U16);
+    for(i = 0; i < RB_WORDS; i++) {
+        for(w = words[i]; w; w &= w - 1) {
+            c->d.arr[n++] = (i << 6) + rb_ctz(w);
+        }
+    }
+}
+
+static void
+rb_cont_to_bits(hr_rb_cont *c)
+{
+    U64 *words;
+    Newx(words, RB_WORDS, U64);
+    rb_cont_words(c, words);
+    Safefree(c->d.arr);
+    c->d.bits = words;
+    c->is_bits = 1;
+}
+
+static void
+rb_cont_to_array(hr_rb_cont *c)
+{
+    U64 *words = c->d.bits;
+    rb_cont_from_words(c, words, c->card);
+    Safefree(words);
+}
+
+static void
+rb_cont_copy(hr_rb_cont *src, hr_rb_cont *dst)
+{
+    *dst = *src;
+    if(src->is_bits) {
+        Newx(dst->d.bits, RB_WORDS, U64);
+        Copy(src->d.bits, dst->d.bits, RB_WORDS, U64);
+    } else {
+        dst->alloc = src->card;
+        Newx(dst->d.arr, src->card ? src->card : 1, U16);
+        Copy(src->d.arr, dst->d.arr, src->card, U16);
+    }
+}
+
+/*Combines two containers with the same key into out, returning the number
+ of IDs in the result*/
+static U32
+rb_cont_op(int op, hr_rb_cont *a, hr_rb_cont *b, hr_rb_cont *out)
+{
+    U64 wa[RB_WORDS], wb[RB_WORDS];
+    U32 i, j, n = 0;
+
+    if(op == RB_AND && a->is_bits && !b->is_bits) {
+        hr_rb_cont *tmp = a;
+        a = b;
+        b = tmp;
+    }
+    out->key = a->key;
+    out->is_bits = 0;
+
+    if(!a->is_bits && !b->is_bits) {
+        /*Merge the sorted arrays*/
+        U16 *res;
+        Newx(res, op == RB_OR ? a->card + b->card : a->card + 1, U16);
+        for(i = j = 0; i < a->card || j < b->card;) {
+            if(j == b->card || (i < a->card && a->d.arr[i] < b->d.arr[j])) {
+                if(op != RB_AND) {
+                    res[n++] = a->d.arr[i];
+                }
+                i++;
+            } else if(i == a->card || b->d.arr[j] < a->d.arr[i]) {
+                if(op == RB_OR) {
+                    res[n++] = b->d.arr[j];
+                }
+                j++;
+            } else {
+                if(op != RB_ANDNOT) {
+                    res[n++] = a->d.arr[i];
+                }
+                i++;
+                j++;
+            }
+            if(op != RB_OR && i == a->card) {
+                break;
+            }
+        }
+        out->d.arr = res;
+        out->card = out->alloc = n;
+        if(n > RB_ARRAY_MAX) {
+            rb_cont_to_bits(out);
+        }
+        return n;
+    }
+
+    if(op != RB_OR && !a->is_bits) {
+        /*Filter the array by the other side's bits*/
+        int keep = op == RB_AND;
+        Newx(out->d.arr, a->card, U16);
+        for(i = 0; i < a->card; i++) {
+            U16 low = a->d.arr[i];
+            if(!!(b->d.bits[low >> 6] & ((U64)1 << (low & 63))) == keep) {
+                out->d.arr[n++] = low;
+            }
+        }
+        out->card = out->alloc = n;
+        return n;
+    }
+
+    rb_cont_words(a, wa);
+    rb_cont_words(b, wb);
+    for(i = 0; i < RB_WORDS; i++) {
+        switch(op) {
+            case RB_AND:
+                wa[i] &= wb[i];
+                break;
+            case RB_OR:
+                wa[i] |= wb[i];
+                break;
+            default:
+                wa[i] &= ~wb[i];
+                break;
+        }
+        n += rb_popcount(wa[i]);
+    }
+    rb_cont_from_words(out, wa, n);
+    return n;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+/// Bitmaps                                                                  ///
+////////////////////////////////////////////////////////////////////////////////
+
+static int
+rb_find(HR_Bitmap *bm, U16 key, U32 *pos)
+{
+    U32 lo = 0, hi = bm->ncont, mid;
+    while(lo < hi) {
+        mid = (lo + hi) / 2;
+        if(bm->conts[mid].key < key) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    *pos = lo;
+    return lo < bm->ncont && bm->conts[lo].key == key;
+}
+
+static hr_rb_cont*
+rb_insert(HR_Bitmap *bm, U32 pos)
+{
+    if(bm->ncont == bm->alloc) {
+        bm->alloc = bm->alloc ? bm->alloc * 2 : 4;
+        Renew(bm->conts, bm->alloc, hr_rb_cont);
+    }
+    Move(bm->conts + pos, bm->conts + pos + 1, bm->ncont - pos, hr_rb_cont);
+    bm->ncont++;
+    return bm->conts + pos;
+}
+
+static void
+rb_delete(HR_Bitmap *bm, U32 pos)
+{
+    rb_cont_free(bm->conts + pos);
+    bm->ncont--;
+    Move(bm->conts + pos + 1, bm->conts + pos, bm->ncont - pos, hr_rb_cont);
+}
+
+static void
+rb_clear(HR_Bitmap *bm)
+{
+    U32 i;
+    for(i = 0; i < bm->ncont; i++) {
+        rb_cont_free(bm->conts + i);
+    }
+    Safefree(bm->conts);
+    bm->conts = NULL;
+    bm->ncont = bm->alloc = 0;
+}
+
+static int
+rb_add(HR_Bitmap *bm, U32 id)
+{
+    U16 low = id & 0xffff;
+    U64 mask = (U64)1 << (low & 63);
+    hr_rb_cont *c;
+    U32 pos;
+
+    if(rb_find(bm, id >> 16, &pos)) {
+        c = bm->conts + pos;
+    } else {
+        c = rb_insert(bm, pos);
+        Zero(c, 1, hr_rb_cont);
+        c->key = id >> 16;
+    }
+
+    if(!c->is_bits) {
+        if(rb_arr_find(c, low, &pos)) {
+            return 0;
+        }
+        if(c->card < RB_ARRAY_MAX) {
+            if(c->card == c->alloc) {
+                c->alloc = c->alloc ? c->alloc * 2 : 4;
+                Renew(c->d.arr, c->alloc, U16);
+            }
+            Move(c->d.arr + pos, c->d.arr + pos + 1, c->card - pos, U16);
+            c->d.arr[pos] = low;
+            c->card++;
+            return 1;
+        }
+        rb_cont_to_bits(c);
+    }
+    if(c->d.bits[low >> 6] & mask) {
+        return 0;
+    }
+    c->d.bits[low >> 6] |= mask;
+    c->card++;
+    return 1;
+}
+
+static int
+rb_remove(HR_Bitmap *bm, U32 id)
+{
+    U16 low = id & 0xffff;
+    U64 mask = (U64)1 << (low & 63);
+    hr_rb_cont *c;
+    U32 pos, i;
+
+    if(!rb_find(bm, id >> 16, &pos)) {
+        return 0;
+    }
+    c = bm->conts + pos;
+    if(c->is_bits) {
+        if(!(c->d.bits[low >> 6] & mask)) {
+            return 0;
+        }
+        c->d.bits[low >> 6] &= ~mask;
+        c->card--;
+        /*Only convert back well below the limit, so that a container at the
+         boundary isn't converted on every change*/
+        if(c->card <= RB_ARRAY_MAX / 2) {
+            rb_cont_to_array(c);
+        }
+    } else {
+        if(!rb_arr_find(c, low, &i)) {
+            return 0;
+        }
+        c->card--;
+        Move(c->d.arr + i + 1, c->d.arr + i, c->card - i, U16);
+    }
+    if(!c->card) {
+        rb_delete(bm, pos);
+    }
+    return 1;
+}
+
+static UV
+rb_card(HR_Bitmap *bm)
+{
+    UV n = 0;
+    U32 i;
+    for(i = 0; i < bm->ncont; i++) {
+        n += bm->conts[i].card;
+    }
+    return n;
+}
+
+static void
+rb_append(HR_Bitmap *out, hr_rb_cont *c)
+{
+    *rb_insert(out, out->ncont) = *c;
+}
+
+/*Combines a and b into out, which must be empty*/
+static void
+rb_op(int op, HR_Bitmap *a, HR_Bitmap *b, HR_Bitmap *out)
+{
+    hr_rb_cont res;
+    U32 i = 0, j = 0;
+
+    while(i < a->ncont || j < b->ncont) {
+        if(j == b->ncont || (i < a->ncont && a->conts[i].key < b->conts[j].key)) {
+            if(op != RB_AND) {
+                rb_cont_copy(a->conts + i, &res);
+                rb_append(out, &res);
+            }
+            i++;
+        } else if(i == a->ncont || b->conts[j].key < a->conts[i].key) {
+            if(op == RB_OR) {
+                rb_cont_copy(b->conts + j, &res);
+                rb_append(out, &res);
+            }
+            j++;
+        } else {
+            if(rb_cont_op(op, a->conts + i, b->conts + j, &res)) {
+                rb_append(out, &res);
+            } else {
+                rb_cont_free(&res);
+            }
+            i++;
+            j++;
+        }
+    }
+}
+
+/*Replaces a's contents with (a op b)*/
+static void
+rb_op_inplace(int op, HR_Bitmap *a, HR_Bitmap *b)
+{
+    HR_Bitmap res = { NULL };
+    rb_op(op, a, b, &res);
+    rb_clear(a);
+    a->conts = res.conts;
+    a->ncont = res.ncont;
+    a->alloc = res.alloc;
+}
+
+/*Calls fn for each ID, in ascending order*/
+static void
+rb_foreach(pTHX_ HR_Bitmap *bm, void (*fn)(pTHX_ U32 id, void *data),
+           void *data)
+{
+    hr_rb_cont *c;
+    U32 i, j, base;
+    U64 w;
+
+    for(i = 0; i < bm->ncont; i++) {
+        c = bm->conts + i;
+        base = (U32)c->key << 16;
+        if(!c->is_bits) {
+            for(j = 0; j < c->card; j++) {
+                fn(aTHX_ base | c->d.arr[j], data);
+            }
+            continue;
+        }
+        for(j = 0; j < RB_WORDS; j++) {
+            for(w = c->d.bits[j]; w; w &= w - 1) {
+                fn(aTHX_ base | ((j << 6) + rb_ctz(w)), data);
+            }
+        }
+    }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+/// Value IDs                                                                ///
+////////////////////////////////////////////////////////////////////////////////
+
+static void vid_value_destroyed(SV *value, SV *arg, HR_Action *action);
+
+static void
+vids_unref(HR_ValueIDs *vids)
+{
+    if(--vids->refcount) {
+        return;
+    }
+    HR_DEBUG("Freeing value IDs %p", vids);
+    rb_clear(&vids->dead);
+    Safefree(vids->ents);
+    Safefree(vids->free_ids);
+    Safefree(vids);
+}
+
+static void
+vid_free_id(HR_ValueIDs *vids, U32 id)
+{
+    if(vids->nfree == vids->free_alloc) {
+        vids->free_alloc = vids->free_alloc ? vids->free_alloc * 2 : 64;
+        Renew(vids->free_ids, vids->free_alloc, U32);
+    }
+    vids->free_ids[vids->nfree++] = id;
+}
+
+static void
+sweep_free_id(pTHX_ U32 id, void *vids)
+{
+    vid_free_id((HR_ValueIDs*)vids, id);
+}
+
+/*Clears dead IDs from every bitmap, making them available again*/
+static void
+vids_sweep(pTHX_ HR_ValueIDs *vids)
+{
+    HR_Bitmap *bm;
+    HR_DEBUG("Sweeping %lu dead IDs", (UV)vids->ndead);
+    for(bm = vids->bitmaps; bm; bm = bm->next) {
+        rb_op_inplace(RB_ANDNOT, bm, &vids->dead);
+    }
+    rb_foreach(aTHX_ &vids->dead, sweep_free_id, vids);
+    rb_clear(&vids->dead);
+    vids->ndead = 0;
+}
+
+static hr_vid_ent*
+vid_assign(pTHX_ HR_ValueIDs *vids, SV *value)
+{
+    hr_vid_ent *ent;
+    SV *vref;
+    U32 id;
+
+    if(vids->nfree) {
+        id = vids->free_ids[--vids->nfree];
+    } else {
+        if(vids->next_id == (U32)-1) {
+            die("Out of value IDs");
+        }
+        id = vids->next_id++;
+        if(id >= vids->alloc) {
+            vids->alloc = vids->alloc ? vids->alloc * 2 : 256;
+            Renew(vids->ents, vids->alloc, hr_vid_ent*);
+        }
+    }
+
+    Newx(ent, 1, hr_vid_ent);
+    ent->vids = vids;
+    ent->value = value;
+    ent->id = id;
+    vids->ents[id] = ent;
+    vids->refcount++;
+
+    RV_Newtmp(vref, value);
+    HR_Action destroy_action[] = {
+        HR_DREF_FLDS_arg_for_cfunc(ent, &vid_value_destroyed),
+        HR_ACTION_LIST_TERMINATOR
+    };
+    HR_add_actions_real(aTHX_ vref, destroy_action);
+    RV_Freetmp(vref);
+    return ent;
+}
+
+/*The value is being destroyed*/
+static void
+vid_value_destroyed(SV *value, SV *arg, HR_Action *action)
+{
+    dTHX;
+    hr_vid_ent *ent = (hr_vid_ent*)arg;
+    HR_ValueIDs *vids = ent->vids;
+
+    vids->ents[ent->id] = NULL;
+    rb_add(&vids->dead, ent->id);
+    vids->ndead++;
+    Safefree(ent);
+    if(vids->ndead >= VID_SWEEP_MIN && vids->ndead >= vids->next_id / 8) {
+        vids_sweep(aTHX_ vids);
+    }
+    vids_unref(vids);
+}
+
+/*Releases an ID whose value is alive, but no longer in any bitmap*/
+static void
+vid_release(pTHX_ hr_vid_ent *ent, int detach_action)
+{
+    HR_ValueIDs *vids = ent->vids;
+    SV *vref;
+
+    if(detach_action) {
+        RV_Newtmp(vref, ent->value);
+        HR_del_actions_real(aTHX_ vref, (SV*)&vid_value_destroyed, ent,
+                                  HR_KEY_TYPE_PTR|HR_KEY_SFLAG_HASHREF_OPAQUE);
+        RV_Freetmp(vref);
+    }
+    vids->ents[ent->id] = NULL;
+    vid_free_id(vids, ent->id);
+    Safefree(ent);
+    vids_unref(vids);
+}
+
+/*A value may be in the bitmaps of several tables*/
+static int
+vid_match(void *arg, void *vids)
+{
+    return ((hr_vid_ent*)arg)->vids == vids;
+}
+
+#define vid_find(vids, value) \
+    ((hr_vid_ent*)HR_cfunc_action_arg(value, (void*)&vid_value_destroyed, \
+                                      vid_match, vids))
+
+static HR_Bitmap*
+bitmap_new(HR_ValueIDs *vids)
+{
+    HR_Bitmap *bm;
+    Newxz(bm, 1, HR_Bitmap);
+    bm->vids = vids;
+    bm->next = vids->bitmaps;
+    if(bm->next) {
+        bm->next->prev = bm;
+    }
+    vids->bitmaps = bm;
+    vids->refcount++;
+    return bm;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+/// Hooks                                                                    ///
+////////////////////////////////////////////////////////////////////////////////
+
+/*Called when a value is added to an attribute. The attribute's bitmap is
+ created on its first value*/
+void hr_vid_attr_add(pTHX_ HR_Table_t table, HR_Bitmap **members, SV *value)
+{
+    HR_ValueIDs *vids = hr_tinfo_get(aTHX_ table)->vids;
+    hr_vid_ent *ent;
+
+    if(!vids) {
+        return;
+    }
+    if(!(ent = vid_find(vids, value))) {
+        ent = vid_assign(aTHX_ vids, value);
+    }
+    if(!*members) {
+        *members = bitmap_new(vids);
+    }
+    rb_add(*members, ent->id);
+}
+
+/*Called when a live value is removed from an attribute*/
+void hr_vid_attr_remove(HR_Bitmap *members, SV *value)
+{
+    hr_vid_ent *ent;
+    if(members && (ent = vid_find(members->vids, value))) {
+        rb_remove(members, ent->id);
+    }
+}
+
+/*Called when the attribute is destroyed*/
+void hr_vid_bitmap_free(HR_Bitmap *bm)
+{
+    HR_ValueIDs *vids = bm->vids;
+    if(bm->prev) {
+        bm->prev->next = bm->next;
+    } else {
+        vids->bitmaps = bm->next;
+    }
+    if(bm->next) {
+        bm->next->prev = bm->prev;
+    }
+    rb_clear(bm);
+    Safefree(bm);
+    vids_unref(vids);
+}
+
+/*Called by purge(), once the value has been removed from its attributes*/
+void hr_vid_purge_value(pTHX_ SV *self, SV *value)
+{
+    HR_ValueIDs *vids = hr_tinfo_get(aTHX_ REF2TABLE(self))->vids;
+    hr_vid_ent *ent;
+    if(vids && (ent = vid_find(vids, value))) {
+        vid_release(aTHX_ ent, 1);
+    }
+}
+
+/*Called when the table info is freed. Bitmaps of attributes still alive
+ keep the IDs around until they go*/
+void hr_vid_destroy(pTHX_ HR_ValueIDs *vids)
+{
+    U32 id;
+    if(!PL_dirty) {
+        for(id = 0; id < vids->next_id; id++) {
+            if(vids->ents[id]) {
+                vid_release(aTHX_ vids->ents[id], 1);
+            }
+        }
+    }
+    vids_unref(vids);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+/// Perl-visible functions                                                   ///
+////////////////////////////////////////////////////////////////////////////////
+
+void HRA_enable_attr_bitmaps(SV *self)
+{
+    dTHX;
+    HR_TableInfo *tinfo = hr_tinfo_get(aTHX_ REF2TABLE(self));
+    HR_ValueIDs *vids;
+    SV *attr_lookup;
+    HE *he;
+    STRLEN i;
+
+    if(tinfo->vids) {
+        return;
+    }
+    Newxz(vids, 1, HR_ValueIDs);
+    vids->refcount = 1;
+    tinfo->vids = vids;
+
+    /*Attributes already in the table get their bitmaps now*/
+    get_hashes(aTHX_ REF2TABLE(self),
+               HR_HKEY_LOOKUP_ATTR, &attr_lookup,
+               HR_HKEY_LOOKUP_NULL);
+    for(i = 0; HvARRAY(REF2HASH(attr_lookup))
+               && i <= HvMAX(REF2HASH(attr_lookup)); i++) {
+        for(he = HvARRAY(REF2HASH(attr_lookup))[i]; he; he = HeNEXT(he)) {
+            if(SvROK(HeVAL(he))) {
+                hrattr_bitmap_init(aTHX_ SvRV(HeVAL(he)));
+            }
+        }
+    }
+}
+
+int HRA_attr_bitmaps(SV *self)
+{
+    dTHX;
+    return hr_tinfo_get(aTHX_ REF2TABLE(self))->vids != NULL;
+}
+
+SV* HRA_value_id(SV *self, SV *value)
+{
+    dTHX;
+    HR_ValueIDs *vids = hr_tinfo_get(aTHX_ REF2TABLE(self))->vids;
+    hr_vid_ent *ent;
+    if(!SvROK(value)) {
+        die("Value must be a reference");
+    }
+    if(vids && (ent = vid_find(vids, SvRV(value)))) {
+        return newSVuv(ent->id);
+    }
+    return &PL_sv_undef;
+}
+
+static void
+push_value(pTHX_ U32 id, void *vids)
+{
+    dSP;
+    hr_vid_ent *ent = ((HR_ValueIDs*)vids)->ents[id];
+    XPUSHs(sv_2mortal(newRV_inc(ent->value)));
+    PUTBACK;
+}
+
+/*Values carrying all (op 0) or any (op 1) of the attributes given as
+ attribute/type pairs. Only called with bitmaps enabled*/
+void HRA_fetch_a_set(SV *self, int op, ...)
+{
+    dTHX;
+    HR_ValueIDs *vids = hr_tinfo_get(aTHX_ REF2TABLE(self))->vids;
+    HR_Bitmap acc = { NULL }, res, *members;
+    int i, first = 1;
+    dXSARGS;
+
+    if(items < 4 || (items - 2) % 2) {
+        die("Expected attribute/type pairs");
+    }
+    if(!vids) {
+        die("Attribute bitmaps are not enabled");
+    }
+
+    for(i = 2; i < items; i += 2) {
+        members = hrattr_members(aTHX_ self, ST(i), SvPV_nolen(ST(i+1)));
+        if(!members) {
+            if(op == 0) {
+                rb_clear(&acc);
+                break;
+            }
+            continue;
+        }
+        Zero(&res, 1, HR_Bitmap);
+        if(first) {
+            rb_op(RB_OR, &acc, members, &res);
+            first = 0;
+        } else {
+            rb_op(op == 0 ? RB_AND : RB_OR, &acc, members, &res);
+        }
+        rb_clear(&acc);
+        acc = res;
+        if(op == 0 && !acc.ncont) {
+            break;
+        }
+    }
+    if(vids->ndead) {
+        rb_op_inplace(RB_ANDNOT, &acc, &vids->dead);
+    }
+
+    SP -= items;
+    if(GIMME_V == G_SCALAR) {
+        UV n = rb_card(&acc);
+        rb_clear(&acc);
+        XSRETURN_IV(n);
+    }
+    PUTBACK;
+    rb_foreach(aTHX_ &acc, push_value, vids);
+    rb_clear(&acc);
+}
@@ -0,0 +1,648 @@
+////////////////////////////////////////////////////////////////////////////////
+/// Shared key directory                                                     ///
+////////////////////////////////////////////////////////////////////////////////
+
+/*A directory maps string keys to short string payloads. It lives outside of
+ any interpreter, so every thread holding a handle sees the same entries.
+
+ Writers lock one of a fixed number of stripes, chosen by the key's hash.
+ Readers take no locks at all: entries are never modified once linked, so a
+ store links a new entry in place of the old one, and growing the table
+ links copies into a new bucket array. Unlinked entries and bucket arrays
+ are retired rather than freed, and only freed once no reader can still be
+ looking at them.
+
+ Each handle (and so each interpreter) has a reader slot of its own, on its
+ own cache line, in which it announces the epoch it is reading in. Readers
+ thus never write to memory shared with other readers. Writers scan the
+ slots when retiring garbage, and only advance the epoch once every active
+ reader has caught up with it, at which point garbage retired two epochs ago
+ can no longer be reached by anyone.
+
+ Entries may be tied to a key of a local table with publish(). The key
+ object then gets a CFUNC action (a 'watcher', as with on_evict()), so the
+ entry goes away with the key - however it leaves the table*/
+
+#include "hreg.h"
+#include "hrpriv.h"
+#include "hrdefs.h"
+
+#include <string.h>
+
+#define DIR_DEFAULT_BUCKETS 64
+#define DIR_DEFAULT_STRIPES 16
+#define DIR_MAX_LOAD        2
+#define DIR_CACHE_LINE      64
+
+typedef struct hr_dir_ent hr_dir_ent;
+struct hr_dir_ent {
+    hr_dir_ent  *next;
+    hr_dir_ent  *gc_next;
+    UV          seq;        /*Tells the watcher which published it apart*/
+    U32         hash;
+    U32         klen;
+    U32         vlen;
+    char        data[1];    /*Key, then payload*/
+};
+
+typedef struct hr_dir_table hr_dir_table;
+struct hr_dir_table {
+    hr_dir_table    *gc_next;
+    UV              mask;
+    hr_dir_ent      *buckets[1];
+};
+
+/*The announced epoch, shifted left, with the low bit set while reading*/
+typedef struct hr_dir_reader hr_dir_reader;
+struct hr_dir_reader {
+    UV              state;
+    hr_dir_reader   *next;
+    char            pad[DIR_CACHE_LINE - sizeof(UV) - sizeof(void*)];
+};
+
+struct HR_Directory {
+    U32             refcnt;
+    U32             nstripes;
+    hr_dir_table    *table;
+    UV              count;
+    UV              seq;
+    UV              epoch;
+    hr_dir_reader   *readers;   /*Changed under the gc lock*/
+    hr_dir_ent      *limbo_ents[2];
+    hr_dir_table    *limbo_tables[2];
+#ifdef USE_ITHREADS
+    perl_mutex      gc_lock;
+    perl_mutex      *stripes;
+#endif
+};
+
+typedef struct {
+    HR_Directory    *dir;
+    UV              seq;
+    U32             klen;
+    char            key[1];
+} hr_dir_watcher;
+
+/*What the Perl-visible handle object points to*/
+typedef struct {
+    HR_Directory    *dir;
+    hr_dir_reader   *reader;
+} hr_dir_handle;
+
+static int dir_handle_freehook(pTHX_ SV *sv, MAGIC *mg);
+static int dir_handle_duphook(pTHX_ MAGIC *mg, CLONE_PARAMS *param);
+
+static MGVTBL dir_handle_vtbl = {
+    .svt_free = &dir_handle_freehook,
+    .svt_dup = &dir_handle_duphook
+};
+
+#define dir_ent_key(ent) ((ent)->data)
+#define dir_ent_val(ent) ((ent)->data + (ent)->klen)
+
+#define dir_load(p) __atomic_load_n(&(p), __ATOMIC_ACQUIRE)
+#define dir_publish(p, v) __atomic_store_n(&(p), (v), __ATOMIC_RELEASE)
+
+#ifdef USE_ITHREADS
+#define dir_stripe(dir, hash) (&(dir)->stripes[(hash) & ((dir)->nstripes - 1)])
+#define dir_stripe_lock(dir, hash) MUTEX_LOCK(dir_stripe(dir, hash))
+#define dir_stripe_unlock(dir, hash) MUTEX_UNLOCK(dir_stripe(dir, hash))
+#define dir_gc_lock(dir) MUTEX_LOCK(&(dir)->gc_lock)
+#define dir_gc_unlock(dir) MUTEX_UNLOCK(&(dir)->gc_lock)
+#else
+#define dir_stripe_lock(dir, hash)
+#define dir_stripe_unlock(dir, hash)
+#define dir_gc_lock(dir)
+#define dir_gc_unlock(dir)
+#endif
+
+////////////////////////////////////////////////////////////////////////////////
+/// Reclamation                                                              ///
+////////////////////////////////////////////////////////////////////////////////
+
+/*A reader announcing an epoch which has since moved on only holds writers
+ back until it is done. The fence orders the announcement before the
+ reader's loads, and pairs with the one in dir_try_advance(): either the
+ writer sees the reader, or the reader doesn't see what was unlinked*/
+static inline void
+dir_read_begin(HR_Directory *dir, hr_dir_reader *r)
+{
+    UV e = __atomic_load_n(&dir->epoch, __ATOMIC_ACQUIRE);
+    __atomic_store_n(&r->state, e << 1 | 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+}
+
+#define dir_read_end(r) \
+    __atomic_store_n(&(r)->state, 0, __ATOMIC_RELEASE)
+
+static hr_dir_reader*
+dir_reader_new(HR_Directory *dir)
+{
+    hr_dir_reader *r = PerlMemShared_malloc(sizeof(hr_dir_reader));
+    if(!r) {
+        die("Couldn't allocate directory reader");
+    }
+    Zero(r, 1, hr_dir_reader);
+    dir_gc_lock(dir);
+    r->next = dir->readers;
+    dir->readers = r;
+    dir_gc_unlock(dir);
+    return r;
+}
+
+static void
+dir_reader_free(HR_Directory *dir, hr_dir_reader *r)
+{
+    hr_dir_reader **link;
+    dir_gc_lock(dir);
+    for(link = &dir->readers; *link != r; link = &(*link)->next);
+    *link = r->next;
+    dir_gc_unlock(dir);
+    PerlMemShared_free(r);
+}
+
+static void
+dir_free_garbage(hr_dir_ent *ents, hr_dir_table *tables)
+{
+    hr_dir_ent *ent;
+    hr_dir_table *t;
+    while( (ent = ents) ) {
+        ents = ent->gc_next;
+        PerlMemShared_free(ent);
+    }
+    while( (t = tables) ) {
+        tables = t->gc_next;
+        PerlMemShared_free(t);
+    }
+}
+
+/*Must be called with the gc lock held. Readers still in the previous
+ epoch keep it from advancing*/
+static int
+dir_try_advance(HR_Directory *dir)
+{
+    UV e = dir->epoch, next = (e + 1) & 1, state;
+    hr_dir_reader *r;
+
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    for(r = dir->readers; r; r = r->next) {
+        state = __atomic_load_n(&r->state, __ATOMIC_ACQUIRE);
+        if((state & 1) && state != (e << 1 | 1)) {
+            return 0;
+        }
+    }
+    dir_free_garbage(dir->limbo_ents[next], dir->limbo_tables[next]);
+    dir->limbo_ents[next] = NULL;
+    dir->limbo_tables[next] = NULL;
+    __atomic_store_n(&dir->epoch, e + 1, __ATOMIC_RELEASE);
+    return 1;
+}
+
+/*Retires a chain of entries linked through gc_next, and/or a bucket array*/
+static void
+dir_retire(HR_Directory *dir, hr_dir_ent *first, hr_dir_ent *last,
+           hr_dir_table *t)
+{
+    UV e;
+    dir_gc_lock(dir);
+    e = dir->epoch & 1;
+    if(first) {
+        last->gc_next = dir->limbo_ents[e];
+        dir->limbo_ents[e] = first;
+    }
+    if(t) {
+        t->gc_next = dir->limbo_tables[e];
+        dir->limbo_tables[e] = t;
+    }
+    if(dir_try_advance(dir)) {
+        dir_try_advance(dir);
+    }
+    dir_gc_unlock(dir);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+/// Tables and entries                                                       ///
+////////////////////////////////////////////////////////////////////////////////
+
+static hr_dir_table*
+dir_table_new(UV nbuckets)
+{
+    size_t size = sizeof(hr_dir_table) + (nbuckets - 1) * sizeof(hr_dir_ent*);
+    hr_dir_table *t = PerlMemShared_malloc(size);
+    if(!t) {
+        die("Couldn't allocate directory table");
+    }
+    Zero(t, size, char);
+    t->mask = nbuckets - 1;
+    return t;
+}
+
+static hr_dir_ent*
+dir_ent_new(U32 hash, const char *key, STRLEN klen,
+            const char *val, STRLEN vlen, UV seq)
+{
+    hr_dir_ent *ent = PerlMemShared_malloc(sizeof(hr_dir_ent) + klen + vlen);
+    if(!ent) {
+        die("Couldn't allocate directory entry");
+    }
+    ent->next = NULL;
+    ent->gc_next = NULL;
+    ent->seq = seq;
+    ent->hash = hash;
+    ent->klen = klen;
+    ent->vlen = vlen;
+    Copy(key, dir_ent_key(ent), klen, char);
+    Copy(val, dir_ent_val(ent), vlen, char);
+    return ent;
+}
+
+static inline hr_dir_ent**
+dir_bucket(hr_dir_table *t, U32 hash)
+{
+    return &t->buckets[hash & t->mask];
+}
+
+/*Returns the link pointing to the matching entry, or to the end of the
+ chain. Writers only*/
+static hr_dir_ent**
+dir_find_link(hr_dir_table *t, U32 hash, const char *key, STRLEN klen)
+{
+    hr_dir_ent **link = dir_bucket(t, hash);
+    for(; *link; link = &(*link)->next) {
+        if((*link)->hash == hash && (*link)->klen == klen
+           && memcmp(dir_ent_key(*link), key, klen) == 0) {
+            break;
+        }
+    }
+    return link;
+}
+
+/*Doubles the bucket array. The existing chains may be walked by readers at
+ any time, so they are copied rather than relinked*/
+static void
+dir_grow(HR_Directory *dir)
+{
+    hr_dir_table *old, *t;
+    hr_dir_ent *ent, *copy, **bucket, *first = NULL, *last = NULL;
+    UV i;
+#ifdef USE_ITHREADS
+    U32 s;
+    for(s = 0; s < dir->nstripes; s++) {
+        MUTEX_LOCK(&dir->stripes[s]);
+    }
+#endif
+    old = dir->table;
+    if(dir->count <= (old->mask + 1) * DIR_MAX_LOAD) {
+        old = NULL;
+        goto GT_UNLOCK;
+    }
+    HR_DEBUG("Growing directory %p to %lu buckets", dir,
+             (unsigned long)((old->mask + 1) * 2));
+    t = dir_table_new((old->mask + 1) * 2);
+    for(i = 0; i <= old->mask; i++) {
+        for(ent = old->buckets[i]; ent; ent = ent->next) {
+            copy = dir_ent_new(ent->hash, dir_ent_key(ent), ent->klen,
+                               dir_ent_val(ent), ent->vlen, ent->seq);
+            bucket = dir_bucket(t, ent->hash);
+            copy->next = *bucket;
+            *bucket = copy;
+            ent->gc_next = first;
+            first = ent;
+            if(!last) {
+                last = ent;
+            }
+        }
+    }
+    dir_publish(dir->table, t);
+
+    GT_UNLOCK:
+#ifdef USE_ITHREADS
+    for(s = 0; s < dir->nstripes; s++) {
+        MUTEX_UNLOCK(&dir->stripes[s]);
+    }
+#endif
+    if(old) {
+        dir_retire(dir, first, last, old);
+    }
+}
+
+/*Returns the sequence number of the new entry*/
+static UV
+dir_store(HR_Directory *dir, const char *key, STRLEN klen,
+          const char *val, STRLEN vlen)
+{
+    hr_dir_ent *ent, *old, **link;
+    UV seq = __atomic_add_fetch(&dir->seq, 1, __ATOMIC_RELAXED);
+    U32 hash;
+    int grow = 0;
+
+    PERL_HASH(hash, key, klen);
+    ent = dir_ent_new(hash, key, klen, val, vlen, seq);
+
+    dir_stripe_lock(dir, hash);
+    link = dir_find_link(dir->table, hash, key, klen);
+    old = *link;
+    ent->next = old ? old->next : NULL;
+    dir_publish(*link, ent);
+    if(!old) {
+        grow = __atomic_add_fetch(&dir->count, 1, __ATOMIC_RELAXED)
+                > (dir->table->mask + 1) * DIR_MAX_LOAD;
+    }
+    dir_stripe_unlock(dir, hash);
+
+    if(old) {
+        dir_retire(dir, old, old, NULL);
+    } else if(grow) {
+        dir_grow(dir);
+    }
+    return seq;
+}
+
+/*Only removes the entry if it still has the given sequence number, unless
+ that is 0*/
+static int
+dir_delete(HR_Directory *dir, const char *key, STRLEN klen, UV seq)
+{
+    hr_dir_ent *old, **link;
+    U32 hash;
+
+    PERL_HASH(hash, key, klen);
+    dir_stripe_lock(dir, hash);
+    link = dir_find_link(dir->table, hash, key, klen);
+    old = *link;
+    if(old && (!seq || old->seq == seq)) {
+        dir_publish(*link, old->next);
+        __atomic_sub_fetch(&dir->count, 1, __ATOMIC_RELAXED);
+    } else {
+        old = NULL;
+    }
+    dir_stripe_unlock(dir, hash);
+
+    if(old) {
+        dir_retire(dir, old, old, NULL);
+    }
+    return old != NULL;
+}
+
+static SV*
+dir_fetch(pTHX_ HR_Directory *dir, hr_dir_reader *r, const char *key,
+          STRLEN klen)
+{
+    hr_dir_ent *ent;
+    SV *ret = NULL;
+    U32 hash;
+
+    PERL_HASH(hash, key, klen);
+    dir_read_begin(dir, r);
+    for(ent = dir_load(*dir_bucket(dir_load(dir->table), hash));
+        ent; ent = dir_load(ent->next)) {
+        if(ent->hash == hash && ent->klen == klen
+           && memcmp(dir_ent_key(ent), key, klen) == 0) {
+            ret = newSVpvn(dir_ent_val(ent), ent->vlen);
+            break;
+        }
+    }
+    dir_read_end(r);
+    return ret;
+}
+
+static HR_Directory*
+dir_new(UV nbuckets, UV nstripes)
+{
+    HR_Directory *dir = PerlMemShared_malloc(sizeof(HR_Directory));
+    UV n;
+    if(!dir) {
+        die("Couldn't allocate directory");
+    }
+    Zero(dir, 1, HR_Directory);
+
+    /*Both are powers of two, with at least as many buckets as stripes, so
+     that a bucket is only ever written under a single stripe*/
+    for(n = 1; n < nstripes; n <<= 1);
+    nstripes = n;
+    for(n = nstripes; n < nbuckets; n <<= 1);
+    nbuckets = n;
+
+    dir->refcnt = 1;
+    dir->nstripes = nstripes;
+    dir->table = dir_table_new(nbuckets);
+#ifdef USE_ITHREADS
+    MUTEX_INIT(&dir->gc_lock);
+    dir->stripes = PerlMemShared_malloc(nstripes * sizeof(perl_mutex));
+    if(!dir->stripes) {
+        die("Couldn't allocate directory locks");
+    }
+    for(n = 0; n < nstripes; n++) {
+        MUTEX_INIT(&dir->stripes[n]);
+    }
+#endif
+    return dir;
+}
+
+#define dir_ref(dir) __atomic_add_fetch(&(dir)->refcnt, 1, __ATOMIC_RELAXED)
+
+static void
+dir_unref(HR_Directory *dir)
+{
+    hr_dir_ent *ent, *next;
+    UV i;
+
+    if(__atomic_sub_fetch(&dir->refcnt, 1, __ATOMIC_ACQ_REL)) {
+        return;
+    }
+    HR_DEBUG("Freeing directory %p", dir);
+    for(i = 0; i <= dir->table->mask; i++) {
+        for(ent = dir->table->buckets[i]; ent; ent = next) {
+            next = ent->next;
+            PerlMemShared_free(ent);
+        }
+    }
+    PerlMemShared_free(dir->table);
+    for(i = 0; i < 2; i++) {
+        dir_free_garbage(dir->limbo_ents[i], dir->limbo_tables[i]);
+    }
+#ifdef USE_ITHREADS
+    for(i = 0; i < dir->nstripes; i++) {
+        MUTEX_DESTROY(&dir->stripes[i]);
+    }
+    PerlMemShared_free(dir->stripes);
+    MUTEX_DESTROY(&dir->gc_lock);
+#endif
+    PerlMemShared_free(dir);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+/// Handles                                                                  ///
+////////////////////////////////////////////////////////////////////////////////
+
+/*Takes over a reference to the directory*/
+static hr_dir_handle*
+dir_handle_new(HR_Directory *dir)
+{
+    hr_dir_handle *h;
+    Newx(h, 1, hr_dir_handle);
+    h->dir = dir;
+    h->reader = dir_reader_new(dir);
+    return h;
+}
+
+static int
+dir_handle_freehook(pTHX_ SV *sv, MAGIC *mg)
+{
+    hr_dir_handle *h = (hr_dir_handle*)mg->mg_ptr;
+    if(h) {
+        dir_reader_free(h->dir, h->reader);
+        dir_unref(h->dir);
+        Safefree(h);
+        mg->mg_ptr = NULL;
+    }
+    return 0;
+}
+
+/*Handles in new interpreters refer to the same directory, with a reader
+ slot of their own*/
+static int
+dir_handle_duphook(pTHX_ MAGIC *mg, CLONE_PARAMS *param)
+{
+    HR_Directory *dir = ((hr_dir_handle*)mg->mg_ptr)->dir;
+    dir_ref(dir);
+    mg->mg_ptr = (char*)dir_handle_new(dir);
+    return 0;
+}
+
+static inline hr_dir_handle*
+dir_handle_from_sv(SV *self)
+{
+    MAGIC *mg;
+    if(!SvROK(self) || !(mg = hr_mg_find_vtbl(SvRV(self), &dir_handle_vtbl))) {
+        die("Not a directory handle");
+    }
+    return (hr_dir_handle*)mg->mg_ptr;
+}
+
+#define dir_from_sv(self) (dir_handle_from_sv(self)->dir)
+
+static inline char*
+dir_key_pv(pTHX_ SV *key, STRLEN *klen)
+{
+    if(SvROK(key)) {
+        die("Directory keys must be strings or integers");
+    }
+    return SvPV(key, *klen);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+/// Watchers                                                                 ///
+////////////////////////////////////////////////////////////////////////////////
+
+/*The key object is being destroyed*/
+static void
+dir_key_removed(SV *kobj, SV *arg, HR_Action *action)
+{
+    hr_dir_watcher *w = (hr_dir_watcher*)arg;
+    dir_delete(w->dir, w->key, w->klen, w->seq);
+    dir_unref(w->dir);
+    Safefree(w);
+}
+
+static int
+dir_watcher_match(void *arg, void *dir)
+{
+    return ((hr_dir_watcher*)arg)->dir == dir;
+}
+
+void HRA_dir_publish(SV *self, SV *dirsv, SV *key, SV *payload)
+{
+    dTHX;
+    HR_Directory *dir = dir_from_sv(dirsv);
+    SV *slookup, *kobj, *kref;
+    HE *he;
+    hr_dir_watcher *w;
+    STRLEN klen, vlen;
+    char *kstr, *vstr;
+
+    kstr = dir_key_pv(aTHX_ key, &klen);
+    get_hashes(aTHX_ REF2TABLE(self),
+               HR_HKEY_LOOKUP_SCALAR, &slookup,
+               HR_HKEY_LOOKUP_NULL);
+    he = hv_fetch_ent(REF2HASH(slookup), key, 0, 0);
+    if(!(he && SvROK(HeVAL(he)))) {
+        die("Key must be stored in the table before it is published");
+    }
+    kobj = SvRV(HeVAL(he));
+
+    vstr = SvOK(payload) ? SvPV(payload, vlen) : (vlen = 0, "");
+    w = (hr_dir_watcher*)HR_cfunc_action_arg(kobj, (void*)&dir_key_removed,
+                                             dir_watcher_match, dir);
+    if(w) {
+        w->seq = dir_store(dir, kstr, klen, vstr, vlen);
+        return;
+    }
+
+    Newxc(w, sizeof(hr_dir_watcher) + klen, char, hr_dir_watcher);
+    w->dir = dir;
+    w->klen = klen;
+    Copy(kstr, w->key, klen, char);
+    dir_ref(dir);
+    w->seq = dir_store(dir, kstr, klen, vstr, vlen);
+
+    RV_Newtmp(kref, kobj);
+    HR_Action removed_action[] = {
+        HR_DREF_FLDS_arg_for_cfunc(w, &dir_key_removed),
+        HR_ACTION_LIST_TERMINATOR
+    };
+    HR_add_actions_real(aTHX_ kref, removed_action);
+    RV_Freetmp(kref);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+/// Perl API                                                                 ///
+////////////////////////////////////////////////////////////////////////////////
+
+SV* HRXSDIR_new(char *pkg, UV nbuckets, UV nstripes)
+{
+    dTHX;
+    SV *self = mk_blessed_blob(aTHX_ pkg, 0);
+    MAGIC *mg;
+    HR_Directory *dir = dir_new(nbuckets ? nbuckets : DIR_DEFAULT_BUCKETS,
+                                nstripes ? nstripes : DIR_DEFAULT_STRIPES);
+
+    mg = sv_magicext(SvRV(self), NULL, PERL_MAGIC_ext, &dir_handle_vtbl,
+                     (const char*)dir_handle_new(dir), 0);
+    mg->mg_flags |= MGf_DUP;
+    return self;
+}
+
+void HRXSDIR_store(SV *self, SV *key, SV *payload)
+{
+    dTHX;
+    HR_Directory *dir = dir_from_sv(self);
+    STRLEN klen, vlen;
+    char *kstr = dir_key_pv(aTHX_ key, &klen);
+    char *vstr = SvOK(payload) ? SvPV(payload, vlen) : (vlen = 0, "");
+    dir_store(dir, kstr, klen, vstr, vlen);
+}
+
+SV* HRXSDIR_fetch(SV *self, SV *key)
+{
+    dTHX;
+    hr_dir_handle *h = dir_handle_from_sv(self);
+    STRLEN klen;
+    char *kstr = dir_key_pv(aTHX_ key, &klen);
+    SV *ret = dir_fetch(aTHX_ h->dir, h->reader, kstr, klen);
+    return ret ? ret : &PL_sv_undef;
+}
+
+int HRXSDIR_delete(SV *self, SV *key)
+{
+    dTHX;
+    HR_Directory *dir = dir_from_sv(self);
+    STRLEN klen;
+    char *kstr = dir_key_pv(aTHX_ key, &klen);
+    return dir_delete(dir, kstr, klen, 0);
+}
+
+UV HRXSDIR_count(SV *self)
+{
+    return __atomic_load_n(&dir_from_sv(self)->count, __ATOMIC_RELAXED);
+}
@@ -44,7 +44,7 @@ typedef struct {
     sprintf(vname, "%s%p", HR_DUPKEY_VHASH, vaddr);
 
 static inline void
-hr_dup_store_old_lookups(HV *ptr_map, HR_Table_t parent)
+hr_dup_store_old_lookups(pTHX_ HV *ptr_map, HR_Table_t parent)
 {
 
     mk_old_lookup_key(hkey, parent);
@@ -58,7 +58,7 @@ hr_dup_store_old_lookups(HV *ptr_map, HR_Table_t parent)
     
     SV *slookup, *flookup, *rlookup, *alookup;
     
-    get_hashes(parent,
+    get_hashes(aTHX_ parent,
                HR_HKEY_LOOKUP_SCALAR, &slookup,
                HR_HKEY_LOOKUP_REVERSE, &rlookup,
                HR_HKEY_LOOKUP_FORWARD, &flookup,
@@ -75,7 +75,7 @@ hr_dup_store_old_lookups(HV *ptr_map, HR_Table_t parent)
 }
 
 static inline HR_Dup_OldLookups*
-hr_dup_get_old_lookups(HV *ptr_map, void *old_table)
+hr_dup_get_old_lookups(pTHX_ HV *ptr_map, void *old_table)
 {
     mk_old_lookup_key(hkey, old_table);
     HR_DEBUG("Fetching: %s", hkey);
@@ -87,7 +87,7 @@ hr_dup_get_old_lookups(HV *ptr_map, void *old_table)
 
 
 static inline HR_Dup_Kinfo*
-hr_dup_store_kinfo(HV *ptr_map, char *kprefix, void *eptr, int size)
+hr_dup_store_kinfo(pTHX_ HV *ptr_map, char *kprefix, void *eptr, int size)
 {
     if(!size) {
         size = sizeof(HR_Dup_Kinfo);
@@ -100,7 +100,7 @@ hr_dup_store_kinfo(HV *ptr_map, char *kprefix, void *eptr, int size)
 }
 
 static inline HR_Dup_Kinfo*
-hr_dup_get_kinfo(HV *ptr_map, char *kprefix, void *old_eptr)
+hr_dup_get_kinfo(pTHX_ HV *ptr_map, char *kprefix, void *old_eptr)
 {
     mk_di_key(hkey, kprefix, old_eptr);
     SV **stored = hv_fetch(ptr_map, hkey, strlen(hkey), 0);
@@ -109,7 +109,7 @@ hr_dup_get_kinfo(HV *ptr_map, char *kprefix, void *old_eptr)
 }
 
 static inline HR_Dup_Vinfo*
-hr_dup_get_vinfo(HV *ptr_map, void *vaddr, int create)
+hr_dup_get_vinfo(pTHX_ HV *ptr_map, void *vaddr, int create)
 {
     mk_vi_key(hkey, vaddr);
     SV **stored = hv_fetch(ptr_map, hkey, strlen(hkey), create);
@@ -130,7 +130,7 @@ hr_dup_get_vinfo(HV *ptr_map, void *vaddr, int create)
 }
 
 static inline SV*
-hr_dup_newsv_for_oldsv(HV *ptr_map, void *oldptr, int copy)
+hr_dup_newsv_for_oldsv(pTHX_ HV *ptr_map, void *oldptr, int copy)
 {
     mk_ptr_string(old_s, oldptr);
     HR_DEBUG("Fetching for %lu (%p)", oldptr, oldptr);
@@ -148,7 +148,7 @@ hr_dup_newsv_for_oldsv(HV *ptr_map, void *oldptr, int copy)
 }
 
 static inline void
-hr_dup_store_rv(HV *ptr_map, SV *rv)
+hr_dup_store_rv(pTHX_ HV *ptr_map, SV *rv)
 {
     assert(SvROK(rv));
     
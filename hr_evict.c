@@ -0,0 +1,335 @@
+////////////////////////////////////////////////////////////////////////////////
+/// Bounded tables                                                           ///
+////////////////////////////////////////////////////////////////////////////////
+
+/*With max_values set, values are tracked on a CLOCK ring: a circular list
+ with a 'referenced' bit per value, set when the value is fetched. When the table
+ holds more values than allowed, the hand sweeps the ring, clearing bits,
+ and purges the first value found without one. Purging goes through the
+ normal purge path, so keys and attributes cascade as usual.
+
+ Each ring entry is tied to its value by a CFUNC action, which removes the
+ entry when the value is destroyed. Values which leave the table while
+ staying alive (by unlink or purge) are dropped lazily, when the hand
+ reaches them.
+
+ Every fetch hit needs the value's entry, so entries are also kept in an
+ open addressing map keyed by the value's address, rather than being looked
+ up through the value's action list*/
+
+#include "hreg.h"
+#include "hrpriv.h"
+#include "hrdefs.h"
+
+typedef struct hr_clock_ent hr_clock_ent;
+
+struct hr_clock_ent {
+    hr_clock_ent    *next;
+    hr_clock_ent    *prev;
+    HR_Clock        *clock;
+    SV              *value; /*Not refcounted*/
+    int             referenced;
+};
+
+struct HR_Clock {
+    hr_clock_ent    *hand;
+    UV              count;
+    UV              max_values;
+    UV              map_cap;    /*Always a power of two*/
+    hr_clock_ent    **map;
+};
+
+#define CLOCK_MIN_CAP 16
+
+/*Keeps the load factor below 0.7*/
+#define clock_map_full(clock) (((clock)->count + 1) * 10 > (clock)->map_cap * 7)
+
+static void clock_forget(SV *value, SV *arg, HR_Action *action);
+
+/*SVs are allocated from arenas, so the low bits of their addresses carry
+ little; Fibonacci hashing mixes in the rest*/
+static inline UV
+clock_hash(HR_Clock *clock, SV *value)
+{
+#if UVSIZE >= 8
+    return ((UV)value * (UV)0x9E3779B97F4A7C15ULL) >> 32 & (clock->map_cap - 1);
+#else
+    return ((UV)value * (UV)0x9E3779B9UL) >> 16 & (clock->map_cap - 1);
+#endif
+}
+
+static hr_clock_ent*
+clock_find(HR_Clock *clock, SV *value)
+{
+    UV i;
+    if(!clock->count) {
+        return NULL;
+    }
+    for(i = clock_hash(clock, value); clock->map[i];
+        i = (i + 1) & (clock->map_cap - 1)) {
+        if(clock->map[i]->value == value) {
+            return clock->map[i];
+        }
+    }
+    return NULL;
+}
+
+static void
+clock_map_insert(HR_Clock *clock, hr_clock_ent *ent)
+{
+    UV i;
+    for(i = clock_hash(clock, ent->value); clock->map[i];
+        i = (i + 1) & (clock->map_cap - 1))
+        ;
+    clock->map[i] = ent;
+}
+
+static void
+clock_map_grow(HR_Clock *clock)
+{
+    hr_clock_ent **old = clock->map;
+    UV old_cap = clock->map_cap, i;
+
+    clock->map_cap = old_cap ? old_cap * 2 : CLOCK_MIN_CAP;
+    Newxz(clock->map, clock->map_cap, hr_clock_ent*);
+    for(i = 0; i < old_cap; i++) {
+        if(old[i]) {
+            clock_map_insert(clock, old[i]);
+        }
+    }
+    Safefree(old);
+}
+
+/*Backward shift deletion, as for integer keys*/
+static void
+clock_map_remove(HR_Clock *clock, hr_clock_ent *ent)
+{
+    UV mask = clock->map_cap - 1;
+    UV hole = clock_hash(clock, ent->value), i, home;
+
+    while(clock->map[hole] != ent) {
+        hole = (hole + 1) & mask;
+    }
+    for(i = hole;;) {
+        i = (i + 1) & mask;
+        if(!clock->map[i]) {
+            break;
+        }
+        home = clock_hash(clock, clock->map[i]->value);
+        if(((i - home) & mask) >= ((i - hole) & mask)) {
+            clock->map[hole] = clock->map[i];
+            hole = i;
+        }
+    }
+    clock->map[hole] = NULL;
+}
+
+static void
+clock_unlink(hr_clock_ent *ent)
+{
+    HR_Clock *clock = ent->clock;
+    clock_map_remove(clock, ent);
+    if(ent->next == ent) {
+        clock->hand = NULL;
+    } else {
+        ent->prev->next = ent->next;
+        ent->next->prev = ent->prev;
+        if(clock->hand == ent) {
+            clock->hand = ent->next;
+        }
+    }
+    clock->count--;
+}
+
+static void
+clock_ent_free(pTHX_ hr_clock_ent *ent, int detach_action)
+{
+    SV *vref;
+    clock_unlink(ent);
+    if(detach_action) {
+        RV_Newtmp(vref, ent->value);
+        HR_del_actions_real(aTHX_ vref, (SV*)&clock_forget, ent,
+                                  HR_KEY_TYPE_PTR|HR_KEY_SFLAG_HASHREF_OPAQUE);
+        RV_Freetmp(vref);
+    }
+    Safefree(ent);
+}
+
+/*The value is being destroyed*/
+static void
+clock_forget(SV *value, SV *arg, HR_Action *action)
+{
+    dTHX;
+    clock_ent_free(aTHX_ (hr_clock_ent*)arg, 0);
+}
+
+/*New entries go just behind the hand, so they are the last to be examined*/
+static hr_clock_ent*
+clock_add(pTHX_ HR_Clock *clock, SV *value)
+{
+    hr_clock_ent *ent;
+    SV *vref;
+
+    if(clock_map_full(clock)) {
+        clock_map_grow(clock);
+    }
+    Newxz(ent, 1, hr_clock_ent);
+    ent->clock = clock;
+    ent->value = value;
+    clock_map_insert(clock, ent);
+
+    if(!clock->hand) {
+        ent->next = ent->prev = ent;
+        clock->hand = ent;
+    } else {
+        ent->next = clock->hand;
+        ent->prev = clock->hand->prev;
+        ent->prev->next = ent;
+        clock->hand->prev = ent;
+    }
+    clock->count++;
+
+    RV_Newtmp(vref, value);
+    HR_Action forget_action[] = {
+        HR_DREF_FLDS_arg_for_cfunc(ent, &clock_forget),
+        HR_ACTION_LIST_TERMINATOR
+    };
+    HR_add_actions_real(aTHX_ vref, forget_action);
+    RV_Freetmp(vref);
+    return ent;
+}
+
+static inline int
+value_in_table(pTHX_ SV *rlookup, SV *value)
+{
+    mk_ptr_string(vaddr, value);
+    return hv_exists(REF2HASH(rlookup), vaddr, strlen(vaddr));
+}
+
+static void
+clock_evict(pTHX_ SV *self, HR_TableInfo *tinfo, HR_Clock *clock, SV *keep)
+{
+    SV *rlookup;
+    hr_clock_ent *ent;
+    /*Two sweeps always find a victim, unless the only value left in the
+     ring is the one being stored*/
+    UV nskip = 0;
+
+    get_hashes(aTHX_ REF2TABLE(self),
+               HR_HKEY_LOOKUP_REVERSE, &rlookup,
+               HR_HKEY_LOOKUP_NULL);
+
+    while(HvUSEDKEYS(REF2HASH(rlookup)) > clock->max_values
+          && (ent = clock->hand)) {
+        SV *value = ent->value, *vref, *ret;
+
+        if(!value_in_table(aTHX_ rlookup, value)) {
+            /*Stale: left the table some other way*/
+            clock_ent_free(aTHX_ ent, 1);
+            continue;
+        }
+        if(ent->referenced || value == keep) {
+            if(nskip++ > 2 * clock->count) {
+                break;
+            }
+            ent->referenced = 0;
+            clock->hand = ent->next;
+            continue;
+        }
+        nskip = 0;
+
+        HR_DEBUG("Evicting value=%p", value);
+        clock_ent_free(aTHX_ ent, 1);
+        HR_TSTAT_INC(tinfo, evictions);
+        vref = newRV_inc(value);
+        ret = HR_purge_real(aTHX_ self, vref);
+        SvREFCNT_dec(ret);
+        SvREFCNT_dec(vref);
+    }
+}
+
+/*Called after a store, and on a fetch hit. New values enter the ring
+ unreferenced, and a fetch marks them as used. A store may push the table
+ over its limit, in which case other values are evicted*/
+void hr_clock_touch(pTHX_ HR_TableInfo *tinfo, SV *self, SV *value,
+                    int is_fetch)
+{
+    HR_Clock *clock = tinfo->clock;
+    hr_clock_ent *ent;
+
+    /*Frozen tables aren't written to by lookups, so fetches go unmarked*/
+    if(!clock || (is_fetch && tinfo->frozen)) {
+        return;
+    }
+    if(!(ent = clock_find(clock, SvRV(value)))) {
+        ent = clock_add(aTHX_ clock, SvRV(value));
+    }
+    if(is_fetch) {
+        ent->referenced = 1;
+    } else {
+        clock_evict(aTHX_ self, tinfo, clock, SvRV(value));
+    }
+}
+
+void hr_clock_destroy(pTHX_ HR_Clock *clock)
+{
+    while(clock->hand) {
+        clock_ent_free(aTHX_ clock->hand, !PL_dirty);
+    }
+    Safefree(clock->map);
+    Safefree(clock);
+}
+
+void HRA_set_max_values(SV *self, UV max_values)
+{
+    dTHX;
+    HR_TableInfo *tinfo = hr_tinfo_get(aTHX_ REF2TABLE(self));
+    HR_Clock *clock = tinfo->clock;
+    SV *rlookup;
+    STRLEN i;
+    HE *he;
+
+    if(!max_values) {
+        if(clock) {
+            hr_clock_destroy(aTHX_ clock);
+            tinfo->clock = NULL;
+        }
+        return;
+    }
+
+    if(!clock) {
+        Newxz(clock, 1, HR_Clock);
+        tinfo->clock = clock;
+
+        /*Values already in the table start out unreferenced*/
+        get_hashes(aTHX_ REF2TABLE(self),
+                   HR_HKEY_LOOKUP_REVERSE, &rlookup,
+                   HR_HKEY_LOOKUP_NULL);
+        for(i = 0; HvARRAY(REF2HASH(rlookup))
+                   && i <= HvMAX(REF2HASH(rlookup)); i++) {
+            for(he = HvARRAY(REF2HASH(rlookup))[i]; he; he = HeNEXT(he)) {
+                SV *value = (SV*)(UV)Strtoul(HeKEY(he), NULL, 10);
+                if(!clock_find(clock, value)) {
+                    clock_add(aTHX_ clock, value);
+                }
+            }
+        }
+    }
+    clock->max_values = max_values;
+    {
+        HR_OP_BEGIN(cxt);
+        clock_evict(aTHX_ self, tinfo, clock, NULL);
+        HR_OP_END(cxt);
+    }
+}
+
+UV hr_clock_max_values(HR_Clock *clock)
+{
+    return clock ? clock->max_values : 0;
+}
+
+UV HRA_max_values(SV *self)
+{
+    dTHX;
+    return hr_clock_max_values(hr_tinfo_get(aTHX_ REF2TABLE(self))->clock);
+}
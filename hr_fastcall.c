@@ -0,0 +1,133 @@
+////////////////////////////////////////////////////////////////////////////////
+/// Direct calls for fetch and store                                         ///
+////////////////////////////////////////////////////////////////////////////////
+
+/*A call to $table->fetch costs a method lookup (which perl caches), an
+ entersub, and the generated XS wrapper unpacking the arguments into a call
+ to HRA_fetch_sk. The class of $table isn't known when the call is compiled,
+ and call checkers are never consulted for method calls, so the lookup stays.
+ The rest is skipped in the manner of Class::XSAccessor: the first time fetch
+ or store runs from a call site, the site's entersub op is switched over to
+ one of the functions below, which call the C function straight off the
+ stack.
+
+ Each run checks that the call still resolved to our XSUB. If it didn't (say
+ the same call site now sees a PP table, or a subclass overriding the method)
+ the op is put back and marked, so it is never switched again*/
+
+#include "hreg.h"
+#include "hrpriv.h"
+#include "hrdefs.h"
+
+static XSUBADDR_t fetch_xsub;
+static XSUBADDR_t store_xsub;
+static int fastcall_enabled;
+
+#define fastcall_is(cv, xsub) \
+    ((xsub) && SvTYPE(cv) == SVt_PVCV && CvISXSUB((CV*)cv) \
+     && CvXSUB((CV*)cv) == (xsub))
+
+static OP*
+fastcall_revert(pTHX)
+{
+    PL_op->op_ppaddr = PL_ppaddr[OP_ENTERSUB];
+    PL_op->op_spare = 1;
+    return PL_ppaddr[OP_ENTERSUB](aTHX);
+}
+
+static OP*
+pp_hr_fetch(pTHX)
+{
+    dSP;
+    I32 ax;
+    U8 gimme;
+    SV *ret;
+
+    if(!fastcall_is(TOPs, fetch_xsub)) {
+        return fastcall_revert(aTHX);
+    }
+    ax = TOPMARK + 1;
+    if(sp - (PL_stack_base + ax) != 2) {
+        /*Let the wrapper complain about its usage*/
+        return PL_ppaddr[OP_ENTERSUB](aTHX);
+    }
+    POPMARK;
+    gimme = GIMME_V;
+    /*The arguments stay on the stack for the duration of the call, as they
+     would for the wrapper*/
+    PL_stack_sp = sp - 1;
+    ret = HR_fetch_sk_real(aTHX_ PL_stack_base[ax], PL_stack_base[ax + 1]);
+
+    SPAGAIN;
+    sp = PL_stack_base + ax - 1;
+    if(gimme != G_VOID) {
+        XPUSHs(ret ? sv_2mortal(ret) : &PL_sv_undef);
+    } else if(ret) {
+        sv_2mortal(ret);
+    }
+    RETURN;
+}
+
+static OP*
+pp_hr_store(pTHX)
+{
+    dSP;
+    I32 ax;
+    I32 *markp;
+    U8 gimme;
+
+    if(!fastcall_is(TOPs, store_xsub)) {
+        return fastcall_revert(aTHX);
+    }
+    ax = TOPMARK + 1;
+    if(sp - (PL_stack_base + ax) < 3) {
+        return PL_ppaddr[OP_ENTERSUB](aTHX);
+    }
+    gimme = GIMME_V;
+    /*HRA_store_sk reads its options off the stack itself, popping the mark
+     as it does so. This is what the wrapper sets up for it as well*/
+    markp = PL_markstack_ptr;
+    PL_stack_sp = sp - 1;
+    HRA_store_sk(PL_stack_base[ax], PL_stack_base[ax + 1],
+                 PL_stack_base[ax + 2]);
+    if(PL_markstack_ptr == markp) {
+        POPMARK;
+    }
+
+    SPAGAIN;
+    sp = PL_stack_base + ax - 1;
+    if(gimme == G_SCALAR) {
+        XPUSHs(&PL_sv_undef);
+    }
+    RETURN;
+}
+
+void
+hr_fastcall_install(pTHX_ int which)
+{
+    if(!fastcall_enabled || PL_perldb || PL_op->op_type != OP_ENTERSUB) {
+        return;
+    }
+    PL_op->op_ppaddr = (which == HR_FASTCALL_FETCH) ? &pp_hr_fetch : &pp_hr_store;
+}
+
+/*Called once when the module is loaded. The XSUBs are the same for every
+ interpreter*/
+void
+hr_fastcall_init(pTHX)
+{
+    CV *cv;
+#ifdef PERL_DEBUG_READONLY_OPS
+    return;
+#endif
+    if(getenv("HR_NO_FASTCALL")) {
+        return;
+    }
+    if( (cv = get_cv(HR_PKG_CFUNC "::HRA_fetch_sk", 0)) && CvISXSUB(cv)) {
+        fetch_xsub = CvXSUB(cv);
+    }
+    if( (cv = get_cv(HR_PKG_CFUNC "::HRA_store_sk", 0)) && CvISXSUB(cv)) {
+        store_xsub = CvXSUB(cv);
+    }
+    fastcall_enabled = fetch_xsub && store_xsub;
+}
@@ -1,6 +1,7 @@
 #include "hreg.h"
 #include "hrdefs.h"
 #include "hrpriv.h"
+#include "hrprobes.h"
 #include "hr_duputil.h"
 
 #include <string.h>
@@ -19,6 +20,9 @@ __attribute__((packed))
     LOOKUP_FIELDS_COMMON;
 } hrk_simple;
 
+/*Object keys refer to their object by address. Only a StrongKey holds a
+ reference (obj_ptr); a weak key needs no RV of its own, as the action on the
+ object cleans up the key before the object goes away*/
 typedef struct
 __attribute__((packed))
 {
@@ -29,7 +33,7 @@ __attribute__((packed))
 } hrk_encap;
 
 static inline HV*
-get_v_hashref(hrk_encap *ke, SV* value);
+get_v_hashref(pTHX_ hrk_encap *ke, SV* value);
 
 #define ketbl_from_ke(ke) (HR_Table_t)(ke->table)
 
@@ -46,8 +50,11 @@ get_v_hashref(hrk_encap *ke, SV* value);
  private pointer table*/
 
 static void k_encap_cleanup(SV *ksv, SV *_, HR_Action *action_list);
+static void k_encap_cleanup_real(pTHX_ SV *ksv, int obj_dying);
 static void encap_destroy_hook(SV *encap_obj, SV *ksv, HR_Action *action_list);
-static inline void k_encap_wire_actions(SV *ksv, SV *encap);
+static inline void k_encap_wire_actions(pTHX_ SV *ksv, SV *encap);
+static SV* hrk_encap_new(pTHX_ char *package, SV *object, SV *table,
+                         SV *scalar_lookup, int strong);
 
 typedef char* _stashspec[2];
 
@@ -56,6 +63,7 @@ typedef char* _stashspec[2];
 
 void HRA_table_init(SV *self)
 {
+    dTHX;
     AV *my_stashcache = newAV();
     HV *stash;
     
@@ -76,30 +84,42 @@ void HRA_table_init(SV *self)
         av_store(my_stashcache, (I32)((*cspec)[0]), newRV_inc((SV*)stash));
     }
     
+    hr_tinfo_init(aTHX_ my_stashcache);
     av_store((AV*)SvRV(self), HR_HKEY_LOOKUP_PRIVDATA, newRV_noinc(my_stashcache));
 }
 
 static void encap_destroy_hook(SV *encap_obj, SV *ksv, HR_Action *action_list)
 {
+    dTHX;
     U32 old_refcount = refcnt_ka_begin(encap_obj);
     HR_DEBUG("Called!");
     SV *keyrv;
     RV_Newtmp(keyrv, ksv);
     
-    HR_XS_del_action_ext(keyrv, &k_encap_cleanup, NULL,
-                         HR_KEY_TYPE_NULL|HR_KEY_SFLAG_HASHREF_OPAQUE);
-    k_encap_cleanup(ksv, NULL, NULL);
-    refcnt_ka_end(encap_obj, old_refcount);
+    HR_del_actions_real(aTHX_ keyrv, (SV*)&k_encap_cleanup, NULL,
+                              HR_KEY_TYPE_NULL|HR_KEY_SFLAG_HASHREF_OPAQUE);
+    k_encap_cleanup_real(aTHX_ ksv, 1);
+    refcnt_ka_end(aTHX_ encap_obj, old_refcount);
     RV_Freetmp(keyrv);
 }
 
 static void k_encap_cleanup(SV *ksv, SV *_, HR_Action *action_list)
+{
+    dTHX;
+    k_encap_cleanup_real(aTHX_ ksv, 0);
+}
+
+/*obj_dying is set when called from the object's own destructor, whose
+ actions must then be left alone*/
+static void k_encap_cleanup_real(pTHX_ SV *ksv, int obj_dying)
 {
     /*Find our forward entry from the stringified object pointer*/
     hrk_encap *ke = keptr_from_sv(ksv);
     HR_Table_t table = ketbl_from_ke(ke);    
     SV *scalar_lookup, *forward, *reverse;
     SV *encap_rv = ke->obj_ptr;
+    SV *encap_obj = (SV*)ke->obj_paddr;
+    SV *objrv;
     SV *value = NULL;
     SV *vhash = NULL;
     
@@ -117,7 +137,7 @@ static void k_encap_cleanup(SV *ksv, SV *_, HR_Action *action_list)
     
     HR_DEBUG("obj_s=%s", obj_s);
     
-    get_hashes(table,
+    get_hashes(aTHX_ table,
                HR_HKEY_LOOKUP_REVERSE, &reverse,
                HR_HKEY_LOOKUP_FORWARD, &forward,
                HR_HKEY_LOOKUP_SCALAR, &scalar_lookup,
@@ -130,9 +150,11 @@ static void k_encap_cleanup(SV *ksv, SV *_, HR_Action *action_list)
             SvREFCNT(table));
     }
     
-    if(encap_rv && SvROK(encap_rv)) {
-        HR_XS_del_action_ext(encap_rv, &encap_destroy_hook,
-                             ksv, HR_KEY_TYPE_PTR|HR_KEY_SFLAG_HASHREF_OPAQUE);
+    if(encap_obj && !obj_dying) {
+        RV_Newtmp(objrv, encap_obj);
+        HR_del_actions_real(aTHX_ objrv, (SV*)&encap_destroy_hook, ksv,
+                                  HR_KEY_TYPE_PTR|HR_KEY_SFLAG_HASHREF_OPAQUE);
+        RV_Freetmp(objrv);
     }
     
     tmp_hashval = hv_fetch( REF2HASH(forward), obj_s, strlen(obj_s), 0 );
@@ -157,7 +179,7 @@ static void k_encap_cleanup(SV *ksv, SV *_, HR_Action *action_list)
         /*Common value deletion operation*/
         if(!HvKEYS(REF2HASH(vhash))) {
             HR_DEBUG("Removing vhash");
-            HR_PL_del_action_container(value, reverse);
+            HR_del_actions_real(aTHX_ value, reverse, NULL, HR_KEY_TYPE_NULL);
             hv_delete( REF2HASH(reverse), value_s, strlen(value_s), G_DISCARD);
         } else {
             HR_DEBUG("Vhash still has %lu keys remaining", HvKEYS(REF2HASH(vhash)));
@@ -176,7 +198,7 @@ static void k_encap_cleanup(SV *ksv, SV *_, HR_Action *action_list)
     HR_DEBUG("Returning...");
 }
 
-static inline void k_encap_wire_actions(SV *ksv, SV *encap)
+static inline void k_encap_wire_actions(pTHX_ SV *ksv, SV *encap)
 {
     HR_Action key_actions[] = {
         HR_DREF_FLDS_arg_for_cfunc(SvRV(ksv), &k_encap_cleanup),
@@ -187,8 +209,8 @@ static inline void k_encap_wire_actions(SV *ksv, SV *encap)
         HR_ACTION_LIST_TERMINATOR
     };
     
-    HR_add_actions_real(ksv, key_actions);
-    HR_add_actions_real(encap, encap_actions);
+    HR_add_actions_real(aTHX_ ksv, key_actions);
+    HR_add_actions_real(aTHX_ encap, encap_actions);
 }
 
 void HRXSK_encap_link_value(SV *self, SV *value)
@@ -196,37 +218,54 @@ void HRXSK_encap_link_value(SV *self, SV *value)
     /*NOOP*/
 }
 
+/*Drops the reference held by a strong key*/
 void HRXSK_encap_weaken(SV *ksv_ref)
 {
+    dTHX;
     hrk_encap *ke = keptr_from_sv(SvRV(ksv_ref));
+    SV *encap_rv = ke->obj_ptr;
     HR_DEBUG("Weakening encapsulated object reference");
-    sv_rvweaken(ke->obj_ptr);
+    if(encap_rv) {
+        ke->obj_ptr = NULL;
+        SvREFCNT_dec(encap_rv);
+    }
 }
 
 UV HRXSK_encap_kstring(SV* ksv_ref)
 {
     hrk_encap *ke = keptr_from_sv(SvRV(ksv_ref));
-    return (UV)SvRV(ke->obj_ptr);
+    return (UV)ke->obj_paddr;
 }
 
 SV *HRXSK_encap_getencap(SV *ksv_ref)
 {
+    dTHX;
     hrk_encap *ke = keptr_from_sv(SvRV(ksv_ref));
-    //die("Unsupported!");
-    return newSVsv(ke->obj_ptr);
+    if(!ke->obj_paddr) {
+        return &PL_sv_undef;
+    }
+    return newRV_inc((SV*)ke->obj_paddr);
 }
 
 SV* HRXSK_encap_new(char *package, SV* object, SV *table, SV* forward, SV* scalar_lookup)
+{
+    dTHX;
+    return hrk_encap_new(aTHX_ package, object, table, scalar_lookup, 1);
+}
+
+static SV*
+hrk_encap_new(pTHX_ char *package, SV *object, SV *table, SV *scalar_lookup,
+              int strong)
 {    
     HR_DEBUG("Encap key");
-    SV *ksv = mk_blessed_blob(package, sizeof(hrk_encap));
+    SV *ksv = mk_blessed_blob(aTHX_ package, sizeof(hrk_encap));
     
     if(!ksv) {
         die("couldn't create hrk_encap!");
         return NULL;
     }
     hrk_encap *keptr = keptr_from_sv(SvRV(ksv));
-    keptr->obj_ptr = newRV_inc(SvRV(object));
+    keptr->obj_ptr = (strong) ? newRV_inc(SvRV(object)) : NULL;
     keptr->obj_paddr = (char*)SvRV(object);
     
     keptr->table = REF2TABLE(table);
@@ -241,7 +280,7 @@ SV* HRXSK_encap_new(char *package, SV* object, SV *table, SV* forward, SV* scala
     hv_store( REF2HASH(scalar_lookup), key_s, strlen(key_s), self_hval, 0);
 #endif
 
-    k_encap_wire_actions(ksv, object);
+    k_encap_wire_actions(aTHX_ ksv, object);
     
     HR_DEBUG("Returning key %p", SvRV(ksv));
     return ksv;
@@ -250,11 +289,11 @@ SV* HRXSK_encap_new(char *package, SV* object, SV *table, SV* forward, SV* scala
 
 
 static inline HV*
-get_v_hashref(hrk_encap *ke, SV* value)
+get_v_hashref(pTHX_ hrk_encap *ke, SV* value)
 {
     HR_Table_t table = ke->table;
     SV *reverse;
-    get_hashes(table,
+    get_hashes(aTHX_ table,
                HR_HKEY_LOOKUP_REVERSE, &reverse,
                HR_HKEY_LOOKUP_NULL);
     
@@ -279,14 +318,15 @@ get_v_hashref(hrk_encap *ke, SV* value)
 ////////////////////////////////////////////////////////////////////////////////
 ////////////////////////////////////////////////////////////////////////////////
 
-SV* HRXSK_new(char *package, char *key, SV *forward, SV *scalar_lookup)
+static SV*
+hrk_new(pTHX_ char *package, char *key, SV *forward, SV *scalar_lookup)
 {
     hrk_simple newkey;
     
     int keylen = strlen(key) + 1;
     int bloblen = keylen + sizeof(newkey);
     
-    SV *ksv = mk_blessed_blob(package, bloblen);
+    SV *ksv = mk_blessed_blob(aTHX_ package, bloblen);
     
     if(!ksv) {
         die("Couldn't create package!");
@@ -317,10 +357,16 @@ SV* HRXSK_new(char *package, char *key, SV *forward, SV *scalar_lookup)
         HR_ACTION_LIST_TERMINATOR
     };
         
-    HR_add_actions_real(ksv, actions);
+    HR_add_actions_real(aTHX_ ksv, actions);
     return ksv;
 }
 
+SV* HRXSK_new(char *package, char *key, SV *forward, SV *scalar_lookup)
+{
+    dTHX;
+    return hrk_new(aTHX_ package, key, forward, scalar_lookup);
+}
+
 char * HRXSK_kstring(SV *obj)
 {
     char *blob = ksimple_from_sv(SvRV(obj));
@@ -334,12 +380,30 @@ UV HRXSK_prefix_len(SV *obj)
     return (ksimple_from_sv(SvRV(obj)))->prefix_len;
 }
 
+SV *hrk_encap_object(SV *ksv)
+{
+    return (SV*)(keptr_from_sv(ksv))->obj_paddr;
+}
+
+SV *hrk_action_table(HR_Action *action)
+{
+    if(action->ktype == HR_KEY_TYPE_NULL
+       || action->atype != HR_ACTION_TYPE_CALL_CFUNC) {
+        return NULL;
+    }
+    if(action->hashref != (SV*)&encap_destroy_hook
+       && action->hashref != (SV*)&k_encap_cleanup) {
+        return NULL;
+    }
+    return (SV*)ketbl_from_ke(keptr_from_sv((SV*)action->key));
+}
+
 ////////////////////////////////////////////////////////////////////////////////
 ////////////////////////////////////////////////////////////////////////////////
 /// Ref::Store API implementation (keys)                                 ///
 ////////////////////////////////////////////////////////////////////////////////
 ////////////////////////////////////////////////////////////////////////////////
-static inline SV* ukey2ikey(
+static inline SV* ukey2ikey(pTHX_
     SV* self,
     SV* key,
     SV** existing, /*PP: Argument to $options{O_EXCL}: $expected*/
@@ -357,7 +421,7 @@ static inline SV* ukey2ikey(
     HE *stored_val = NULL;
     char *kstring_p = NULL;
     
-    get_hashes(REF2TABLE(self),
+    get_hashes(aTHX_ REF2TABLE(self),
                HR_HKEY_LOOKUP_SCALAR, &slookup,
                HR_HKEY_LOOKUP_PRIVDATA, &my_stashcache_ref,
                HR_HKEY_LOOKUP_FORWARD, &flookup,
@@ -401,16 +465,13 @@ static inline SV* ukey2ikey(
         blessparam_setstash(stash_params, stash_from_cache_nocheck(
             my_stashcache_ref, HR_STASH_KEY_ENCAP));
         
-        kobj = HRXSK_encap_new(blessparam2chrp(stash_params),
-                    key, self, flookup, slookup);
-        if( (options & STORE_OPT_STRONG_KEY) == 0) {
-            HRXSK_encap_weaken(kobj);
-        }
+        kobj = hrk_encap_new(aTHX_ blessparam2chrp(stash_params),
+                    key, self, slookup, options & STORE_OPT_STRONG_KEY);
     } else {
         blessparam_setstash(stash_params,stash_from_cache_nocheck(
             my_stashcache_ref, HR_STASH_KEY_SCALAR));
         
-        kobj = HRXSK_new(blessparam2chrp(stash_params),
+        kobj = hrk_new(aTHX_ blessparam2chrp(stash_params),
                 SvPV_nolen(our_key), flookup, slookup);
         /*XS Simple key's weaken_encapsulated is nop*/
     }
@@ -433,8 +494,28 @@ static inline SV* ukey2ikey(
 
 
 
+/*Parses the option hash of the store functions, beginning at argument
+ opt_start*/
 static inline void
-store_helper(int *opt_p, SV **key_p, SV **vsv, char **prefix_p, int *prefix_len)
+store_opts(pTHX_ I32 ax, I32 items, int opt_start, int *opt_p, NV *ttl_p)
+{
+    if( (items - opt_start) % 2 ) {
+        die("Odd number of option hash arguments");
+    }
+    
+    for(opt_start; opt_start < items; opt_start += 2) {
+        if(strcmp(HR_STROPT_TTL, SvPV_nolen(ST(opt_start))) == 0) {
+            *ttl_p = SvNV(ST(opt_start+1));
+            continue;
+        }
+        _chkopt(STRONG_VALUE, opt_start, (*opt_p));
+        _chkopt(STRONG_KEY, opt_start, (*opt_p));
+    }
+}
+
+static inline void
+store_helper(pTHX_ int *opt_p, SV **key_p, SV **vsv, char **prefix_p,
+             int *prefix_len, NV *ttl_p)
 {
     dXSARGS;
     int opt_start = 3;
@@ -463,32 +544,170 @@ store_helper(int *opt_p, SV **key_p, SV **vsv, char **prefix_p, int *prefix_len)
         }
     }
     
-    if( (items - opt_start) % 2 ) {
-        die("Odd number of option hash arguments");
+    store_opts(aTHX_ ax, items, opt_start, opt_p, ttl_p);
+    XSRETURN(0);
+}
+
+
+/*Typed keys. The prefixed key is composed in a buffer on our own stack,
+ wrapped in a temporary SV which does not own it, rather than formatting a
+ new string for every call. Long keys fall back to a mortal string*/
+#define KT_SMALLBUF 128
+
+typedef struct {
+    SV      *sv;
+    int     prefix_len;
+    char    buf[KT_SMALLBUF];
+} kt_keybuf;
+
+static inline SV*
+kt_key_get(pTHX_ SV *self, SV *key, SV *t, kt_keybuf *kb)
+{
+    SV *kt_lookup;
+    HE *kt_ent;
+    char *pstr, *kstr, *dst;
+    STRLEN plen, klen;
+    
+    get_hashes(aTHX_ REF2TABLE(self), HR_HKEY_LOOKUP_KT, &kt_lookup,
+               HR_HKEY_LOOKUP_NULL);
+    if(!(kt_ent = hv_fetch_ent(REF2HASH(kt_lookup), t, 0, 0))) {
+        die("Couldn't find prefix for type '%s'", SvPV_nolen(t));
     }
+    kb->sv = NULL;
+    kb->prefix_len = 0;
     
-    for(opt_start; opt_start < items; opt_start += 2) {
-        _chkopt(STRONG_VALUE, opt_start, (*opt_p));
-        _chkopt(STRONG_KEY, opt_start, (*opt_p));
+    if(SvROK(key)) {
+        warn("Prefixed keys have no effect for object keys");
+        return key;
     }
-    XSRETURN(0);
+    
+    pstr = SvPV(HeVAL(kt_ent), plen);
+    kstr = SvPV(key, klen);
+    kb->prefix_len = plen;
+    
+    if(plen + klen + 2 > KT_SMALLBUF) {
+        kb->sv = sv_2mortal(newSV(plen + klen + 2));
+        SvPOK_on(kb->sv);
+        dst = SvPVX(kb->sv);
+    } else {
+        /*Mortal, so that a die() leaves nothing behind. The buffer is
+         detached again by kt_key_done()*/
+        kb->sv = sv_2mortal(newSV_type(SVt_PV));
+        SvPV_set(kb->sv, kb->buf);
+        SvLEN_set(kb->sv, 0);
+        SvPOK_on(kb->sv);
+        dst = kb->buf;
+    }
+    Copy(pstr, dst, plen, char);
+    dst[plen] = *HR_PREFIX_DELIM;
+    Copy(kstr, dst + plen + 1, klen, char);
+    dst[plen + klen + 1] = '\0';
+    SvCUR_set(kb->sv, plen + klen + 1);
+    return kb->sv;
 }
 
+static inline void
+kt_key_done(kt_keybuf *kb)
+{
+    if(kb->sv && SvPVX(kb->sv) == kb->buf) {
+        SvPOK_off(kb->sv);
+        SvPV_set(kb->sv, NULL);
+        SvCUR_set(kb->sv, 0);
+    }
+}
 
 void HRA_store_kt(SV *self, SV *key, SV *t, SV *value, ...)
 {
-    SV *kt_lookup;
-    HE *key_res;
+    dTHX;
+    int iopts = STORE_OPT_O_CREAT;
+    NV ttl = 0;
+    kt_keybuf kb;
+    SV *kobj;
     
-    get_hashes(REF2TABLE(self), HR_HKEY_LOOKUP_KT, &kt_lookup,
-               HR_HKEY_LOOKUP_NULL);
+    dXSARGS;
+    if(!SvROK(value)) {
+        die("Value must be reference");
+    }
+    store_opts(aTHX_ ax, items, 4, &iopts, &ttl);
+    
+    key = kt_key_get(aTHX_ self, key, t, &kb);
+    HR_PROBE3(store__entry, SvRV(self), SvRV(value), HR_PROBE_KLEN(key));
+    HR_store_sk_real(aTHX_ self, key, value, kb.prefix_len, iopts);
+    if(ttl > 0 && (kobj = ukey2ikey(aTHX_ self, key, NULL, 0))) {
+        hr_ttl_schedule(aTHX_ self, SvRV(kobj), ttl, 0);
+    }
+    HR_PROBE1(store__return, SvRV(self));
+    kt_key_done(&kb);
+    XSRETURN(0);
+}
+
+SV *HRA_fetch_kt(SV *self, SV *key, SV *t)
+{
+    dTHX;
+    kt_keybuf kb;
+    SV *ret = HR_fetch_sk_real(aTHX_ self, kt_key_get(aTHX_ self, key, t, &kb));
+    kt_key_done(&kb);
+    return ret;
+}
+
+SV *HRA_unlink_kt(SV *self, SV *key, SV *t)
+{
+    dTHX;
+    kt_keybuf kb;
+    SV *ret = HR_unlink_sk_real(aTHX_ self,
+                                kt_key_get(aTHX_ self, key, t, &kb));
+    kt_key_done(&kb);
+    return ret;
+}
+
+SV *HRA_purgeby_kt(SV *self, SV *key, SV *t)
+{
+    dTHX;
+    kt_keybuf kb;
+    SV *value = HR_fetch_sk_real(aTHX_ self,
+                                 kt_key_get(aTHX_ self, key, t, &kb));
+    kt_key_done(&kb);
+    if(!(value && SvROK(value))) {
+        return &PL_sv_undef;
+    }
+    SvREFCNT_dec(HR_purge_real(aTHX_ self, value));
+    return value;
+}
+
+/*PP: has_key*/
+static int
+lexists_real(pTHX_ SV *self, SV *key)
+{
+    SV *forward, *slookup, *value;
     
-    key_res = hv_fetch_ent(REF2HASH(kt_lookup), t, 0, 0);
-    if(!key_res) {
-        die("Couldn't fetch key for %s", SvPV_nolen(key));
+    if(hr_frozen_lookup(aTHX_ hr_tinfo_get(aTHX_ REF2TABLE(self)),
+                        key, &value)) {
+        return value != NULL;
     }
-    /*Value is unused, and is popped off the stack..*/
-    HRA_store_sk(self, key, HeVAL(key_res));
+    if(SvROK(key)) {
+        key = sv_2mortal(newSVuv(SvUV(key)));
+    }
+    get_hashes(aTHX_ REF2TABLE(self),
+               HR_HKEY_LOOKUP_FORWARD, &forward,
+               HR_HKEY_LOOKUP_SCALAR, &slookup,
+               HR_HKEY_LOOKUP_NULL);
+    return hv_exists_ent(REF2HASH(forward), key, 0)
+        || hv_exists_ent(REF2HASH(slookup), key, 0);
+}
+
+int HRA_lexists_sk(SV *self, SV *key)
+{
+    dTHX;
+    return lexists_real(aTHX_ self, key);
+}
+
+int HRA_lexists_kt(SV *self, SV *key, SV *t)
+{
+    dTHX;
+    kt_keybuf kb;
+    int ret = lexists_real(aTHX_ self, kt_key_get(aTHX_ self, key, t, &kb));
+    kt_key_done(&kb);
+    return ret;
 }
 
 /*The third argument is only the value for the perl-facing store/store_sk
@@ -497,22 +716,48 @@ void HRA_store_kt(SV *self, SV *key, SV *t, SV *value, ...)
 */
 
 void HRA_store_sk(SV *self, SV *key, SV *value, ...)
+{
+    dTHX;
+    char *prefix = NULL;
+    int prefix_len = 0;
+    int iopts = STORE_OPT_O_CREAT;
+    NV ttl = 0;
+    SV *kobj;
+    
+    HR_FASTCALL_INSTALL(HR_FASTCALL_STORE);
+    store_helper(aTHX_ &iopts, &key, &value, &prefix, &prefix_len, &ttl);
+    HR_PROBE3(store__entry, SvRV(self), SvRV(value), HR_PROBE_KLEN(key));
+    HR_store_sk_real(aTHX_ self, key, value, prefix_len, iopts);
+    if(ttl > 0 && (kobj = ukey2ikey(aTHX_ self, key, NULL, 0))) {
+        hr_ttl_schedule(aTHX_ self, SvRV(kobj), ttl, 0);
+    }
+    HR_PROBE1(store__return, SvRV(self));
+    
+    if(prefix_len) {
+        SvREFCNT_dec(key);
+    }
+}
+
+/*Does the actual work for store_sk. The key is already prefixed, and the
+ options have already been parsed. This does not touch the perl stack, and
+ can be used for batch insertion*/
+static void
+store_sk_real(pTHX_ SV *self, SV *key, SV *value, int prefix_len, int iopts)
 {
     SV *flookup = NULL,  *rlookup = NULL; //Lookup tables
     SV *kobj    = NULL, *kstring = NULL; // Key object and string
     SV *vstring = NULL; //Value refaddr
     SV *hval    = NULL; //reference to store in the forward hash
-    SV *existing_ent = NULL; /* SV** to send/receive options for O_CREAT/O_EXCL*/
+    SV *existing_ent = value; /* SV** to send/receive options for O_CREAT/O_EXCL*/
     SV *vhash; //Value's lookup references
-    char *prefix = NULL;
-    int prefix_len = 0;
     int key_is_ref = SvROK(key);
-    int iopts = STORE_OPT_O_CREAT;
+    HR_TableInfo *tinfo = hr_tinfo_get(aTHX_ REF2TABLE(self));
     
-    store_helper(&iopts, &key, &value, &prefix, &prefix_len);
-    existing_ent = value;
-    
-    kobj = ukey2ikey(self, key, &existing_ent, iopts);
+    HR_TSTAT_INC(tinfo, stores);
+    if(tinfo->frozen) {
+        hr_frozen_thaw(aTHX_ self);
+    }
+    kobj = ukey2ikey(aTHX_ self, key, &existing_ent, iopts);
     
     if(existing_ent) {
         HR_DEBUG("We're already stored");
@@ -537,12 +782,12 @@ void HRA_store_sk(SV *self, SV *key, SV *value, ...)
         }
     }
     
-    get_hashes(REF2TABLE(self),
+    get_hashes(aTHX_ REF2TABLE(self),
                HR_HKEY_LOOKUP_FORWARD, &flookup,
                HR_HKEY_LOOKUP_REVERSE, &rlookup,
                HR_HKEY_LOOKUP_NULL);
     /*Get value hashref*/
-    vhash = get_vhash_from_rlookup(rlookup, vstring, 1);
+    vhash = get_vhash_from_rlookup(aTHX_ rlookup, vstring, 1);
     assert(vhash);
     hv_store_ent(REF2HASH(vhash), kstring, kobj, 0);
     
@@ -552,7 +797,17 @@ void HRA_store_sk(SV *self, SV *key, SV *value, ...)
     hv_store_ent(REF2HASH(flookup), kstring, hval, 0);
     
     /*PP: dref_add_ptr*/
-    HR_PL_add_action_ptr(hval, rlookup);
+    HR_Action hval_actions[] = {
+        HR_DREF_FLDS_ptr_from_hv(SvRV(hval), rlookup),
+        HR_ACTION_LIST_TERMINATOR
+    };
+    HR_add_actions_real(aTHX_ hval, hval_actions);
+    hr_evict_watch(aTHX_ tinfo, SvRV(kobj), kstring, SvRV(value));
+    if(prefix_len) {
+        STRLEN klen;
+        char *kstr = SvPV(kstring, klen);
+        hr_oidx_add(aTHX_ self, SvRV(kobj), kstr, klen, 0);
+    }
     
     /*PP: if(!$options{StrongValue}) { weaken($self->forward->kstring)}*/
     if( (iopts & STORE_OPT_STRONG_VALUE) == 0) {
@@ -567,37 +822,471 @@ void HRA_store_sk(SV *self, SV *key, SV *value, ...)
     if(vstring) {
         SvREFCNT_dec(vstring);
     }
-    if(prefix_len) {
-        SvREFCNT_dec(key);
+    hr_clock_touch(aTHX_ tinfo, self, value, 0);
+}
+
+/*The store paths all come through here, so this is where they are timed*/
+void HR_store_sk_real(pTHX_ SV *self, SV *key, SV *value, int prefix_len,
+                      int iopts)
+{
+    HR_OP_BEGIN(cxt);
+    UV lat_begin = hr_latency_begin(aTHX_ self);
+    store_sk_real(aTHX_ self, key, value, prefix_len, iopts);
+    if(lat_begin) {
+        hr_latency_end(aTHX_ self, HR_LAT_STORE, lat_begin);
     }
+    HR_OP_END(cxt);
 }
 
+/*Only the exported entry point switches its call site over to a direct
+ call. The other callers of fetch (typed keys, the C API, and the direct
+ call itself) come in below it, as the current op isn't theirs*/
 SV *HRA_fetch_sk(SV *self, SV *key)
 {
-    SV *kobj = ukey2ikey(self, key, NULL, 0);
+    dTHX;
+    HR_FASTCALL_INSTALL(HR_FASTCALL_FETCH);
+    return HR_fetch_sk_real(aTHX_ self, key);
+}
+
+SV *HR_fetch_sk_real(pTHX_ SV *self, SV *key)
+{
+    HR_PROBE2(fetch__entry, SvRV(self), HR_PROBE_KLEN(key));
+    SV *kobj;
     SV *flookup;
     SV *ret = NULL;
+    HR_TableInfo *tinfo = hr_tinfo_get(aTHX_ REF2TABLE(self));
+    if(hr_frozen_fetch(aTHX_ tinfo, key, &ret)) {
+        HR_PROBE2(fetch__return, SvRV(self), ret != &PL_sv_undef);
+        return ret;
+    }
+    kobj = ukey2ikey(aTHX_ self, key, NULL, 0);
     if(!kobj) {
         HR_DEBUG("Can't find key object!");
+        HR_TSTAT_INC(tinfo, fetch_misses);
+        HR_PROBE2(fetch__return, SvRV(self), 0);
         return &PL_sv_undef;
     }
     int key_is_ref = SvROK(key);
     key = (key_is_ref) ? newSVuv(SvUV(key)) : key;
-    get_hashes(REF2TABLE(self),
+    get_hashes(aTHX_ REF2TABLE(self),
                HR_HKEY_LOOKUP_FORWARD, &flookup,
                HR_HKEY_LOOKUP_NULL);
     
     HE *res = hv_fetch_ent(REF2HASH(flookup), key, 0, 0);
     if(res) {
         HR_DEBUG("Got result for %p", key);
+        HR_TSTAT_INC(tinfo, fetch_hits);
         ret = newSVsv(HeVAL(res));
+        hr_clock_touch(aTHX_ tinfo, self, ret, 1);
     } else {
         HR_DEBUG("Nothing for %p", key);
+        HR_TSTAT_INC(tinfo, fetch_misses);
     }
     HR_DEBUG("Refcount for key: %d", SvREFCNT(SvRV(kobj)));
     if(key_is_ref) {
         SvREFCNT_dec(key);
     }
+    HR_PROBE2(fetch__return, SvRV(self), ret != NULL);
+    return ret;
+}
+
+/*Returns the stored forward entry for a key, or NULL. Object keys are
+ stringified on the stack, so no SVs are created*/
+static inline SV*
+fetch_stored(pTHX_ SV *self, SV *key)
+{
+    SV *flookup, *ret = NULL;
+    SV **ent;
+    HE *res;
+    HR_TableInfo *tinfo = hr_tinfo_get(aTHX_ REF2TABLE(self));
+    
+    get_hashes(aTHX_ REF2TABLE(self),
+               HR_HKEY_LOOKUP_FORWARD, &flookup,
+               HR_HKEY_LOOKUP_NULL);
+    if(SvROK(key)) {
+        mk_ptr_string(kstr, SvRV(key));
+        if( (ent = hv_fetch(REF2HASH(flookup), kstr, strlen(kstr), 0)) ) {
+            ret = *ent;
+        }
+    } else if( (res = hv_fetch_ent(REF2HASH(flookup), key, 0, 0)) ) {
+        ret = HeVAL(res);
+    }
+    
+    if(ret && SvROK(ret)) {
+        HR_TSTAT_INC(tinfo, fetch_hits);
+        hr_clock_touch(aTHX_ tinfo, self, ret, 1);
+        return ret;
+    }
+    HR_TSTAT_INC(tinfo, fetch_misses);
+    return NULL;
+}
+
+/*Like fetch, but returns the stored reference itself rather than a copy.
+ It is only kept alive (by a mortal reference count) until the end of the
+ calling statement, and must not be modified*/
+void HRA_fetch_alias(SV *self, SV *key)
+{
+    dTHX;
+    SV *stored, *value;
+    dXSARGS;
+    
+    /*Frozen tables have no stored reference to give out, so a new one is*/
+    if(hr_frozen_lookup(aTHX_ hr_tinfo_get(aTHX_ REF2TABLE(self)),
+                        key, &value)) {
+        ST(0) = value ? sv_2mortal(newRV_inc(value)) : &PL_sv_undef;
+        XSRETURN(1);
+    }
+    stored = fetch_stored(aTHX_ self, key);
+    if(!stored) {
+        XSRETURN_UNDEF;
+    }
+    ST(0) = sv_2mortal(SvREFCNT_inc_simple_NN(stored));
+    XSRETURN(1);
+}
+
+/*Assigns the value to an existing scalar. Returns true if it was found;
+ otherwise the scalar is set to undef*/
+void HRA_fetch_into(SV *self, SV *key, SV *target)
+{
+    dTHX;
+    SV *stored, *value;
+    dXSARGS;
+    
+    if(hr_frozen_lookup(aTHX_ hr_tinfo_get(aTHX_ REF2TABLE(self)),
+                        key, &value)) {
+        if(value) {
+            RV_Newtmp(stored, value);
+            sv_setsv(target, stored);
+            RV_Freetmp(stored);
+        } else {
+            sv_setsv(target, &PL_sv_undef);
+        }
+        SvSETMAGIC(target);
+        ST(0) = value ? &PL_sv_yes : &PL_sv_no;
+        XSRETURN(1);
+    }
+    stored = fetch_stored(aTHX_ self, key);
+    sv_setsv(target, stored ? stored : &PL_sv_undef);
+    SvSETMAGIC(target);
+    ST(0) = stored ? &PL_sv_yes : &PL_sv_no;
+    XSRETURN(1);
+}
+
+/*PP: unlink_sk. Dissociates the value from a single key. Deleting the key
+ from the value's vhash drops the last strong reference to the key object,
+ whose own actions then remove the forward and scalar entries*/
+static SV*
+unlink_sk_real(pTHX_ SV *self, SV *key)
+{
+    SV *kobj;
+    SV *flookup, *rlookup;
+    SV *kstring, *vstring, *vhash;
+    SV *ret;
+    HE *res;
+    HR_TableInfo *tinfo = hr_tinfo_get(aTHX_ REF2TABLE(self));
+    
+    /*Thawed before the lookup, as releasing the image may free key objects*/
+    if(tinfo->frozen) {
+        hr_frozen_thaw(aTHX_ self);
+    }
+    kobj = ukey2ikey(aTHX_ self, key, NULL, 0);
+    if(!kobj) {
+        return &PL_sv_undef;
+    }
+    HR_TSTAT_INC(tinfo, unlinks);
+    
+    get_hashes(aTHX_ REF2TABLE(self),
+               HR_HKEY_LOOKUP_FORWARD, &flookup,
+               HR_HKEY_LOOKUP_REVERSE, &rlookup,
+               HR_HKEY_LOOKUP_NULL);
+    
+    kstring = SvROK(key) ? sv_2mortal(newSVuv(SvUV(key))) : key;
+    res = hv_fetch_ent(REF2HASH(flookup), kstring, 0, 0);
+    if(!(res && SvROK(HeVAL(res)))) {
+        die("Found orphaned key %s", SvPV_nolen(kstring));
+    }
+    
+    /*Keep the value alive for our caller*/
+    ret = newSVsv(HeVAL(res));
+    vstring = sv_2mortal(newSVuv((UV)SvRV(ret)));
+    
+    vhash = get_vhash_from_rlookup(aTHX_ rlookup, vstring, 0);
+    if(!vhash) {
+        die("Can't locate vhash");
+    }
+    hv_delete_ent(REF2HASH(vhash), kstring, G_DISCARD, 0);
+    
+    if(!HvKEYS(REF2HASH(vhash))) {
+        hv_delete_ent(REF2HASH(rlookup), vstring, G_DISCARD, 0);
+        HR_del_actions_real(aTHX_ ret, rlookup, SvRV(ret), HR_KEY_TYPE_PTR);
+    }
+    return ret;
+}
+
+SV *HRA_unlink_sk(SV *self, SV *key)
+{
+    dTHX;
+    return HR_unlink_sk_real(aTHX_ self, key);
+}
+
+SV *HR_unlink_sk_real(pTHX_ SV *self, SV *key)
+{
+    HR_OP_BEGIN(cxt);
+    UV lat_begin = hr_latency_begin(aTHX_ self);
+    SV *ret = unlink_sk_real(aTHX_ self, key);
+    if(lat_begin) {
+        hr_latency_end(aTHX_ self, HR_LAT_UNLINK, lat_begin);
+    }
+    HR_OP_END(cxt);
+    return ret;
+}
+
+/*Unlinks a key given its key object, for expiry*/
+void hrk_unlink_obj(pTHX_ SV *self, SV *ksv)
+{
+    SV *my_stashcache_ref, *key, *ret;
+    get_hashes(aTHX_ REF2TABLE(self),
+               HR_HKEY_LOOKUP_PRIVDATA, &my_stashcache_ref,
+               HR_HKEY_LOOKUP_NULL);
+    
+    if(SvSTASH(ksv) == stash_from_cache_nocheck(my_stashcache_ref,
+                                                HR_STASH_KEY_ENCAP)) {
+        if(!(keptr_from_sv(ksv))->obj_paddr) {
+            return;
+        }
+        key = newRV_inc((SV*)(keptr_from_sv(ksv))->obj_paddr);
+    } else {
+        key = newSVpv(ksimple_strkey(ksimple_from_sv(ksv)), 0);
+    }
+    ret = HR_unlink_sk_real(aTHX_ self, key);
+    SvREFCNT_dec(key);
+    SvREFCNT_dec(ret);
+}
+
+/*PP: purge. Removes all keys and attributes pointing to the value. Keys go
+ away with the vhash; attributes need to remove the value from their own
+ attribute hashes as well*/
+static SV*
+purge_real(pTHX_ SV *self, SV *value)
+{
+    SV *rlookup, *my_stashcache_ref;
+    SV *vstring, *vhash;
+    HV *ascalar_stash, *aencap_stash;
+    AV *attrs;
+    HE *cur;
+    I32 i;
+    HR_TableInfo *tinfo;
+    
+    if(!SvROK(value)) {
+        return &PL_sv_undef;
+    }
+    tinfo = hr_tinfo_get(aTHX_ REF2TABLE(self));
+    HR_TSTAT_INC(tinfo, purges);
+    if(tinfo->frozen) {
+        hr_frozen_thaw(aTHX_ self);
+    }
+    
+    get_hashes(aTHX_ REF2TABLE(self),
+               HR_HKEY_LOOKUP_REVERSE, &rlookup,
+               HR_HKEY_LOOKUP_PRIVDATA, &my_stashcache_ref,
+               HR_HKEY_LOOKUP_NULL);
+    
+    vstring = sv_2mortal(newSVuv((UV)SvRV(value)));
+    vhash = get_vhash_from_rlookup(aTHX_ rlookup, vstring, 0);
+    
+    if(vhash) {
+        ascalar_stash = stash_from_cache_nocheck(my_stashcache_ref,
+                                                 HR_STASH_ATTR_SCALAR);
+        aencap_stash = stash_from_cache_nocheck(my_stashcache_ref,
+                                                HR_STASH_ATTR_ENCAP);
+        /*Unlinking an attribute modifies the vhash, so collect them first*/
+        attrs = (AV*)sv_2mortal((SV*)newAV());
+        hv_iterinit(REF2HASH(vhash));
+        while( (cur = hv_iternext(REF2HASH(vhash))) ) {
+            SV *lobj = hv_iterval(REF2HASH(vhash), cur);
+            if(!SvROK(lobj)) {
+                die("Found stale key object!");
+            }
+            if(SvSTASH(SvRV(lobj)) == ascalar_stash
+               || SvSTASH(SvRV(lobj)) == aencap_stash) {
+                av_push(attrs, newSVsv(lobj));
+            }
+        }
+        for(i = 0; i <= av_len(attrs); i++) {
+            hrattr_unlink_value(aTHX_ *av_fetch(attrs, i, 0), value);
+        }
+    }
+    
+    hr_ik_purge_value(aTHX_ self, SvRV(value));
+    hr_vid_purge_value(aTHX_ self, SvRV(value));
+    HR_del_actions_real(aTHX_ value, rlookup, SvRV(value), HR_KEY_TYPE_PTR);
+    hv_delete_ent(REF2HASH(rlookup), vstring, G_DISCARD, 0);
+    return newSVsv(value);
+}
+
+SV *HRA_purge(SV *self, SV *value)
+{
+    dTHX;
+    return HR_purge_real(aTHX_ self, value);
+}
+
+SV *HR_purge_real(pTHX_ SV *self, SV *value)
+{
+    HR_OP_BEGIN(cxt);
+    UV lat_begin = hr_latency_begin(aTHX_ self);
+    SV *ret = purge_real(aTHX_ self, value);
+    if(lat_begin) {
+        hr_latency_end(aTHX_ self, HR_LAT_PURGE, lat_begin);
+    }
+    HR_OP_END(cxt);
+    return ret;
+}
+
+/*PP: exchange_value. Everything stored for the old value is moved over to
+ the new one in place: the vhash is re-filed under the new address, and the
+ forward entry of each key and the hash entry of each attribute is
+ retargeted, keeping its strength*/
+static void
+exchange_value_real(pTHX_ SV *self, SV *old, SV *new)
+{
+    SV *rlookup, *flookup, *my_stashcache_ref;
+    SV *ostring, *nstring, *vhash, *lobj, *hval;
+    HV *vh, *ascalar_stash, *aencap_stash;
+    HE *cur, *fent;
+    
+    if(!(SvROK(old) && SvROK(new))) {
+        die("Values must be references");
+    }
+    if(SvRV(old) == SvRV(new)) {
+        return;
+    }
+    hr_frozen_thaw(aTHX_ self);
+    
+    get_hashes(aTHX_ REF2TABLE(self),
+               HR_HKEY_LOOKUP_REVERSE, &rlookup,
+               HR_HKEY_LOOKUP_FORWARD, &flookup,
+               HR_HKEY_LOOKUP_PRIVDATA, &my_stashcache_ref,
+               HR_HKEY_LOOKUP_NULL);
+    
+    ostring = sv_2mortal(newSVuv((UV)SvRV(old)));
+    nstring = sv_2mortal(newSVuv((UV)SvRV(new)));
+    if(hv_exists_ent(REF2HASH(rlookup), nstring, 0)) {
+        die("Can't switch to existing value!");
+    }
+    
+    hr_ik_exchange_value(aTHX_ self, SvRV(old), SvRV(new));
+    
+    if(!(vhash = get_vhash_from_rlookup(aTHX_ rlookup, ostring, 0))) {
+        return;
+    }
+    
+    /*Re-file the vhash. It must survive its old entry being deleted*/
+    vh = (HV*)SvREFCNT_inc(SvRV(vhash));
+    HR_del_actions_real(aTHX_ old, rlookup, SvRV(old), HR_KEY_TYPE_PTR);
+    hv_delete_ent(REF2HASH(rlookup), ostring, G_DISCARD, 0);
+    hv_store_ent(REF2HASH(rlookup), nstring, newRV_noinc((SV*)vh), 0);
+    
+    HR_Action rlookup_delete[] = {
+        HR_DREF_FLDS_ptr_from_hv(SvRV(new), rlookup),
+        HR_ACTION_LIST_TERMINATOR
+    };
+    HR_add_actions_real(aTHX_ new, rlookup_delete);
+    
+    ascalar_stash = stash_from_cache_nocheck(my_stashcache_ref,
+                                             HR_STASH_ATTR_SCALAR);
+    aencap_stash = stash_from_cache_nocheck(my_stashcache_ref,
+                                            HR_STASH_ATTR_ENCAP);
+    
+    hv_iterinit(vh);
+    while( (cur = hv_iternext(vh)) ) {
+        lobj = hv_iterval(vh, cur);
+        if(!SvROK(lobj)) {
+            die("Found stale key object!");
+        }
+        if(SvSTASH(SvRV(lobj)) == ascalar_stash
+           || SvSTASH(SvRV(lobj)) == aencap_stash) {
+            hrattr_exchange_value(aTHX_ SvRV(lobj), old, new);
+            continue;
+        }
+        
+        fent = hv_fetch_ent(REF2HASH(flookup), hv_iterkeysv(cur), 0, 0);
+        if(!fent) {
+            die("Found orphaned key %s", HePV(cur, PL_na));
+        }
+        hr_evict_retarget(aTHX_ self, SvRV(lobj), SvRV(new));
+        hval = newSVsv(new);
+        HR_Action hval_actions[] = {
+            HR_DREF_FLDS_ptr_from_hv(SvRV(hval), rlookup),
+            HR_ACTION_LIST_TERMINATOR
+        };
+        HR_add_actions_real(aTHX_ hval, hval_actions);
+        if(SvWEAKREF(HeVAL(fent))) {
+            sv_rvweaken(hval);
+        }
+        /*Replaces (and releases) the old forward reference*/
+        hv_store_ent(REF2HASH(flookup), hv_iterkeysv(cur), hval, 0);
+    }
+    hr_vid_purge_value(aTHX_ self, SvRV(old));
+    hr_clock_touch(aTHX_ hr_tinfo_get(aTHX_ REF2TABLE(self)), self, new, 0);
+}
+
+void HRA_exchange_value(SV *self, SV *old, SV *new)
+{
+    dTHX;
+    HR_OP_BEGIN(cxt);
+    exchange_value_real(aTHX_ self, old, new);
+    HR_OP_END(cxt);
+}
+
+/*Moves a value from one key to another, keeping the strength of both the
+ value and (for object keys) the key. Dies, without changing anything, if
+ the new key holds a different value*/
+static SV*
+rekey_real(pTHX_ SV *self, SV *old, SV *new)
+{
+    SV *kobj, *flookup, *kstring, *value;
+    HE *fent;
+    int iopts = STORE_OPT_O_CREAT;
+    
+    kobj = ukey2ikey(aTHX_ self, old, NULL, 0);
+    if(!kobj) {
+        return &PL_sv_undef;
+    }
+    get_hashes(aTHX_ REF2TABLE(self),
+               HR_HKEY_LOOKUP_FORWARD, &flookup,
+               HR_HKEY_LOOKUP_NULL);
+    
+    kstring = SvROK(old) ? sv_2mortal(newSVuv((UV)SvRV(old))) : old;
+    fent = hv_fetch_ent(REF2HASH(flookup), kstring, 0, 0);
+    if(!(fent && SvROK(HeVAL(fent)))) {
+        die("Found orphaned key %s", SvPV_nolen(kstring));
+    }
+    value = newSVsv(HeVAL(fent));
+    
+    if(SvROK(old) == SvROK(new)
+       && (SvROK(old) ? SvRV(old) == SvRV(new) : sv_eq(old, new))) {
+        return value;
+    }
+    
+    if(!SvWEAKREF(HeVAL(fent))) {
+        iopts |= STORE_OPT_STRONG_VALUE;
+    }
+    if(SvROK(old) && (keptr_from_sv(SvRV(kobj)))->obj_ptr) {
+        iopts |= STORE_OPT_STRONG_KEY;
+    }
+    
+    sv_2mortal(value);
+    HR_store_sk_real(aTHX_ self, new, value, 0, iopts);
+    SvREFCNT_dec(HR_unlink_sk_real(aTHX_ self, old));
+    return newSVsv(value);
+}
+
+SV *HRA_rekey(SV *self, SV *old, SV *new)
+{
+    dTHX;
+    HR_OP_BEGIN(cxt);
+    SV *ret = rekey_real(aTHX_ self, old, new);
+    HR_OP_END(cxt);
     return ret;
 }
 
@@ -608,42 +1297,50 @@ SV *HRA_fetch_sk(SV *self, SV *key)
 ////////////////////////////////////////////////////////////////////////////////
 void HRA_ithread_store_lookup_info(SV *self, HV *ptr_map)
 {
-    hr_dup_store_old_lookups(ptr_map, REF2TABLE(self));
+    dTHX;
+    hr_dup_store_old_lookups(aTHX_ ptr_map, REF2TABLE(self));
 }
 
 void HRXSK_encap_ithread_predup(SV *self, SV *table, HV *ptr_map, SV *value)
 {
+    dTHX;
     hrk_encap *ke = keptr_from_sv(SvRV(self));   
-    HR_Dup_Kinfo *ki = hr_dup_store_kinfo(ptr_map, HR_DUPKEY_KENCAP,
+    HR_Dup_Kinfo *ki = hr_dup_store_kinfo(aTHX_ ptr_map, HR_DUPKEY_KENCAP,
                                           ke->obj_paddr, 0);
+    SV *objrv;
     
-    if(SvWEAKREF(ke->obj_ptr)) {
+    if(!ke->obj_ptr) {
         ki->flags = HRK_DUP_WEAK_ENCAP;
     } else {
         ki->flags = 0;
     }
     
-    HV *vhash = get_v_hashref(ke, value);
+    HV *vhash = get_v_hashref(aTHX_ ke, value);
     ki->vhash = vhash;
     
-    hr_dup_store_rv(ptr_map, ke->obj_ptr);
+    RV_Newtmp(objrv, (SV*)ke->obj_paddr);
+    hr_dup_store_rv(aTHX_ ptr_map, objrv);
+    RV_Freetmp(objrv);
 }
 
 void HRXSK_encap_ithread_postdup(SV *newself, SV *newtable, HV *ptr_map, UV old_table)
 {
+    dTHX;
     hrk_encap *ke = keptr_from_sv(SvRV(newself));
     
-    HR_Dup_OldLookups *old_lookups = hr_dup_get_old_lookups(ptr_map, ke->table);
-    HR_Dup_Kinfo *ki = hr_dup_get_kinfo(ptr_map, HR_DUPKEY_KENCAP, ke->obj_paddr);
+    HR_Dup_OldLookups *old_lookups = hr_dup_get_old_lookups(aTHX_ ptr_map,
+                                                            ke->table);
+    HR_Dup_Kinfo *ki = hr_dup_get_kinfo(aTHX_ ptr_map, HR_DUPKEY_KENCAP, ke->obj_paddr);
     
     HR_DEBUG("Old vhash was %p, old obj_paddr was %p", ki->vhash, ke->obj_paddr);
     
-    SV *new_encap = hr_dup_newsv_for_oldsv(ptr_map, ke->obj_paddr, 0);    
-    k_encap_wire_actions(newself, new_encap);
+    SV *new_encap = hr_dup_newsv_for_oldsv(aTHX_ ptr_map, ke->obj_paddr, 0);    
+    k_encap_wire_actions(aTHX_ newself, new_encap);
     ke->obj_paddr = SvRV(new_encap);
-    ke->obj_ptr = newSVsv(new_encap);
     if(ki->flags & HRK_DUP_WEAK_ENCAP) {
-        sv_rvweaken(ke->obj_ptr);
+        ke->obj_ptr = NULL;
+    } else {
+        ke->obj_ptr = newSVsv(new_encap);
     }
     ke->table = SvRV(newtable);
     HR_DEBUG("Reassigned %p", SvRV(newtable));
@@ -653,12 +1350,13 @@ void HRXSK_encap_ithread_postdup(SV *newself, SV *newtable, HV *ptr_map, UV old_
 /*Postdup for simple keys*/
 void HRXSK_ithread_postdup(SV *newself, SV *newtable, HV *ptr_map, UV old_table)
 {
+    dTHX;
     hrk_simple *ksp = ksimple_from_sv(SvRV(newself));
     
     char *key = ksimple_strkey(ksp);
     SV *slookup, *flookup;
     
-    get_hashes(REF2TABLE(newtable),
+    get_hashes(aTHX_ REF2TABLE(newtable),
                HR_HKEY_LOOKUP_SCALAR, &slookup,
                HR_HKEY_LOOKUP_FORWARD, &flookup,
                HR_HKEY_LOOKUP_NULL);
@@ -668,5 +1366,5 @@ void HRXSK_ithread_postdup(SV *newself, SV *newtable, HV *ptr_map, UV old_table)
         HR_DREF_FLDS_Estr_from_hv(key, flookup),
         HR_ACTION_LIST_TERMINATOR
     };
-    HR_add_actions_real(newself, key_actions);
+    HR_add_actions_real(aTHX_ newself, key_actions);
 }
\ No newline at end of file
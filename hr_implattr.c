@@ -5,6 +5,7 @@
 #include "hreg.h"
 #include "hrpriv.h"
 #include "hrdefs.h"
+#include "hrprobes.h"
 #include "hr_duputil.h"
 
 #include <string.h>
@@ -15,6 +16,7 @@
     LOOKUP_FIELDS_COMMON \
     SV *table; \
     HV *attrhash; \
+    HR_Bitmap *members; \
     unsigned char encap;
 
 typedef struct {
@@ -40,29 +42,42 @@ typedef struct {
 
 #define attr_encap_cast(attr) ((hrattr_encap*)attr)
 
-static inline SV *attr_get(SV *self, SV *attr, char *t, int options);
-static inline SV *attr_new_common(char *pkg, char *key, SV *table, int attrsize);
+/*Walks the attribute hash's buckets directly. Unlike hv_iterinit(), this
+ writes nothing to the hash, so lookups leave a frozen table's pages alone*/
+#define attrhash_foreach(hv, he, i) \
+    for(i = 0; HvARRAY(hv) && i <= HvMAX(hv); i++) \
+        for(he = HvARRAY(hv)[i]; he; he = HeNEXT(he))
+
+static inline SV *attr_get(pTHX_ SV *self, SV *attr, char *t, int options);
+static inline SV *attr_get_str(pTHX_ SV *self, SV *attr, char *attr_fullstr,
+                              int attrlen, int prefix_len, int options);
+static inline void attr_store_value(pTHX_ SV *self, HR_TableInfo *tinfo,
+                                    SV *aobj,
+                                    SV *value, int options);
+static inline SV *attr_new_common(pTHX_ char *pkg, char *key, SV *table, int attrsize);
 
 static void attr_destroy_trigger(SV *self, SV *encap_obj, HR_Action *action_list);
 static void encap_attr_destroy_hook(SV *encap_obj, SV *attr_sv, HR_Action *action_list);
 
-static inline SV* attr_simple_new(char *pkg, char *astr, SV *table);
-static inline SV* attr_encap_new(char *pkg, char *astr, SV *encapped, SV *table);
-static inline SV* attr_new_common(char *pkg, char *astr, SV *table, int attrsz);
-static inline void attr_delete_from_vhash(SV *self, SV *value);
-static inline void attr_delete_value_from_attrhash(SV *self, SV *value);
+static inline SV* attr_simple_new(pTHX_ char *pkg, char *astr, SV *table);
+static inline SV* attr_encap_new(pTHX_ char *pkg, char *astr, SV *encapped, SV *table);
+static inline SV* attr_new_common(pTHX_ char *pkg, char *astr, SV *table,
+                                  int attrsz);
+static inline void attr_delete_from_vhash(pTHX_ SV *self, SV *value);
+static inline void attr_delete_value_from_attrhash(pTHX_ SV *self, SV *value);
 
 static inline SV*
-attr_new_common(char *pkg, char *key, SV *table, int attrsize)
+attr_new_common(pTHX_ char *pkg, char *key, SV *table, int attrsize)
 {
     int keylen = strlen(key) + 1;
     int bloblen = attrsize + keylen;
-    SV *self = mk_blessed_blob(pkg, bloblen);
+    SV *self = mk_blessed_blob(aTHX_ pkg, bloblen);
     hrattr_simple *attr = attr_from_sv(SvRV(self));
     char *key_offset = attr_strkey(attr, attrsize);
     Copy(key, key_offset, keylen, char);
     attr->table = SvRV(table);
     attr->attrhash = newHV();
+    attr->members = NULL;
     attr->encap = 0;
     
     HR_Action destroy_action[] = {
@@ -70,14 +85,14 @@ attr_new_common(char *pkg, char *key, SV *table, int attrsize)
         HR_ACTION_LIST_TERMINATOR
     };
     
-    HR_add_actions_real(self, destroy_action);
+    HR_add_actions_real(aTHX_ self, destroy_action);
     return self;
 }
 
 static inline SV
-*attr_encap_new(char *pkg, char *key, SV *obj, SV *table)
+*attr_encap_new(pTHX_ char *pkg, char *key, SV *obj, SV *table)
 {
-    SV *self = attr_new_common(pkg, key, table, sizeof(hrattr_encap));
+    SV *self = attr_new_common(aTHX_ pkg, key, table, sizeof(hrattr_encap));
     hrattr_encap *attr = attr_encap_cast(attr_from_sv(SvRV(self)));
     attr->obj_rv = newSVsv(obj);
     attr->obj_paddr = (char*)SvRV(obj);
@@ -86,19 +101,20 @@ static inline SV
         HR_DREF_FLDS_arg_for_cfunc(SvRV(self), (SV*)&encap_attr_destroy_hook),
         HR_ACTION_LIST_TERMINATOR
     };
-    HR_add_actions_real(obj, encap_destroy_action);
+    HR_add_actions_real(aTHX_ obj, encap_destroy_action);
     return self;
 }
 
 static inline SV
-*attr_simple_new(char *pkg, char *key, SV *table)
+*attr_simple_new(pTHX_ char *pkg, char *key, SV *table)
 {
-    return attr_new_common(pkg, key, table, sizeof(hrattr_simple));
+    return attr_new_common(aTHX_ pkg, key, table, sizeof(hrattr_simple));
 }
 
 
 SV  *HRXSATTR_get_hash(SV *self)
 {
+    dTHX;
     hrattr_simple *attr = attr_from_sv(SvRV(self));
     if(attr->attrhash) {
         return newRV_inc((SV*)attr->attrhash);
@@ -116,6 +132,7 @@ char *HRXSATTR_kstring(SV *self)
 
 SV *HRXSATTR_encap_ukey(SV *self)
 {
+    dTHX;
     return newSVsv(attr_encap_cast(attr_from_sv(SvRV(self)))->obj_rv);
 }
 
@@ -124,33 +141,55 @@ UV HRXSATTR_prefix_len(SV *self)
     return (attr_from_sv(SvRV(self)))->prefix_len;
 }
 
+HV *hrattr_attrhash(SV *attr_sv, int *is_encap)
+{
+    hrattr_simple *attr = attr_from_sv(attr_sv);
+    if(is_encap) {
+        *is_encap = attr->encap;
+    }
+    return attr->attrhash;
+}
+
+SV *hrattr_encap_object(SV *attr_sv)
+{
+    hrattr_simple *attr = attr_from_sv(attr_sv);
+    if(!attr->encap) {
+        return NULL;
+    }
+    return (SV*)(attr_encap_cast(attr))->obj_paddr;
+}
+
+SV *hrattr_action_table(HR_Action *action)
+{
+    if(action->ktype == HR_KEY_TYPE_NULL
+       || action->atype != HR_ACTION_TYPE_CALL_CFUNC) {
+        return NULL;
+    }
+    if(action->hashref != (SV*)&attr_destroy_trigger
+       && action->hashref != (SV*)&encap_attr_destroy_hook) {
+        return NULL;
+    }
+    return (attr_from_sv((SV*)action->key))->table;
+}
+
 static inline SV*
-attr_get(SV *self, SV *attr, char *t, int options)
+attr_get(pTHX_ SV *self, SV *attr, char *t, int options)
 {
     char *attr_ustr = NULL, *attr_fullstr = NULL;
     char smallbuf[128] = { '\0' };
     char ptr_buf[128] = { '\0' };
-    SV *kt_lookup, *attr_lookup;
+    SV *kt_lookup;
     SV **kt_ent;
     SV *aobj = NULL;
-    SV **a_ent;
-    SV *my_stashcache_ref;
-    
-    HR_BlessParams stash_params;
     
     int attrlen     = 0;
     int on_heap     = 0;
-    int prefix_len  = 0;
     
-    get_hashes(REF2TABLE(self),
-               HR_HKEY_LOOKUP_ATTR, &attr_lookup,
+    get_hashes(aTHX_ REF2TABLE(self),
                HR_HKEY_LOOKUP_KT, &kt_lookup,
-               HR_HKEY_LOOKUP_PRIVDATA, &my_stashcache_ref,
                HR_HKEY_LOOKUP_NULL
             );
     
-    blessparam_init(stash_params);
-    
     if(! (kt_ent = hv_fetch(REF2HASH(kt_lookup), t, strlen(t), 0))) {
         die("Couldn't determine keytype '%s'", t);
     }
@@ -177,21 +216,49 @@ attr_get(SV *self, SV *attr, char *t, int options)
     *attr_fullstr = '\0';
     
     sprintf(attr_fullstr, "%s%s%s", SvPV_nolen(*kt_ent), HR_PREFIX_DELIM, attr_ustr);
+    
+    aobj = attr_get_str(aTHX_ self, attr, attr_fullstr, attrlen-1, strlen(t), options);
+    
+    if(on_heap) {
+        Safefree(attr_fullstr);
+    }
+    return aobj;
+}
+
+/*Looks up (and possibly creates) the attribute object for an already
+ composed attribute string. attr is only consulted for object attributes,
+ and may be NULL otherwise*/
+static inline SV*
+attr_get_str(pTHX_ SV *self, SV *attr, char *attr_fullstr, int attrlen,
+             int prefix_len, int options)
+{
+    SV *attr_lookup;
+    SV *aobj = NULL;
+    SV **a_ent;
+    SV *my_stashcache_ref;
+    
+    HR_BlessParams stash_params;
+    
+    get_hashes(aTHX_ REF2TABLE(self),
+               HR_HKEY_LOOKUP_ATTR, &attr_lookup,
+               HR_HKEY_LOOKUP_PRIVDATA, &my_stashcache_ref,
+               HR_HKEY_LOOKUP_NULL
+            );
+    
+    blessparam_init(stash_params);
     HR_DEBUG("ATTRKEY=%s", attr_fullstr);
     
-    a_ent = hv_fetch(REF2HASH(attr_lookup), attr_fullstr, attrlen-1, 0);
+    a_ent = hv_fetch(REF2HASH(attr_lookup), attr_fullstr, attrlen, 0);
     if(!a_ent) {
         
-        prefix_len = strlen(t);
-        
         if( (options & STORE_OPT_O_CREAT) == 0) {
             HR_DEBUG("Could not locate attribute and O_CREAT not specified");
             goto GT_RET;
-        } else if(SvROK(attr)) {
+        } else if(attr && SvROK(attr)) {
             blessparam_setstash(stash_params,
                 stash_from_cache_nocheck(my_stashcache_ref, HR_STASH_ATTR_ENCAP));
             
-            aobj = attr_encap_new(blessparam2chrp(stash_params),
+            aobj = attr_encap_new(aTHX_ blessparam2chrp(stash_params),
                                   attr_fullstr, attr, self);
             if( (options & STORE_OPT_STRONG_KEY) == 0) {
                 sv_rvweaken( ((hrattr_encap*)attr_from_sv(SvRV(aobj)))->obj_rv );
@@ -199,11 +266,12 @@ attr_get(SV *self, SV *attr, char *t, int options)
         } else {
             blessparam_setstash(stash_params,
                 stash_from_cache_nocheck(my_stashcache_ref,HR_STASH_ATTR_SCALAR));
-            aobj = attr_simple_new(blessparam2chrp(stash_params), attr_fullstr, self);
+            aobj = attr_simple_new(aTHX_ blessparam2chrp(stash_params), attr_fullstr, self);
+            hr_oidx_add(aTHX_ self, SvRV(aobj), attr_fullstr, attrlen, 1);
         }
         
         a_ent = hv_store(REF2HASH(attr_lookup),
-                         attr_fullstr, attrlen-1,
+                         attr_fullstr, attrlen,
                          newSVsv(aobj), 0);
         
         /*Actual attribute entry is ALWAYS weak and is entirely dependent on vhash
@@ -216,47 +284,104 @@ attr_get(SV *self, SV *attr, char *t, int options)
     }
     
     GT_RET:
-    if(on_heap) {
-        Safefree(attr_fullstr);
-    }
     HR_DEBUG("Returning %p", aobj);
     return aobj;
 }
 
 void HRA_store_a(SV *self, SV *attr, char *t, SV *value, ...)
 {
-    SV *vstring = newSVuv((UV)SvRV(value)); //reverse lookup key
+    dTHX;
     SV *aobj    = NULL; //primary attribute entry, from attr_lookup
-    SV *vref    = NULL; //value's entry in attribute hash
-    SV *attrhash_ref = NULL; //reference for attribute hash, for adding actions
-    
-    SV **a_r_ent = NULL; //lval-type HE for looking/storing attr in vhash
-    char *astring = NULL;
-    
-    hrattr_simple *aptr; //our private attribute structure
-    
     int options = STORE_OPT_O_CREAT;
     int i;
+    NV ttl = 0;
     
     dXSARGS;
     if ((items-4) % 2) {
         die("Expected hash options or nothing (got %d)", items-3);
     }
     for(i=4;i<items;i+=2) {
+        if(strcmp(HR_STROPT_TTL, SvPV_nolen(ST(i))) == 0) {
+            ttl = SvNV(ST(i+1));
+            continue;
+        }
         _chkopt(STRONG_ATTR, i, options);
         _chkopt(STRONG_VALUE, i, options);
     }
     
-    aobj = attr_get(self, attr, t, options);
+    HR_PROBE3(store_a__entry, SvRV(self), SvRV(value), t);
+    aobj = hrattr_store(aTHX_ self, attr, t, value, options);
+    if(ttl > 0) {
+        hr_ttl_schedule(aTHX_ self, SvRV(aobj), ttl, 1);
+    }
+    HR_PROBE1(store_a__return, SvRV(self));
+    XSRETURN(0);
+}
+
+/*Does the work of store_a(), without touching the perl stack. Returns the
+ attribute object*/
+SV* hrattr_store(pTHX_ SV *self, SV *attr, char *t, SV *value, int options)
+{
+    HR_OP_BEGIN(cxt);
+    SV *aobj;
+    HR_TableInfo *tinfo = hr_tinfo_get(aTHX_ REF2TABLE(self));
+    UV lat_begin = hr_latency_begin(aTHX_ self);
+    if(tinfo->frozen) {
+        hr_frozen_thaw(aTHX_ self);
+    }
+    aobj = attr_get(aTHX_ self, attr, t, options | STORE_OPT_O_CREAT);
     if(!aobj) {
         die("attr_get() failed to return anything");
     }
+    attr_store_value(aTHX_ self, tinfo, aobj, value, options);
+    if(lat_begin) {
+        hr_latency_end(aTHX_ self, HR_LAT_STORE_A, lat_begin);
+    }
+    HR_OP_END(cxt);
+    return aobj;
+}
+
+/*Stores a value under an already composed attribute string, for batch
+ insertion. Only string attributes can be stored this way*/
+void hrattr_store_str(pTHX_ SV *self, char *attr_fullstr, int attrlen,
+                      int prefix_len, SV *value, int options)
+{
+    HR_OP_BEGIN(cxt);
+    SV *aobj;
+    HR_TableInfo *tinfo = hr_tinfo_get(aTHX_ REF2TABLE(self));
+    UV lat_begin = hr_latency_begin(aTHX_ self);
+    if(tinfo->frozen) {
+        hr_frozen_thaw(aTHX_ self);
+    }
+    aobj = attr_get_str(aTHX_ self, NULL, attr_fullstr, attrlen, prefix_len,
+                            options | STORE_OPT_O_CREAT);
+    if(!aobj) {
+        die("attr_get_str() failed to return anything");
+    }
+    attr_store_value(aTHX_ self, tinfo, aobj, value, options);
+    if(lat_begin) {
+        hr_latency_end(aTHX_ self, HR_LAT_STORE_A, lat_begin);
+    }
+    HR_OP_END(cxt);
+}
+
+static inline void
+attr_store_value(pTHX_ SV *self, HR_TableInfo *tinfo, SV *aobj, SV *value,
+                 int options)
+{
+    SV *vstring = newSVuv((UV)SvRV(value)); //reverse lookup key
+    SV *vref    = NULL; //value's entry in attribute hash
+    SV *attrhash_ref = NULL; //reference for attribute hash, for adding actions
+    char *astring = NULL;
+    
+    hrattr_simple *aptr; //our private attribute structure
     
+    HR_TSTAT_INC(tinfo, attr_stores);
     aptr = attr_from_sv(SvRV(aobj));
     assert(SvROK(aobj));
     astring = attr_strkey(aptr, attr_getsize(aptr));
     
-    if(!insert_into_vhash(value, aobj, astring, REF2TABLE(self), NULL)) {
+    if(!insert_into_vhash(aTHX_ value, aobj, astring, REF2TABLE(self), NULL)) {
         goto GT_RET; /*No new insertions*/
     }
     
@@ -281,18 +406,22 @@ void HRA_store_a(SV *self, SV *attr, char *t, SV *value, ...)
         HR_ACTION_LIST_TERMINATOR
     };
     
-    HR_add_actions_real(value, v_actions);
+    HR_add_actions_real(aTHX_ value, v_actions);
+    hr_vid_attr_add(aTHX_ REF2TABLE(self), &aptr->members, SvRV(value));
         
     GT_RET:
     SvREFCNT_dec(vstring);
     if(attrhash_ref) {
         RV_Freetmp(attrhash_ref);
     }
-    XSRETURN(0);
+    hr_clock_touch(aTHX_ tinfo, self, value, 0);
 }
 
 void HRA_fetch_a(SV *self, SV *attr, char *t)
 {
+    dTHX;
+    SV **frozen;
+    U32 nfrozen, i;
     dXSARGS;
     SP -= 3;
     
@@ -300,7 +429,20 @@ void HRA_fetch_a(SV *self, SV *attr, char *t)
         XSRETURN(0);
     }
     
-    SV *aobj = attr_get(self, attr, t, 0);
+    HR_TableInfo *tinfo = hr_tinfo_get(aTHX_ REF2TABLE(self));
+    HR_TSTAT_INC(tinfo, attr_fetches);
+    if(hr_frozen_fetch_a(aTHX_ tinfo, attr, t, &frozen, &nfrozen)) {
+        if(GIMME_V == G_SCALAR) {
+            XSRETURN_IV(nfrozen);
+        }
+        EXTEND(sp, nfrozen);
+        for(i = 0; i < nfrozen; i++) {
+            PUSHs(sv_2mortal(newRV_inc(frozen[i])));
+        }
+        PUTBACK;
+        return;
+    }
+    SV *aobj = attr_get(aTHX_ self, attr, t, 0);
     if(!aobj) {
         HR_DEBUG("Can't find attribute!");
         XSRETURN_EMPTY;
@@ -310,7 +452,7 @@ void HRA_fetch_a(SV *self, SV *attr, char *t)
     hrattr_simple *aptr = attr_from_sv(SvRV(aobj));
     
     HR_DEBUG("Attrhash=%p", aptr->attrhash);
-    int nkeys = hv_iterinit(aptr->attrhash);
+    int nkeys = HvUSEDKEYS(aptr->attrhash);
     HR_DEBUG("We have %d keys", nkeys);
     if(GIMME_V == G_SCALAR) {
         HR_DEBUG("Scalar return value requested");
@@ -318,17 +460,108 @@ void HRA_fetch_a(SV *self, SV *attr, char *t)
     }
     HR_DEBUG("Will do some stack voodoo");
     EXTEND(sp, nkeys);
-    HE *cur = hv_iternext(aptr->attrhash);
-    for(; cur != NULL; cur = hv_iternext(aptr->attrhash))
-    {
-        XPUSHs(sv_mortalcopy(hv_iterval(aptr->attrhash, cur)));
+    HE *cur;
+    attrhash_foreach(aptr->attrhash, cur, i) {
+        PUSHs(sv_mortalcopy(HeVAL(cur)));
+    }
+    PUTBACK;
+}
+
+/*Like fetch_a, but pushes the stored references themselves. See
+ HRA_fetch_alias()*/
+void HRA_fetch_a_alias(SV *self, SV *attr, char *t)
+{
+    dTHX;
+    SV *aobj;
+    SV **frozen;
+    U32 nfrozen;
+    hrattr_simple *aptr;
+    HE *cur;
+    I32 nkeys;
+    STRLEN i;
+    dXSARGS;
+    SP -= items;
+    
+    HR_TableInfo *tinfo = hr_tinfo_get(aTHX_ REF2TABLE(self));
+    HR_TSTAT_INC(tinfo, attr_fetches);
+    /*As with fetch_alias, frozen tables give out new references*/
+    if(hr_frozen_fetch_a(aTHX_ tinfo, attr, t, &frozen, &nfrozen)) {
+        if(GIMME_V == G_SCALAR) {
+            XSRETURN_IV(nfrozen);
+        }
+        EXTEND(SP, nfrozen);
+        for(i = 0; i < nfrozen; i++) {
+            PUSHs(sv_2mortal(newRV_inc(frozen[i])));
+        }
+        PUTBACK;
+        return;
+    }
+    if(!(aobj = attr_get(aTHX_ self, attr, t, 0))) {
+        XSRETURN_EMPTY;
+    }
+    aptr = attr_from_sv(SvRV(aobj));
+    nkeys = HvUSEDKEYS(aptr->attrhash);
+    if(GIMME_V == G_SCALAR) {
+        XSRETURN_IV(nkeys);
+    }
+    EXTEND(SP, nkeys);
+    attrhash_foreach(aptr->attrhash, cur, i) {
+        PUSHs(sv_2mortal(SvREFCNT_inc_simple_NN(HeVAL(cur))));
     }
     PUTBACK;
 }
 
+/*Fills an array with the attribute's values, reusing its existing elements
+ and truncating it to fit. Returns the number of values*/
+UV HRA_fetch_a_into(SV *self, SV *attr, char *t, SV *dest_ref)
+{
+    dTHX;
+    return hrattr_fetch_into(aTHX_ self, attr, t, dest_ref);
+}
+
+UV hrattr_fetch_into(pTHX_ SV *self, SV *attr, char *t, SV *dest_ref)
+{
+    SV *aobj, *vref;
+    SV **frozen;
+    U32 nfrozen;
+    AV *dest;
+    hrattr_simple *aptr;
+    HE *cur;
+    SV **elem;
+    I32 n = 0;
+    STRLEN i;
+    
+    if(!(SvROK(dest_ref) && SvTYPE(SvRV(dest_ref)) == SVt_PVAV)) {
+        die("Expected an array reference");
+    }
+    dest = (AV*)SvRV(dest_ref);
+    
+    HR_TableInfo *tinfo = hr_tinfo_get(aTHX_ REF2TABLE(self));
+    HR_TSTAT_INC(tinfo, attr_fetches);
+    if(hr_frozen_fetch_a(aTHX_ tinfo, attr, t, &frozen, &nfrozen)) {
+        av_extend(dest, (I32)nfrozen - 1);
+        for(; n < (I32)nfrozen; n++) {
+            elem = av_fetch(dest, n, 1);
+            RV_Newtmp(vref, frozen[n]);
+            sv_setsv(*elem, vref);
+            RV_Freetmp(vref);
+        }
+    } else if( (aobj = attr_get(aTHX_ self, attr, t, 0)) ) {
+        aptr = attr_from_sv(SvRV(aobj));
+        av_extend(dest, HvUSEDKEYS(aptr->attrhash) - 1);
+        attrhash_foreach(aptr->attrhash, cur, i) {
+            elem = av_fetch(dest, n++, 1);
+            sv_setsv(*elem, HeVAL(cur));
+        }
+    }
+    av_fill(dest, n - 1);
+    return n;
+}
+
 SV* HRA_attr_get(SV *self, SV *attr, char *t)
 {
-    SV *ret = attr_get(self, attr, t, 0);
+    dTHX;
+    SV *ret = attr_get(aTHX_ self, attr, t, 0);
     if(ret) {
         ret = newSVsv(ret);
     } else {
@@ -336,30 +569,86 @@ SV* HRA_attr_get(SV *self, SV *attr, char *t)
     }
 }
 
+int HRA_has_a(SV *self, SV *attr, char *t, SV *value)
+{
+    dTHX;
+    SV *aobj;
+    hrattr_simple *aptr;
+    if(!SvROK(value)) {
+        die("Value must be a reference");
+    }
+    if(!(aobj = attr_get(aTHX_ self, attr, t, 0))) {
+        return 0;
+    }
+    aptr = attr_from_sv(SvRV(aobj));
+    mk_ptr_string(vstring, SvRV(value));
+    return hv_exists(aptr->attrhash, vstring, strlen(vstring));
+}
+
+HR_Bitmap* hrattr_members(pTHX_ SV *self, SV *attr, char *t)
+{
+    SV *aobj = attr_get(aTHX_ self, attr, t, 0);
+    return aobj ? (attr_from_sv(SvRV(aobj)))->members : NULL;
+}
+
+void hrattr_bitmap_init(pTHX_ SV *attr_sv)
+{
+    hrattr_simple *attr = attr_from_sv(attr_sv);
+    HE *he;
+    STRLEN i;
+    for(i = 0; HvARRAY(attr->attrhash) && i <= HvMAX(attr->attrhash); i++) {
+        for(he = HvARRAY(attr->attrhash)[i]; he; he = HeNEXT(he)) {
+            if(SvROK(HeVAL(he))) {
+                hr_vid_attr_add(aTHX_ attr_parent_tbl(attr), &attr->members,
+                                SvRV(HeVAL(he)));
+            }
+        }
+    }
+}
+
 void HRA_dissoc_a(SV *self, SV *attr, char *t, SV *value)
 {
-    SV *aobj = attr_get(self, attr, t, 0);
+    dTHX;
+    SV *aobj;
+    hr_frozen_thaw(aTHX_ self);
+    aobj = attr_get(aTHX_ self, attr, t, 0);
     if(!aobj) {
         return;
     }
+    HR_OP_BEGIN(cxt);
     HR_DEBUG("Dissoc called");
-    attr_delete_value_from_attrhash(aobj, value);
-    attr_delete_from_vhash(aobj, value);
+    HR_TSTAT_INC(hr_tinfo_get(aTHX_ REF2TABLE(self)), attr_unlinks);
+    attr_delete_value_from_attrhash(aTHX_ aobj, value);
+    attr_delete_from_vhash(aTHX_ aobj, value);
+    HR_OP_END(cxt);
 }
 
 void HRA_unlink_a(SV *self, SV* attr, char *t)
 {
+    dTHX;
     HR_DEBUG("UNLINK_ATTR");
-    SV *aobj = attr_get(self, attr, t, 0);
+    SV *aobj;
+    hr_frozen_thaw(aTHX_ self);
+    aobj = attr_get(aTHX_ self, attr, t, 0);
     if(!aobj) {
         return;
     }
+    HR_OP_BEGIN(cxt);
+    HR_TSTAT_INC(hr_tinfo_get(aTHX_ REF2TABLE(self)), attr_unlinks);
     attr_destroy_trigger(SvRV(aobj), NULL, NULL);
+    HR_OP_END(cxt);
     HR_DEBUG("UNLINK_ATTR DONE");
 }
 
 
-static inline void attr_delete_from_vhash(SV *self, SV *value)
+void hrattr_unlink(pTHX_ SV *attr_sv)
+{
+    hrattr_simple *attr = attr_from_sv(attr_sv);
+    HR_TSTAT_INC(hr_tinfo_get(aTHX_ attr_parent_tbl(attr)), attr_unlinks);
+    attr_destroy_trigger(attr_sv, NULL, NULL);
+}
+
+static inline void attr_delete_from_vhash(pTHX_ SV *self, SV *value)
 {
     hrattr_simple *attr = attr_from_sv(SvRV((self)));
     //UN_del_action(value, SvRV(self));
@@ -369,10 +658,10 @@ static inline void attr_delete_from_vhash(SV *self, SV *value)
     
     char *astr = attr_strkey(attr, attr_getsize(attr));
     
-    get_hashes((HR_Table_t)attr_parent_tbl(attr),
+    get_hashes(aTHX_ (HR_Table_t)attr_parent_tbl(attr),
                HR_HKEY_LOOKUP_REVERSE, &rlookup, HR_HKEY_LOOKUP_NULL);
     
-    vhash = get_vhash_from_rlookup(rlookup, vaddr, 0);
+    vhash = get_vhash_from_rlookup(aTHX_ rlookup, vaddr, 0);
     
     U32 old_refcount = refcnt_ka_begin(value);
     if(vhash) {
@@ -382,16 +671,16 @@ static inline void attr_delete_from_vhash(SV *self, SV *value)
         hv_delete(REF2HASH(vhash), astr, strlen(astr), G_DISCARD);
         if(!HvKEYS(REF2HASH(vhash))) {
             HR_DEBUG("Vhash empty");
-            HR_PL_del_action_container(value, rlookup);
+            HR_del_actions_real(aTHX_ value, rlookup, NULL, HR_KEY_TYPE_NULL);
             hv_delete_ent(REF2HASH(rlookup), vaddr, G_DISCARD, 0);
         } else {
             HR_DEBUG("Vhash still has %d keys", HvKEYS(REF2HASH(vhash)));
         }
     }
-    refcnt_ka_end(value, old_refcount);
+    refcnt_ka_end(aTHX_ value, old_refcount);
 }
 
-static inline void attr_delete_value_from_attrhash(SV *self, SV *value)
+static inline void attr_delete_value_from_attrhash(pTHX_ SV *self, SV *value)
 {
     hrattr_simple *attr = attr_from_sv(SvRV((self)));
     SV *vaddr = newSVuv((UV)SvRV(value));
@@ -400,8 +689,9 @@ static inline void attr_delete_value_from_attrhash(SV *self, SV *value)
     
     HR_DEBUG("Deleting action vobj=%p ::  attrhash=%p",
              SvRV(value), SvRV(attrhash_ref));
-    HR_PL_del_action_container(value, attrhash_ref);
+    HR_del_actions_real(aTHX_ value, attrhash_ref, NULL, HR_KEY_TYPE_NULL);
     hv_delete_ent(attr->attrhash, vaddr, G_DISCARD, 0);
+    hr_vid_attr_remove(attr->members, SvRV(value));
     
     RV_Freetmp(attrhash_ref);
     SvREFCNT_dec(vaddr);
@@ -410,8 +700,51 @@ static inline void attr_delete_value_from_attrhash(SV *self, SV *value)
 
 void HRXSATTR_unlink_value(SV *self, SV *value)
 {
-    attr_delete_value_from_attrhash(self, value);
-    attr_delete_from_vhash(self, value);
+    dTHX;
+    hrattr_unlink_value(aTHX_ self, value);
+}
+
+void hrattr_unlink_value(pTHX_ SV *self, SV *value)
+{
+    attr_delete_value_from_attrhash(aTHX_ self, value);
+    attr_delete_from_vhash(aTHX_ self, value);
+}
+
+/*Moves the attribute's entry for one value over to another, for
+ exchange_value(). The vhash is taken care of by the caller*/
+void hrattr_exchange_value(pTHX_ SV *attr_sv, SV *old, SV *new)
+{
+    hrattr_simple *attr = attr_from_sv(attr_sv);
+    SV *nstring = sv_2mortal(newSVuv((UV)SvRV(new)));
+    SV *attrhash_ref, *vref;
+    SV **ent;
+    int was_weak;
+    mk_ptr_string(ostring, SvRV(old));
+    
+    if(!(ent = hv_fetch(attr->attrhash, ostring, strlen(ostring), 0))) {
+        return;
+    }
+    was_weak = SvWEAKREF(*ent);
+    
+    RV_Newtmp(attrhash_ref, (SV*)attr->attrhash);
+    HR_del_actions_real(aTHX_ old, attrhash_ref, NULL, HR_KEY_TYPE_NULL);
+    hv_delete(attr->attrhash, ostring, strlen(ostring), G_DISCARD);
+    
+    vref = newSVsv(new);
+    hv_store_ent(attr->attrhash, nstring, vref, 0);
+    if(was_weak) {
+        sv_rvweaken(vref);
+    }
+    
+    HR_Action v_actions[] = {
+        HR_DREF_FLDS_ptr_from_hv(SvRV(new), attrhash_ref),
+        HR_ACTION_LIST_TERMINATOR
+    };
+    HR_add_actions_real(aTHX_ new, v_actions);
+    RV_Freetmp(attrhash_ref);
+    
+    hr_vid_attr_remove(attr->members, SvRV(old));
+    hr_vid_attr_add(aTHX_ attr_parent_tbl(attr), &attr->members, SvRV(new));
 }
 
 
@@ -436,6 +769,7 @@ Encapsulated object has been deleted
 
 static void encap_attr_destroy_hook(SV *encap_obj, SV *attr_sv, HR_Action *action_list)
 {
+    dTHX;
     HR_DEBUG("Encap hook called. Attribute is %p", attr_sv);
     hrattr_encap *aencap = attr_encap_cast(attr_from_sv(attr_sv));
     aencap->obj_paddr = NULL;
@@ -449,6 +783,7 @@ static void encap_attr_destroy_hook(SV *encap_obj, SV *attr_sv, HR_Action *actio
 
 static void attr_destroy_trigger(SV *self_sv, SV *encap_obj, HR_Action *action_list)
 {
+    dTHX;
     HR_DEBUG("self_sv=%p", self_sv);
     
     HR_DEBUG("Attr destroy hook");
@@ -456,12 +791,14 @@ static void attr_destroy_trigger(SV *self_sv, SV *encap_obj, HR_Action *action_l
     //sv_dump(self_sv);
     hrattr_simple *attr = attr_from_sv(self_sv);
     HR_DEBUG("hrattr=%p", attr);
+    HR_PROBE2(attr__destroy, self_sv,
+              attr->attrhash ? HvUSEDKEYS(attr->attrhash) : 0);
     HR_Table_t parent = attr_parent_tbl(attr);
     HR_DEBUG("Parent=%p", parent);
     SV *rlookup = NULL, *attr_lookup = NULL;
     
     if(SvREFCNT(parent)) {
-        get_hashes(parent,
+        get_hashes(aTHX_ parent,
                    HR_HKEY_LOOKUP_REVERSE, &rlookup,
                    HR_HKEY_LOOKUP_ATTR, &attr_lookup,
                    HR_HKEY_LOOKUP_NULL);
@@ -484,15 +821,21 @@ static void attr_destroy_trigger(SV *self_sv, SV *encap_obj, HR_Action *action_l
     RV_Newtmp( attrhash_ref, ((SV*)attr->attrhash) );
     RV_Newtmp( self_ref, self_sv );
     
+    if(attr->members) {
+        hr_vid_bitmap_free(attr->members);
+        attr->members = NULL;
+    }
+    
     if(action_list) {
-        while( (HR_nullify_action(action_list,
+        while( (HR_nullify_action(aTHX_ action_list,
                                 (SV*)&attr_destroy_trigger,
                                 NULL,
                                 HR_KEY_TYPE_NULL|HR_KEY_SFLAG_HASHREF_OPAQUE)
                 == HR_ACTION_DELETED) );
         /*No body*/
     } else {
-        HR_PL_del_action_container(self_ref, (SV*)&attr_destroy_trigger);
+        HR_del_actions_real(aTHX_ self_ref, (SV*)&attr_destroy_trigger,
+                            NULL, HR_KEY_TYPE_NULL);
     }
     
     HR_DEBUG("Deleted self destroy hook");
@@ -504,8 +847,9 @@ static void attr_destroy_trigger(SV *self_sv, SV *encap_obj, HR_Action *action_l
         if(aencap->obj_paddr) {
             SV *encap_ref = NULL;
             RV_Newtmp(encap_ref, (SV*)aencap->obj_paddr);
-            HR_PL_del_action_container(encap_ref,
-                                 (SV*)&encap_attr_destroy_hook);
+            HR_del_actions_real(aTHX_ encap_ref,
+                                (SV*)&encap_attr_destroy_hook,
+                                NULL, HR_KEY_TYPE_NULL);
             RV_Freetmp(encap_ref);
             HR_DEBUG("Deleted encap destroy hook");
         }
@@ -536,35 +880,36 @@ static void attr_destroy_trigger(SV *self_sv, SV *encap_obj, HR_Action *action_l
         
         U32 old_v_refcount = refcnt_ka_begin(vptr);
         
-        attr_delete_value_from_attrhash(self_ref, vref);
+        attr_delete_value_from_attrhash(aTHX_ self_ref, vref);
         if(SvROK(vref) && parent) {
             HR_DEBUG("Deleting vhash entry");
-            attr_delete_from_vhash(self_ref, vref);
+            attr_delete_from_vhash(aTHX_ self_ref, vref);
         } else {
             HR_DEBUG("Eh?");
         }
         RV_Freetmp(vref);
         
-        refcnt_ka_end(vptr, old_v_refcount);
+        refcnt_ka_end(aTHX_ vptr, old_v_refcount);
     }
     
     SvREFCNT_dec(attr->attrhash);
     RV_Freetmp(self_ref);
     RV_Freetmp(attrhash_ref);
     
-    refcnt_ka_end(self_sv, old_refcount);
+    refcnt_ka_end(aTHX_ self_sv, old_refcount);
     HR_DEBUG("Attr destroy done");
 }
 
 void HRXSATTR_ithread_predup(SV *self, SV *table, HV *ptr_map)
 {
+    dTHX;
     hrattr_simple *attr = attr_from_sv(SvRV(self));
     
     /*Make sure our attribute hash is visible to perl space*/
     SV *attrhash_ref;
     RV_Newtmp(attrhash_ref, (SV*)attr->attrhash);
     
-    hr_dup_store_rv(ptr_map, attrhash_ref);
+    hr_dup_store_rv(aTHX_ ptr_map, attrhash_ref);
     
     RV_Freetmp(attrhash_ref);
     
@@ -573,16 +918,16 @@ void HRXSATTR_ithread_predup(SV *self, SV *table, HV *ptr_map)
     SV *vtmp;
     SV *rlookup;
     
-    get_hashes(REF2TABLE(table),
+    get_hashes(aTHX_ REF2TABLE(table),
                HR_HKEY_LOOKUP_REVERSE, &rlookup,
                HR_HKEY_LOOKUP_NULL);
     
     hv_iterinit(attr->attrhash);
     while( (vtmp = hv_iternextsv(attr->attrhash, &ktmp, &tmplen))) {
-        HR_Dup_Vinfo *vi = hr_dup_get_vinfo(ptr_map, SvRV(vtmp), 1);
+        HR_Dup_Vinfo *vi = hr_dup_get_vinfo(aTHX_ ptr_map, SvRV(vtmp), 1);
         if(!vi->vhash) {
             SV *vaddr = newSVuv((UV)SvRV(vtmp));
-            SV *vhash = get_vhash_from_rlookup(rlookup, vaddr, 0);
+            SV *vhash = get_vhash_from_rlookup(aTHX_ rlookup, vaddr, 0);
             vi->vhash = vhash;
             SvREFCNT_dec(vaddr);
         }
@@ -591,8 +936,8 @@ void HRXSATTR_ithread_predup(SV *self, SV *table, HV *ptr_map)
     if(attr->encap) {
         hrattr_encap *aencap = attr_encap_cast(attr);
         
-        hr_dup_store_rv(ptr_map, aencap->obj_rv);
-        char *ai = (char*)hr_dup_store_kinfo(
+        hr_dup_store_rv(aTHX_ ptr_map, aencap->obj_rv);
+        char *ai = (char*)hr_dup_store_kinfo(aTHX_
             ptr_map, HR_DUPKEY_AENCAP, aencap->obj_paddr, 1);
         
         if(SvWEAKREF(aencap->obj_rv)) {
@@ -605,16 +950,20 @@ void HRXSATTR_ithread_predup(SV *self, SV *table, HV *ptr_map)
 
 void HRXSATTR_ithread_postdup(SV *newself, SV *newtable, HV *ptr_map)
 {
+    dTHX;
     hrattr_simple *attr = attr_from_sv(SvRV(newself));
     
     HR_DEBUG("Fetching new attrhash_ref");
     
-    SV *new_attrhash_ref = hr_dup_newsv_for_oldsv(ptr_map, attr->attrhash, 0);
+    SV *new_attrhash_ref = hr_dup_newsv_for_oldsv(aTHX_ ptr_map,
+                                                  attr->attrhash, 0);
     
     attr->attrhash = (HV*)SvRV(new_attrhash_ref);
     SvREFCNT_inc(attr->attrhash); /*Because the copy hash will soon be deleted*/
     
     attr->table = SvRV(newtable);
+    /*The parent's bitmap stays with the parent*/
+    attr->members = NULL;
     
     HR_DEBUG("New attrhash: %p", attr->attrhash);
         
@@ -645,7 +994,7 @@ void HRXSATTR_ithread_postdup(SV *newself, SV *newtable, HV *ptr_map)
                 HR_ACTION_LIST_TERMINATOR
             };
 			HR_DEBUG("Will add new actions for value in attrhash");
-            HR_add_actions_real(stored, v_actions);
+            HR_add_actions_real(aTHX_ stored, v_actions);
         }
         Safefree(klist_head);
     }
@@ -656,12 +1005,13 @@ void HRXSATTR_ithread_postdup(SV *newself, SV *newtable, HV *ptr_map)
     };
 
 	HR_DEBUG("Will add new actions for attribute object");
-    HR_add_actions_real(newself, attr_actions);
+    HR_add_actions_real(aTHX_ newself, attr_actions);
     
     if(attr->encap) {
         hrattr_encap *aencap = attr_encap_cast(attr);
-        SV *new_encap = hr_dup_newsv_for_oldsv(ptr_map, aencap->obj_paddr, 1);
-        char *ainfo = (char*)hr_dup_get_kinfo(
+        SV *new_encap = hr_dup_newsv_for_oldsv(aTHX_ ptr_map,
+                                               aencap->obj_paddr, 1);
+        char *ainfo = (char*)hr_dup_get_kinfo(aTHX_
                     ptr_map, HR_DUPKEY_AENCAP, aencap->obj_paddr);
         if(*ainfo == HRK_DUP_WEAK_ENCAP) {
             sv_rvweaken(new_encap);
@@ -671,7 +1021,7 @@ void HRXSATTR_ithread_postdup(SV *newself, SV *newtable, HV *ptr_map)
             HR_ACTION_LIST_TERMINATOR
         };
 		HR_DEBUG("Will add actions for new encapsulated object");
-        HR_add_actions_real(new_encap, encap_actions);
+        HR_add_actions_real(aTHX_ new_encap, encap_actions);
 
         aencap->obj_rv = new_encap;
         aencap->obj_paddr = (char*)SvRV(new_encap);
@@ -0,0 +1,476 @@
+////////////////////////////////////////////////////////////////////////////////
+/// Integer keys                                                             ///
+////////////////////////////////////////////////////////////////////////////////
+
+/*Keys stored with store_ik() stay as native IVs. They live in an open
+ addressing table of their own, hanging off the table info, and never pass
+ through the scalar, forward or reverse lookups (nor get a key object).
+
+ Each value with integer keys gets a small record listing them, tied to the
+ value by a CFUNC action. When the value is destroyed, the action removes
+ all of its integer keys. The record is detached once its last key is
+ unlinked. Records are found from their value through a second map, keyed
+ by the value's address*/
+
+#include "hreg.h"
+#include "hrpriv.h"
+#include "hrdefs.h"
+
+#define IK_MIN_CAP      16
+
+/*Keeps the load factor below 0.7*/
+#define ik_full(idx) (((idx)->count + 1) * 10 > (idx)->cap * 7)
+
+typedef struct hr_ik_vent hr_ik_vent;
+
+typedef struct {
+    IV          key;
+    SV          *value;     /*NULL if the slot is empty*/
+    hr_ik_vent  *vent;
+    U8          strong;
+} hr_ik_slot;
+
+struct hr_ik_vent {
+    HR_IntIndex *idx;
+    SV          *value;
+    UV          nkeys;
+    UV          cap;
+    IV          *keys;
+};
+
+struct HR_IntIndex {
+    UV          count;
+    UV          cap;        /*Always a power of two*/
+    hr_ik_slot  *slots;
+    UV          nvents;
+    UV          vcap;       /*Likewise*/
+    hr_ik_vent  **vents;
+};
+
+static void ik_value_destroyed(SV *value, SV *arg, HR_Action *action);
+
+/*Fibonacci hashing spreads sequential keys over the whole table*/
+static inline UV
+ik_hash(HR_IntIndex *idx, IV key)
+{
+#if UVSIZE >= 8
+    return ((UV)key * (UV)0x9E3779B97F4A7C15ULL) >> 32 & (idx->cap - 1);
+#else
+    return ((UV)key * (UV)0x9E3779B9UL) >> 16 & (idx->cap - 1);
+#endif
+}
+
+static hr_ik_slot*
+ik_find(HR_IntIndex *idx, IV key)
+{
+    UV i;
+    if(!idx || !idx->count) {
+        return NULL;
+    }
+    for(i = ik_hash(idx, key); idx->slots[i].value; i = (i + 1) & (idx->cap - 1)) {
+        if(idx->slots[i].key == key) {
+            return &idx->slots[i];
+        }
+    }
+    return NULL;
+}
+
+static hr_ik_slot*
+ik_insert_slot(HR_IntIndex *idx, IV key)
+{
+    UV i;
+    for(i = ik_hash(idx, key); idx->slots[i].value; i = (i + 1) & (idx->cap - 1))
+        ;
+    idx->slots[i].key = key;
+    return &idx->slots[i];
+}
+
+static void
+ik_grow(HR_IntIndex *idx)
+{
+    hr_ik_slot *old = idx->slots;
+    UV old_cap = idx->cap, i;
+
+    idx->cap = old_cap ? old_cap * 2 : IK_MIN_CAP;
+    Newxz(idx->slots, idx->cap, hr_ik_slot);
+    for(i = 0; i < old_cap; i++) {
+        if(old[i].value) {
+            *ik_insert_slot(idx, old[i].key) = old[i];
+        }
+    }
+    Safefree(old);
+}
+
+/*Backward shift deletion: entries after the hole which would be found
+ earlier in their probe sequence are moved into it, so that no tombstones
+ are needed*/
+static void
+ik_remove_slot(HR_IntIndex *idx, hr_ik_slot *slot)
+{
+    UV mask = idx->cap - 1;
+    UV hole = slot - idx->slots, i = hole, home;
+
+    while(1) {
+        i = (i + 1) & mask;
+        if(!idx->slots[i].value) {
+            break;
+        }
+        home = ik_hash(idx, idx->slots[i].key);
+        if(((i - home) & mask) >= ((i - hole) & mask)) {
+            idx->slots[hole] = idx->slots[i];
+            hole = i;
+        }
+    }
+    Zero(&idx->slots[hole], 1, hr_ik_slot);
+    idx->count--;
+}
+
+static void
+vent_add_key(hr_ik_vent *vent, IV key)
+{
+    if(vent->nkeys == vent->cap) {
+        vent->cap = vent->cap ? vent->cap * 2 : 2;
+        Renew(vent->keys, vent->cap, IV);
+    }
+    vent->keys[vent->nkeys++] = key;
+}
+
+static void
+vent_del_key(hr_ik_vent *vent, IV key)
+{
+    UV i;
+    for(i = 0; i < vent->nkeys; i++) {
+        if(vent->keys[i] == key) {
+            vent->keys[i] = vent->keys[--vent->nkeys];
+            return;
+        }
+    }
+}
+
+static inline UV
+vent_hash(HR_IntIndex *idx, SV *value)
+{
+#if UVSIZE >= 8
+    return ((UV)value * (UV)0x9E3779B97F4A7C15ULL) >> 32 & (idx->vcap - 1);
+#else
+    return ((UV)value * (UV)0x9E3779B9UL) >> 16 & (idx->vcap - 1);
+#endif
+}
+
+static hr_ik_vent*
+vent_find(HR_IntIndex *idx, SV *value)
+{
+    UV i;
+    if(!idx->nvents) {
+        return NULL;
+    }
+    for(i = vent_hash(idx, value); idx->vents[i]; i = (i + 1) & (idx->vcap - 1)) {
+        if(idx->vents[i]->value == value) {
+            return idx->vents[i];
+        }
+    }
+    return NULL;
+}
+
+static void
+vent_map_insert(HR_IntIndex *idx, hr_ik_vent *vent)
+{
+    UV i;
+    for(i = vent_hash(idx, vent->value); idx->vents[i]; i = (i + 1) & (idx->vcap - 1))
+        ;
+    idx->vents[i] = vent;
+}
+
+static void
+vent_map_add(HR_IntIndex *idx, hr_ik_vent *vent)
+{
+    hr_ik_vent **old = idx->vents;
+    UV old_cap = idx->vcap, i;
+
+    if((idx->nvents + 1) * 10 > idx->vcap * 7) {
+        idx->vcap = old_cap ? old_cap * 2 : IK_MIN_CAP;
+        Newxz(idx->vents, idx->vcap, hr_ik_vent*);
+        for(i = 0; i < old_cap; i++) {
+            if(old[i]) {
+                vent_map_insert(idx, old[i]);
+            }
+        }
+        Safefree(old);
+    }
+    vent_map_insert(idx, vent);
+    idx->nvents++;
+}
+
+/*Backward shift deletion, as for the keys*/
+static void
+vent_map_remove(HR_IntIndex *idx, hr_ik_vent *vent)
+{
+    UV mask = idx->vcap - 1;
+    UV hole = vent_hash(idx, vent->value), i, home;
+
+    while(idx->vents[hole] != vent) {
+        hole = (hole + 1) & mask;
+    }
+    for(i = hole;;) {
+        i = (i + 1) & mask;
+        if(!idx->vents[i]) {
+            break;
+        }
+        home = vent_hash(idx, idx->vents[i]->value);
+        if(((i - home) & mask) >= ((i - hole) & mask)) {
+            idx->vents[hole] = idx->vents[i];
+            hole = i;
+        }
+    }
+    idx->vents[hole] = NULL;
+    idx->nvents--;
+}
+
+static void
+vent_free(pTHX_ hr_ik_vent *vent, int detach_action)
+{
+    SV *vref;
+    vent_map_remove(vent->idx, vent);
+    if(detach_action) {
+        RV_Newtmp(vref, vent->value);
+        HR_del_actions_real(aTHX_ vref, (SV*)&ik_value_destroyed, vent,
+                                  HR_KEY_TYPE_PTR|HR_KEY_SFLAG_HASHREF_OPAQUE);
+        RV_Freetmp(vref);
+    }
+    Safefree(vent->keys);
+    Safefree(vent);
+}
+
+/*Takes a single key out of the index. The value's reference, if strong, is
+ released last, as that may destroy it*/
+static void
+ik_unlink_slot(pTHX_ HR_IntIndex *idx, hr_ik_slot *slot)
+{
+    hr_ik_vent *vent = slot->vent;
+    SV *value = slot->value;
+    int strong = slot->strong;
+
+    vent_del_key(vent, slot->key);
+    ik_remove_slot(idx, slot);
+    if(!vent->nkeys) {
+        vent_free(aTHX_ vent, 1);
+    }
+    if(strong) {
+        SvREFCNT_dec(value);
+    }
+}
+
+/*The value is being destroyed. None of its keys can be strong*/
+static void
+ik_value_destroyed(SV *value, SV *arg, HR_Action *action)
+{
+    dTHX;
+    hr_ik_vent *vent = (hr_ik_vent*)arg;
+    hr_ik_slot *slot;
+    UV i;
+
+    HR_DEBUG("Removing %lu integer keys for %p", vent->nkeys, value);
+    for(i = 0; i < vent->nkeys; i++) {
+        if( (slot = ik_find(vent->idx, vent->keys[i])) ) {
+            ik_remove_slot(vent->idx, slot);
+        }
+    }
+    vent_free(aTHX_ vent, 0);
+}
+
+static void
+ik_insert(pTHX_ HR_IntIndex *idx, IV key, SV *value, int strong)
+{
+    hr_ik_slot *slot;
+    hr_ik_vent *vent;
+    SV *vref;
+
+    if(ik_full(idx)) {
+        ik_grow(idx);
+    }
+    if(!(vent = vent_find(idx, value))) {
+        Newxz(vent, 1, hr_ik_vent);
+        vent->idx = idx;
+        vent->value = value;
+        vent_map_add(idx, vent);
+
+        RV_Newtmp(vref, value);
+        HR_Action destroy_action[] = {
+            HR_DREF_FLDS_arg_for_cfunc(vent, &ik_value_destroyed),
+            HR_ACTION_LIST_TERMINATOR
+        };
+        HR_add_actions_real(aTHX_ vref, destroy_action);
+        RV_Freetmp(vref);
+    }
+    vent_add_key(vent, key);
+
+    slot = ik_insert_slot(idx, key);
+    slot->value = value;
+    slot->vent = vent;
+    slot->strong = strong;
+    if(strong) {
+        SvREFCNT_inc(value);
+    }
+    idx->count++;
+}
+
+void HRA_store_ik(SV *self, IV key, SV *value, ...)
+{
+    dTHX;
+    HR_TableInfo *tinfo = hr_tinfo_get(aTHX_ REF2TABLE(self));
+    HR_IntIndex *idx = tinfo->intkeys;
+    hr_ik_slot *slot;
+    int options = 0;
+    int i;
+
+    dXSARGS;
+    if ((items-3) % 2) {
+        die("Expected hash options or nothing (got %d)", items-3);
+    }
+    for(i=3;i<items;i+=2) {
+        _chkopt(STRONG_VALUE, i, options);
+    }
+
+    if(!SvROK(value)) {
+        die("Value must be reference");
+    }
+
+    if( (slot = ik_find(idx, key)) ) {
+        if(slot->value != SvRV(value)) {
+            die("Requested key (%"IVdf") for value=%p, but existing key "
+                "already stores %p", key, SvRV(value), slot->value);
+        }
+        HR_DEBUG("We're already stored");
+        XSRETURN(0);
+    }
+
+    if(!idx) {
+        Newxz(idx, 1, HR_IntIndex);
+        tinfo->intkeys = idx;
+    }
+    HR_TSTAT_INC(tinfo, stores);
+    ik_insert(aTHX_ idx, key, SvRV(value),
+              (options & STORE_OPT_STRONG_VALUE) ? 1 : 0);
+    XSRETURN(0);
+}
+
+SV *HRA_fetch_ik(SV *self, IV key)
+{
+    dTHX;
+    HR_TableInfo *tinfo = hr_tinfo_get(aTHX_ REF2TABLE(self));
+    hr_ik_slot *slot = ik_find(tinfo->intkeys, key);
+    if(!slot) {
+        HR_TSTAT_INC(tinfo, fetch_misses);
+        return &PL_sv_undef;
+    }
+    HR_TSTAT_INC(tinfo, fetch_hits);
+    return newRV_inc(slot->value);
+}
+
+SV *HRA_unlink_ik(SV *self, IV key)
+{
+    dTHX;
+    HR_TableInfo *tinfo = hr_tinfo_get(aTHX_ REF2TABLE(self));
+    HR_IntIndex *idx = tinfo->intkeys;
+    hr_ik_slot *slot = ik_find(idx, key);
+    SV *ret;
+
+    if(!slot) {
+        return &PL_sv_undef;
+    }
+    HR_TSTAT_INC(tinfo, unlinks);
+    /*The value may only be held by us*/
+    ret = newRV_inc(slot->value);
+    ik_unlink_slot(aTHX_ idx, slot);
+    return ret;
+}
+
+int HRA_lexists_ik(SV *self, IV key)
+{
+    dTHX;
+    return ik_find(hr_tinfo_get(aTHX_ REF2TABLE(self))->intkeys, key) != NULL;
+}
+
+UV HRA_ik_count(SV *self)
+{
+    dTHX;
+    HR_IntIndex *idx = hr_tinfo_get(aTHX_ REF2TABLE(self))->intkeys;
+    return idx ? idx->count : 0;
+}
+
+/*Called from purge()*/
+void hr_ik_purge_value(pTHX_ SV *self, SV *value)
+{
+    HR_IntIndex *idx = hr_tinfo_get(aTHX_ REF2TABLE(self))->intkeys;
+    hr_ik_vent *vent;
+    int last;
+
+    if(!idx || !idx->count || !(vent = vent_find(idx, value))) {
+        return;
+    }
+    /*Unlinking the last key frees the record*/
+    do {
+        last = vent->nkeys == 1;
+        ik_unlink_slot(aTHX_ idx, ik_find(idx, vent->keys[0]));
+    } while(!last);
+}
+
+/*Called from exchange_value(). The caller keeps the old value alive*/
+void hr_ik_exchange_value(pTHX_ SV *self, SV *old, SV *new)
+{
+    HR_IntIndex *idx = hr_tinfo_get(aTHX_ REF2TABLE(self))->intkeys;
+    hr_ik_vent *vent;
+    IV *keys;
+    U8 *strong;
+    UV nkeys, i;
+
+    if(!idx || !idx->count || !(vent = vent_find(idx, old))) {
+        return;
+    }
+    /*Unlinking the last key frees the record, so take a copy*/
+    nkeys = vent->nkeys;
+    Newx(keys, nkeys, IV);
+    Newx(strong, nkeys, U8);
+    for(i = 0; i < nkeys; i++) {
+        keys[i] = vent->keys[i];
+        strong[i] = ik_find(idx, keys[i])->strong;
+    }
+    for(i = 0; i < nkeys; i++) {
+        ik_unlink_slot(aTHX_ idx, ik_find(idx, keys[i]));
+    }
+    for(i = 0; i < nkeys; i++) {
+        ik_insert(aTHX_ idx, keys[i], new, strong[i]);
+    }
+    Safefree(keys);
+    Safefree(strong);
+}
+
+/*Called when the table info is freed. Records are detached from their
+ values first, so that strong references can then be dropped without
+ calling back into the index*/
+void hr_ik_destroy(pTHX_ HR_IntIndex *idx)
+{
+    hr_ik_vent *vent;
+    hr_ik_slot *other;
+    UV i, j;
+
+    for(i = 0; i < idx->cap; i++) {
+        if(!idx->slots[i].value || !(vent = idx->slots[i].vent)) {
+            continue;
+        }
+        for(j = 0; j < vent->nkeys; j++) {
+            if( (other = ik_find(idx, vent->keys[j])) ) {
+                other->vent = NULL;
+            }
+        }
+        vent_free(aTHX_ vent, !PL_dirty);
+    }
+    for(i = 0; i < idx->cap; i++) {
+        if(idx->slots[i].value && idx->slots[i].strong) {
+            SvREFCNT_dec(idx->slots[i].value);
+        }
+    }
+    Safefree(idx->slots);
+    Safefree(idx->vents);
+    Safefree(idx);
+}
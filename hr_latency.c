@@ -0,0 +1,529 @@
+////////////////////////////////////////////////////////////////////////////////
+/// Latency histograms                                                       ///
+////////////////////////////////////////////////////////////////////////////////
+
+/*Once enabled for a table, stores, attribute stores, unlinks and purges are
+ timed, as are the cascades run by the free hook when an object tied to the
+ table is destroyed. Cascades are filed under the kind of object which set them
+ off (a value, a key of a given type, an attribute...), with the time taken,
+ how deeply the actions nested, and how many of them fired.
+
+ Histograms are log-linear, in the manner of HdrHistogram: each power of two is
+ split into 16 linear buckets, so any recorded value is known to within about
+ 6%. Times are in nanoseconds.
+
+ A cascade can't tell which table it belongs to from the object being freed, so
+ it is attributed by its actions: deletions from one of the table's lookups, or
+ the callbacks of keys and attributes, which know their parent table. Tables
+ with histograms are kept in a per-interpreter registry for this, which also
+ lets us check that a table didn't go away during its own cascade*/
+
+#include "hreg.h"
+#include "hrpriv.h"
+#include "hrdefs.h"
+
+#include <stdint.h>
+#include <time.h>
+
+#define LAT_SUB_BITS    4
+#define LAT_SUB         (1 << LAT_SUB_BITS)
+#define LAT_MSB_MAX     47      /*Values are clamped to 2^48, about 3 days*/
+#define LAT_VALUE_MAX   ((((uint64_t)1) << (LAT_MSB_MAX + 1)) - 1)
+#define LAT_BUCKETS     ((LAT_MSB_MAX - LAT_SUB_BITS + 2) * LAT_SUB)
+
+/*Tables a single cascade may be attributed to*/
+#define LAT_MATCH_MAX   4
+#define LAT_KIND_MAX    (HR_PREFIX_LEN_MAX + 8)
+
+typedef struct {
+    uint64_t    count;
+    uint64_t    min;
+    uint64_t    max;
+    uint64_t    total;
+    uint64_t    buckets[LAT_BUCKETS];
+} hr_lat_hist;
+
+typedef struct {
+    hr_lat_hist latency;
+    hr_lat_hist depth;
+    hr_lat_hist actions;
+} hr_lat_cascade;
+
+struct HR_Latency {
+    UV          serial;
+    SV          *table;     /*Table referent. Only compared*/
+    HV          *lookups[4];/*Forward, reverse, scalar and attribute. Likewise*/
+    hr_lat_hist ops[HR_LAT_OP_COUNT];
+    HV          *cascades;  /*Kind => hr_lat_cascade, kept in the string buffer*/
+};
+
+static const char *lat_op_names[HR_LAT_OP_COUNT] = {
+    "store", "store_a", "unlink", "purge"
+};
+
+static uint64_t
+lat_now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static int
+lat_msb(uint64_t v)
+{
+#ifdef __GNUC__
+    return 63 - __builtin_clzll(v);
+#else
+    int ret = 0;
+    while(v >>= 1) {
+        ret++;
+    }
+    return ret;
+#endif
+}
+
+static unsigned
+lat_bucket(uint64_t v)
+{
+    int m;
+    if(v < LAT_SUB) {
+        return (unsigned)v;
+    }
+    if(v > LAT_VALUE_MAX) {
+        v = LAT_VALUE_MAX;
+    }
+    m = lat_msb(v);
+    return (m - LAT_SUB_BITS + 1) * LAT_SUB
+        + (unsigned)(v >> (m - LAT_SUB_BITS)) - LAT_SUB;
+}
+
+/*Highest value falling into a bucket*/
+static uint64_t
+lat_bucket_high(unsigned idx)
+{
+    unsigned row = idx / LAT_SUB, sub = idx % LAT_SUB;
+    if(!row) {
+        return idx;
+    }
+    return (((uint64_t)(LAT_SUB + sub + 1)) << (row - 1)) - 1;
+}
+
+static void
+lat_record(hr_lat_hist *h, uint64_t v)
+{
+    if(!h->count || v < h->min) {
+        h->min = v;
+    }
+    if(v > h->max) {
+        h->max = v;
+    }
+    h->count++;
+    h->total += v;
+    h->buckets[lat_bucket(v)]++;
+}
+
+static uint64_t
+lat_percentile(hr_lat_hist *h, double q)
+{
+    uint64_t target = (uint64_t)(q * h->count + 0.5);
+    uint64_t seen = 0, high;
+    unsigned i;
+
+    if(!target) {
+        target = 1;
+    }
+    for(i = 0; i < LAT_BUCKETS; i++) {
+        seen += h->buckets[i];
+        if(seen >= target) {
+            high = lat_bucket_high(i);
+            return high > h->max ? h->max : high;
+        }
+    }
+    return h->max;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+/// Registry and attribution                                                 ///
+////////////////////////////////////////////////////////////////////////////////
+
+static void
+lat_register(pTHX_ HR_Latency *lat)
+{
+    HR_Context *cxt = HR_CXT;
+    Renew(cxt->latency, cxt->nlatency + 1, HR_Latency*);
+    cxt->latency[cxt->nlatency++] = lat;
+    lat->serial = ++cxt->latency_serial;
+}
+
+static void
+lat_unregister(pTHX_ HR_Latency *lat)
+{
+    HR_Context *cxt = HR_CXT;
+    U32 i;
+    for(i = 0; i < cxt->nlatency; i++) {
+        if(cxt->latency[i] == lat) {
+            cxt->latency[i] = cxt->latency[--cxt->nlatency];
+            break;
+        }
+    }
+    if(!cxt->nlatency) {
+        Safefree(cxt->latency);
+        cxt->latency = NULL;
+    }
+}
+
+static int
+lat_registered(HR_Context *cxt, HR_Latency *lat, UV serial)
+{
+    U32 i;
+    for(i = 0; i < cxt->nlatency; i++) {
+        if(cxt->latency[i] == lat) {
+            return lat->serial == serial;
+        }
+    }
+    return 0;
+}
+
+typedef struct {
+    HR_Latency  *lat[LAT_MATCH_MAX];
+    UV          serial[LAT_MATCH_MAX];
+    int         count;
+} lat_match_t;
+
+static void
+lat_match_add(lat_match_t *m, HR_Latency *lat)
+{
+    int i;
+    for(i = 0; i < m->count; i++) {
+        if(m->lat[i] == lat) {
+            return;
+        }
+    }
+    if(m->count < LAT_MATCH_MAX) {
+        m->lat[m->count] = lat;
+        m->serial[m->count] = lat->serial;
+        m->count++;
+    }
+}
+
+static void
+lat_match_action(HR_Context *cxt, HR_Action *action, lat_match_t *m)
+{
+    SV *container = NULL, *table = NULL;
+    HR_Latency *lat;
+    U32 i;
+    int j;
+
+    if(!action->hashref || action->ktype == HR_KEY_TYPE_NULL) {
+        return;
+    }
+    switch(action->atype) {
+    case HR_ACTION_TYPE_CALL_CFUNC:
+        if(!(table = hrk_action_table(action))) {
+            table = hrattr_action_table(action);
+        }
+        if(!table) {
+            return;
+        }
+        break;
+    case HR_ACTION_TYPE_DEL_HV:
+    case HR_ACTION_TYPE_DEL_AV:
+        if(action->flags & HR_FLAG_HASHREF_RV) {
+            if(!SvROK(action->hashref)) {
+                return;
+            }
+            container = SvRV(action->hashref);
+        } else {
+            container = action->hashref;
+        }
+        break;
+    default:
+        return;
+    }
+
+    for(i = 0; i < cxt->nlatency; i++) {
+        lat = cxt->latency[i];
+        if(table) {
+            if(lat->table == table) {
+                lat_match_add(m, lat);
+            }
+            continue;
+        }
+        for(j = 0; j < 4; j++) {
+            if((SV*)lat->lookups[j] == container) {
+                lat_match_add(m, lat);
+                break;
+            }
+        }
+    }
+}
+
+/*Names the kind of object setting off a cascade. Typed keys and attributes
+ carry their prefix here, which the report translates back to the type*/
+static void
+lat_kind(pTHX_ SV *object, HR_Action *actions, char *buf)
+{
+    const char *stash = SvOBJECT(object) ? HvNAME(SvSTASH(object)) : NULL;
+    const char *what = NULL;
+    char *kstr = NULL;
+    UV plen = 0;
+    SV *rv;
+    HR_Action *cur;
+
+    if(stash && strcmp(stash, HR_PKG_KEY_SCALAR) == 0) {
+        RV_Newtmp(rv, object);
+        kstr = HRXSK_kstring(rv);
+        plen = HRXSK_prefix_len(rv);
+        RV_Freetmp(rv);
+        what = "key";
+    } else if(stash && strcmp(stash, HR_PKG_ATTR_SCALAR) == 0) {
+        RV_Newtmp(rv, object);
+        kstr = HRXSATTR_kstring(rv);
+        plen = HRXSATTR_prefix_len(rv);
+        RV_Freetmp(rv);
+        what = "attr";
+    } else if(stash && strcmp(stash, HR_PKG_KEY_ENCAP) == 0) {
+        what = "object_key";
+    } else if(stash && strcmp(stash, HR_PKG_ATTR_ENCAP) == 0) {
+        what = "object_attr";
+    } else {
+        /*A user object. It is a value unless it is encapsulated by a key or
+         attribute*/
+        what = "value";
+        for(cur = actions; cur; cur = cur->next) {
+            if(!cur->hashref) {
+                continue;
+            }
+            if(hrk_action_table(cur)) {
+                what = "object_key";
+                break;
+            }
+            if(hrattr_action_table(cur)) {
+                what = "object_attr";
+            }
+        }
+    }
+
+    if(plen && kstr && plen <= HR_PREFIX_LEN_MAX) {
+        sprintf(buf, "%s:%.*s", what, (int)plen, kstr);
+    } else {
+        strcpy(buf, what);
+    }
+}
+
+static hr_lat_cascade*
+lat_cascade_get(pTHX_ HR_Latency *lat, const char *kind)
+{
+    SV **svp = hv_fetch(lat->cascades, kind, strlen(kind), 1);
+    SV *sv = *svp;
+    if(!SvPOK(sv)) {
+        sv_setpvn(sv, "", 0);
+        SvGROW(sv, sizeof(hr_lat_cascade));
+        Zero(SvPVX(sv), sizeof(hr_lat_cascade), char);
+        SvCUR_set(sv, sizeof(hr_lat_cascade));
+    }
+    return (hr_lat_cascade*)SvPVX(sv);
+}
+
+/*Called by the free hook for objects freed outside of any other cascade*/
+void
+hr_latency_cascade(pTHX_ SV *object, HR_Action *actions)
+{
+    HR_Context *cxt = HR_CXT;
+    lat_match_t m;
+    HR_Action *cur;
+    hr_lat_cascade *c;
+    char kind[LAT_KIND_MAX];
+    uint64_t begin, elapsed;
+    int i;
+
+    m.count = 0;
+    for(cur = actions; cur; cur = cur->next) {
+        lat_match_action(cxt, cur, &m);
+    }
+    if(!m.count) {
+        HR_trigger_and_free_actions(aTHX_ actions, object);
+        return;
+    }
+
+    lat_kind(aTHX_ object, actions, kind);
+    cxt->cascade_actions = 0;
+    cxt->cascade_depth = 0;
+    begin = lat_now();
+    HR_trigger_and_free_actions(aTHX_ actions, object);
+    elapsed = lat_now() - begin;
+
+    for(i = 0; i < m.count; i++) {
+        if(!lat_registered(cxt, m.lat[i], m.serial[i])) {
+            continue;
+        }
+        c = lat_cascade_get(aTHX_ m.lat[i], kind);
+        lat_record(&c->latency, elapsed);
+        lat_record(&c->depth, cxt->cascade_depth);
+        lat_record(&c->actions, cxt->cascade_actions);
+    }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+/// Operations                                                               ///
+////////////////////////////////////////////////////////////////////////////////
+
+UV
+hr_latency_begin(pTHX_ SV *self)
+{
+    if(!HR_CXT->nlatency || !hr_tinfo_get(aTHX_ REF2TABLE(self))->latency) {
+        return 0;
+    }
+    return (UV)lat_now();
+}
+
+void
+hr_latency_end(pTHX_ SV *self, int op, UV begin)
+{
+    HR_Latency *lat = hr_tinfo_get(aTHX_ REF2TABLE(self))->latency;
+    if(lat) {
+        lat_record(&lat->ops[op], lat_now() - begin);
+    }
+}
+
+void
+hr_latency_destroy(pTHX_ HR_Latency *lat)
+{
+    lat_unregister(aTHX_ lat);
+    SvREFCNT_dec(lat->cascades);
+    Safefree(lat);
+}
+
+void HRA_enable_latency(SV *self, int on)
+{
+    dTHX;
+    HR_TableInfo *tinfo = hr_tinfo_get(aTHX_ REF2TABLE(self));
+    HR_Latency *lat;
+    SV *lookups[4];
+    int i;
+
+    if(!on) {
+        if(tinfo->latency) {
+            hr_latency_destroy(aTHX_ tinfo->latency);
+            tinfo->latency = NULL;
+        }
+        return;
+    }
+    if(tinfo->latency) {
+        return;
+    }
+
+    get_hashes(aTHX_ REF2TABLE(self),
+               HR_HKEY_LOOKUP_FORWARD, &lookups[0],
+               HR_HKEY_LOOKUP_REVERSE, &lookups[1],
+               HR_HKEY_LOOKUP_SCALAR, &lookups[2],
+               HR_HKEY_LOOKUP_ATTR, &lookups[3],
+               HR_HKEY_LOOKUP_NULL);
+    Newxz(lat, 1, HR_Latency);
+    lat->table = SvRV(self);
+    for(i = 0; i < 4; i++) {
+        lat->lookups[i] = (lookups[i] && SvROK(lookups[i]))
+            ? REF2HASH(lookups[i]) : NULL;
+    }
+    lat->cascades = newHV();
+    lat_register(aTHX_ lat);
+    tinfo->latency = lat;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+/// Reporting                                                                ///
+////////////////////////////////////////////////////////////////////////////////
+
+#define lat_store(hv, name, sv) \
+    hv_store(hv, name, sizeof(name)-1, sv, 0)
+
+static SV*
+lat_hist_report(pTHX_ hr_lat_hist *h)
+{
+    HV *ret = newHV();
+    lat_store(ret, "count", newSVnv((NV)h->count));
+    lat_store(ret, "min", newSVnv((NV)h->min));
+    lat_store(ret, "max", newSVnv((NV)h->max));
+    lat_store(ret, "mean",
+              newSVnv(h->count ? (NV)h->total / h->count : 0));
+    lat_store(ret, "p50", newSVnv((NV)lat_percentile(h, 0.50)));
+    lat_store(ret, "p90", newSVnv((NV)lat_percentile(h, 0.90)));
+    lat_store(ret, "p99", newSVnv((NV)lat_percentile(h, 0.99)));
+    lat_store(ret, "p999", newSVnv((NV)lat_percentile(h, 0.999)));
+    return newRV_noinc((SV*)ret);
+}
+
+/*Kinds are recorded with the type prefix, which we turn back into the name
+ given to register_kt()*/
+static SV*
+lat_kind_name(pTHX_ HV *kt_lookup, char *kind, I32 klen)
+{
+    char *sep = memchr(kind, ':', klen);
+    char *prefix, *pstr;
+    STRLEN plen;
+    HE *ent;
+
+    if(!sep || !kt_lookup) {
+        return newSVpvn(kind, klen);
+    }
+    prefix = sep + 1;
+    hv_iterinit(kt_lookup);
+    while( (ent = hv_iternext(kt_lookup)) ) {
+        pstr = SvPV(HeVAL(ent), plen);
+        if(plen == (STRLEN)(kind + klen - prefix)
+           && memcmp(pstr, prefix, plen) == 0) {
+            SV *ret = newSVpvn(kind, prefix - kind);
+            sv_catsv(ret, hv_iterkeysv(ent));
+            return ret;
+        }
+    }
+    return newSVpvn(kind, klen);
+}
+
+SV* HRA_latency_report(SV *self, int reset)
+{
+    dTHX;
+    HR_Latency *lat = hr_tinfo_get(aTHX_ REF2TABLE(self))->latency;
+    HV *ret, *cascades;
+    SV *kt_ref, *name;
+    HE *ent;
+    hr_lat_cascade *c;
+    char *kind;
+    I32 klen;
+    int i;
+
+    if(!lat) {
+        return &PL_sv_undef;
+    }
+    get_hashes(aTHX_ REF2TABLE(self), HR_HKEY_LOOKUP_KT, &kt_ref,
+               HR_HKEY_LOOKUP_NULL);
+
+    ret = newHV();
+    for(i = 0; i < HR_LAT_OP_COUNT; i++) {
+        hv_store(ret, lat_op_names[i], strlen(lat_op_names[i]),
+                 lat_hist_report(aTHX_ &lat->ops[i]), 0);
+    }
+
+    cascades = newHV();
+    hv_iterinit(lat->cascades);
+    while( (ent = hv_iternext(lat->cascades)) ) {
+        HV *kreport = newHV();
+        kind = hv_iterkey(ent, &klen);
+        c = (hr_lat_cascade*)SvPVX(HeVAL(ent));
+        lat_store(kreport, "latency", lat_hist_report(aTHX_ &c->latency));
+        lat_store(kreport, "depth", lat_hist_report(aTHX_ &c->depth));
+        lat_store(kreport, "actions", lat_hist_report(aTHX_ &c->actions));
+        name = lat_kind_name(aTHX_ (kt_ref && SvROK(kt_ref)) ? REF2HASH(kt_ref) : NULL,
+                             kind, klen);
+        hv_store_ent(cascades, name, newRV_noinc((SV*)kreport), 0);
+        SvREFCNT_dec(name);
+    }
+    lat_store(ret, "cascades", newRV_noinc((SV*)cascades));
+
+    if(reset) {
+        Zero(lat->ops, HR_LAT_OP_COUNT, hr_lat_hist);
+        hv_clear(lat->cascades);
+    }
+    return newRV_noinc((SV*)ret);
+}
@@ -0,0 +1,354 @@
+////////////////////////////////////////////////////////////////////////////////
+/// Removal notifications                                                    ///
+////////////////////////////////////////////////////////////////////////////////
+
+/*on_evict() subscribes a callback to key removals. Each key object gets a
+ CFUNC action (a 'watcher') recording its key string and value address, so
+ every way a key can leave the table - unlink, purge, eviction, expiry or its
+ value being destroyed - ends up in the same place.
+
+ Rather than calling back into perl for every key, events are queued on the
+ subscription and handed over as a pair of arrays once a batch is full, or
+ when flush_evictions() is called.
+
+ A key is usually removed in the middle of a table operation, which may
+ still be holding entries of the lookups. A full subscription is therefore
+ only put on the interpreter's due list, and delivered at the next safe
+ point (see HR_OP_BEGIN in hrpriv.h): when the operation returns, or when a
+ free which happened outside of any operation has finished cascading.
+
+ Watchers hold a reference to the subscription, so that it outlives the
+ table info if key objects happen to be freed after it*/
+
+#include "hreg.h"
+#include "hrpriv.h"
+#include "hrdefs.h"
+
+struct HR_EvictSub {
+    SV          *cb;        /*NULL once closed*/
+    UV          batch;
+    AV          *keys;
+    AV          *vaddrs;
+    UV          refcount;
+    int         delivering;
+    int         due;        /*On the due list*/
+    HR_EvictSub *next_due;
+};
+
+typedef struct {
+    HR_EvictSub *sub;
+    UV          vaddr;
+    char        key[1];     /*Key string, allocated along with the watcher*/
+} hr_evict_watcher;
+
+static void evict_key_removed(SV *kobj, SV *arg, HR_Action *action);
+
+static void
+evsub_unref(pTHX_ HR_EvictSub *sub)
+{
+    if(--sub->refcount) {
+        return;
+    }
+    HR_DEBUG("Freeing subscription %p", sub);
+    SvREFCNT_dec(sub->cb);
+    SvREFCNT_dec((SV*)sub->keys);
+    SvREFCNT_dec((SV*)sub->vaddrs);
+    Safefree(sub);
+}
+
+/*Hands over everything queued, for as long as at least 'min' events are
+ pending. Events queued by the callback itself are picked up by the loop.
+ The callback runs under G_EVAL, as we may be inside a free. $@ is localised
+ around it, since a delivery may happen while an error is being unwound*/
+static UV
+evsub_deliver(pTHX_ HR_EvictSub *sub, UV min)
+{
+    UV ndelivered = 0;
+    AV *keys, *vaddrs;
+    SV *cb;
+
+    if(sub->delivering) {
+        return 0;
+    }
+    sub->refcount++;
+    sub->delivering = 1;
+    while(sub->cb && (UV)(av_len(sub->keys) + 1) >= min
+          && av_len(sub->keys) >= 0) {
+        keys = sub->keys;
+        vaddrs = sub->vaddrs;
+        sub->keys = newAV();
+        sub->vaddrs = newAV();
+        ndelivered += av_len(keys) + 1;
+        cb = SvREFCNT_inc(sub->cb);
+
+        dSP;
+        ENTER;
+        SAVETMPS;
+        save_scalar(PL_errgv);
+        PUSHMARK(SP);
+        XPUSHs(sv_2mortal(newRV_noinc((SV*)keys)));
+        XPUSHs(sv_2mortal(newRV_noinc((SV*)vaddrs)));
+        PUTBACK;
+        call_sv(cb, G_DISCARD|G_EVAL);
+        SPAGAIN;
+        if(SvTRUE(ERRSV)) {
+            warn("on_evict callback died: %s", SvPV_nolen(ERRSV));
+        }
+        PUTBACK;
+        FREETMPS;
+        LEAVE;
+        SvREFCNT_dec(cb);
+    }
+    sub->delivering = 0;
+    evsub_unref(aTHX_ sub);
+    return ndelivered;
+}
+
+/*The key object is being destroyed*/
+static void
+evict_key_removed(SV *kobj, SV *arg, HR_Action *action)
+{
+    dTHX;
+    hr_evict_watcher *w = (hr_evict_watcher*)arg;
+    HR_EvictSub *sub = w->sub;
+
+    if(sub->cb) {
+        av_push(sub->keys, newSVpv(w->key, 0));
+        av_push(sub->vaddrs, newSVuv(w->vaddr));
+        if(!sub->due && (UV)(av_len(sub->keys) + 1) >= sub->batch) {
+            HR_Context *cxt = HR_CXT;
+            sub->due = 1;
+            sub->refcount++;
+            sub->next_due = cxt->evict_due;
+            cxt->evict_due = sub;
+        }
+    }
+    Safefree(w);
+    evsub_unref(aTHX_ sub);
+}
+
+/*Called at a safe point, with nothing of the table's borrowed. Each
+ subscription is taken off the list before its callback runs, so that
+ removals made by the callback can queue it again*/
+void hr_evict_deliver_due(pTHX_ HR_Context *cxt)
+{
+    HR_EvictSub *sub;
+    while( (sub = cxt->evict_due) ) {
+        cxt->evict_due = sub->next_due;
+        sub->next_due = NULL;
+        sub->due = 0;
+        evsub_deliver(aTHX_ sub, sub->batch);
+        evsub_unref(aTHX_ sub);
+    }
+}
+
+static int
+watcher_match(void *arg, void *sub)
+{
+    return ((hr_evict_watcher*)arg)->sub == sub;
+}
+
+#define watcher_find(sub, kobj) \
+    ((hr_evict_watcher*)HR_cfunc_action_arg(kobj, (void*)&evict_key_removed, \
+                                            watcher_match, sub))
+
+static void
+watcher_add(pTHX_ HR_EvictSub *sub, SV *kobj, char *key, STRLEN klen, SV *value)
+{
+    hr_evict_watcher *w;
+    SV *kref;
+
+    Newxc(w, sizeof(hr_evict_watcher) + klen, char, hr_evict_watcher);
+    w->sub = sub;
+    w->vaddr = (UV)value;
+    Copy(key, w->key, klen, char);
+    w->key[klen] = '\0';
+    sub->refcount++;
+
+    RV_Newtmp(kref, kobj);
+    HR_Action removed_action[] = {
+        HR_DREF_FLDS_arg_for_cfunc(w, &evict_key_removed),
+        HR_ACTION_LIST_TERMINATOR
+    };
+    HR_add_actions_real(aTHX_ kref, removed_action);
+    RV_Freetmp(kref);
+}
+
+static void
+watcher_del(pTHX_ hr_evict_watcher *w, SV *kobj)
+{
+    HR_EvictSub *sub = w->sub;
+    SV *kref;
+
+    RV_Newtmp(kref, kobj);
+    HR_del_actions_real(aTHX_ kref, (SV*)&evict_key_removed, w,
+                              HR_KEY_TYPE_PTR|HR_KEY_SFLAG_HASHREF_OPAQUE);
+    RV_Freetmp(kref);
+    Safefree(w);
+    evsub_unref(aTHX_ sub);
+}
+
+/*Calls fn for every key object in the table, skipping the attribute
+ objects which share the value hashes*/
+static void
+evict_foreach_key(pTHX_ SV *self, HR_EvictSub *sub,
+                  void (*fn)(pTHX_ HR_EvictSub*, SV*, HE*, SV*))
+{
+    SV *rlookup, *my_stashcache_ref;
+    HV *ascalar_stash, *aencap_stash;
+    HE *vent, *kent;
+    HV *vh;
+    SV *lobj;
+    STRLEN i, j;
+
+    get_hashes(aTHX_ REF2TABLE(self),
+               HR_HKEY_LOOKUP_REVERSE, &rlookup,
+               HR_HKEY_LOOKUP_PRIVDATA, &my_stashcache_ref,
+               HR_HKEY_LOOKUP_NULL);
+    ascalar_stash = stash_from_cache_nocheck(my_stashcache_ref,
+                                             HR_STASH_ATTR_SCALAR);
+    aencap_stash = stash_from_cache_nocheck(my_stashcache_ref,
+                                            HR_STASH_ATTR_ENCAP);
+
+    /*Walked directly, so that any iteration in progress is left alone*/
+    for(i = 0; HvARRAY(REF2HASH(rlookup))
+               && i <= HvMAX(REF2HASH(rlookup)); i++) {
+        for(vent = HvARRAY(REF2HASH(rlookup))[i]; vent; vent = HeNEXT(vent)) {
+            if(!SvROK(HeVAL(vent))) {
+                continue;
+            }
+            vh = REF2HASH(HeVAL(vent));
+            for(j = 0; HvARRAY(vh) && j <= HvMAX(vh); j++) {
+                for(kent = HvARRAY(vh)[j]; kent; kent = HeNEXT(kent)) {
+                    lobj = HeVAL(kent);
+                    if(!SvROK(lobj)
+                       || SvSTASH(SvRV(lobj)) == ascalar_stash
+                       || SvSTASH(SvRV(lobj)) == aencap_stash) {
+                        continue;
+                    }
+                    fn(aTHX_ sub, SvRV(lobj), kent,
+                       (SV*)(UV)Strtoul(HeKEY(vent), NULL, 10));
+                }
+            }
+        }
+    }
+}
+
+static void
+foreach_watch(pTHX_ HR_EvictSub *sub, SV *kobj, HE *kent, SV *value)
+{
+    STRLEN klen;
+    char *key = HePV(kent, klen);
+    if(!watcher_find(sub, kobj)) {
+        watcher_add(aTHX_ sub, kobj, key, klen, value);
+    }
+}
+
+static void
+foreach_unwatch(pTHX_ HR_EvictSub *sub, SV *kobj, HE *kent, SV *value)
+{
+    hr_evict_watcher *w = watcher_find(sub, kobj);
+    if(w) {
+        watcher_del(aTHX_ w, kobj);
+    }
+}
+
+/*Called when a new key object is stored*/
+void hr_evict_watch(pTHX_ HR_TableInfo *tinfo, SV *kobj, SV *kstring, SV *value)
+{
+    HR_EvictSub *sub = tinfo->evsub;
+    STRLEN klen;
+    char *key;
+
+    if(!sub) {
+        return;
+    }
+    key = SvPV(kstring, klen);
+    watcher_add(aTHX_ sub, kobj, key, klen, value);
+}
+
+/*Called from exchange_value() for each key object moving to a new value*/
+void hr_evict_retarget(pTHX_ SV *self, SV *kobj, SV *value)
+{
+    HR_EvictSub *sub = hr_tinfo_get(aTHX_ REF2TABLE(self))->evsub;
+    hr_evict_watcher *w;
+
+    if(sub && (w = watcher_find(sub, kobj))) {
+        w->vaddr = (UV)value;
+    }
+}
+
+/*Closing delivers whatever is pending, and detaches the watchers*/
+static void
+evsub_close(pTHX_ SV *self, HR_EvictSub *sub)
+{
+    evsub_deliver(aTHX_ sub, 1);
+    SvREFCNT_dec(sub->cb);
+    sub->cb = NULL;
+    evict_foreach_key(aTHX_ self, sub, foreach_unwatch);
+    evsub_unref(aTHX_ sub);
+}
+
+/*Called when the table info is freed. The table's DESTROY has normally
+ closed the subscription already; anything still pending is dropped, as
+ perl can't safely be called from here*/
+void hr_evict_sub_destroy(pTHX_ HR_EvictSub *sub)
+{
+    SvREFCNT_dec(sub->cb);
+    sub->cb = NULL;
+    evsub_unref(aTHX_ sub);
+}
+
+/*Returns the callback, for a new thread to subscribe again with*/
+SV* hr_evict_sub_cb(HR_EvictSub *sub, UV *batch)
+{
+    *batch = sub->batch;
+    return sub->cb;
+}
+
+void HRA_on_evict(SV *self, SV *cb, UV batch)
+{
+    dTHX;
+    HR_TableInfo *tinfo = hr_tinfo_get(aTHX_ REF2TABLE(self));
+    HR_EvictSub *sub = tinfo->evsub;
+
+    if(!SvOK(cb)) {
+        if(sub) {
+            tinfo->evsub = NULL;
+            evsub_close(aTHX_ self, sub);
+        }
+        return;
+    }
+    if(!(SvROK(cb) && SvTYPE(SvRV(cb)) == SVt_PVCV)) {
+        die("Callback must be a code reference");
+    }
+
+    if(!sub) {
+        Newxz(sub, 1, HR_EvictSub);
+        sub->keys = newAV();
+        sub->vaddrs = newAV();
+        sub->refcount = 1;
+        tinfo->evsub = sub;
+        evict_foreach_key(aTHX_ self, sub, foreach_watch);
+    }
+    SvREFCNT_dec(sub->cb);
+    sub->cb = newSVsv(cb);
+    sub->batch = batch ? batch : 1;
+    if((UV)(av_len(sub->keys) + 1) >= sub->batch) {
+        evsub_deliver(aTHX_ sub, sub->batch);
+    }
+}
+
+UV HRA_flush_evictions(SV *self)
+{
+    dTHX;
+    HR_EvictSub *sub = hr_tinfo_get(aTHX_ REF2TABLE(self))->evsub;
+    return sub ? evsub_deliver(aTHX_ sub, 1) : 0;
+}
+
+UV HRA_evictions_pending(SV *self)
+{
+    dTHX;
+    HR_EvictSub *sub = hr_tinfo_get(aTHX_ REF2TABLE(self))->evsub;
+    return sub ? av_len(sub->keys) + 1 : 0;
+}
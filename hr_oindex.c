@@ -0,0 +1,482 @@
+////////////////////////////////////////////////////////////////////////////////
+/// Ordered indexes                                                          ///
+////////////////////////////////////////////////////////////////////////////////
+
+/*index_kt() keeps the typed keys and attributes of one type in a skip list,
+ ordered by their string (after the prefix), or numerically. This allows
+ range and prefix scans without walking the whole forward lookup.
+
+ Each node is tied to its key or attribute object by a CFUNC action, which
+ takes the node out of the list when the object is destroyed - which is how
+ keys and attributes leave the table, whichever way they are removed*/
+
+#include "hreg.h"
+#include "hrpriv.h"
+#include "hrdefs.h"
+
+#define OIDX_MAX_LEVEL  24
+
+typedef struct hr_oidx_node hr_oidx_node;
+
+struct hr_oidx_node {
+    HR_OrderedIndex *idx;
+    SV              *obj;       /*Key or attribute object. Not refcounted*/
+    NV              num;        /*Numeric value of the key, if numeric*/
+    char            *full;      /*Full key string, as in the lookups*/
+    char            *key;       /*Key string after the prefix*/
+    STRLEN          klen;
+    U8              is_attr;
+    U8              level;
+    hr_oidx_node    *next[1];   /*'level' forward pointers*/
+};
+
+struct HR_OrderedIndex {
+    HR_OrderedIndex *next;      /*Next index in the table*/
+    char            *prefix;    /*Including the delimiter*/
+    STRLEN          plen;
+    int             numeric;
+    int             level;
+    U32             rng;
+    UV              count;
+    hr_oidx_node    *head;
+};
+
+static void oidx_obj_destroyed(SV *obj, SV *arg, HR_Action *action);
+
+static hr_oidx_node*
+oidx_node_new(int level)
+{
+    hr_oidx_node *node;
+    Newxc(node, sizeof(hr_oidx_node) + (level - 1) * sizeof(hr_oidx_node*),
+          char, hr_oidx_node);
+    Zero(node, 1, hr_oidx_node);
+    Zero(node->next, level, hr_oidx_node*);
+    node->level = level;
+    return node;
+}
+
+/*Each level holds a quarter of the nodes of the one below*/
+static int
+oidx_random_level(HR_OrderedIndex *idx)
+{
+    int level = 1;
+    U32 x;
+    do {
+        x = idx->rng;
+        x ^= x << 13;
+        x ^= x >> 17;
+        x ^= x << 5;
+        idx->rng = x;
+    } while((x & 3) == 0 && ++level < OIDX_MAX_LEVEL);
+    return level;
+}
+
+/*Compares a node with a range bound: by number only, or by string only*/
+static int
+oidx_cmp_bound(HR_OrderedIndex *idx, hr_oidx_node *node,
+               char *key, STRLEN klen, NV num)
+{
+    int ret;
+    if(idx->numeric) {
+        return node->num < num ? -1 : node->num > num;
+    }
+    ret = memcmp(node->key, key, node->klen < klen ? node->klen : klen);
+    if(!ret && node->klen != klen) {
+        ret = node->klen < klen ? -1 : 1;
+    }
+    return ret;
+}
+
+/*Full ordering of the list. Numerically equal keys are ordered by string,
+ and nodes with equal keys (a key and an attribute may share a string) by
+ object, so that removal can find the exact node*/
+static int
+oidx_cmp(HR_OrderedIndex *idx, hr_oidx_node *node,
+         char *key, STRLEN klen, NV num, SV *obj)
+{
+    int ret;
+    if(idx->numeric && (ret = oidx_cmp_bound(idx, node, key, klen, num))) {
+        return ret;
+    }
+    ret = memcmp(node->key, key, node->klen < klen ? node->klen : klen);
+    if(!ret && node->klen != klen) {
+        ret = node->klen < klen ? -1 : 1;
+    }
+    if(!ret && node->obj != obj) {
+        ret = node->obj < obj ? -1 : 1;
+    }
+    return ret;
+}
+
+/*Returns the first node at or after the search key, filling update[] (if
+ given) with the last node before it on each level. Without an object, the
+ search is for the first node within a bound*/
+static hr_oidx_node*
+oidx_search(HR_OrderedIndex *idx, char *key, STRLEN klen, NV num, SV *obj,
+            hr_oidx_node **update)
+{
+    hr_oidx_node *cur = idx->head;
+    int i;
+    for(i = idx->level - 1; i >= 0; i--) {
+        while(cur->next[i]
+              && (obj ? oidx_cmp(idx, cur->next[i], key, klen, num, obj)
+                      : oidx_cmp_bound(idx, cur->next[i], key, klen, num)) < 0) {
+            cur = cur->next[i];
+        }
+        if(update) {
+            update[i] = cur;
+        }
+    }
+    return cur->next[0];
+}
+
+static inline NV
+oidx_num(pTHX_ char *key)
+{
+    return Atof(key);
+}
+
+static void
+oidx_insert(pTHX_ HR_OrderedIndex *idx, SV *obj, char *fullstr, STRLEN len,
+            int is_attr)
+{
+    hr_oidx_node *update[OIDX_MAX_LEVEL], *node;
+    char *key = fullstr + idx->plen;
+    STRLEN klen = len - idx->plen;
+    NV num = idx->numeric ? oidx_num(aTHX_ key) : 0;
+    SV *objref;
+    int level, i;
+
+    oidx_search(idx, key, klen, num, obj, update);
+    level = oidx_random_level(idx);
+    for(i = idx->level; i < level; i++) {
+        update[i] = idx->head;
+    }
+    if(level > idx->level) {
+        idx->level = level;
+    }
+
+    node = oidx_node_new(level);
+    node->idx = idx;
+    node->obj = obj;
+    node->num = num;
+    node->full = savepvn(fullstr, len);
+    node->key = node->full + idx->plen;
+    node->klen = klen;
+    node->is_attr = is_attr;
+    for(i = 0; i < level; i++) {
+        node->next[i] = update[i]->next[i];
+        update[i]->next[i] = node;
+    }
+    idx->count++;
+
+    RV_Newtmp(objref, obj);
+    HR_Action destroy_action[] = {
+        HR_DREF_FLDS_arg_for_cfunc(node, &oidx_obj_destroyed),
+        HR_ACTION_LIST_TERMINATOR
+    };
+    HR_add_actions_real(aTHX_ objref, destroy_action);
+    RV_Freetmp(objref);
+}
+
+static void
+oidx_node_free(pTHX_ hr_oidx_node *node, int detach_action)
+{
+    SV *objref;
+    if(detach_action) {
+        RV_Newtmp(objref, node->obj);
+        HR_del_actions_real(aTHX_ objref, (SV*)&oidx_obj_destroyed, node,
+                                  HR_KEY_TYPE_PTR|HR_KEY_SFLAG_HASHREF_OPAQUE);
+        RV_Freetmp(objref);
+    }
+    Safefree(node->full);
+    Safefree(node);
+}
+
+/*The key or attribute object is being destroyed*/
+static void
+oidx_obj_destroyed(SV *obj, SV *arg, HR_Action *action)
+{
+    dTHX;
+    hr_oidx_node *node = (hr_oidx_node*)arg;
+    HR_OrderedIndex *idx = node->idx;
+    hr_oidx_node *update[OIDX_MAX_LEVEL];
+    int i;
+
+    oidx_search(idx, node->key, node->klen, node->num, node->obj, update);
+    for(i = 0; i < node->level; i++) {
+        update[i]->next[i] = node->next[i];
+    }
+    while(idx->level > 1 && !idx->head->next[idx->level - 1]) {
+        idx->level--;
+    }
+    idx->count--;
+    oidx_node_free(aTHX_ node, 0);
+}
+
+/*Index for a full key or attribute string, if its prefix has one*/
+static HR_OrderedIndex*
+oidx_for_string(HR_OrderedIndex *idx, char *fullstr, STRLEN len)
+{
+    for(; idx; idx = idx->next) {
+        if(len >= idx->plen && memcmp(fullstr, idx->prefix, idx->plen) == 0) {
+            return idx;
+        }
+    }
+    return NULL;
+}
+
+/*Called when a new key or attribute object is created*/
+void hr_oidx_add(pTHX_ SV *self, SV *obj, char *fullstr, STRLEN len,
+                 int is_attr)
+{
+    HR_OrderedIndex *idx = hr_tinfo_get(aTHX_ REF2TABLE(self))->oindexes;
+    if(idx && (idx = oidx_for_string(idx, fullstr, len))) {
+        oidx_insert(aTHX_ idx, obj, fullstr, len, is_attr);
+    }
+}
+
+void hr_oidx_destroy(pTHX_ HR_OrderedIndex *idx)
+{
+    HR_OrderedIndex *next;
+    hr_oidx_node *node, *nnext;
+    for(; idx; idx = next) {
+        next = idx->next;
+        for(node = idx->head->next[0]; node; node = nnext) {
+            nnext = node->next[0];
+            oidx_node_free(aTHX_ node, !PL_dirty);
+        }
+        Safefree(idx->head);
+        Safefree(idx->prefix);
+        Safefree(idx);
+    }
+}
+
+/*Index for a key type. If there is none, its prefix is returned instead*/
+static HR_OrderedIndex*
+oidx_get(pTHX_ SV *self, SV *t, SV **prefix_p)
+{
+    SV *kt_lookup;
+    HE *kt_ent;
+    HR_OrderedIndex *idx;
+    STRLEN plen;
+    char *pstr;
+
+    get_hashes(aTHX_ REF2TABLE(self), HR_HKEY_LOOKUP_KT, &kt_lookup,
+               HR_HKEY_LOOKUP_NULL);
+    if(!(kt_ent = hv_fetch_ent(REF2HASH(kt_lookup), t, 0, 0))) {
+        die("Couldn't find prefix for type '%s'", SvPV_nolen(t));
+    }
+    pstr = SvPV(HeVAL(kt_ent), plen);
+    for(idx = hr_tinfo_get(aTHX_ REF2TABLE(self))->oindexes;
+        idx; idx = idx->next) {
+        if(idx->plen == plen + 1 && memcmp(idx->prefix, pstr, plen) == 0) {
+            return idx;
+        }
+    }
+    if(prefix_p) {
+        *prefix_p = HeVAL(kt_ent);
+    }
+    return NULL;
+}
+
+/*Indexes whatever already exists for the prefix. Key objects are found
+ through the scalar lookup, which holds (weak) references to them*/
+static void
+oidx_populate(pTHX_ SV *self, HR_OrderedIndex *idx)
+{
+    SV *slookup, *attr_lookup, *my_stashcache_ref, *ref;
+    HV *aencap_stash;
+    HE *he;
+    STRLEN i, len;
+    char *str;
+
+    get_hashes(aTHX_ REF2TABLE(self),
+               HR_HKEY_LOOKUP_SCALAR, &slookup,
+               HR_HKEY_LOOKUP_ATTR, &attr_lookup,
+               HR_HKEY_LOOKUP_PRIVDATA, &my_stashcache_ref,
+               HR_HKEY_LOOKUP_NULL);
+    aencap_stash = stash_from_cache_nocheck(my_stashcache_ref,
+                                            HR_STASH_ATTR_ENCAP);
+
+    for(i = 0; HvARRAY(REF2HASH(slookup))
+               && i <= HvMAX(REF2HASH(slookup)); i++) {
+        for(he = HvARRAY(REF2HASH(slookup))[i]; he; he = HeNEXT(he)) {
+            ref = HeVAL(he);
+            str = HePV(he, len);
+            if(SvROK(ref) && len >= idx->plen
+               && memcmp(str, idx->prefix, idx->plen) == 0) {
+                oidx_insert(aTHX_ idx, SvRV(ref), str, len, 0);
+            }
+        }
+    }
+    for(i = 0; HvARRAY(REF2HASH(attr_lookup))
+               && i <= HvMAX(REF2HASH(attr_lookup)); i++) {
+        for(he = HvARRAY(REF2HASH(attr_lookup))[i]; he; he = HeNEXT(he)) {
+            ref = HeVAL(he);
+            str = HePV(he, len);
+            if(SvROK(ref) && SvSTASH(SvRV(ref)) != aencap_stash
+               && len >= idx->plen
+               && memcmp(str, idx->prefix, idx->plen) == 0) {
+                oidx_insert(aTHX_ idx, SvRV(ref), str, len, 1);
+            }
+        }
+    }
+}
+
+void HRA_index_kt(SV *self, SV *t, int numeric)
+{
+    dTHX;
+    HR_TableInfo *tinfo = hr_tinfo_get(aTHX_ REF2TABLE(self));
+    HR_OrderedIndex *idx;
+    SV *prefix;
+    STRLEN plen;
+    char *pstr;
+
+    if( (idx = oidx_get(aTHX_ self, t, &prefix)) ) {
+        if(idx->numeric != (numeric ? 1 : 0)) {
+            die("Type '%s' is already indexed %s", SvPV_nolen(t),
+                idx->numeric ? "numerically" : "as strings");
+        }
+        return;
+    }
+
+    pstr = SvPV(prefix, plen);
+    Newxz(idx, 1, HR_OrderedIndex);
+    Newx(idx->prefix, plen + 2, char);
+    Copy(pstr, idx->prefix, plen, char);
+    idx->prefix[plen] = *HR_PREFIX_DELIM;
+    idx->prefix[plen + 1] = '\0';
+    idx->plen = plen + 1;
+    idx->numeric = numeric ? 1 : 0;
+    idx->level = 1;
+    idx->rng = (U32)PTR2UV(idx) | 1;
+    idx->head = oidx_node_new(OIDX_MAX_LEVEL);
+
+    idx->next = tinfo->oindexes;
+    tinfo->oindexes = idx;
+    oidx_populate(aTHX_ self, idx);
+}
+
+/*Pushes the values of one node: the value of a key, or all values of an
+ attribute. In scalar context, they are only counted*/
+static I32
+oidx_push_values(pTHX_ SV *flookup, hr_oidx_node *node, int want_list)
+{
+    dSP;
+    HV *attrhash;
+    HE *he;
+    SV **fent;
+    I32 n = 0;
+
+    if(node->is_attr) {
+        attrhash = hrattr_attrhash(node->obj, NULL);
+        if(!want_list) {
+            return HvUSEDKEYS(attrhash);
+        }
+        hv_iterinit(attrhash);
+        while( (he = hv_iternext(attrhash)) ) {
+            XPUSHs(sv_mortalcopy(HeVAL(he)));
+            n++;
+        }
+    } else {
+        fent = hv_fetch(REF2HASH(flookup), node->full,
+                        node->key - node->full + node->klen, 0);
+        if(fent && SvROK(*fent)) {
+            if(want_list) {
+                XPUSHs(sv_mortalcopy(*fent));
+            }
+            n++;
+        }
+    }
+    PUTBACK;
+    return n;
+}
+
+/*Returns the values of all nodes from 'node' onwards, up to the bound 'hi'
+ (inclusive), or for as long as they match 'prefix'*/
+static void
+oidx_fetch(pTHX_ SV *self, HR_OrderedIndex *idx, hr_oidx_node *node,
+           SV *hi, SV *prefix)
+{
+    dXSARGS;
+    int want_list = GIMME_V == G_ARRAY;
+    char *hstr = NULL, *pstr = NULL;
+    STRLEN hlen = 0, plen = 0;
+    NV hnum = 0;
+    SV *flookup;
+    I32 n = 0;
+
+    SP -= items;
+    PUTBACK;
+    if(GIMME_V == G_VOID) {
+        XSRETURN(0);
+    }
+    get_hashes(aTHX_ REF2TABLE(self), HR_HKEY_LOOKUP_FORWARD, &flookup,
+               HR_HKEY_LOOKUP_NULL);
+    if(hi && SvOK(hi)) {
+        hstr = SvPV(hi, hlen);
+        hnum = SvNV(hi);
+    }
+    if(prefix) {
+        pstr = SvPV(prefix, plen);
+    }
+
+    for(; node; node = node->next[0]) {
+        if(hstr && oidx_cmp_bound(idx, node, hstr, hlen, hnum) > 0) {
+            break;
+        }
+        if(pstr && (node->klen < plen || memcmp(node->key, pstr, plen))) {
+            break;
+        }
+        n += oidx_push_values(aTHX_ flookup, node, want_list);
+    }
+    if(!want_list) {
+        XSRETURN_IV(n);
+    }
+}
+
+void HRA_fetch_range(SV *self, SV *t, SV *lo, SV *hi)
+{
+    dTHX;
+    HR_OrderedIndex *idx = oidx_get(aTHX_ self, t, NULL);
+    hr_oidx_node *first;
+    STRLEN llen = 0;
+    char *lstr = "";
+
+    if(!idx) {
+        die("Type '%s' has no index", SvPV_nolen(t));
+    }
+    if(SvOK(lo)) {
+        lstr = SvPV(lo, llen);
+        first = oidx_search(idx, lstr, llen, SvNV(lo), NULL, NULL);
+    } else {
+        first = idx->head->next[0];
+    }
+    oidx_fetch(aTHX_ self, idx, first, hi, NULL);
+}
+
+void HRA_fetch_prefix(SV *self, SV *t, SV *prefix)
+{
+    dTHX;
+    HR_OrderedIndex *idx = oidx_get(aTHX_ self, t, NULL);
+    STRLEN plen;
+    char *pstr;
+
+    if(!idx) {
+        die("Type '%s' has no index", SvPV_nolen(t));
+    }
+    if(idx->numeric) {
+        die("Prefix scans need an index ordered by string");
+    }
+    pstr = SvPV(prefix, plen);
+    oidx_fetch(aTHX_ self, idx, oidx_search(idx, pstr, plen, 0, NULL, NULL),
+               NULL, prefix);
+}
+
+UV HRA_index_count(SV *self, SV *t)
+{
+    dTHX;
+    HR_OrderedIndex *idx = oidx_get(aTHX_ self, t, NULL);
+    return idx ? idx->count : 0;
+}
@@ -0,0 +1,606 @@
+////////////////////////////////////////////////////////////////////////////////
+/// Saving and loading tables                                                ///
+////////////////////////////////////////////////////////////////////////////////
+
+/*Tables are saved as a flat binary file. All integers are 32 bit, in the byte
+ order of the machine which wrote the file:
+
+ [header]
+ [types]    { tlen, name, plen, prefix } x ntypes
+ [keys]     { value, flags, prefix_len, klen, key } x nkeys
+ [attrs]    { prefix_len, alen, attr, nmembers, { value, flags } x nmembers } x nattrs
+ [values]   { len, payload } x nvalues
+
+ Keys and attributes are stored as their full prefixed strings, and refer to
+ values by their index in the values section. Loading maps the file, decodes
+ all values, and then inserts everything directly through the C store
+ routines. Object keys and object attributes are not saved.
+*/
+
+#include "hreg.h"
+#include "hrpriv.h"
+#include "hrdefs.h"
+
+#include <string.h>
+#include <errno.h>
+
+#ifdef HAS_MMAP
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+#define HR_PERSIST_MAGIC "HRSTORE"
+#define HR_PERSIST_VERSION 1
+#define HR_PERSIST_BYTEORDER 0x01020304
+
+enum {
+    HR_PERSIST_STRONG_VALUE = 1 << 0
+};
+
+typedef struct {
+    char    magic[8];
+    U32     version;
+    U32     byteorder;
+    U32     ntypes;
+    U32     nkeys;
+    U32     nattrs;
+    U32     nvalues;
+    U32     values_off; /*Offset of the values section from the file start*/
+    U32     reserved;
+} hr_persist_hdr;
+
+////////////////////////////////////////////////////////////////////////////////
+/// Value encoding                                                           ///
+////////////////////////////////////////////////////////////////////////////////
+
+SV* hr_value_encode(pTHX_ SV *encoder, SV *value)
+{
+    SV *ret;
+    int count;
+
+    if(!(encoder && SvOK(encoder))) {
+        if(SvTYPE(SvRV(value)) < SVt_PVAV && SvOK(SvRV(value))) {
+            return newSVsv(SvRV(value));
+        }
+        die("No encoder given, and value %p is not a reference to a "
+            "defined scalar", SvRV(value));
+    }
+
+    dSP;
+    ENTER;
+    SAVETMPS;
+    PUSHMARK(SP);
+    XPUSHs(value);
+    PUTBACK;
+    count = call_sv(encoder, G_SCALAR);
+    SPAGAIN;
+    if(count != 1) {
+        die("Value encoder must return a single scalar");
+    }
+    ret = newSVsv(POPs);
+    PUTBACK;
+    FREETMPS;
+    LEAVE;
+    return ret;
+}
+
+static SV*
+persist_value_decode(pTHX_ SV *decoder, const char *payload, U32 len)
+{
+    SV *ret;
+    int count;
+
+    if(!(decoder && SvOK(decoder))) {
+        return newRV_noinc(newSVpvn(payload, len));
+    }
+
+    dSP;
+    ENTER;
+    SAVETMPS;
+    PUSHMARK(SP);
+    XPUSHs(sv_2mortal(newSVpvn(payload, len)));
+    PUTBACK;
+    count = call_sv(decoder, G_SCALAR);
+    SPAGAIN;
+    if(count != 1) {
+        die("Value decoder must return a single scalar");
+    }
+    ret = newSVsv(POPs);
+    PUTBACK;
+    FREETMPS;
+    LEAVE;
+
+    if(!SvROK(ret)) {
+        SvREFCNT_dec(ret);
+        die("Value decoder must return a reference");
+    }
+    return ret;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+/// Saving                                                                   ///
+////////////////////////////////////////////////////////////////////////////////
+
+typedef struct {
+    PerlIO  *fp;
+    HV      *vindex;    /*Value address => value index*/
+    AV      *payloads;  /*Encoded values, by index*/
+    SV      *encoder;
+    U32     nbytes;
+} persist_writer;
+
+static inline void
+persist_write(pTHX_ persist_writer *w, const void *buf, STRLEN len)
+{
+    if(PerlIO_write(w->fp, buf, len) != (SSize_t)len) {
+        die("Couldn't write table: %s", Strerror(errno));
+    }
+    w->nbytes += len;
+}
+
+static inline void
+persist_write_u32(pTHX_ persist_writer *w, U32 u)
+{
+    persist_write(aTHX_ w, &u, sizeof(u));
+}
+
+static inline void
+persist_write_str(pTHX_ persist_writer *w, const char *str, STRLEN len)
+{
+    persist_write_u32(aTHX_ w, len);
+    persist_write(aTHX_ w, str, len);
+}
+
+static U32
+persist_value_index(pTHX_ persist_writer *w, SV *value)
+{
+    mk_ptr_string(vstr, SvRV(value));
+    SV **stored = hv_fetch(w->vindex, vstr, strlen(vstr), 1);
+    U32 ret;
+
+    if(SvOK(*stored)) {
+        return (U32)SvUV(*stored);
+    }
+    ret = av_len(w->payloads) + 1;
+    av_push(w->payloads, hr_value_encode(aTHX_ w->encoder, value));
+    sv_setuv(*stored, ret);
+    return ret;
+}
+
+static U32
+persist_save_types(pTHX_ persist_writer *w, HV *kt_lookup)
+{
+    HE *cur;
+    char *tstr, *pstr;
+    I32 tlen;
+    STRLEN plen;
+    U32 count = 0;
+
+    hv_iterinit(kt_lookup);
+    while( (cur = hv_iternext(kt_lookup)) ) {
+        tstr = hv_iterkey(cur, &tlen);
+        pstr = SvPV(hv_iterval(kt_lookup, cur), plen);
+        persist_write_str(aTHX_ w, tstr, tlen);
+        persist_write_str(aTHX_ w, pstr, plen);
+        count++;
+    }
+    return count;
+}
+
+static U32
+persist_save_keys(pTHX_ persist_writer *w, HV *forward, HV *slookup,
+                  HV *encap_stash)
+{
+    HE *cur;
+    char *kstr;
+    I32 klen;
+    SV **kobj;
+    U32 count = 0;
+
+    hv_iterinit(forward);
+    while( (cur = hv_iternext(forward)) ) {
+        SV *value = hv_iterval(forward, cur);
+        if(!SvROK(value)) {
+            continue;
+        }
+        kstr = hv_iterkey(cur, &klen);
+        kobj = hv_fetch(slookup, kstr, klen, 0);
+        if(!kobj || !SvROK(*kobj) || SvSTASH(SvRV(*kobj)) == encap_stash) {
+            HR_DEBUG("Skipping object key %s", kstr);
+            continue;
+        }
+        persist_write_u32(aTHX_ w, persist_value_index(aTHX_ w, value));
+        persist_write_u32(aTHX_ w,
+                          SvWEAKREF(value) ? 0 : HR_PERSIST_STRONG_VALUE);
+        persist_write_u32(aTHX_ w, HRXSK_prefix_len(*kobj));
+        persist_write_str(aTHX_ w, kstr, klen);
+        count++;
+    }
+    return count;
+}
+
+static U32
+persist_save_attrs(pTHX_ persist_writer *w, HV *attr_lookup)
+{
+    HE *cur, *vcur;
+    HV *attrhash;
+    AV *members = (AV*)sv_2mortal((SV*)newAV());
+    char *astr;
+    I32 alen, i;
+    int is_encap;
+    U32 count = 0;
+
+    hv_iterinit(attr_lookup);
+    while( (cur = hv_iternext(attr_lookup)) ) {
+        SV *aobj = hv_iterval(attr_lookup, cur);
+        if(!SvROK(aobj)) {
+            continue;
+        }
+        attrhash = hrattr_attrhash(SvRV(aobj), &is_encap);
+        if(is_encap || !attrhash) {
+            continue;
+        }
+
+        /*Collect the live members first, so we know how many to write*/
+        av_clear(members);
+        hv_iterinit(attrhash);
+        while( (vcur = hv_iternext(attrhash)) ) {
+            SV *value = hv_iterval(attrhash, vcur);
+            if(SvROK(value)) {
+                av_push(members, SvREFCNT_inc(value));
+            }
+        }
+        if(av_len(members) < 0) {
+            continue;
+        }
+
+        astr = hv_iterkey(cur, &alen);
+        persist_write_u32(aTHX_ w, HRXSATTR_prefix_len(aobj));
+        persist_write_str(aTHX_ w, astr, alen);
+        persist_write_u32(aTHX_ w, av_len(members) + 1);
+        for(i = 0; i <= av_len(members); i++) {
+            SV *value = *av_fetch(members, i, 0);
+            persist_write_u32(aTHX_ w, persist_value_index(aTHX_ w, value));
+            persist_write_u32(aTHX_ w, SvWEAKREF(value) ? 0 : HR_PERSIST_STRONG_VALUE);
+        }
+        count++;
+    }
+    return count;
+}
+
+static void
+persist_close(pTHX_ void *fp)
+{
+    PerlIO_close((PerlIO*)fp);
+}
+
+void HRA_save(SV *self, char *path, SV *encoder)
+{
+    dTHX;
+    persist_writer w;
+    hr_persist_hdr hdr;
+    SV *forward, *slookup, *attr_lookup, *kt_lookup, *my_stashcache_ref;
+    STRLEN plen;
+    char *pstr;
+    U32 i;
+
+    get_hashes(aTHX_ REF2TABLE(self),
+               HR_HKEY_LOOKUP_FORWARD, &forward,
+               HR_HKEY_LOOKUP_SCALAR, &slookup,
+               HR_HKEY_LOOKUP_ATTR, &attr_lookup,
+               HR_HKEY_LOOKUP_KT, &kt_lookup,
+               HR_HKEY_LOOKUP_PRIVDATA, &my_stashcache_ref,
+               HR_HKEY_LOOKUP_NULL);
+
+    Zero(&w, 1, persist_writer);
+    Zero(&hdr, 1, hr_persist_hdr);
+
+    if(!(w.fp = PerlIO_open(path, "wb"))) {
+        die("Couldn't open '%s' for writing: %s", path, Strerror(errno));
+    }
+
+    ENTER;
+    SAVETMPS;
+    SAVEDESTRUCTOR_X(persist_close, w.fp);
+
+    w.vindex = (HV*)sv_2mortal((SV*)newHV());
+    w.payloads = (AV*)sv_2mortal((SV*)newAV());
+    w.encoder = encoder;
+
+    /*The header is rewritten once the counts are known*/
+    persist_write(aTHX_ &w, &hdr, sizeof(hdr));
+
+    if(kt_lookup && SvROK(kt_lookup)) {
+        hdr.ntypes = persist_save_types(aTHX_ &w, REF2HASH(kt_lookup));
+    }
+    hdr.nkeys = persist_save_keys(aTHX_ &w, REF2HASH(forward),
+                                  REF2HASH(slookup),
+                    stash_from_cache_nocheck(my_stashcache_ref, HR_STASH_KEY_ENCAP));
+    hdr.nattrs = persist_save_attrs(aTHX_ &w, REF2HASH(attr_lookup));
+
+    hdr.values_off = w.nbytes;
+    hdr.nvalues = av_len(w.payloads) + 1;
+    for(i = 0; i < hdr.nvalues; i++) {
+        pstr = SvPV(*av_fetch(w.payloads, i, 0), plen);
+        persist_write_str(aTHX_ &w, pstr, plen);
+    }
+
+    Copy(HR_PERSIST_MAGIC, hdr.magic, sizeof(HR_PERSIST_MAGIC), char);
+    hdr.version = HR_PERSIST_VERSION;
+    hdr.byteorder = HR_PERSIST_BYTEORDER;
+
+    if(PerlIO_seek(w.fp, 0, SEEK_SET) != 0) {
+        die("Couldn't rewind '%s': %s", path, Strerror(errno));
+    }
+    persist_write(aTHX_ &w, &hdr, sizeof(hdr));
+
+    HR_DEBUG("Saved %u keys, %u attributes, %u values",
+             hdr.nkeys, hdr.nattrs, hdr.nvalues);
+
+    FREETMPS;
+    LEAVE;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+/// Loading                                                                  ///
+////////////////////////////////////////////////////////////////////////////////
+
+typedef struct {
+    const char  *p;
+    const char  *end;
+} persist_reader;
+
+typedef struct {
+    char    *buf;
+    STRLEN  len;
+    int     mapped;
+} persist_map;
+
+static inline void
+persist_need(persist_reader *r, STRLEN len)
+{
+    if(len > (STRLEN)(r->end - r->p)) {
+        die("Truncated or corrupt table file");
+    }
+}
+
+static inline U32
+persist_read_u32(persist_reader *r)
+{
+    U32 ret;
+    persist_need(r, sizeof(ret));
+    Copy(r->p, &ret, sizeof(ret), char);
+    r->p += sizeof(ret);
+    return ret;
+}
+
+/*Returns the string's position in the file, and advances past it*/
+static inline const char*
+persist_read_str(persist_reader *r, U32 *len)
+{
+    const char *ret;
+    *len = persist_read_u32(r);
+    persist_need(r, *len);
+    ret = r->p;
+    r->p += *len;
+    return ret;
+}
+
+static void
+persist_unmap(pTHX_ void *arg)
+{
+    persist_map *map = arg;
+    if(!map->buf) {
+        return;
+    }
+#ifdef HAS_MMAP
+    if(map->mapped) {
+        munmap(map->buf, map->len);
+        map->buf = NULL;
+        return;
+    }
+#endif
+    Safefree(map->buf);
+    map->buf = NULL;
+}
+
+static void
+persist_map_file(pTHX_ persist_map *map, char *path)
+{
+    PerlIO *fp;
+    Zero(map, 1, persist_map);
+
+#ifdef HAS_MMAP
+    struct stat st;
+    int fd = open(path, O_RDONLY);
+    if(fd >= 0) {
+        if(fstat(fd, &st) == 0 && st.st_size > 0) {
+            void *addr = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+            if(addr != MAP_FAILED) {
+                map->buf = addr;
+                map->len = st.st_size;
+                map->mapped = 1;
+            }
+        }
+        close(fd);
+        if(map->mapped) {
+            return;
+        }
+    }
+#endif
+
+    /*No mmap, or the file couldn't be mapped. Read it in instead*/
+    if(!(fp = PerlIO_open(path, "rb"))) {
+        die("Couldn't open '%s': %s", path, Strerror(errno));
+    }
+    map->len = 0;
+    Newx(map->buf, 8192, char);
+    while(1) {
+        SSize_t nr;
+        Renew(map->buf, map->len + 8192, char);
+        nr = PerlIO_read(fp, map->buf + map->len, 8192);
+        if(nr <= 0) {
+            break;
+        }
+        map->len += nr;
+    }
+    PerlIO_close(fp);
+}
+
+static void
+persist_load_types(pTHX_ persist_reader *r, U32 ntypes, HV *kt_lookup)
+{
+    const char *tstr, *pstr;
+    U32 tlen, plen;
+
+    while(ntypes--) {
+        tstr = persist_read_str(r, &tlen);
+        pstr = persist_read_str(r, &plen);
+        if(!hv_exists(kt_lookup, tstr, tlen)) {
+            hv_store(kt_lookup, tstr, tlen, newSVpvn(pstr, plen), 0);
+        }
+    }
+}
+
+static inline SV*
+persist_value_at(pTHX_ AV *values, U32 vidx)
+{
+    SV **ret = av_fetch(values, vidx, 0);
+    if(!ret) {
+        die("Corrupt table file (value index %u out of range)", vidx);
+    }
+    return *ret;
+}
+
+static inline int
+persist_store_opts(U32 flags)
+{
+    return (flags & HR_PERSIST_STRONG_VALUE) ? STORE_OPT_STRONG_VALUE : 0;
+}
+
+static void
+persist_load_keys(pTHX_ persist_reader *r, U32 nkeys, SV *self, AV *values)
+{
+    /*A single key SV is reused for all insertions; the lookup hashes keep
+     their own copies of the key strings*/
+    SV *ksv = sv_2mortal(newSV(0));
+    const char *kstr;
+    U32 vidx, flags, prefix_len, klen;
+
+    while(nkeys--) {
+        vidx = persist_read_u32(r);
+        flags = persist_read_u32(r);
+        prefix_len = persist_read_u32(r);
+        kstr = persist_read_str(r, &klen);
+        if(prefix_len > klen) {
+            die("Truncated or corrupt table file");
+        }
+        sv_setpvn(ksv, kstr, klen);
+        HR_store_sk_real(aTHX_ self, ksv, persist_value_at(aTHX_ values, vidx),
+                         prefix_len,
+                         STORE_OPT_O_CREAT | persist_store_opts(flags));
+    }
+}
+
+static void
+persist_load_attrs(pTHX_ persist_reader *r, U32 nattrs, SV *self, AV *values)
+{
+    /*Attribute objects copy their string with strlen(), so it needs to be
+     terminated*/
+    SV *asv = sv_2mortal(newSV(0));
+    const char *astr;
+    U32 prefix_len, alen, nmembers, vidx, flags;
+
+    while(nattrs--) {
+        prefix_len = persist_read_u32(r);
+        astr = persist_read_str(r, &alen);
+        if(prefix_len > alen) {
+            die("Truncated or corrupt table file");
+        }
+        sv_setpvn(asv, astr, alen);
+        nmembers = persist_read_u32(r);
+        while(nmembers--) {
+            vidx = persist_read_u32(r);
+            flags = persist_read_u32(r);
+            hrattr_store_str(aTHX_ self, SvPVX(asv), alen, prefix_len,
+                             persist_value_at(aTHX_ values, vidx),
+                             persist_store_opts(flags));
+        }
+    }
+}
+
+void HRA_load_into(SV *self, char *path, SV *decoder)
+{
+    dTHX;
+    persist_map map;
+    persist_reader r, vr;
+    hr_persist_hdr hdr;
+    SV *kt_lookup;
+    AV *values;
+    const char *payload;
+    U32 plen, i;
+
+    get_hashes(aTHX_ REF2TABLE(self),
+               HR_HKEY_LOOKUP_KT, &kt_lookup,
+               HR_HKEY_LOOKUP_NULL);
+
+    ENTER;
+    SAVETMPS;
+
+    persist_map_file(aTHX_ &map, path);
+    SAVEDESTRUCTOR_X(persist_unmap, &map);
+
+    r.p = map.buf;
+    r.end = map.buf + map.len;
+    persist_need(&r, sizeof(hdr));
+    Copy(r.p, &hdr, 1, hr_persist_hdr);
+    r.p += sizeof(hdr);
+
+    if(memcmp(hdr.magic, HR_PERSIST_MAGIC, sizeof(HR_PERSIST_MAGIC)) != 0) {
+        die("'%s' is not a saved table", path);
+    }
+    if(hdr.byteorder != HR_PERSIST_BYTEORDER) {
+        die("'%s' was saved on a machine with a different byte order", path);
+    }
+    if(hdr.version != HR_PERSIST_VERSION) {
+        die("'%s' has unsupported version %u", path, hdr.version);
+    }
+    /*The counts are checked against the file before anything is allocated
+     from them: every value takes at least its length word. The keys and
+     attributes must end where the values begin*/
+    if(hdr.values_off < sizeof(hdr) || hdr.values_off > map.len
+       || hdr.nvalues > (map.len - hdr.values_off) / sizeof(U32)) {
+        die("Truncated or corrupt table file");
+    }
+    r.end = map.buf + hdr.values_off;
+
+    /*Decode all the values up front. They are kept alive until the load
+     is done; after that, weak entries depend on whatever else references
+     the decoded values*/
+    values = (AV*)sv_2mortal((SV*)newAV());
+    av_extend(values, hdr.nvalues);
+    vr.p = map.buf + hdr.values_off;
+    vr.end = map.buf + map.len;
+    for(i = 0; i < hdr.nvalues; i++) {
+        payload = persist_read_str(&vr, &plen);
+        av_store(values, i, persist_value_decode(aTHX_ decoder, payload, plen));
+    }
+
+    if(hdr.ntypes) {
+        if(!(kt_lookup && SvROK(kt_lookup))) {
+            die("Table has no key type lookup");
+        }
+        persist_load_types(aTHX_ &r, hdr.ntypes, REF2HASH(kt_lookup));
+    }
+    persist_load_keys(aTHX_ &r, hdr.nkeys, self, values);
+    persist_load_attrs(aTHX_ &r, hdr.nattrs, self, values);
+
+    HR_DEBUG("Loaded %u keys, %u attributes, %u values",
+             hdr.nkeys, hdr.nattrs, hdr.nvalues);
+
+    FREETMPS;
+    LEAVE;
+}
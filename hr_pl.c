@@ -1,9 +1,11 @@
 #include <string.h>
 #include <stdint.h>
 #include "hreg.h"
+#include "hrpriv.h"
+#include "hrprobes.h"
 
-HR_INLINE MAGIC* get_our_magic(SV* objref, int create);
-HR_INLINE void free_our_magic(SV* objref);
+HR_INLINE MAGIC* get_our_magic(pTHX_ SV* objref, int create);
+HR_INLINE void free_our_magic(pTHX_ SV* objref);
 
 static int hr_freehook(pTHX_ SV* target, MAGIC *mg);
 static int hr_duphook(pTHX_ MAGIC *mg, CLONE_PARAMS *param);
@@ -19,6 +21,7 @@ static MGVTBL vtbl = {
 static int
 hr_freehook(pTHX_ SV* object, MAGIC *mg)
 {
+	HR_Context *cxt;
 	if(PL_dirty) {
 		HR_DEBUG("Not triggering during global destruction");
 		return;
@@ -26,12 +29,23 @@ hr_freehook(pTHX_ SV* object, MAGIC *mg)
 	HR_DEBUG("FREEHOOK: mg=%p, obj=%p", mg, object);
 	HR_DEBUG("Object refcount: %d", SvREFCNT(object));
 	OURMAGIC_infree(mg) = 1;
+	cxt = HR_CXT;
+	cxt->stats.freehook_calls++;
+	HR_PROBE2(freehook, object, SvREFCNT(object));
 	
 #if (PERL_VERSION < 10) || (PERL_VERSION == 10 && PERL_SUBVERSION < 1)
 #warning "Nasty SvMAGIC_set hack"
 	SvMAGIC_set(object, mg);
 #endif
-    HR_trigger_and_free_actions(_mg_action_list(mg), object);
+	if(cxt->nlatency && !cxt->trigger_depth) {
+		hr_latency_cascade(aTHX_ object, _mg_action_list(mg));
+	} else {
+		HR_trigger_and_free_actions(aTHX_ _mg_action_list(mg), object);
+	}
+	/*A free outside of any table operation is its own safe point*/
+	if(cxt->evict_due && !cxt->trigger_depth && !cxt->op_depth) {
+		hr_evict_deliver_due(aTHX_ cxt);
+	}
 }
 
 /*This is called for new threads, we initialize a new HR_Action list,
@@ -43,8 +57,56 @@ hr_duphook(pTHX_ MAGIC *mg, CLONE_PARAMS *param)
 	Newxz_Action(mg->mg_ptr);
 }
 
+UV
+HR_action_count(SV *target)
+{
+	MAGIC *mg;
+	HR_Action *cur;
+	UV ret = 0;
+	
+	if(SvTYPE(target) < SVt_PVMG) {
+		return 0;
+	}
+	for(mg = SvMAGIC(target); mg; mg = mg->mg_moremagic) {
+		if(mg->mg_virtual == &vtbl) {
+			for(cur = _mg_action_list(mg); cur; cur = cur->next) {
+				ret++;
+			}
+			break;
+		}
+	}
+	return ret;
+}
+
+void*
+HR_cfunc_action_arg(SV *target, void *fptr,
+					int (*match)(void *arg, void *data), void *data)
+{
+	MAGIC *mg;
+	HR_Action *cur;
+	
+	if(SvTYPE(target) < SVt_PVMG) {
+		return NULL;
+	}
+	for(mg = SvMAGIC(target); mg; mg = mg->mg_moremagic) {
+		if(mg->mg_virtual != &vtbl) {
+			continue;
+		}
+		for(cur = _mg_action_list(mg); cur; cur = cur->next) {
+			if(cur->atype == HR_ACTION_TYPE_CALL_CFUNC
+			   && cur->ktype != HR_KEY_TYPE_NULL
+			   && (void*)cur->hashref == fptr
+			   && (!match || match(cur->key, data))) {
+				return cur->key;
+			}
+		}
+		break;
+	}
+	return NULL;
+}
+
 HR_INLINE MAGIC*
-get_our_magic(SV* objref, int create)
+get_our_magic(pTHX_ SV* objref, int create)
 {
 	MAGIC *mg;
     HR_Action *action_list;
@@ -106,7 +168,7 @@ get_our_magic(SV* objref, int create)
 }
 
 HR_INLINE void
-free_our_magic(SV* target)
+free_our_magic(pTHX_ SV* target)
 {
     MAGIC *mg_last = mg_find(target, PERL_MAGIC_ext);
     MAGIC *mg_cur = mg_last;
@@ -126,7 +188,7 @@ free_our_magic(SV* target)
     action = _mg_action_list(mg_cur);
     if(action) {
 		HR_DEBUG("Found action=%p", action);
-		while((action = HR_free_action(action)));
+		while((action = HR_free_action(aTHX_ action)));
 	}
     
     /*Check if this is the last magic on the variable*/
@@ -146,10 +208,10 @@ free_our_magic(SV* target)
 }
 
 HREG_API_INTERNAL void
-HR_add_actions_real(SV* objref, HR_Action *actions)
+HR_add_actions_real(pTHX_ SV* objref, HR_Action *actions)
 {
     HR_DEBUG("Have objref=%p, action_list=%p", objref, actions);
-    MAGIC *mg = get_our_magic(objref, 1);
+    MAGIC *mg = get_our_magic(aTHX_ objref, 1);
     
     if(!actions) {
         die("Must have at least one action!");
@@ -159,22 +221,22 @@ HR_add_actions_real(SV* objref, HR_Action *actions)
         if(!actions->hashref) {
             die("Must have hashref!");
         }
-        HR_add_action(_mg_action_list(mg), actions, 1);
+        HR_add_action(aTHX_ _mg_action_list(mg), actions, 1);
         actions++;
     }
 }
 
 void
-HR_PL_add_actions(SV *objref, char *blob) {
-    HR_add_actions_real(objref, (HR_Action*)blob);
+HR_PL_add_actions(pTHX_ SV *objref, char *blob) {
+    HR_add_actions_real(aTHX_ objref, (HR_Action*)blob);
 }
 
 
-HR_INLINE void
-pl_del_action_common(SV *objref, SV *hashref,
+HREG_API_INTERNAL void
+HR_del_actions_real(pTHX_ SV *objref, SV *hashref,
 										void *key, HR_KeyType_t ktype)
 {
-	MAGIC *mg = get_our_magic(objref, 0);
+	MAGIC *mg = get_our_magic(aTHX_ objref, 0);
 	int dv; /*Deletion status*/
     HR_DEBUG("DELETE: O=%p, SV=%p", objref, hashref);
 	if(!mg) {
@@ -182,26 +244,27 @@ pl_del_action_common(SV *objref, SV *hashref,
 	}
 	
 	if(OURMAGIC_infree(mg)) {
-		while(HR_nullify_action(
+		while(HR_nullify_action(aTHX_
 			_mg_action_list(mg), hashref, key, ktype) == HR_ACTION_DELETED);
 		/*no body*/
 		return;
 	}
 	
     dv = HR_ACTION_NOT_FOUND;
-    while( (dv = HR_del_action(
+    while( (dv = HR_del_action(aTHX_
 			_mg_action_list(mg), hashref, key, ktype)) == HR_ACTION_DELETED );
     /*no body*/
     HR_DEBUG("Delete done");
 	
     if(dv == HR_ACTION_EMPTY) {
-        free_our_magic(SvRV(objref));
+        free_our_magic(aTHX_ SvRV(objref));
     }
 }
 
 #define gen_del_fn(suffix, argtype, ktype) \
 	void HR_PL_del_action_ ## suffix(SV *obj, SV *ctr, argtype arg) { \
-		pl_del_action_common(obj, ctr, (void*)arg, ktype); \
+		dTHX; \
+		HR_del_actions_real(aTHX_ obj, ctr, (void*)arg, ktype); \
 	}
 
 gen_del_fn(ptr, UV, HR_KEY_TYPE_PTR);
@@ -213,18 +276,21 @@ gen_del_fn(sv, SV*, HR_KEY_STYPE_PTR_RV);
 void HR_XS_del_action_ext(
 	SV *object, void *container, void *arg, HR_KeyType_t ktype)
 {
-	pl_del_action_common(object, container, arg, ktype);
+	dTHX;
+	HR_del_actions_real(aTHX_ object, container, arg, ktype);
 }
 
 
 void HR_PL_del_action_container(SV *object, SV *hashref)
 {
-	pl_del_action_common(object, hashref, NULL, HR_KEY_TYPE_NULL);
+	dTHX;
+	HR_del_actions_real(aTHX_ object, hashref, NULL, HR_KEY_TYPE_NULL);
 }
 
 void
 HR_PL_add_action_str(SV *objref, SV *hashref, char *str)
 {
+	dTHX;
 	int action_type;
 	
 	int reftype = SvTYPE(SvRV(hashref));
@@ -251,17 +317,18 @@ HR_PL_add_action_str(SV *objref, SV *hashref, char *str)
 		},
 		HR_ACTION_LIST_TERMINATOR
 	};
-	HR_add_actions_real(objref, actions);
+	HR_add_actions_real(aTHX_ objref, actions);
 }
 
 void
 HR_PL_add_action_ptr(SV* objref, SV *hashref)
 {
+	dTHX;
 	HR_Action actions[] = {
 		HR_DREF_FLDS_ptr_from_hv(SvRV(objref), hashref),
 		HR_ACTION_LIST_TERMINATOR
 	};
-	HR_add_actions_real(objref, actions);
+	HR_add_actions_real(aTHX_ objref, actions);
 }
 
 void HR_PL_add_action_ext(
@@ -273,6 +340,7 @@ void HR_PL_add_action_ext(
 	unsigned int flags
 	)
 {
+	dTHX;
 	
 	flags |= HR_FLAG_HASHREF_RV;
 	/*Turn off flags which make no sense coming from perl*/
@@ -292,5 +360,5 @@ void HR_PL_add_action_ext(
 		},
 		HR_ACTION_LIST_TERMINATOR
 	};
-	HR_add_actions_real(objref, actions);
+	HR_add_actions_real(aTHX_ objref, actions);
 }
\ No newline at end of file
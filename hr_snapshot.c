@@ -0,0 +1,831 @@
+////////////////////////////////////////////////////////////////////////////////
+/// Immutable shared snapshots                                               ///
+////////////////////////////////////////////////////////////////////////////////
+
+/*A snapshot is a read-only image of a table's string keys, typed keys and
+ string attributes. The image is a single block of shared memory which does
+ not reference any SVs, and can thus be queried from any interpreter without
+ locking or copying.
+
+ Images are published through a slot. freeze_shared() compiles a new image
+ and swaps it into the table's slot; handles notice the generation change
+ and pick up the new image on their next lookup. Old images are freed when
+ the last handle referencing them moves on.
+
+ freeze() builds the same kind of image for the table's own use. Instead of
+ encoded payloads, it holds references to the live values, and lookups go
+ to it rather than to the perl hashes. The image is a single block which is
+ never written to by lookups, so it stays shared between forked processes;
+ any change to the table drops it.
+*/
+
+#include "hreg.h"
+#include "hrpriv.h"
+#include "hrdefs.h"
+
+#include <string.h>
+
+typedef struct {
+    U32 hash;
+    U32 koff;   /*Offset of the key in the arena. 0 means the bucket is empty*/
+    U32 klen;
+    U32 a;      /*keys: value index. attrs: member offset. types: prefix offset*/
+    U32 b;      /*attrs: member count. types: prefix length*/
+} hr_snap_ent;
+
+typedef struct {
+    U32 nbuckets;
+    hr_snap_ent *ents;
+} hr_snap_section;
+
+typedef struct {
+    U32 off;
+    U32 len;
+} hr_snap_val;
+
+struct HR_SnapImage {
+    SV              **svs;  /*Live values (frozen tables), or NULL*/
+    U32             refcnt;
+    U32             nvalues;
+    hr_snap_section keys;
+    hr_snap_section attrs;
+    hr_snap_section types;
+    U32             *members;
+    hr_snap_val     *values;
+    char            *arena;
+};
+
+struct HR_SnapSlot {
+    U32             refcnt;
+    U32             generation;
+    HR_SnapImage    *current;
+#ifdef USE_ITHREADS
+    perl_mutex      lock;
+#endif
+};
+
+/*What the Perl-visible handle object points to. Each interpreter has its
+ own handle, which caches the image it last used*/
+typedef struct {
+    HR_SnapSlot     *slot;
+    HR_SnapImage    *img;
+    U32             generation;
+} hr_snap_handle;
+
+static int snap_handle_freehook(pTHX_ SV *sv, MAGIC *mg);
+static int snap_handle_duphook(pTHX_ MAGIC *mg, CLONE_PARAMS *param);
+
+static MGVTBL snap_handle_vtbl = {
+    .svt_free = &snap_handle_freehook,
+    .svt_dup = &snap_handle_duphook
+};
+
+#define snap_ref(p) __atomic_add_fetch(&((p)->refcnt), 1, __ATOMIC_RELAXED)
+#define snap_unref(p) __atomic_sub_fetch(&((p)->refcnt), 1, __ATOMIC_ACQ_REL)
+
+#define snap_key(img, ent) ((img)->arena + (ent)->koff)
+
+////////////////////////////////////////////////////////////////////////////////
+/// Images and Slots                                                         ///
+////////////////////////////////////////////////////////////////////////////////
+
+static inline void
+snap_image_unref(HR_SnapImage *img)
+{
+    if(img && snap_unref(img) == 0) {
+        HR_DEBUG("Freeing snapshot image %p", img);
+        PerlMemShared_free(img);
+    }
+}
+
+static HR_SnapSlot*
+snap_slot_new(void)
+{
+    HR_SnapSlot *slot = PerlMemShared_malloc(sizeof(HR_SnapSlot));
+    if(!slot) {
+        die("Couldn't allocate snapshot slot");
+    }
+    Zero(slot, 1, HR_SnapSlot);
+    slot->refcnt = 1;
+#ifdef USE_ITHREADS
+    MUTEX_INIT(&slot->lock);
+#endif
+    return slot;
+}
+
+void hr_snap_slot_unref(HR_SnapSlot *slot)
+{
+    if(snap_unref(slot)) {
+        return;
+    }
+    HR_DEBUG("Freeing snapshot slot %p", slot);
+    snap_image_unref(slot->current);
+#ifdef USE_ITHREADS
+    MUTEX_DESTROY(&slot->lock);
+#endif
+    PerlMemShared_free(slot);
+}
+
+/*Replaces the slot's current image. The slot takes over the caller's
+ reference to the new image*/
+static void
+snap_slot_publish(HR_SnapSlot *slot, HR_SnapImage *img)
+{
+    HR_SnapImage *old;
+#ifdef USE_ITHREADS
+    MUTEX_LOCK(&slot->lock);
+#endif
+    old = slot->current;
+    slot->current = img;
+    __atomic_add_fetch(&slot->generation, 1, __ATOMIC_RELEASE);
+#ifdef USE_ITHREADS
+    MUTEX_UNLOCK(&slot->lock);
+#endif
+    snap_image_unref(old);
+}
+
+/*Lookups go through here. The common case is a single atomic load; the lock
+ is only taken once per handle after a new image was published*/
+static inline HR_SnapImage*
+snap_handle_image(hr_snap_handle *h)
+{
+    HR_SnapImage *img;
+    U32 gen = __atomic_load_n(&h->slot->generation, __ATOMIC_ACQUIRE);
+
+    if(h->img && gen == h->generation) {
+        return h->img;
+    }
+
+#ifdef USE_ITHREADS
+    MUTEX_LOCK(&h->slot->lock);
+#endif
+    img = h->slot->current;
+    gen = h->slot->generation;
+    if(img) {
+        snap_ref(img);
+    }
+#ifdef USE_ITHREADS
+    MUTEX_UNLOCK(&h->slot->lock);
+#endif
+
+    snap_image_unref(h->img);
+    h->img = img;
+    h->generation = gen;
+    return img;
+}
+
+static inline hr_snap_ent*
+snap_find(HR_SnapImage *img, hr_snap_section *sec, const char *key, STRLEN klen)
+{
+    U32 hash, mask, i;
+    hr_snap_ent *ent;
+
+    if(!sec->nbuckets) {
+        return NULL;
+    }
+    PERL_HASH(hash, key, klen);
+    mask = sec->nbuckets - 1;
+
+    for(i = hash & mask; ; i = (i + 1) & mask) {
+        ent = sec->ents + i;
+        if(!ent->koff) {
+            return NULL;
+        }
+        if(ent->hash == hash && ent->klen == klen
+           && memcmp(snap_key(img, ent), key, klen) == 0) {
+            return ent;
+        }
+    }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+/// Image Compilation                                                        ///
+////////////////////////////////////////////////////////////////////////////////
+
+/*Entries are first gathered into growable buffers, and then laid out in a
+ single shared block once all sizes are known*/
+typedef struct {
+    char    *buf;
+    STRLEN  len;
+    STRLEN  alloc;
+} snap_buf;
+
+typedef struct {
+    snap_buf    arena;
+    snap_buf    keys;
+    snap_buf    attrs;
+    snap_buf    types;
+    snap_buf    members;
+    snap_buf    values;
+    snap_buf    svs;
+    HV          *vindex; /*Value address => value index*/
+    SV          *encoder;
+    int         live;   /*Keep references rather than encoding*/
+} snap_builder;
+
+static inline void*
+snap_buf_reserve(snap_buf *sb, STRLEN len)
+{
+    char *ret;
+    if(sb->len + len > sb->alloc) {
+        sb->alloc = (sb->alloc + len) * 2;
+        Renew(sb->buf, sb->alloc, char);
+    }
+    ret = sb->buf + sb->len;
+    sb->len += len;
+    return ret;
+}
+
+static inline U32
+snap_arena_add(snap_builder *b, const char *str, STRLEN len)
+{
+    U32 off = b->arena.len;
+    char *dst = snap_buf_reserve(&b->arena, len + 1);
+    Copy(str, dst, len, char);
+    dst[len] = '\0';
+    return off;
+}
+
+static inline void
+snap_add_ent(snap_builder *b, snap_buf *sec, const char *key, STRLEN klen,
+             U32 a, U32 c)
+{
+    hr_snap_ent *ent = snap_buf_reserve(sec, sizeof(hr_snap_ent));
+    PERL_HASH(ent->hash, key, klen);
+    ent->koff = snap_arena_add(b, key, klen);
+    ent->klen = klen;
+    ent->a = a;
+    ent->b = c;
+}
+
+static U32
+snap_value_index(pTHX_ snap_builder *b, SV *value)
+{
+    mk_ptr_string(vstr, SvRV(value));
+    SV **stored = hv_fetch(b->vindex, vstr, strlen(vstr), 1);
+    hr_snap_val *sval;
+    SV *payload;
+    STRLEN plen;
+    char *pstr;
+    U32 ret;
+
+    if(SvOK(*stored)) {
+        return (U32)SvUV(*stored);
+    }
+
+    if(b->live) {
+        ret = b->svs.len / sizeof(SV*);
+        *(SV**)snap_buf_reserve(&b->svs, sizeof(SV*)) =
+            SvREFCNT_inc_simple_NN(SvRV(value));
+        sv_setuv(*stored, ret);
+        return ret;
+    }
+
+    payload = hr_value_encode(aTHX_ b->encoder, value);
+    pstr = SvPV(payload, plen);
+    ret = b->values.len / sizeof(hr_snap_val);
+    sval = snap_buf_reserve(&b->values, sizeof(hr_snap_val));
+    sval->off = snap_arena_add(b, pstr, plen);
+    sval->len = plen;
+    SvREFCNT_dec(payload);
+
+    sv_setuv(*stored, ret);
+    return ret;
+}
+
+static void
+snap_gather_keys(pTHX_ snap_builder *b, HV *forward, HV *slookup,
+                 HV *encap_stash)
+{
+    HE *cur;
+    char *kstr;
+    I32 klen;
+    SV **kobj;
+
+    hv_iterinit(forward);
+    while( (cur = hv_iternext(forward)) ) {
+        SV *value = hv_iterval(forward, cur);
+        if(!SvROK(value)) {
+            continue;
+        }
+        kstr = hv_iterkey(cur, &klen);
+        kobj = hv_fetch(slookup, kstr, klen, 0);
+        if(!kobj || !SvROK(*kobj) || SvSTASH(SvRV(*kobj)) == encap_stash) {
+            HR_DEBUG("Skipping object key %s", kstr);
+            continue;
+        }
+        snap_add_ent(b, &b->keys, kstr, klen, snap_value_index(aTHX_ b, value),
+                     0);
+    }
+}
+
+static void
+snap_gather_attrs(pTHX_ snap_builder *b, HV *attr_lookup)
+{
+    HE *cur, *vcur;
+    HV *attrhash;
+    char *astr;
+    I32 alen;
+    int is_encap;
+
+    hv_iterinit(attr_lookup);
+    while( (cur = hv_iternext(attr_lookup)) ) {
+        SV *aobj = hv_iterval(attr_lookup, cur);
+        U32 moff, count = 0;
+        if(!SvROK(aobj)) {
+            continue;
+        }
+        attrhash = hrattr_attrhash(SvRV(aobj), &is_encap);
+        if(is_encap || !attrhash) {
+            continue;
+        }
+        moff = b->members.len / sizeof(U32);
+        hv_iterinit(attrhash);
+        while( (vcur = hv_iternext(attrhash)) ) {
+            SV *value = hv_iterval(attrhash, vcur);
+            /*Index the value first; the member slot is only valid until
+             the next reservation*/
+            U32 vidx;
+            if(!SvROK(value)) {
+                continue;
+            }
+            vidx = snap_value_index(aTHX_ b, value);
+            *(U32*)snap_buf_reserve(&b->members, sizeof(U32)) = vidx;
+            count++;
+        }
+        if(!count) {
+            continue;
+        }
+        astr = hv_iterkey(cur, &alen);
+        snap_add_ent(b, &b->attrs, astr, alen, moff, count);
+    }
+}
+
+static void
+snap_gather_types(pTHX_ snap_builder *b, HV *kt_lookup)
+{
+    HE *cur;
+    char *tstr, *pstr;
+    I32 tlen;
+    STRLEN plen;
+
+    hv_iterinit(kt_lookup);
+    while( (cur = hv_iternext(kt_lookup)) ) {
+        tstr = hv_iterkey(cur, &tlen);
+        pstr = SvPV(hv_iterval(kt_lookup, cur), plen);
+        snap_add_ent(b, &b->types, tstr, tlen, snap_arena_add(b, pstr, plen), plen);
+    }
+}
+
+static inline U32
+snap_nbuckets(U32 nents)
+{
+    U32 ret = 1;
+    /*Keep the load factor at or below one half so probing stays short*/
+    while(ret < nents * 2) {
+        ret <<= 1;
+    }
+    return nents ? ret : 0;
+}
+
+static void
+snap_layout_section(hr_snap_section *sec, snap_buf *src)
+{
+    U32 nents = src->len / sizeof(hr_snap_ent);
+    U32 mask, i, j;
+    hr_snap_ent *ents = (hr_snap_ent*)src->buf;
+
+    Zero(sec->ents, sec->nbuckets, hr_snap_ent);
+    mask = sec->nbuckets - 1;
+    for(i = 0; i < nents; i++) {
+        for(j = ents[i].hash & mask; sec->ents[j].koff; j = (j + 1) & mask);
+        sec->ents[j] = ents[i];
+    }
+}
+
+static HR_SnapImage*
+snap_image_build(snap_builder *b)
+{
+    HR_SnapImage *img;
+    hr_snap_section keys, attrs, types;
+    STRLEN total;
+    char *p;
+
+    keys.nbuckets = snap_nbuckets(b->keys.len / sizeof(hr_snap_ent));
+    attrs.nbuckets = snap_nbuckets(b->attrs.len / sizeof(hr_snap_ent));
+    types.nbuckets = snap_nbuckets(b->types.len / sizeof(hr_snap_ent));
+
+    total = sizeof(HR_SnapImage)
+        + (keys.nbuckets + attrs.nbuckets + types.nbuckets) * sizeof(hr_snap_ent)
+        + b->svs.len + b->values.len + b->members.len + b->arena.len;
+
+    if(b->arena.len > (U32)-1) {
+        die("Snapshot too large");
+    }
+
+    img = PerlMemShared_malloc(total);
+    if(!img) {
+        die("Couldn't allocate %lu bytes for snapshot", (unsigned long)total);
+    }
+
+    p = (char*)(img + 1);
+
+    /*Pointers go first, while p is still aligned*/
+    img->svs = b->svs.len ? (SV**)p : NULL;
+    Copy(b->svs.buf, p, b->svs.len, char);
+    p += b->svs.len;
+
+    img->keys.nbuckets = keys.nbuckets;
+    img->keys.ents = (hr_snap_ent*)p;
+    p += keys.nbuckets * sizeof(hr_snap_ent);
+
+    img->attrs.nbuckets = attrs.nbuckets;
+    img->attrs.ents = (hr_snap_ent*)p;
+    p += attrs.nbuckets * sizeof(hr_snap_ent);
+
+    img->types.nbuckets = types.nbuckets;
+    img->types.ents = (hr_snap_ent*)p;
+    p += types.nbuckets * sizeof(hr_snap_ent);
+
+    img->values = (hr_snap_val*)p;
+    img->nvalues = b->live ? b->svs.len / sizeof(SV*)
+                           : b->values.len / sizeof(hr_snap_val);
+    Copy(b->values.buf, p, b->values.len, char);
+    p += b->values.len;
+
+    img->members = (U32*)p;
+    Copy(b->members.buf, p, b->members.len, char);
+    p += b->members.len;
+
+    img->arena = p;
+    Copy(b->arena.buf, p, b->arena.len, char);
+
+    snap_layout_section(&img->keys, &b->keys);
+    snap_layout_section(&img->attrs, &b->attrs);
+    snap_layout_section(&img->types, &b->types);
+
+    img->refcnt = 1;
+    return img;
+}
+
+static void
+snap_builder_free(pTHX_ snap_builder *b)
+{
+    Safefree(b->arena.buf);
+    Safefree(b->keys.buf);
+    Safefree(b->attrs.buf);
+    Safefree(b->types.buf);
+    Safefree(b->members.buf);
+    Safefree(b->values.buf);
+    Safefree(b->svs.buf);
+    SvREFCNT_dec(b->vindex);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+/// Handles                                                                  ///
+////////////////////////////////////////////////////////////////////////////////
+
+static int
+snap_handle_freehook(pTHX_ SV *sv, MAGIC *mg)
+{
+    hr_snap_handle *h = (hr_snap_handle*)mg->mg_ptr;
+    if(!h) {
+        return 0;
+    }
+    snap_image_unref(h->img);
+    hr_snap_slot_unref(h->slot);
+    Safefree(h);
+    mg->mg_ptr = NULL;
+    return 0;
+}
+
+/*The new interpreter gets its own handle, sharing the slot and image*/
+static int
+snap_handle_duphook(pTHX_ MAGIC *mg, CLONE_PARAMS *param)
+{
+    hr_snap_handle *old = (hr_snap_handle*)mg->mg_ptr, *h;
+    Newx(h, 1, hr_snap_handle);
+    Copy(old, h, 1, hr_snap_handle);
+    snap_ref(h->slot);
+    if(h->img) {
+        snap_ref(h->img);
+    }
+    mg->mg_ptr = (char*)h;
+    return 0;
+}
+
+static SV*
+snap_handle_new(pTHX_ HR_SnapSlot *slot)
+{
+    SV *self = mk_blessed_blob(aTHX_ HR_PKG_SNAPSHOT, 0);
+    hr_snap_handle *h;
+    MAGIC *mg;
+
+    Newxz(h, 1, hr_snap_handle);
+    h->slot = slot;
+    snap_ref(slot);
+
+    mg = sv_magicext(SvRV(self), NULL, PERL_MAGIC_ext, &snap_handle_vtbl,
+                     (const char*)h, 0);
+    mg->mg_flags |= MGf_DUP;
+    return self;
+}
+
+static inline HR_SnapImage*
+snap_image_from_sv(SV *self)
+{
+    MAGIC *mg;
+    if(!SvROK(self) || !(mg = hr_mg_find_vtbl(SvRV(self), &snap_handle_vtbl))) {
+        die("Not a snapshot handle");
+    }
+    return snap_handle_image((hr_snap_handle*)mg->mg_ptr);
+}
+
+/*Composes "prefix#key" for typed lookups. Returns NULL if the type is unknown.
+ The returned buffer is mortal*/
+static char*
+snap_typed_key(pTHX_ HR_SnapImage *img, SV *key, char *t, STRLEN *len)
+{
+    hr_snap_ent *tent = snap_find(img, &img->types, t, strlen(t));
+    STRLEN ulen;
+    char *ustr, *ret;
+    SV *buf;
+
+    if(!tent) {
+        return NULL;
+    }
+    if(SvROK(key)) {
+        die("Object lookups are not available in shared snapshots");
+    }
+    ustr = SvPV(key, ulen);
+    *len = tent->b + sizeof(HR_PREFIX_DELIM) - 1 + ulen;
+    buf = sv_2mortal(newSV(*len));
+    ret = SvPVX(buf);
+    Copy(img->arena + tent->a, ret, tent->b, char);
+    Copy(HR_PREFIX_DELIM, ret + tent->b, sizeof(HR_PREFIX_DELIM) - 1, char);
+    Copy(ustr, ret + tent->b + sizeof(HR_PREFIX_DELIM) - 1, ulen, char);
+    return ret;
+}
+
+static inline SV*
+snap_value_sv(pTHX_ HR_SnapImage *img, U32 vidx)
+{
+    hr_snap_val *sval = img->values + vidx;
+    return newSVpvn(img->arena + sval->off, sval->len);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+/// Perl API                                                                 ///
+////////////////////////////////////////////////////////////////////////////////
+
+static HR_SnapImage*
+snap_image_from_table(pTHX_ SV *self, SV *encoder, int live)
+{
+    snap_builder b;
+    SV *forward, *slookup, *attr_lookup, *kt_lookup, *my_stashcache_ref;
+    HR_SnapImage *img;
+
+    get_hashes(aTHX_ REF2TABLE(self),
+               HR_HKEY_LOOKUP_FORWARD, &forward,
+               HR_HKEY_LOOKUP_SCALAR, &slookup,
+               HR_HKEY_LOOKUP_ATTR, &attr_lookup,
+               HR_HKEY_LOOKUP_KT, &kt_lookup,
+               HR_HKEY_LOOKUP_PRIVDATA, &my_stashcache_ref,
+               HR_HKEY_LOOKUP_NULL);
+
+    Zero(&b, 1, snap_builder);
+    b.vindex = newHV();
+    b.encoder = encoder;
+    b.live = live;
+    /*Offset 0 is reserved to mark empty buckets*/
+    snap_arena_add(&b, "", 0);
+
+    snap_gather_keys(aTHX_ &b, REF2HASH(forward), REF2HASH(slookup),
+                     stash_from_cache_nocheck(my_stashcache_ref, HR_STASH_KEY_ENCAP));
+    snap_gather_attrs(aTHX_ &b, REF2HASH(attr_lookup));
+    if(kt_lookup && SvROK(kt_lookup)) {
+        snap_gather_types(aTHX_ &b, REF2HASH(kt_lookup));
+    }
+
+    img = snap_image_build(&b);
+    snap_builder_free(aTHX_ &b);
+
+    HR_DEBUG("Built image %p with %d values", img, img->nvalues);
+    return img;
+}
+
+SV* HRA_freeze_shared(SV *self, SV *encoder)
+{
+    dTHX;
+    HR_TableInfo *tinfo = hr_tinfo_get(aTHX_ REF2TABLE(self));
+    HR_SnapImage *img = snap_image_from_table(aTHX_ self, encoder, 0);
+
+    if(!tinfo->snap_slot) {
+        tinfo->snap_slot = snap_slot_new();
+    }
+    snap_slot_publish(tinfo->snap_slot, img);
+    return snap_handle_new(aTHX_ tinfo->snap_slot);
+}
+
+SV* HRXSNAP_fetch(SV *self, SV *key)
+{
+    dTHX;
+    HR_SnapImage *img = snap_image_from_sv(self);
+    hr_snap_ent *ent;
+    STRLEN klen;
+    char *kstr;
+
+    if(SvROK(key)) {
+        die("Object lookups are not available in shared snapshots");
+    }
+    kstr = SvPV(key, klen);
+    if(!img || !(ent = snap_find(img, &img->keys, kstr, klen))) {
+        return &PL_sv_undef;
+    }
+    return snap_value_sv(aTHX_ img, ent->a);
+}
+
+SV* HRXSNAP_fetch_kt(SV *self, SV *key, char *t)
+{
+    dTHX;
+    HR_SnapImage *img = snap_image_from_sv(self);
+    hr_snap_ent *ent;
+    STRLEN klen;
+    char *kstr;
+
+    if(!img || !(kstr = snap_typed_key(aTHX_ img, key, t, &klen))) {
+        return &PL_sv_undef;
+    }
+    if(!(ent = snap_find(img, &img->keys, kstr, klen))) {
+        return &PL_sv_undef;
+    }
+    return snap_value_sv(aTHX_ img, ent->a);
+}
+
+void HRXSNAP_fetch_a(SV *self, SV *attr, char *t)
+{
+    dTHX;
+    dXSARGS;
+    SP -= 3;
+
+    HR_SnapImage *img;
+    hr_snap_ent *ent = NULL;
+    STRLEN alen;
+    char *astr;
+    U32 i;
+
+    if(GIMME_V == G_VOID) {
+        XSRETURN(0);
+    }
+
+    img = snap_image_from_sv(self);
+    if(img && (astr = snap_typed_key(aTHX_ img, attr, t, &alen))) {
+        ent = snap_find(img, &img->attrs, astr, alen);
+    }
+    if(!ent) {
+        XSRETURN_EMPTY;
+    }
+    if(GIMME_V == G_SCALAR) {
+        XSRETURN_IV(ent->b);
+    }
+    EXTEND(sp, ent->b);
+    for(i = 0; i < ent->b; i++) {
+        PUSHs(sv_2mortal(snap_value_sv(aTHX_ img, img->members[ent->a + i])));
+    }
+    PUTBACK;
+}
+
+UV HRXSNAP_generation(SV *self)
+{
+    MAGIC *mg;
+    if(!SvROK(self) || !(mg = hr_mg_find_vtbl(SvRV(self), &snap_handle_vtbl))) {
+        die("Not a snapshot handle");
+    }
+    return __atomic_load_n(&((hr_snap_handle*)mg->mg_ptr)->slot->generation,
+                           __ATOMIC_ACQUIRE);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+/// Frozen Tables                                                            ///
+////////////////////////////////////////////////////////////////////////////////
+
+static void
+frozen_release(pTHX_ HR_SnapImage *img)
+{
+    U32 i;
+    for(i = 0; i < img->nvalues; i++) {
+        SvREFCNT_dec(img->svs[i]);
+    }
+    snap_image_unref(img);
+}
+
+/*Called before anything changes the table, and before it looks up the key
+ or attribute objects involved. Releasing the values may destroy some of
+ them (and their keys), which modifies the table; it is unfrozen by then*/
+void hr_frozen_thaw(pTHX_ SV *self)
+{
+    HR_TableInfo *tinfo = hr_tinfo_get(aTHX_ REF2TABLE(self));
+    HR_SnapImage *img = tinfo->frozen;
+    if(!img) {
+        return;
+    }
+    HR_DEBUG("Thawing table %p", SvRV(self));
+    tinfo->frozen = NULL;
+    frozen_release(aTHX_ img);
+}
+
+/*Called when the table info is freed. The table's DESTROY normally thaws
+ it first; otherwise this is global destruction, and the values are left
+ alone*/
+void hr_frozen_destroy(pTHX_ HR_SnapImage *img)
+{
+    if(PL_dirty) {
+        snap_image_unref(img);
+    } else {
+        frozen_release(aTHX_ img);
+    }
+}
+
+/*Lookups of frozen tables. These return false if the table isn't frozen, or
+ if the lookup (of an object key, or attribute) must go to the hashes.
+ hr_frozen_lookup() gives the value itself, or NULL if the key is missing*/
+int hr_frozen_lookup(pTHX_ HR_TableInfo *tinfo, SV *key, SV **value)
+{
+    HR_SnapImage *img = tinfo->frozen;
+    hr_snap_ent *ent;
+    STRLEN klen;
+    char *kstr;
+
+    if(!img || SvROK(key)) {
+        return 0;
+    }
+    kstr = SvPV(key, klen);
+    ent = snap_find(img, &img->keys, kstr, klen);
+    *value = ent ? img->svs[ent->a] : NULL;
+    return 1;
+}
+
+/*A missing key is returned as &PL_sv_undef, as fetch does*/
+int hr_frozen_fetch(pTHX_ HR_TableInfo *tinfo, SV *key, SV **ret)
+{
+    SV *value;
+    if(!hr_frozen_lookup(aTHX_ tinfo, key, &value)) {
+        return 0;
+    }
+    *ret = value ? newRV_inc(value) : &PL_sv_undef;
+    return 1;
+}
+
+int hr_frozen_fetch_a(pTHX_ HR_TableInfo *tinfo, SV *attr, char *t,
+                      SV ***values,
+                      U32 *count)
+{
+    HR_SnapImage *img = tinfo->frozen;
+    hr_snap_ent *ent;
+    STRLEN alen;
+    char *astr;
+    U32 i;
+
+    if(!img || SvROK(attr) || !(astr = snap_typed_key(aTHX_ img, attr, t,
+                                                      &alen))) {
+        return 0;
+    }
+    *count = 0;
+    if( (ent = snap_find(img, &img->attrs, astr, alen)) ) {
+        /*Member indexes are resolved into a mortal buffer*/
+        SV *buf = sv_2mortal(newSV(ent->b * sizeof(SV*) + 1));
+        *values = (SV**)SvPVX(buf);
+        for(i = 0; i < ent->b; i++) {
+            (*values)[i] = img->svs[img->members[ent->a + i]];
+        }
+        *count = ent->b;
+    }
+    return 1;
+}
+
+void HRA_freeze(SV *self)
+{
+    dTHX;
+    HR_TableInfo *tinfo = hr_tinfo_get(aTHX_ REF2TABLE(self));
+    /*Built before the old image is released, so that values held only by
+     it carry over*/
+    HR_SnapImage *img = snap_image_from_table(aTHX_ self, NULL, 1);
+    HR_OP_BEGIN(cxt);
+    hr_frozen_thaw(aTHX_ self);
+    tinfo->frozen = img;
+    HR_OP_END(cxt);
+}
+
+void HRA_thaw(SV *self)
+{
+    dTHX;
+    HR_OP_BEGIN(cxt);
+    hr_frozen_thaw(aTHX_ self);
+    HR_OP_END(cxt);
+}
+
+int HRA_is_frozen(SV *self)
+{
+    dTHX;
+    return hr_tinfo_get(aTHX_ REF2TABLE(self))->frozen != NULL;
+}
@@ -0,0 +1,470 @@
+////////////////////////////////////////////////////////////////////////////////
+/// Per-table private information                                            ///
+////////////////////////////////////////////////////////////////////////////////
+
+#include "hreg.h"
+#include "hrpriv.h"
+#include "hrdefs.h"
+
+static int tinfo_freehook(pTHX_ SV *sv, MAGIC *mg);
+static int tinfo_duphook(pTHX_ MAGIC *mg, CLONE_PARAMS *param);
+
+static MGVTBL tinfo_vtbl = {
+    .svt_free = &tinfo_freehook,
+    .svt_dup = &tinfo_duphook
+};
+
+#define tinfo_from_mg(mg) ((HR_TableInfo*)(mg)->mg_ptr)
+
+static int
+tinfo_freehook(pTHX_ SV *sv, MAGIC *mg)
+{
+    HR_TableInfo *tinfo = tinfo_from_mg(mg);
+    HR_DEBUG("Freeing table info %p", tinfo);
+    if(!tinfo) {
+        return 0;
+    }
+    if(tinfo->snap_slot) {
+        hr_snap_slot_unref(tinfo->snap_slot);
+    }
+    if(tinfo->ttl) {
+        hr_ttl_destroy(aTHX_ tinfo->ttl);
+    }
+    if(tinfo->clock) {
+        hr_clock_destroy(aTHX_ tinfo->clock);
+    }
+    if(tinfo->intkeys) {
+        hr_ik_destroy(aTHX_ tinfo->intkeys);
+    }
+    if(tinfo->evsub) {
+        hr_evict_sub_destroy(aTHX_ tinfo->evsub);
+    }
+    if(tinfo->oindexes) {
+        hr_oidx_destroy(aTHX_ tinfo->oindexes);
+    }
+    if(tinfo->vids) {
+        hr_vid_destroy(aTHX_ tinfo->vids);
+    }
+    if(tinfo->frozen) {
+        hr_frozen_destroy(aTHX_ tinfo->frozen);
+    }
+    if(tinfo->latency) {
+        hr_latency_destroy(aTHX_ tinfo->latency);
+    }
+    SvREFCNT_dec(tinfo->dup_evict_cb);
+    Safefree(tinfo);
+    mg->mg_ptr = NULL;
+    return 0;
+}
+
+/*A cloned table starts out with its own table info. Anything published
+ by the parent stays with the parent*/
+static int
+tinfo_duphook(pTHX_ MAGIC *mg, CLONE_PARAMS *param)
+{
+    HR_TableInfo *old = tinfo_from_mg(mg);
+    HR_TableInfo *tinfo;
+    SV *cb;
+    HR_DEBUG("Initializing table info for new thread");
+    Newxz(tinfo, 1, HR_TableInfo);
+#ifdef USE_ITHREADS
+    /*Actions start out empty in the new thread, so watchers and the
+     eviction ring can't be carried over. Their settings are, and
+     HRA_ithread_restore() rebuilds them once the keys are in place*/
+    if(old->evsub && (cb = hr_evict_sub_cb(old->evsub, &tinfo->dup_evict_batch))) {
+        tinfo->dup_evict_cb = sv_dup_inc(cb, param);
+    }
+    tinfo->dup_max_values = hr_clock_max_values(old->clock);
+#endif
+    mg->mg_ptr = (char*)tinfo;
+    return 0;
+}
+
+/*Called from ithread_postdup(), once the lookups of the new thread's copy
+ of the table have been rebuilt*/
+void HRA_ithread_restore(SV *self)
+{
+    dTHX;
+    HR_TableInfo *tinfo = hr_tinfo_get(aTHX_ REF2TABLE(self));
+    SV *cb = tinfo->dup_evict_cb;
+
+    if(tinfo->dup_max_values) {
+        HRA_set_max_values(self, tinfo->dup_max_values);
+        tinfo->dup_max_values = 0;
+    }
+    if(cb) {
+        tinfo->dup_evict_cb = NULL;
+        HRA_on_evict(self, cb, tinfo->dup_evict_batch);
+        SvREFCNT_dec(cb);
+    }
+}
+
+void hr_tinfo_init(pTHX_ AV *privdata)
+{
+    SV *holder = newSV(0);
+    HR_TableInfo *tinfo;
+    MAGIC *mg;
+
+    Newxz(tinfo, 1, HR_TableInfo);
+    mg = sv_magicext(holder, NULL, PERL_MAGIC_ext, &tinfo_vtbl,
+                     (const char*)tinfo, 0);
+    mg->mg_flags |= MGf_DUP;
+    av_store(privdata, HR_PRIVDATA_TINFO, holder);
+}
+
+HR_TableInfo* hr_tinfo_get(pTHX_ HR_Table_t table)
+{
+    SV *privdata;
+    SV **holder;
+    MAGIC *mg;
+
+    get_hashes(aTHX_ table, HR_HKEY_LOOKUP_PRIVDATA, &privdata,
+               HR_HKEY_LOOKUP_NULL);
+    if(!privdata) {
+        die("Table has no private data. Was table_init() called?");
+    }
+    holder = av_fetch(REF2ARRAY(privdata), HR_PRIVDATA_TINFO, 0);
+    if(!holder || !(mg = hr_mg_find_vtbl(*holder, &tinfo_vtbl))) {
+        die("Couldn't find table info!");
+    }
+    return tinfo_from_mg(mg);
+}
+
+/*Pre-sizes the lookups for an expected number of entries, so that bulk
+ loads don't rehash as they grow. Each key carries actions for its forward
+ and scalar entries, each value one for its reverse entry, and each
+ attribute two for its lookup and value hash entries*/
+void HRA_table_reserve(SV *self, UV nkeys, UV nvalues, UV nattrs)
+{
+    dTHX;
+    SV *forward, *reverse, *scalar_lookup, *attr_lookup;
+    get_hashes(aTHX_ REF2TABLE(self),
+               HR_HKEY_LOOKUP_FORWARD, &forward,
+               HR_HKEY_LOOKUP_REVERSE, &reverse,
+               HR_HKEY_LOOKUP_SCALAR, &scalar_lookup,
+               HR_HKEY_LOOKUP_ATTR, &attr_lookup,
+               HR_HKEY_LOOKUP_NULL);
+    
+    if(nkeys) {
+        hv_ksplit(REF2HASH(forward), nkeys);
+        hv_ksplit(REF2HASH(scalar_lookup), nkeys);
+    }
+    if(nvalues) {
+        hv_ksplit(REF2HASH(reverse), nvalues);
+    }
+    if(nattrs) {
+        hv_ksplit(REF2HASH(attr_lookup), nattrs);
+    }
+    HR_action_pool_reserve(2 * nkeys + nvalues + 2 * nattrs);
+}
+
+#define stat_store(hv, name, val) \
+    hv_store(hv, name, sizeof(name)-1, newSVuv(val), 0)
+
+#define lookup_count(sv) \
+    ((sv && SvROK(sv)) ? HvUSEDKEYS(REF2HASH(sv)) : 0)
+
+SV* HRA_stats(SV *self)
+{
+    dTHX;
+    HR_TableInfo *tinfo = hr_tinfo_get(aTHX_ REF2TABLE(self));
+    HR_TableStats *ts = &tinfo->stats;
+    SV *forward, *reverse, *scalar_lookup, *attr_lookup, *kt_lookup;
+    HV *ret = newHV();
+
+    get_hashes(aTHX_ REF2TABLE(self),
+               HR_HKEY_LOOKUP_FORWARD, &forward,
+               HR_HKEY_LOOKUP_REVERSE, &reverse,
+               HR_HKEY_LOOKUP_SCALAR, &scalar_lookup,
+               HR_HKEY_LOOKUP_ATTR, &attr_lookup,
+               HR_HKEY_LOOKUP_KT, &kt_lookup,
+               HR_HKEY_LOOKUP_NULL);
+
+    stat_store(ret, "stores", ts->stores);
+    stat_store(ret, "fetch_hits", ts->fetch_hits);
+    stat_store(ret, "fetch_misses", ts->fetch_misses);
+    stat_store(ret, "unlinks", ts->unlinks);
+    stat_store(ret, "purges", ts->purges);
+    stat_store(ret, "attr_stores", ts->attr_stores);
+    stat_store(ret, "attr_fetches", ts->attr_fetches);
+    stat_store(ret, "attr_unlinks", ts->attr_unlinks);
+    stat_store(ret, "evictions", ts->evictions);
+
+    stat_store(ret, "forward_entries", lookup_count(forward));
+    stat_store(ret, "reverse_entries", lookup_count(reverse));
+    stat_store(ret, "scalar_entries", lookup_count(scalar_lookup));
+    stat_store(ret, "attr_entries", lookup_count(attr_lookup));
+    stat_store(ret, "keytype_entries", lookup_count(kt_lookup));
+
+    /*Per-interpreter*/
+    stat_store(ret, "freehook_calls", HR_Stats.freehook_calls);
+    stat_store(ret, "actions_created", HR_Stats.actions_created);
+    stat_store(ret, "actions_freed", HR_Stats.actions_freed);
+    stat_store(ret, "max_action_list", HR_Stats.max_action_list);
+    stat_store(ret, "max_trigger_depth", HR_Stats.max_trigger_depth);
+
+    return newRV_noinc((SV*)ret);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+/// Memory accounting                                                        ///
+////////////////////////////////////////////////////////////////////////////////
+
+/*These are estimates: they follow perl's own layout (heads, bodies, string
+ buffers and magic), but ignore allocator overhead and arena slack. Hashes are
+ walked bucket by bucket, so that any active iterators are left alone*/
+
+static size_t
+sv_memsize(SV *sv)
+{
+    size_t ret = sizeof(SV);
+    MAGIC *mg;
+    
+    switch(SvTYPE(sv)) {
+    case SVt_NULL:
+    case SVt_IV:
+        break;
+    case SVt_NV:
+        ret += sizeof(NV);
+        break;
+    case SVt_PV:
+        ret += sizeof(XPV);
+        break;
+    case SVt_PVIV:
+        ret += sizeof(XPVIV);
+        break;
+    case SVt_PVNV:
+        ret += sizeof(XPVNV);
+        break;
+    case SVt_PVAV:
+        ret += sizeof(XPVAV);
+        break;
+    case SVt_PVHV:
+        ret += sizeof(XPVHV);
+        break;
+    default:
+        ret += sizeof(XPVMG);
+        break;
+    }
+    
+    if(SvTYPE(sv) >= SVt_PV && SvTYPE(sv) <= SVt_PVMG && !SvROK(sv)) {
+        ret += SvLEN(sv);
+    }
+    
+    if(SvTYPE(sv) >= SVt_PVMG) {
+        for(mg = SvMAGIC(sv); mg; mg = mg->mg_moremagic) {
+            ret += sizeof(MAGIC);
+        }
+    }
+    return ret;
+}
+
+#define he_memsize(he) \
+    (sizeof(HE) + sizeof(HEK) + HeKLEN(he) + 2 + sv_memsize(HeVAL(he)))
+
+#define hv_foreach_he(hv, i, he) \
+    for(i = 0; HvARRAY(hv) && i <= HvMAX(hv); i++) \
+        for(he = HvARRAY(hv)[i]; he; he = HeNEXT(he))
+
+/*The hash itself and its bucket array, without any entries*/
+static size_t
+hv_memsize_shallow(HV *hv)
+{
+    size_t ret = sv_memsize((SV*)hv);
+    if(HvARRAY(hv)) {
+        ret += (HvMAX(hv) + 1) * sizeof(HE*);
+    }
+    return ret;
+}
+
+/*The hash, and all of its entries (but not what they refer to)*/
+static size_t
+hv_memsize(HV *hv)
+{
+    size_t ret = hv_memsize_shallow(hv);
+    STRLEN i;
+    HE *he;
+    hv_foreach_he(hv, i, he) {
+        ret += he_memsize(he);
+    }
+    return ret;
+}
+
+#define action_memsize(sv) \
+    (HR_action_count(sv) * sizeof(HR_Action))
+
+typedef struct {
+    UV      nkeys;
+    UV      nattrs;
+    size_t  key_bytes;
+    size_t  attr_bytes;
+} HR_TypeUsage;
+
+/*Maps a key string to its key type's slot in the usage array. Slot 0 is for
+ untyped and object keys*/
+static HR_TypeUsage*
+type_usage(pTHX_ HV *prefix_map, HR_TypeUsage *usage, char *kstr,
+           int prefix_len)
+{
+    SV **slot;
+    if(!prefix_len) {
+        return usage;
+    }
+    slot = hv_fetch(prefix_map, kstr, prefix_len, 0);
+    if(!slot) {
+        return usage;
+    }
+    return usage + SvUV(*slot);
+}
+
+#define usage_store(hv, name, val) \
+    hv_store(hv, name, sizeof(name)-1, newSVuv(val), 0)
+
+static SV*
+type_usage_ref(pTHX_ HR_TypeUsage *tu)
+{
+    HV *ret = newHV();
+    usage_store(ret, "keys", tu->nkeys);
+    usage_store(ret, "attributes", tu->nattrs);
+    usage_store(ret, "key_bytes", tu->key_bytes);
+    usage_store(ret, "attr_bytes", tu->attr_bytes);
+    return newRV_noinc((SV*)ret);
+}
+
+SV* HRA_memory_usage(SV *self)
+{
+    dTHX;
+    HR_Table_t table = REF2TABLE(self);
+    SV *forward, *reverse, *scalar_lookup, *attr_lookup, *kt_lookup, *privdata;
+    HV *key_encap_stash;
+    HV *prefix_map, *ret, *by_type;
+    HR_TypeUsage *usage, *tu;
+    size_t lookup_bytes, key_bytes = 0, attr_bytes = 0, reverse_bytes = 0;
+    size_t action_bytes = 0;
+    UV ntypes = 1, live_actions;
+    STRLEN i;
+    HE *he;
+    SV **fwd_ent;
+    
+    get_hashes(aTHX_ table,
+               HR_HKEY_LOOKUP_FORWARD, &forward,
+               HR_HKEY_LOOKUP_REVERSE, &reverse,
+               HR_HKEY_LOOKUP_SCALAR, &scalar_lookup,
+               HR_HKEY_LOOKUP_ATTR, &attr_lookup,
+               HR_HKEY_LOOKUP_KT, &kt_lookup,
+               HR_HKEY_LOOKUP_PRIVDATA, &privdata,
+               HR_HKEY_LOOKUP_NULL);
+    
+    key_encap_stash = stash_from_cache_nocheck_S(aTHX_ privdata,
+                                                 HR_STASH_KEY_ENCAP);
+    
+    /*Lookup structures. Forward and scalar entries are accounted to the
+     keys they belong to, attribute entries to their attributes, and reverse
+     entries to the value hashes*/
+    lookup_bytes = sv_memsize((SV*)table)
+        + hv_memsize_shallow(REF2HASH(forward))
+        + hv_memsize_shallow(REF2HASH(reverse))
+        + hv_memsize_shallow(REF2HASH(scalar_lookup))
+        + hv_memsize_shallow(REF2HASH(attr_lookup))
+        + hv_memsize(REF2HASH(kt_lookup));
+    
+    /*Map each key type's prefix to a slot*/
+    prefix_map = (HV*)sv_2mortal((SV*)newHV());
+    hv_foreach_he(REF2HASH(kt_lookup), i, he) {
+        STRLEN plen;
+        char *prefix = SvPV(HeVAL(he), plen);
+        hv_store(prefix_map, prefix, plen, newSVuv(ntypes), 0);
+        ntypes++;
+    }
+    Newxz(usage, ntypes, HR_TypeUsage);
+    
+    hv_foreach_he(REF2HASH(scalar_lookup), i, he) {
+        SV *ksv, *encap;
+        size_t sz;
+        if(!SvROK(HeVAL(he))) {
+            continue;
+        }
+        ksv = SvRV(HeVAL(he));
+        sz = he_memsize(he) + sv_memsize(ksv);
+        if( (fwd_ent = hv_fetch(REF2HASH(forward), HeKEY(he), HeKLEN(he), 0)) ) {
+            sz += sizeof(HE) + sizeof(HEK) + HeKLEN(he) + 2
+                + sv_memsize(*fwd_ent);
+        }
+        key_bytes += sz;
+        action_bytes += action_memsize(ksv);
+        
+        if(SvSTASH(ksv) == key_encap_stash) {
+            if( (encap = hrk_encap_object(ksv)) ) {
+                action_bytes += action_memsize(encap);
+            }
+            tu = usage;
+        } else {
+            tu = type_usage(aTHX_ prefix_map, usage, HeKEY(he),
+                            HRXSK_prefix_len(HeVAL(he)));
+        }
+        tu->nkeys++;
+        tu->key_bytes += sz;
+    }
+    
+    hv_foreach_he(REF2HASH(attr_lookup), i, he) {
+        SV *asv, *encap;
+        size_t sz;
+        if(!SvROK(HeVAL(he))) {
+            continue;
+        }
+        asv = SvRV(HeVAL(he));
+        sz = he_memsize(he) + sv_memsize(asv)
+            + hv_memsize(hrattr_attrhash(asv, NULL));
+        attr_bytes += sz;
+        action_bytes += action_memsize(asv);
+        if( (encap = hrattr_encap_object(asv)) ) {
+            action_bytes += action_memsize(encap);
+        }
+        tu = type_usage(aTHX_ prefix_map, usage, HeKEY(he),
+                        HRXSATTR_prefix_len(HeVAL(he)));
+        tu->nattrs++;
+        tu->attr_bytes += sz;
+    }
+    
+    /*Reverse entries are keyed by the value's address, and are removed
+     when the value is destroyed*/
+    hv_foreach_he(REF2HASH(reverse), i, he) {
+        SV *value = (SV*)(UV)Strtoul(HeKEY(he), NULL, 10);
+        reverse_bytes += he_memsize(he);
+        if(SvROK(HeVAL(he))) {
+            reverse_bytes += hv_memsize(REF2HASH(HeVAL(he)));
+        }
+        if(value) {
+            action_bytes += action_memsize(value);
+        }
+    }
+    
+    ret = newHV();
+    usage_store(ret, "lookups", lookup_bytes);
+    usage_store(ret, "keys", key_bytes);
+    usage_store(ret, "attributes", attr_bytes);
+    usage_store(ret, "reverse", reverse_bytes);
+    usage_store(ret, "actions", action_bytes);
+    usage_store(ret, "total", lookup_bytes + key_bytes + attr_bytes
+                + reverse_bytes + action_bytes);
+    
+    /*Per-interpreter, from the allocation counters. These can't be exact, as
+     an action may be freed by another interpreter than the one creating it*/
+    live_actions = HR_Stats.actions_created > HR_Stats.actions_freed
+        ? HR_Stats.actions_created - HR_Stats.actions_freed : 0;
+    usage_store(ret, "actions_allocated", live_actions * sizeof(HR_Action));
+    
+    /*Untyped string keys and object keys are reported under ""*/
+    by_type = newHV();
+    hv_store(by_type, "", 0, type_usage_ref(aTHX_ usage), 0);
+    hv_foreach_he(REF2HASH(kt_lookup), i, he) {
+        STRLEN plen;
+        char *prefix = SvPV(HeVAL(he), plen);
+        tu = type_usage(aTHX_ prefix_map, usage, prefix, plen);
+        hv_store(by_type, HeKEY(he), HeKLEN(he), type_usage_ref(aTHX_ tu), 0);
+    }
+    hv_store(ret, "by_type", sizeof("by_type")-1, newRV_noinc((SV*)by_type), 0);
+    
+    Safefree(usage);
+    return newRV_noinc((SV*)ret);
+}
@@ -0,0 +1,261 @@
+////////////////////////////////////////////////////////////////////////////////
+/// Time-to-live entries                                                     ///
+////////////////////////////////////////////////////////////////////////////////
+
+/*Keys and attributes stored with a TTL are placed on a hierarchical timer
+ wheel, kept in the table info. expire() advances the wheel and unlinks
+ whatever has become due, using the same paths as unlink() and unlink_a().
+
+ Each entry is tied to its key or attribute object by a CFUNC action. If the
+ object goes away for any other reason (unlink, purge, or its value being
+ destroyed), the action takes the entry off the wheel*/
+
+#include "hreg.h"
+#include "hrpriv.h"
+#include "hrdefs.h"
+
+#include <sys/time.h>
+
+/*Four levels of 64 slots, with a resolution of 1/16th of a second, cover
+ about twelve days. Later deadlines are parked in the last level and
+ re-cascaded until they come into range*/
+#define TTL_HZ          16
+#define TTL_LEVELS      4
+#define TTL_BITS        6
+#define TTL_SLOTS       (1 << TTL_BITS)
+#define TTL_MASK        (TTL_SLOTS - 1)
+#define TTL_MAX_DELTA   (((UV)1 << (TTL_BITS * TTL_LEVELS)) - 1)
+
+#define ttl_slot_index(when, level) \
+    (((when) >> (TTL_BITS * (level))) & TTL_MASK)
+
+typedef struct hr_ttl_ent hr_ttl_ent;
+
+struct hr_ttl_ent {
+    hr_ttl_ent  *next;
+    hr_ttl_ent  **pprev;
+    HR_TTLWheel *wheel;
+    UV          expires;    /*In ticks*/
+    SV          *obj;       /*Key or attribute object. Not refcounted*/
+    int         is_attr;
+};
+
+struct HR_TTLWheel {
+    UV          now;        /*Next tick to be processed*/
+    UV          count;
+    hr_ttl_ent  *slots[TTL_LEVELS][TTL_SLOTS];
+};
+
+static void ttl_cancel(SV *obj, SV *arg, HR_Action *action);
+
+static NV
+ttl_time(void)
+{
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec + (tv.tv_usec / 1000000.0);
+}
+
+#define ttl_tick(t) ((UV)((t) * TTL_HZ))
+
+static void
+ttl_link(HR_TTLWheel *w, hr_ttl_ent *ent)
+{
+    UV when = ent->expires;
+    UV delta;
+    int level;
+    hr_ttl_ent **head;
+
+    if(when < w->now) {
+        when = w->now;
+    }
+    delta = when - w->now;
+    if(delta > TTL_MAX_DELTA) {
+        delta = TTL_MAX_DELTA;
+        when = w->now + delta;
+    }
+    for(level = 0; level < TTL_LEVELS - 1; level++) {
+        if(delta < ((UV)1 << (TTL_BITS * (level + 1)))) {
+            break;
+        }
+    }
+
+    head = &w->slots[level][ttl_slot_index(when, level)];
+    ent->next = *head;
+    if(ent->next) {
+        ent->next->pprev = &ent->next;
+    }
+    ent->pprev = head;
+    *head = ent;
+}
+
+static void
+ttl_unlink(hr_ttl_ent *ent)
+{
+    *(ent->pprev) = ent->next;
+    if(ent->next) {
+        ent->next->pprev = ent->pprev;
+    }
+    ent->next = NULL;
+    ent->pprev = NULL;
+}
+
+/*Takes the entry off the wheel, and detaches it from its object*/
+static void
+ttl_ent_free(pTHX_ hr_ttl_ent *ent, int detach_action)
+{
+    SV *objref;
+    ttl_unlink(ent);
+    ent->wheel->count--;
+    if(detach_action) {
+        RV_Newtmp(objref, ent->obj);
+        HR_del_actions_real(aTHX_ objref, (SV*)&ttl_cancel, ent,
+                                  HR_KEY_TYPE_PTR|HR_KEY_SFLAG_HASHREF_OPAQUE);
+        RV_Freetmp(objref);
+    }
+    Safefree(ent);
+}
+
+/*The object is being destroyed*/
+static void
+ttl_cancel(SV *obj, SV *arg, HR_Action *action)
+{
+    dTHX;
+    HR_DEBUG("Cancelling TTL for %p", obj);
+    ttl_ent_free(aTHX_ (hr_ttl_ent*)arg, 0);
+}
+
+void hr_ttl_schedule(pTHX_ SV *self, SV *obj, NV ttl, int is_attr)
+{
+    HR_TableInfo *tinfo = hr_tinfo_get(aTHX_ REF2TABLE(self));
+    HR_TTLWheel *w = tinfo->ttl;
+    hr_ttl_ent *ent;
+    SV *objref;
+
+    if(!w) {
+        Newxz(w, 1, HR_TTLWheel);
+        w->now = ttl_tick(ttl_time());
+        tinfo->ttl = w;
+    }
+
+    /*Storing again resets the deadline*/
+    if( (ent = HR_cfunc_action_arg(obj, (void*)&ttl_cancel, NULL, NULL)) ) {
+        ttl_unlink(ent);
+    } else {
+        Newxz(ent, 1, hr_ttl_ent);
+        ent->wheel = w;
+        ent->obj = obj;
+        ent->is_attr = is_attr;
+        w->count++;
+
+        RV_Newtmp(objref, obj);
+        HR_Action cancel_action[] = {
+            HR_DREF_FLDS_arg_for_cfunc(ent, &ttl_cancel),
+            HR_ACTION_LIST_TERMINATOR
+        };
+        HR_add_actions_real(aTHX_ objref, cancel_action);
+        RV_Freetmp(objref);
+    }
+    ent->expires = ttl_tick(ttl_time() + ttl);
+    ttl_link(w, ent);
+}
+
+/*Moves all entries in a higher level slot down to where they now belong*/
+static void
+ttl_cascade(HR_TTLWheel *w, int level, int index)
+{
+    hr_ttl_ent *ent, *next;
+    ent = w->slots[level][index];
+    w->slots[level][index] = NULL;
+    for(; ent; ent = next) {
+        next = ent->next;
+        ttl_link(w, ent);
+    }
+}
+
+static void
+ttl_fire(pTHX_ SV *self, hr_ttl_ent *ent)
+{
+    SV *obj = ent->obj;
+    int is_attr = ent->is_attr;
+
+    ttl_ent_free(aTHX_ ent, 1);
+    if(is_attr) {
+        hrattr_unlink(aTHX_ obj);
+    } else {
+        hrk_unlink_obj(aTHX_ self, obj);
+    }
+}
+
+UV HRA_expire(SV *self, NV now)
+{
+    dTHX;
+    HR_TableInfo *tinfo = hr_tinfo_get(aTHX_ REF2TABLE(self));
+    HR_TTLWheel *w = tinfo->ttl;
+    UV until, nexpired = 0;
+    hr_ttl_ent **head;
+    int level;
+
+    if(!w) {
+        return 0;
+    }
+
+    HR_OP_BEGIN(cxt);
+    if(now <= 0) {
+        now = ttl_time();
+    }
+    until = ttl_tick(now);
+
+    while(w->now <= until) {
+        if(!w->count) {
+            w->now = until + 1;
+            break;
+        }
+
+        for(level = 1; level < TTL_LEVELS; level++) {
+            if(ttl_slot_index(w->now, level - 1)) {
+                break;
+            }
+            ttl_cascade(w, level, ttl_slot_index(w->now, level));
+        }
+
+        /*Expiring an entry may cascade into other entries being cancelled,
+         so the slot is consumed from its head*/
+        head = &w->slots[0][ttl_slot_index(w->now, 0)];
+        while(*head) {
+            /*Thawing may destroy values and cancel their entries, so the
+             slot is looked at again afterwards*/
+            if(tinfo->frozen) {
+                hr_frozen_thaw(aTHX_ self);
+                continue;
+            }
+            ttl_fire(aTHX_ self, *head);
+            nexpired++;
+        }
+        w->now++;
+    }
+    HR_OP_END(cxt);
+    return nexpired;
+}
+
+UV HRA_ttl_pending(SV *self)
+{
+    dTHX;
+    HR_TableInfo *tinfo = hr_tinfo_get(aTHX_ REF2TABLE(self));
+    return tinfo->ttl ? tinfo->ttl->count : 0;
+}
+
+/*Called when the table info is freed. The objects are still alive, and
+ must not be left with actions pointing to freed entries*/
+void hr_ttl_destroy(pTHX_ HR_TTLWheel *w)
+{
+    int level, index;
+    for(level = 0; level < TTL_LEVELS; level++) {
+        for(index = 0; index < TTL_SLOTS; index++) {
+            while(w->slots[level][index]) {
+                ttl_ent_free(aTHX_ w->slots[level][index], !PL_dirty);
+            }
+        }
+    }
+    Safefree(w);
+}
@@ -30,6 +30,7 @@ enum {
 #define HR_STROPT_STRONG_KEY 	"StrongKey"
 #define HR_STROPT_STRONG_VALUE	"StrongValue"
 #define HR_STROPT_STRONG_ATTR	"StrongAttr"
+#define HR_STROPT_TTL			"TTL"
 
 #define HR_PKG_BASE "Ref::Store::XS"
 
@@ -37,12 +38,17 @@ enum {
 #define HR_PKG_KEY_ENCAP	"Ref::Store::XS::Key::Encapsulating"
 #define HR_PKG_ATTR_SCALAR	"Ref::Store::XS::Attribute"
 #define HR_PKG_ATTR_ENCAP	"Ref::Store::XS::Attribute::Encapsulating"
+#define HR_PKG_SNAPSHOT		"Ref::Store::XS::Snapshot"
+#define HR_PKG_DIRECTORY	"Ref::Store::XS::Directory"
+#define HR_PKG_CFUNC		"Ref::Store::XS::cfunc"
 
 enum {
     HR_STASH_KEY_SCALAR,
     HR_STASH_KEY_ENCAP,
     HR_STASH_ATTR_SCALAR,
-    HR_STASH_ATTR_ENCAP
+    HR_STASH_ATTR_ENCAP,
+    /*Not a stash. The C-side table info lives after the cached stashes*/
+    HR_PRIVDATA_TINFO
 };
 
 #endif /*HRDEFS_H_*/
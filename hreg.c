@@ -1,5 +1,6 @@
 #include "hreg.h"
 #include "hrpriv.h"
+#include "hrprobes.h"
 #include <perl.h>
 #undef NDEBUG
 #include <assert.h>
@@ -14,18 +15,18 @@
 static inline HR_Action
 *action_find_similar(HR_Action *actions, SV *hashref,
                      void *key, HR_KeyType_t ktype,
-                     HR_Action **lastp);
+                     HR_Action **lastp, UV *scannedp);
 
 static inline HR_Action*
-trigger_and_free_action(HR_Action *action_list, SV *object);
+trigger_and_free_action(pTHX_ HR_Action *action_list, SV *object);
 
 static inline void action_sanitize_str(HR_Action *action);
-static inline void action_sanitize_ptr(HR_Action *action);
+static inline void action_sanitize_ptr(pTHX_ HR_Action *action);
 
 #define action_sanitize(actionp) \
     ((actionp->ktype == HR_KEY_TYPE_STR) \
             ? action_sanitize_str(actionp) : \
-            action_sanitize_ptr(actionp)); \
+            action_sanitize_ptr(aTHX_ actionp)); \
     if( (actionp->flags & (HR_FLAG_HASHREF_RV|HR_FLAG_SV_REFCNT_DEC)) ) { \
         SvREFCNT_dec(actionp->hashref); \
     } \
@@ -39,6 +40,130 @@ static inline void action_sanitize_ptr(HR_Action *action);
 ////////////////////////////////////////////////////////////////////////////////
 ////////////////////////////////////////////////////////////////////////////////
 
+int HR_DebugEnabled;
+
+#define MY_CXT_KEY "Ref::Store::XS::_guts" XS_VERSION
+typedef HR_Context my_cxt_t;
+START_MY_CXT
+
+/*A new thread starts out with its parent's context, and duplicating the
+ parent's objects already allocates actions, before CLONE is ever called.
+ The context is therefore cloned on first use by another interpreter.
+ Counters start over, as they describe this interpreter*/
+#ifdef PERL_IMPLICIT_CONTEXT
+static HR_Context*
+context_clone(pTHX)
+{
+    MY_CXT_CLONE;
+    Zero(&MY_CXT, 1, HR_Context);
+    MY_CXT.owner = aTHX;
+    return &MY_CXT;
+}
+#endif
+
+HR_Context*
+hr_context_get(pTHX)
+{
+    dMY_CXT;
+#ifdef PERL_IMPLICIT_CONTEXT
+    if(MY_CXT.owner != aTHX) {
+        return context_clone(aTHX);
+    }
+#endif
+    return &MY_CXT;
+}
+
+/*Called once when the module is loaded*/
+void
+HRA_context_init()
+{
+    dTHX;
+    MY_CXT_INIT;
+    Zero(&MY_CXT, 1, HR_Context);
+#ifdef PERL_IMPLICIT_CONTEXT
+    MY_CXT.owner = aTHX;
+#endif
+    if(getenv("HR_DEBUG")) {
+        HR_DebugEnabled = 1;
+    }
+    hr_fastcall_init(aTHX);
+}
+
+/*Action node pool. Once reserve() has been called, freed actions are kept on
+ a free list for reuse rather than returned to the allocator; like perl's own
+ SV arenas, the pool never shrinks. Nodes are allocated in chunks, so bulk
+ loads don't hit malloc for every back-delete. Actions may be freed from any
+ interpreter, so the list is guarded by a spinlock under ithreads*/
+static HR_Action *action_freelist;
+static int action_pool_enabled;
+
+#ifdef USE_ITHREADS
+static char action_pool_busy;
+#define action_pool_lock() \
+    while(__atomic_test_and_set(&action_pool_busy, __ATOMIC_ACQUIRE)) { ; }
+#define action_pool_unlock() \
+    __atomic_clear(&action_pool_busy, __ATOMIC_RELEASE)
+#else
+#define action_pool_lock()
+#define action_pool_unlock()
+#endif
+
+HREG_API_INTERNAL
+HR_Action*
+HR_action_pool_get(void)
+{
+    HR_Action *ret;
+    if(!action_freelist) {
+        return NULL;
+    }
+    action_pool_lock();
+    if( (ret = action_freelist) ) {
+        action_freelist = ret->next;
+    }
+    action_pool_unlock();
+    if(ret) {
+        Zero(ret, 1, HR_Action);
+    }
+    return ret;
+}
+
+HREG_API_INTERNAL
+int
+HR_action_pool_put(HR_Action *action)
+{
+    if(!action_pool_enabled) {
+        return 0;
+    }
+    action_pool_lock();
+    action->next = action_freelist;
+    action_freelist = action;
+    action_pool_unlock();
+    return 1;
+}
+
+void
+HR_action_pool_reserve(UV count)
+{
+    HR_Action *chunk;
+    UV i;
+    if(!count) {
+        return;
+    }
+    Newxz(chunk, count, HR_Action);
+    for(i = 0; i < count - 1; i++) {
+        chunk[i].next = chunk + i + 1;
+    }
+    action_pool_lock();
+    chunk[count-1].next = action_freelist;
+    action_freelist = chunk;
+    action_pool_enabled = 1;
+    action_pool_unlock();
+}
+
+/*If scannedp is not NULL, an unsuccessful action_find_similar() stores the
+ number of actions it walked there. When adding, this is the length of the
+ list before the new action*/
+
 #define cmp_container_SV2RV(sv, rv) \
     (SvROK(rv) && sv == SvRV(rv))
 
@@ -53,7 +178,7 @@ static inline void action_sanitize_str(HR_Action *action)
     }
 }
 
-static inline void action_sanitize_ptr(HR_Action *action)
+static inline void action_sanitize_ptr(pTHX_ HR_Action *action)
 {
     if( (action->flags & HR_FLAG_SV_REFCNT_DEC) ) {
         HR_DEBUG("Decreasing reference count on SV=%p", action->key);
@@ -66,17 +191,18 @@ static inline void action_sanitize_ptr(HR_Action *action)
 static inline HR_Action* action_find_similar(
     HR_Action *action_list,
     SV* hashref, void *key, HR_KeyType_t ktype,
-    HR_Action **lastp)
+    HR_Action **lastp, UV *scannedp)
 {
     HR_DEBUG("Request to find ktype=%d, kp=%p", ktype, hashref);
     HR_Action *cur = action_list;
+    UV scanned = 0;
     *lastp = cur;
     
     int uhashref_is_opaque = (ktype & HR_KEY_SFLAG_HASHREF_OPAQUE);
     ktype &= (~HR_KEY_SFLAG_HASHREF_OPAQUE);
     
     /*Prefilter for container comparison*/
-    for(; cur; *lastp = cur, cur = cur->next) {
+    for(; cur; *lastp = cur, cur = cur->next, scanned++) {
         if(uhashref_is_opaque == 0 && action_container_is_sv(cur)) {
             if(action_container_is_rv(cur)) {
                 if(!cmp_container_RV2RV(cur->hashref, hashref)) {
@@ -126,11 +252,14 @@ static inline HR_Action* action_find_similar(
         }
     }
     HR_DEBUG("Couldn't find match");
+    if(scannedp) {
+        *scannedp = scanned;
+    }
     return NULL;
 }
 
 HREG_API_INTERNAL void
-HR_add_action(HR_Action *action_list,
+HR_add_action(pTHX_ HR_Action *action_list,
               HR_Action *new_action,
               int want_unique)
 {
@@ -139,10 +268,12 @@ HR_add_action(HR_Action *action_list,
     
     int search_flags = 0;
     int tail_len;
+    UV scanned;
     
     if(action_list->ktype == HR_KEY_TYPE_NULL) {
         HR_DEBUG("List empty, creating new");
         cur = action_list;
+        HR_STAT_MAX(max_action_list, 1);
         //goto GT_INSERT_ENTRY;
     } else {
         
@@ -151,12 +282,14 @@ HR_add_action(HR_Action *action_list,
         }
         if( (cur = action_find_similar(
                 action_list, new_action->hashref,
-                new_action->key, new_action->ktype|search_flags, &last)) ) {
+                new_action->key, new_action->ktype|search_flags,
+                &last, &scanned)) ) {
             
             HR_DEBUG("Existing action found for %p", cur->hashref);
             return;
         
         }
+        HR_STAT_MAX(max_action_list, scanned + 1);
     }
     
     //Newxz_Action(cur);
@@ -212,7 +345,7 @@ HR_add_action(HR_Action *action_list,
 
 HREG_API_INTERNAL
 HR_Action*
-HR_free_action(HR_Action *action)
+HR_free_action(pTHX_ HR_Action *action)
 {
     HR_Action *ret = action->next;
     action_sanitize(action);
@@ -223,10 +356,10 @@ HR_free_action(HR_Action *action)
 
 HREG_API_INTERNAL
 HR_DeletionStatus_t
-HR_del_action(HR_Action *action_list, SV *hashref, void *key, HR_KeyType_t ktype)
+HR_del_action(pTHX_ HR_Action *action_list, SV *hashref, void *key, HR_KeyType_t ktype)
 {
     HR_Action *cur = action_list, *last = action_list;
-    cur = action_find_similar(action_list, hashref, key, ktype, &last);
+    cur = action_find_similar(action_list, hashref, key, ktype, &last, NULL);
     
     if(!cur) {
         HR_DEBUG("Nothing to delete");
@@ -261,11 +394,12 @@ HR_del_action(HR_Action *action_list, SV *hashref, void *key, HR_KeyType_t ktype
 
 HREG_API_INTERNAL
 HR_DeletionStatus_t
-HR_nullify_action(HR_Action *action_list, SV *hashref, void *key, HR_KeyType_t ktype)
+HR_nullify_action(pTHX_ HR_Action *action_list, SV *hashref, void *key, HR_KeyType_t ktype)
 {
     HR_Action *last = NULL;
     
-    action_list = action_find_similar(action_list, hashref, key, ktype, &last);
+    action_list = action_find_similar(action_list, hashref, key, ktype,
+                                      &last, NULL);
     if(action_list) {
         HR_DEBUG("Nullifying action");
         action_sanitize(action_list);
@@ -277,13 +411,16 @@ HR_nullify_action(HR_Action *action_list, SV *hashref, void *key, HR_KeyType_t k
 
 HREG_API_INTERNAL
 void
-HR_trigger_and_free_actions(HR_Action *action_list, SV *object)
+HR_trigger_and_free_actions(pTHX_ HR_Action *action_list, SV *object)
 {
     HR_Action *head = action_list;
     HR_DEBUG("BEGIN action_list=%p, next=%p", action_list,
              action_list->next);
     HR_Action *last;
-    while( (action_list = trigger_and_free_action(action_list, object)) ) { ; }
+    UV nactions = 0;
+    HR_PROBE1(trigger__entry, object);
+    while( (action_list = trigger_and_free_action(aTHX_ action_list,
+                                                  object)) ) { ; }
     
     /*We don't want to let each action being freed immediately. Speficially
      we want to allow a case where we can nullify existing actions, in which
@@ -295,13 +432,15 @@ HR_trigger_and_free_actions(HR_Action *action_list, SV *object)
         action_list = action_list->next;
         HR_DEBUG("Free %p", last);
         Free_Action(last);
+        nactions++;
     }
+    HR_PROBE2(trigger__return, object, nactions);
     HR_DEBUG("Done");
 }
 
 
 static inline void
-invoke_coderef(SV *coderef, SV *object, char *key)
+invoke_coderef(pTHX_ SV *coderef, SV *object, char *key)
 {
     SV *tmpref = sv_2mortal(newRV_inc(object));
     U32 old_refcount = refcnt_ka_begin(object);
@@ -320,7 +459,7 @@ invoke_coderef(SV *coderef, SV *object, char *key)
     
     
     call_sv(coderef, G_DISCARD);
-    refcnt_ka_end(object, old_refcount);
+    refcnt_ka_end(aTHX_ object, old_refcount);
     
     SPAGAIN;
     PUTBACK;
@@ -330,13 +469,19 @@ invoke_coderef(SV *coderef, SV *object, char *key)
 }
 
 static inline HR_Action*
-trigger_and_free_action(HR_Action *action_list, SV *object)
+trigger_and_free_action(pTHX_ HR_Action *action_list, SV *object)
 {
-    
-    static int recurse_level = 0;
-    
+    HR_Context *cxt = HR_CXT;
     HR_Action *ret = NULL;
-    recurse_level++;
+    
+    cxt->trigger_depth++;
+    if(cxt->trigger_depth > cxt->stats.max_trigger_depth) {
+        cxt->stats.max_trigger_depth = cxt->trigger_depth;
+    }
+    if(cxt->trigger_depth > cxt->cascade_depth) {
+        cxt->cascade_depth = cxt->trigger_depth;
+    }
+    HR_PROBE3(trigger__action, object, action_list->atype, cxt->trigger_depth);
     
     if(!action_list->hashref) {
         HR_DEBUG("Can't find hashref!");
@@ -358,7 +503,7 @@ trigger_and_free_action(HR_Action *action_list, SV *object)
     
     U32 old_refcount;
     
-    HR_DEBUG("ENTER! (LVL=%d)", recurse_level);
+    HR_DEBUG("ENTER! (LVL=%d)", (int)cxt->trigger_depth);
     switch (action_list->ktype) {
         
         case HR_KEY_TYPE_NULL:
@@ -367,6 +512,7 @@ trigger_and_free_action(HR_Action *action_list, SV *object)
             break;
         
         case HR_KEY_TYPE_PTR: {
+            cxt->cascade_actions++;
             switch (action_list->atype) {
                 case HR_ACTION_TYPE_DEL_HV:
                 case HR_ACTION_TYPE_DEL_AV: {
@@ -407,7 +553,7 @@ trigger_and_free_action(HR_Action *action_list, SV *object)
                     
                     /*Now we want to check how much the refcount has changed*/
                     HR_DEBUG("KEEPALIVE, ORIG=%d, CUR=%d", FAKE_REFCOUNT, SvREFCNT(container));
-                    refcnt_ka_end(container, old_refcount);
+                    refcnt_ka_end(aTHX_ container, old_refcount);
                     
                     break;
                 }
@@ -416,7 +562,7 @@ trigger_and_free_action(HR_Action *action_list, SV *object)
                     warn("Support for SV keys for coderefs not yet implemented. "
                          "Stringifying pointer");
                     mk_ptr_string(arg_s, action_list->key);
-                    invoke_coderef(action_list->hashref, object, arg_s);
+                    invoke_coderef(aTHX_ action_list->hashref, object, arg_s);
                     break;
                 }
                 
@@ -435,6 +581,7 @@ trigger_and_free_action(HR_Action *action_list, SV *object)
         }
         
         case HR_KEY_TYPE_STR:
+            cxt->cascade_actions++;
             old_refcount = refcnt_ka_begin(container);
             
             switch(action_list->atype) {
@@ -446,14 +593,14 @@ trigger_and_free_action(HR_Action *action_list, SV *object)
                     break;
                 }
                 case HR_ACTION_TYPE_CALL_CV: {
-                    invoke_coderef(action_list->hashref, object, action_list->key);
+                    invoke_coderef(aTHX_ action_list->hashref, object, action_list->key);
                     break;
                 }
                 default:
                     die("Unsupported action %d for string type", action_list->atype);
                     break;
             }
-            refcnt_ka_end(container, old_refcount);
+            refcnt_ka_end(aTHX_ container, old_refcount);
             //action_sanitize_str(action_list);
             break;
         
@@ -466,7 +613,7 @@ trigger_and_free_action(HR_Action *action_list, SV *object)
     ret = action_list->next;
     action_sanitize(action_list);
     //action_clear(action_list);
-    HR_DEBUG("EXIT (LVL=%d)", recurse_level);
-    recurse_level--;
+    HR_DEBUG("EXIT (LVL=%d)", (int)cxt->trigger_depth);
+    cxt->trigger_depth--;
     return ret;
 }
\ No newline at end of file
@@ -1,6 +1,7 @@
 #ifndef HREG_H_
 #define HREG_H_
 
+#define PERL_NO_GET_CONTEXT
 #include "EXTERN.h"
 #include "perl.h"
 #include "XSUB.h"
@@ -11,12 +12,10 @@
 //#define HR_DEBUG
 
 #ifndef HR_DEBUG
-static int _hr_enable_debug = -1;
-#define _hr_can_debug \
-    (_hr_enable_debug >= 0 ? _hr_enable_debug : \
-        (_hr_enable_debug = getenv("HR_DEBUG") ? 1 : 0))
+/*Set from the environment once, when the module is loaded*/
+extern int HR_DebugEnabled;
 
-#define HR_DEBUG(fmt, ...) if(_hr_can_debug) { \
+#define HR_DEBUG(fmt, ...) if(HR_DebugEnabled) { \
     fprintf(stderr, "[%s:%d (%s)] " fmt "\n", \
         __FILE__, __LINE__, __func__, ## __VA_ARGS__); \
 }
@@ -78,7 +77,7 @@ _mk_ptr_string(char *str, size_t value)
 #undef Perl_malloc
 #undef Perl_mfree
 
-#define Newxz_Action(ptr) \
+#define _Newxz_Action(ptr) \
     ptr = Perl_malloc(sizeof(HR_Action)); \
     Zero(ptr, 1, HR_Action);
 
@@ -89,19 +88,74 @@ _mk_ptr_string(char *str, size_t value)
 #define Resize_Action_tail(ptr, tail_len) \
     ptr = Perl_realloc(ptr, sizeof(HR_Action)+tail_len);
 
-#define Free_Action(ptr) \
+#define _Free_Action(ptr) \
     Perl_mfree(ptr);
 
 #else /*!HR_PERL_MALLOC*/
        
-#define Newxz_Action(ptr) \
+#define _Newxz_Action(ptr) \
     Newxz(ptr, 1, HR_Action)
 
-#define Free_Action(ptr) \
+#define _Free_Action(ptr) \
     Safefree(ptr);
 
 #endif
 
+/*Per-interpreter operation counters, reported by stats(). These are meant
+ for sizing and tuning rather than exact accounting*/
+typedef struct {
+    UV  freehook_calls;
+    UV  actions_created;
+    UV  actions_freed;
+    UV  max_action_list;
+    UV  max_trigger_depth;
+} HR_GlobalStats;
+
+/*Everything mutable which isn't owned by a table lives here, one per
+ interpreter (see hr_context_get() in hreg.c), so that tables in different
+ threads never share state. The action pool is the exception, being shared
+ and locked*/
+typedef struct HR_Latency HR_Latency;
+
+typedef struct {
+    HR_GlobalStats  stats;
+    UV              trigger_depth;
+    HR_Latency      **latency;      /*Tables with latency histograms enabled*/
+    U32             nlatency;
+    UV              latency_serial;
+    UV              cascade_actions;/*Actions fired by the current cascade*/
+    UV              cascade_depth;  /*Its deepest nesting*/
+    I32             op_depth;       /*Nesting of mutating operations*/
+    struct HR_EvictSub *evict_due;  /*Subscriptions with a full batch*/
+#ifdef PERL_IMPLICIT_CONTEXT
+    PerlInterpreter *owner;
+#endif
+} HR_Context;
+
+#define HR_CXT (hr_context_get(aTHX))
+#define HR_Stats (HR_CXT->stats)
+
+#define HR_STAT_MAX(field, val) \
+    if((UV)(val) > HR_Stats.field) { HR_Stats.field = (val); }
+
+typedef struct HR_Action HR_Action;
+
+/*Reserved action nodes, see HR_action_pool_reserve()*/
+HR_Action*  HR_action_pool_get(void);
+int         HR_action_pool_put(HR_Action *action);
+
+#define Newxz_Action(ptr) \
+    STMT_START { \
+        if(!(ptr = (void*)HR_action_pool_get())) { _Newxz_Action(ptr); } \
+        HR_Stats.actions_created++; \
+    } STMT_END
+
+#define Free_Action(ptr) \
+    STMT_START { \
+        if(!HR_action_pool_put(ptr)) { _Free_Action(ptr); } \
+        HR_Stats.actions_freed++; \
+    } STMT_END
+
 /*action tail functions*/
 
 #define action_is_tailed_nocheck(actionp) \
@@ -169,7 +223,6 @@ enum {
 #define action_key_is_rv(aptr) ((aptr)->flags & HR_FLAG_SV_REFCNT_DEC)
 #define action_container_is_sv(aptr) ((aptr->atype != HR_ACTION_TYPE_CALL_CFUNC))
 #define action_container_is_rv(aptr) ((aptr->flags & (HR_FLAG_HASHREF_RV)))
-typedef struct HR_Action HR_Action;
 typedef void(*HR_ActionCallback)(void*,SV*,HR_Action*);
 
 struct
@@ -211,22 +264,22 @@ HR_Action {
     .key = arg, .hashref = (SV*)fptr }
 
 HREG_API_INTERNAL
-void HR_add_action(HR_Action *action_list, HR_Action *new_action, int want_unique);
+void HR_add_action(pTHX_ HR_Action *action_list, HR_Action *new_action, int want_unique);
 
 HREG_API_INTERNAL
-void HR_trigger_and_free_actions(HR_Action *action_list, SV *object);
+void HR_trigger_and_free_actions(pTHX_ HR_Action *action_list, SV *object);
 
 HREG_API_INTERNAL
 HR_DeletionStatus_t
-HR_del_action(HR_Action *action_list, SV *hashref, void *key, HR_KeyType_t ktype);
+HR_del_action(pTHX_ HR_Action *action_list, SV *hashref, void *key, HR_KeyType_t ktype);
 
 HREG_API_INTERNAL
 HR_DeletionStatus_t
-HR_nullify_action(HR_Action *action_list, SV *hashref, void *key, HR_KeyType_t ktype);
+HR_nullify_action(pTHX_ HR_Action *action_list, SV *hashref, void *key, HR_KeyType_t ktype);
 
 HREG_API_INTERNAL
 HR_Action*
-HR_free_action(HR_Action *action);
+HR_free_action(pTHX_ HR_Action *action);
 /*
 ////////////////////////////////////////////////////////////////////////////////
 ////////////////////////////////////////////////////////////////////////////////
@@ -237,7 +290,11 @@ HR_free_action(HR_Action *action);
 ////////////////////////////////////////////////////////////////////////////////
 */
 HREG_API_INTERNAL
-void HR_add_actions_real(SV *objref, HR_Action *actions);
+void HR_add_actions_real(pTHX_ SV *objref, HR_Action *actions);
+
+HREG_API_INTERNAL
+void HR_del_actions_real(pTHX_ SV *objref, SV *hashref,
+                         void *key, HR_KeyType_t ktype);
 
 /*Perl API*/
 
@@ -294,15 +351,101 @@ void HRXSATTR_ithread_postdup(SV *newself, SV *newtable, HV *ptr_map);
 
 /*H::R API*/
 void 	HRA_table_init(SV *self);
+void	HRA_table_reserve(SV *self, UV nkeys, UV nvalues, UV nattrs);
 void 	HRA_store_sk(SV *hr, SV *ukey, SV *value, ...);
 void 	HRA_store_kt(SV *hr, SV *ukey, SV *t, SV *value, ...);
+SV*		HRA_fetch_kt(SV *hr, SV *ukey, SV *t);
+SV*		HRA_unlink_kt(SV *hr, SV *ukey, SV *t);
+SV*		HRA_purgeby_kt(SV *hr, SV *ukey, SV *t);
+int		HRA_lexists_kt(SV *hr, SV *ukey, SV *t);
+int		HRA_lexists_sk(SV *hr, SV *ukey);
 SV* 	HRA_fetch_sk(SV *hr, SV *ukey); /*we manipulate perl's stack in this one*/
+void	HRA_fetch_alias(SV *hr, SV *ukey);
+void	HRA_fetch_into(SV *hr, SV *ukey, SV *target);
+SV*		HRA_unlink_sk(SV *hr, SV *ukey);
+SV*		HRA_purge(SV *hr, SV *value);
+void	HRA_exchange_value(SV *hr, SV *old, SV *new);
+SV*		HRA_rekey(SV *hr, SV *old, SV *new);
 
 void 	HRA_store_a(SV *hr, SV *attr, char *t, SV *value, ...);
 void  	HRA_fetch_a(SV *hr, SV *attr, char *t);
+void	HRA_fetch_a_alias(SV *hr, SV *attr, char *t);
+UV		HRA_fetch_a_into(SV *hr, SV *attr, char *t, SV *dest);
 void 	HRA_dissoc_a(SV *hr, SV *attr, char *t, SV *value);
 void 	HRA_unlink_a(SV *hr, SV *attr, char *t);
 SV* 	HRA_attr_get(SV *hr, SV *attr, char *t); //Do we really need this?
 void 	HRA_ithread_store_lookup_info(SV *self, HV *ptr_map);
+void 	HRA_ithread_restore(SV *self);
+
+/*Shared snapshots*/
+SV*		HRA_freeze_shared(SV *hr, SV *encoder);
+SV*		HRXSNAP_fetch(SV *snap, SV *ukey);
+SV*		HRXSNAP_fetch_kt(SV *snap, SV *ukey, char *t);
+void	HRXSNAP_fetch_a(SV *snap, SV *attr, char *t);
+UV		HRXSNAP_generation(SV *snap);
+
+/*Shared key directory*/
+SV*		HRXSDIR_new(char *pkg, UV nbuckets, UV nstripes);
+void	HRXSDIR_store(SV *dir, SV *key, SV *payload);
+SV*		HRXSDIR_fetch(SV *dir, SV *key);
+int		HRXSDIR_delete(SV *dir, SV *key);
+UV		HRXSDIR_count(SV *dir);
+void	HRA_dir_publish(SV *hr, SV *dir, SV *key, SV *payload);
+
+/*Saving and loading*/
+void	HRA_save(SV *hr, char *path, SV *encoder);
+void	HRA_load_into(SV *hr, char *path, SV *decoder);
+
+/*Time-to-live entries*/
+UV		HRA_expire(SV *hr, NV now);
+UV		HRA_ttl_pending(SV *hr);
+
+/*Bounded tables*/
+void	HRA_set_max_values(SV *hr, UV max_values);
+UV		HRA_max_values(SV *hr);
+
+/*Integer keys*/
+void	HRA_store_ik(SV *hr, IV key, SV *value, ...);
+SV*		HRA_fetch_ik(SV *hr, IV key);
+SV*		HRA_unlink_ik(SV *hr, IV key);
+int		HRA_lexists_ik(SV *hr, IV key);
+UV		HRA_ik_count(SV *hr);
+
+/*Removal notifications*/
+void	HRA_on_evict(SV *hr, SV *cb, UV batch);
+UV		HRA_flush_evictions(SV *hr);
+UV		HRA_evictions_pending(SV *hr);
+
+/*Ordered indexes*/
+void	HRA_index_kt(SV *hr, SV *t, int numeric);
+void	HRA_fetch_range(SV *hr, SV *t, SV *lo, SV *hi);
+void	HRA_fetch_prefix(SV *hr, SV *t, SV *prefix);
+UV		HRA_index_count(SV *hr, SV *t);
+
+/*Attribute bitmaps*/
+void	HRA_enable_attr_bitmaps(SV *hr);
+int		HRA_attr_bitmaps(SV *hr);
+SV*		HRA_value_id(SV *hr, SV *value);
+int		HRA_has_a(SV *hr, SV *attr, char *t, SV *value);
+void	HRA_fetch_a_set(SV *hr, int op, ...);
+
+/*Frozen tables*/
+void	HRA_freeze(SV *hr);
+void	HRA_thaw(SV *hr);
+int		HRA_is_frozen(SV *hr);
+
+/*Latency histograms*/
+void	HRA_enable_latency(SV *hr, int on);
+SV*		HRA_latency_report(SV *hr, int reset);
+
+/*Exported C API (lib/Ref/Store/XS/hr_api.h)*/
+UV		HRA_api_publish();
+
+/*Per-interpreter state, set up when the module is loaded*/
+void	HRA_context_init();
+
+/*Statistics*/
+SV*		HRA_stats(SV *hr);
+SV*		HRA_memory_usage(SV *hr);
 
 #endif /*HREG_H_*/
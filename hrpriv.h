@@ -28,7 +28,7 @@ typedef char* HR_BlessParams[2];
 
 
 HR_INLINE HV*
-stash_from_cache_nocheck_S(SV *aref, int stashtype)
+stash_from_cache_nocheck_S(pTHX_ SV *aref, int stashtype)
 {
     HV *ret;
     SV **elem;
@@ -81,7 +81,7 @@ refcnt_ka_begin(SV *sv)
 }
 
 HR_INLINE void
-refcnt_ka_end(SV *sv, U32 old_refcount)
+refcnt_ka_end(pTHX_ SV *sv, U32 old_refcount)
 {
     I32 effective_refcount = old_refcount + (SvREFCNT(sv) - FAKE_REFCOUNT);
     if(effective_refcount <= 0 && old_refcount > 0) {
@@ -112,7 +112,7 @@ typedef AV* HR_Table_t;
     ((HR_Table_t)SvRV(tbl))
 
 HR_INLINE void
-get_hashes(HR_Table_t table, ...)
+get_hashes(pTHX_ HR_Table_t table, ...)
 {
     va_list ap;
     va_start(ap, table);
@@ -147,7 +147,7 @@ get_hashes(HR_Table_t table, ...)
     SvROK_on(vsv);
 
 HR_INLINE SV*
-get_vhash_from_rlookup(SV *rlookup, SV *vaddr, int create)
+get_vhash_from_rlookup(pTHX_ SV *rlookup, SV *vaddr, int create)
 {
     HE* h_ent = hv_fetch_ent(REF2HASH(rlookup), vaddr, create, 0);
     SV *href;
@@ -170,7 +170,7 @@ get_vhash_from_rlookup(SV *rlookup, SV *vaddr, int create)
             HR_DREF_FLDS_ptr_from_hv(SvRV(vref), rlookup ),
             HR_ACTION_LIST_TERMINATOR
         };
-        HR_add_actions_real(vref, rlookup_delete);
+        HR_add_actions_real(aTHX_ vref, rlookup_delete);
         RV_Freetmp(vref);
     }
     
@@ -185,7 +185,7 @@ get_vhash_from_rlookup(SV *rlookup, SV *vaddr, int create)
 */
 
 HR_INLINE int
-insert_into_vhash(
+insert_into_vhash(pTHX_
     SV *vref,
     SV *lobj,
     char *kstring,
@@ -199,10 +199,10 @@ insert_into_vhash(
     int created;
     
     if(!rlookup) {
-        get_hashes(table, HR_HKEY_LOOKUP_REVERSE, &rlookup,
+        get_hashes(aTHX_ table, HR_HKEY_LOOKUP_REVERSE, &rlookup,
                    HR_HKEY_LOOKUP_NULL);
     }
-    vhash = get_vhash_from_rlookup(rlookup, vaddr, VHASH_INIT_FULL);
+    vhash = get_vhash_from_rlookup(aTHX_ rlookup, vaddr, VHASH_INIT_FULL);
     
     stored = hv_fetch(REF2HASH(vhash), kstring, strlen(kstring), 1);
     if(!SvROK(*stored)) {
@@ -219,7 +219,7 @@ insert_into_vhash(
 }
 
 HR_INLINE HV*
-stash_from_pkgparam(char *arg)
+stash_from_pkgparam(pTHX_ char *arg)
 {
     if(! (*arg) ) {
         HR_DEBUG("Special stash stored!");
@@ -231,10 +231,10 @@ stash_from_pkgparam(char *arg)
 }
 
 HR_INLINE SV*
-mk_blessed_blob(char *pkg, int size)
+mk_blessed_blob(pTHX_ char *pkg, int size)
 {
     HR_DEBUG("New blob requested with size=%d", size);
-    HV *stash = stash_from_pkgparam(pkg);
+    HV *stash = stash_from_pkgparam(aTHX_ pkg);
     SV *referrant = newSV(size);
     HR_DEBUG("Allocated block=%p", SvPVX(referrant));
     if(!stash) {
@@ -247,5 +247,236 @@ mk_blessed_blob(char *pkg, int size)
     return self;
 }
 
+/*Per-table C-side information. This is kept behind ext magic on an SV inside
+ the table's private data, so that it is freed and duplicated along with the
+ table itself*/
+
+typedef struct HR_SnapSlot HR_SnapSlot;
+typedef struct HR_SnapImage HR_SnapImage;
+typedef struct HR_Directory HR_Directory;
+
+/*Per-table operation counters, reported by stats()*/
+typedef struct {
+    UV  stores;
+    UV  fetch_hits;
+    UV  fetch_misses;
+    UV  unlinks;
+    UV  purges;
+    UV  attr_stores;
+    UV  attr_fetches;
+    UV  attr_unlinks;
+    UV  evictions;
+} HR_TableStats;
+
+typedef struct HR_TTLWheel HR_TTLWheel;
+typedef struct HR_Clock HR_Clock;
+typedef struct HR_IntIndex HR_IntIndex;
+typedef struct HR_EvictSub HR_EvictSub;
+typedef struct HR_OrderedIndex HR_OrderedIndex;
+typedef struct HR_ValueIDs HR_ValueIDs;
+typedef struct HR_Bitmap HR_Bitmap;
+
+typedef struct {
+    HR_SnapSlot     *snap_slot; /*Slot last published by freeze_shared()*/
+    HR_TableStats   stats;
+    HR_TTLWheel     *ttl;       /*Pending expiries, created on first use*/
+    HR_Clock        *clock;     /*Eviction ring, if max_values is set*/
+    HR_IntIndex     *intkeys;   /*Integer keys, created on first use*/
+    HR_EvictSub     *evsub;     /*Removal subscription, from on_evict()*/
+    HR_OrderedIndex *oindexes;  /*Ordered indexes, from index_kt()*/
+    HR_ValueIDs     *vids;      /*Value IDs, if attribute bitmaps are enabled*/
+    HR_SnapImage    *frozen;    /*Lookup image, while frozen by freeze()*/
+    HR_Latency      *latency;   /*Histograms, from enable_latency()*/
+    /*Carried into a new thread, until HRA_ithread_restore()*/
+    SV              *dup_evict_cb;
+    UV              dup_evict_batch;
+    UV              dup_max_values;
+} HR_TableInfo;
+
+HR_INLINE MAGIC*
+hr_mg_find_vtbl(SV *sv, MGVTBL *vtbl)
+{
+    MAGIC *mg;
+    if(SvTYPE(sv) < SVt_PVMG) {
+        return NULL;
+    }
+    for(mg = SvMAGIC(sv); mg; mg = mg->mg_moremagic) {
+        if(mg->mg_virtual == vtbl) {
+            return mg;
+        }
+    }
+    return NULL;
+}
+
+HR_Context*     hr_context_get(pTHX);
+
+void            hr_tinfo_init(pTHX_ AV *privdata);
+HR_TableInfo*   hr_tinfo_get(pTHX_ HR_Table_t table);
+
+/*Takes the table info, which hot paths look up once with hr_tinfo_get() and
+ pass along. Nothing is counted while the table is frozen, so that lookups
+ leave the table info's pages alone*/
+#define HR_TSTAT_INC(tinfo, field) \
+    ((tinfo)->frozen ? (void)0 : (void)(tinfo)->stats.field++)
+
+void            hr_snap_slot_unref(HR_SnapSlot *slot);
+
+/*Frozen tables. Anything modifying the table must call hr_frozen_thaw()
+ first. The lookups return false if they can't be answered from the image*/
+void            hr_frozen_thaw(pTHX_ SV *self);
+void            hr_frozen_destroy(pTHX_ HR_SnapImage *img);
+int             hr_frozen_lookup(pTHX_ HR_TableInfo *tinfo, SV *key,
+                                 SV **value);
+int             hr_frozen_fetch(pTHX_ HR_TableInfo *tinfo, SV *key, SV **ret);
+int             hr_frozen_fetch_a(pTHX_ HR_TableInfo *tinfo, SV *attr, char *t,
+                                  SV ***values, U32 *count);
+
+/*Returns the value hash of an attribute object, and whether it encapsulates
+ an object*/
+HV*             hrattr_attrhash(SV *attr_sv, int *is_encap);
+
+/*Encapsulated objects of key and attribute blobs, or NULL if the object is
+ gone. hrk_encap_object must only be called for encapsulating keys*/
+SV*             hrk_encap_object(SV *ksv);
+SV*             hrattr_encap_object(SV *attr_sv);
+
+/*Pre-allocates action nodes for bulk loading*/
+void            HR_action_pool_reserve(UV count);
+
+/*Number of action nodes attached to an object, including the list head*/
+UV              HR_action_count(SV *target);
+
+/*Argument of the first CFUNC action on an object calling fptr, or NULL.
+ If several tables attach the same callback, match() picks out ours*/
+void*           HR_cfunc_action_arg(SV *target, void *fptr,
+                                    int (*match)(void *arg, void *data),
+                                    void *data);
+
+/*Unlinks a key or attribute given its object, as unlink() and unlink_a()*/
+void            hrk_unlink_obj(pTHX_ SV *self, SV *ksv);
+void            hrattr_unlink(pTHX_ SV *attr_sv);
+
+/*Time-to-live entries*/
+void            hr_ttl_schedule(pTHX_ SV *self, SV *obj, NV ttl, int is_attr);
+void            hr_ttl_destroy(pTHX_ HR_TTLWheel *wheel);
+
+/*Bounded tables*/
+void            hr_clock_touch(pTHX_ HR_TableInfo *tinfo, SV *self, SV *value,
+                               int is_fetch);
+void            hr_clock_destroy(pTHX_ HR_Clock *clock);
+UV              hr_clock_max_values(HR_Clock *clock);
+
+/*Integer keys*/
+void            hr_ik_purge_value(pTHX_ SV *self, SV *value);
+void            hr_ik_destroy(pTHX_ HR_IntIndex *idx);
+void            hr_ik_exchange_value(pTHX_ SV *self, SV *old, SV *new);
+
+/*Removal notifications*/
+void            hr_evict_watch(pTHX_ HR_TableInfo *tinfo, SV *kobj, SV *kstring,
+                               SV *value);
+void            hr_evict_retarget(pTHX_ SV *self, SV *kobj, SV *value);
+void            hr_evict_sub_destroy(pTHX_ HR_EvictSub *sub);
+SV*             hr_evict_sub_cb(HR_EvictSub *sub, UV *batch);
+void            hr_evict_deliver_due(pTHX_ HR_Context *cxt);
+
+/*Removal notifications call into perl, which may re-enter the table, so
+ they are only delivered at safe points: when the outermost mutating
+ operation returns, or once a free outside of any operation has finished
+ cascading. The mutating entry points are bracketed with these. The depth
+ is kept on the save stack, so that it is restored if the operation dies*/
+#define HR_OP_BEGIN(cxt) \
+    HR_Context *cxt = HR_CXT; \
+    I32 cxt ## _saveix = PL_savestack_ix; \
+    SAVEI32(cxt->op_depth); \
+    cxt->op_depth++
+
+#define HR_OP_END(cxt) \
+    STMT_START { \
+        LEAVE_SCOPE(cxt ## _saveix); \
+        if(!cxt->op_depth && cxt->evict_due) { \
+            hr_evict_deliver_due(aTHX_ cxt); \
+        } \
+    } STMT_END
+
+/*Ordered indexes*/
+void            hr_oidx_add(pTHX_ SV *self, SV *obj, char *fullstr, STRLEN len,
+                            int is_attr);
+void            hr_oidx_destroy(pTHX_ HR_OrderedIndex *idx);
+
+/*Attribute bitmaps. Values are passed as the referents*/
+void            hr_vid_attr_add(pTHX_ HR_Table_t table, HR_Bitmap **members,
+                                SV *value);
+void            hr_vid_attr_remove(HR_Bitmap *members, SV *value);
+void            hr_vid_bitmap_free(HR_Bitmap *bm);
+void            hr_vid_purge_value(pTHX_ SV *self, SV *value);
+void            hr_vid_destroy(pTHX_ HR_ValueIDs *vids);
+
+/*An attribute's bitmap, or NULL if it has none (or doesn't exist).
+ hrattr_bitmap_init fills in the bitmap of an existing attribute*/
+HR_Bitmap*      hrattr_members(pTHX_ SV *self, SV *attr, char *t);
+void            hrattr_bitmap_init(pTHX_ SV *attr_sv);
+
+/*Retargets an attribute's entry for exchange_value()*/
+void            hrattr_exchange_value(pTHX_ SV *attr_sv, SV *old, SV *new);
+/*Removes a value from an attribute, for purge()*/
+void            hrattr_unlink_value(pTHX_ SV *self, SV *value);
+/*fetch_a_into, for the C API*/
+UV              hrattr_fetch_into(pTHX_ SV *self, SV *attr, char *t,
+                                  SV *dest_ref);
+
+/*Stack-free store routines, for batch insertion. Keys and attributes are
+ passed as their full (prefixed) strings*/
+void            HR_store_sk_real(pTHX_ SV *self, SV *key, SV *value,
+                                 int prefix_len, int iopts);
+/*fetch, without switching the calling op to a direct call. Returns a new
+ reference, &PL_sv_undef or NULL*/
+SV*             HR_fetch_sk_real(pTHX_ SV *self, SV *key);
+SV*             HR_unlink_sk_real(pTHX_ SV *self, SV *key);
+SV*             HR_purge_real(pTHX_ SV *self, SV *value);
+void            hrattr_store_str(pTHX_ SV *self, char *attr_fullstr,
+                                 int attrlen, int prefix_len, SV *value,
+                                 int options);
+SV*             hrattr_store(pTHX_ SV *self, SV *attr, char *t, SV *value,
+                             int options);
+
+/*Latency histograms. Operations are timed between hr_latency_begin(), which
+ returns 0 unless the table has them enabled, and hr_latency_end()*/
+enum {
+    HR_LAT_STORE = 0,
+    HR_LAT_STORE_A,
+    HR_LAT_UNLINK,
+    HR_LAT_PURGE,
+    HR_LAT_OP_COUNT
+};
+
+UV              hr_latency_begin(pTHX_ SV *self);
+void            hr_latency_end(pTHX_ SV *self, int op, UV begin);
+void            hr_latency_cascade(pTHX_ SV *object, HR_Action *actions);
+void            hr_latency_destroy(pTHX_ HR_Latency *lat);
+
+/*Parent table of a key or attribute, given one of the CFUNC actions tying
+ it to its own object or to an encapsulated one. NULL for any other action*/
+SV*             hrk_action_table(HR_Action *action);
+SV*             hrattr_action_table(HR_Action *action);
+
+/*Direct calls for fetch and store. HR_FASTCALL_INSTALL is placed at the top
+ of the exported XS entry points only, and switches the entersub op calling
+ them (if any) over to a direct call, see hr_fastcall.c. Internal callers use
+ the _real variants, so that ops belonging to other subs are never patched*/
+#define HR_FASTCALL_FETCH   0
+#define HR_FASTCALL_STORE   1
+
+#define HR_FASTCALL_INSTALL(which) \
+    if(PL_op && PL_op->op_ppaddr == PL_ppaddr[OP_ENTERSUB] \
+       && !PL_op->op_spare) { \
+        hr_fastcall_install(aTHX_ which); \
+    }
+
+void            hr_fastcall_install(pTHX_ int which);
+void            hr_fastcall_init(pTHX);
+
+/*Calls a user-supplied value encoder, returning a new SV with the encoded
+ string. Without an encoder, the value must be a reference to a plain scalar*/
+SV*             hr_value_encode(pTHX_ SV *encoder, SV *value);
 
 #endif /* HRPRIV_H_ */
\ No newline at end of file
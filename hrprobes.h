@@ -0,0 +1,37 @@
+#ifndef HRPROBES_H_
+#define HRPROBES_H_
+
+/*Static tracepoints. When built with HR_USE_SDT (Makefile.PL defines this if
+ sys/sdt.h is found), these are USDT probes under the "ref_store" provider,
+ usable from bpftrace, systemtap or dtrace. A probe costs a single nop until a
+ tracer attaches to it, and arguments should be kept cheap to evaluate.
+ Without HR_USE_SDT they compile to nothing.
+
+ Probe names use double underscores, which tracers display as dashes, e.g.
+    bpftrace -e 'usdt:./blib/arch/auto/Ref/Store/Store.so:ref_store:fetch-return
+        { @hits[arg1] = count(); }'
+*/
+
+#ifdef HR_USE_SDT
+#include <sys/sdt.h>
+
+#define HR_PROBE1(name, a1) \
+    DTRACE_PROBE1(ref_store, name, a1)
+#define HR_PROBE2(name, a1, a2) \
+    DTRACE_PROBE2(ref_store, name, a1, a2)
+#define HR_PROBE3(name, a1, a2, a3) \
+    DTRACE_PROBE3(ref_store, name, a1, a2, a3)
+
+#else
+
+#define HR_PROBE1(name, a1)
+#define HR_PROBE2(name, a1, a2)
+#define HR_PROBE3(name, a1, a2, a3)
+
+#endif /*HR_USE_SDT*/
+
+/*Length of a plain string key, without forcing stringification*/
+#define HR_PROBE_KLEN(sv) \
+    ((SvPOK(sv)) ? SvCUR(sv) : 0)
+
+#endif /* HRPROBES_H_ */
@@ -94,10 +94,56 @@ sub new {
 		$self->table_init();
 	}
 	
+	my %reserve = map { $_ => $options{$_} }
+		grep { $options{$_} } qw(expected_keys expected_values expected_attrs);
+	$self->reserve(%reserve) if %reserve;
+	
+	if($options{max_values}) {
+		die "max_values is only supported by the XS backend"
+			unless $self->can('set_max_values');
+		$self->set_max_values($options{max_values});
+	}
+	
+	if($options{attr_bitmaps}) {
+		die "attr_bitmaps is only supported by the XS backend"
+			unless $self->can('enable_attr_bitmaps');
+		$self->enable_attr_bitmaps();
+	}
+	
+	if($options{latency}) {
+		die "latency is only supported by the XS backend"
+			unless $self->can('enable_latency');
+		$self->enable_latency();
+	}
+	
 	weaken($Tables{$self+0} = $self);
 	return $self;
 }
 
+#Generic presizing. Assigning to keys() preallocates the hash buckets
+sub reserve {
+	my ($self,%options) = @_;
+	if($options{expected_keys}) {
+		keys(%{$self->forward}) = $options{expected_keys};
+		keys(%{$self->scalar_lookup}) = $options{expected_keys};
+	}
+	if($options{expected_values}) {
+		keys(%{$self->reverse}) = $options{expected_values};
+	}
+	if($options{expected_attrs}) {
+		keys(%{$self->attr_lookup}) = $options{expected_attrs};
+	}
+}
+
+sub load {
+	my ($cls,$path,$decoder,%options) = @_;
+	my $self = $cls->new(%options);
+	if(!$self->can('load_into')) {
+		die(ref($self) . " does not support loading saved tables");
+	}
+	return $self->load_into($path, $decoder);
+}
+
 sub purge {
 	my ($self,$value) = @_;
 	return unless defined $value;
@@ -135,6 +181,17 @@ sub exchange_value {
 	}
 }
 
+sub rekey {
+	my ($self,$old,$new) = @_;
+	my $value = $self->fetch($old);
+	return unless defined $value;
+	my ($olds,$news) = map { ref $_ ? $_+0 : $_ } ($old,$new);
+	return $value if $olds eq $news;
+	$self->store($new, $value);
+	$self->unlink($old);
+	return $value;
+}
+
 sub register_kt {
 	my ($self,$kt,$id_prefix) = @_;
 	if(!$self->keytypes) {
@@ -575,6 +632,40 @@ sub unlink_a {
 	}
 }
 
+sub has_a {
+    my ($self,$attr,$t,$value) = @_;
+    my $aobj = $self->attr_get($attr, $t) or return 0;
+    return exists $aobj->get_hash->{$value+0} ? 1 : 0;
+}
+
+#Generic versions of the multi-attribute queries, taking attribute/type pairs.
+#The XS backend does these with bitmaps, when enabled
+sub _attr_pairs {
+    my ($self,@spec) = @_;
+    die "Expected attribute/type pairs" if !@spec || @spec % 2;
+    my @hashes;
+    while (my ($attr,$t) = splice(@spec, 0, 2)) {
+        my $aobj = $self->attr_get($attr, $t);
+        push @hashes, $aobj ? $aobj->get_hash : {};
+    }
+    return @hashes;
+}
+
+sub fetch_a_all {
+    my $self = shift;
+    my ($first,@rest) = sort { keys %$a <=> keys %$b } $self->_attr_pairs(@_);
+    my @ret = grep {
+        my $vaddr = $_+0;
+        !grep { !exists $_->{$vaddr} } @rest;
+    } values %$first;
+    return wantarray ? @ret : scalar @ret;
+}
+
+sub fetch_a_any {
+    my $self = shift;
+    my %ret = map { %$_ } $self->_attr_pairs(@_);
+    return wantarray ? values %ret : scalar keys %ret;
+}
 
 *lexists_a = \&has_attr;
 
@@ -1089,6 +1180,12 @@ values
 
 Returns true if C<$value> is stored in the database
 
+=item exchange_value($old, $new)
+
+Replaces C<$old> with C<$new> under all of its keys and attributes, as if each
+had been stored again with C<$new>, keeping their C<StrongValue> settings. Dies
+if C<$new> is already in the database. Only fully supported by the XS backend.
+
 =back
 
 =item Simple Key (SK)
@@ -1124,6 +1221,12 @@ By default the value is weakened before it is inserted into the database, and wh
 the last external reference is destroyed, an implicit L</purge> is performed. Setting
 this to true will disable this behavior and not weaken the value object.
 
+=item TTL
+
+I<XS backend only>
+
+Expire the key after this many seconds. See L</EXPIRY>.
+
 =back
 
 It is important to note the various rules and behaviors with key and value
@@ -1196,6 +1299,24 @@ It is an error to call this method twice on the same lookup <-> value specificat
 
 Returns the value object indexed under C<$key>, if any. Also available under C<fetch_sk>
 
+=item fetch_alias($key)
+
+=item fetch_into($key, $scalar)
+
+I<XS backend only>
+
+Variants of C<fetch> which avoid allocating a new reference for each result.
+C<fetch_alias> returns the table's own (possibly weak) reference to the value.
+It only lasts until the end of the statement, and must not be modified; copy
+it into a variable to keep it. C<fetch_into> assigns the value to C<$scalar>
+(or undef if there is none), and returns true if the key was found.
+
+	my $conn;
+	foreach my $id (@ids) {
+		$table->fetch_into($id, $conn) or next;
+		$conn->ping();
+	}
+
 =item lexists($key)
 
 Returns true if C<$key> exists in the database. Also available as C<lexists_sk>
@@ -1213,6 +1334,13 @@ Also available as C<unlink_sk>
 	$table->unlink("key1"); # $foo is not deleted because it exists under "key2"
 	$table->unlink("key3"); # $bar is deleted because it has no remaining lookups
 	
+=item rekey($old_key, $new_key)
+
+Moves the value stored under C<$old_key> to C<$new_key>, and returns it. It is an
+error if C<$new_key> already holds a different value. The XS backend keeps the
+C<StrongValue> and C<StrongKey> settings of the old key; other backends store
+the new key with default options.
+
 =item purgeby($key)
 
 If C<$key> is linked to a value, then that value is removed from the database via
@@ -1271,6 +1399,10 @@ thus:
 
 and so on.
 
+The XS backend implements C<store_kt>, C<fetch_kt>, C<unlink_kt>, C<purgeby_kt>
+and C<lexists_kt> directly, composing the prefixed key on the C stack instead of
+building a new string for every call.
+
 In addition, there is a function which must be used to register key types:
 
 =over
@@ -1315,6 +1447,32 @@ thus:
 	
 However, storing an attribute is done only one value at a time.
 
+=item fetch_a_alias($attr, $type)
+
+=item fetch_a_into($attr, $type, \@values)
+
+I<XS backend only>
+
+Attribute counterparts of L</fetch_alias> and L</fetch_into>. C<fetch_a_into>
+fills C<@values>, reusing its elements, truncates it to the number of values
+found, and returns that number.
+
+=item has_a($attr, $type, $value)
+
+Returns true if C<$value> is stored under the attribute.
+
+=item fetch_a_all($attr, $type, $attr2, $type2, ...)
+
+=item fetch_a_any($attr, $type, $attr2, $type2, ...)
+
+Take any number of attribute/type pairs, and return the values stored under
+I<all> of the attributes, or under I<any> of them, in no particular order. In
+scalar context, the number of such values is returned. See L</ATTRIBUTE BITMAPS>
+for making these fast.
+
+	my @idle_admins = $hash->fetch_a_all(
+		admin => 'role', idle => 'state');
+
 =item dissoc_a($attr, $type, $value)
 
 Dissociates an attribute lookup from a single value. This function is special
@@ -1376,6 +1534,42 @@ default implementation checks to see whether the key is a reference, and if so
 uses its address, otherwise it uses the stringified value. It takes the user key
 as its argument
 
+=item expected_keys, expected_values, expected_attrs
+
+Capacity hints for bulk loading. The internal lookups are pre-sized for this
+many keys, distinct values and attributes, so that they don't repeatedly
+rehash as they grow. The XS backend additionally pre-allocates the nodes used
+for its back-delete actions. These may also be passed later to C<reserve>.
+
+=item max_values
+
+I<XS backend only>
+
+Bounds the number of distinct values held by the table, making it usable as a
+memory-bounded cache (typically together with C<StrongValue>). When a store
+would exceed the limit, a least recently used value is evicted, as if by
+L</purge>, so that all of its keys and attributes go with it.
+
+Recency is approximated with the CLOCK algorithm: fetching a value marks it as
+used, and eviction skips (and unmarks) used values, otherwise going in order
+of insertion. The value being stored is never evicted by its own store. The limit may be
+changed later with C<set_max_values>; setting it to C<0> removes it.
+
+A new thread's copy of the table keeps the limit. Its ring is rebuilt from the
+values it holds, so their order and used marks start over.
+
+=item attr_bitmaps
+
+I<XS backend only>
+
+Keeps a bitmap of values for each attribute; see L</ATTRIBUTE BITMAPS>.
+
+=item latency
+
+I<XS backend only>
+
+Records latency histograms for the table; see L</LATENCY HISTOGRAMS>.
+
 =back
 
 Ref::Store will try and select the best implementation (C<Ref::Store::XS>
@@ -1383,6 +1577,16 @@ and C<Ref::Store::PP>, in that order). You can override this by seting
 C<$Ref::Store::SelectedImpl> to a package of your choosing (which must be
 loaded).
 
+=item reserve(%options)
+
+Pre-sizes an existing table, taking the same C<expected_keys>,
+C<expected_values> and C<expected_attrs> options as C<new>. This is useful
+before loading a large batch into a table which is already populated. Hints
+only ever grow the lookups.
+
+Reserved action nodes in the XS backend are kept in a process-wide pool, which
+is reused as actions are freed, and is not returned to the system.
+
 =back
 
 =head2 ITERATION
@@ -1520,8 +1724,79 @@ for object references, it will print the reference address in decimal and hexade
 the actual SV address of the reference, and whether the reference is a weak
 reference.
 
+=item stats
+
+I<XS backend only>
+
+Returns a hash reference of counters, cheap enough to be left on in production.
+
+Per-table counters: C<stores>, C<fetch_hits>, C<fetch_misses>, C<unlinks>,
+C<purges>, C<attr_stores>, C<attr_fetches>, C<attr_unlinks> and C<evictions>.
+Lookups on a L<frozen|/FROZEN TABLES> table are not counted.
+
+Current entry counts for each internal lookup: C<forward_entries>,
+C<reverse_entries>, C<scalar_entries>, C<attr_entries> and C<keytype_entries>.
+
+Per-thread counters for the back-delete machinery: C<freehook_calls>,
+C<actions_created>, C<actions_freed>, C<max_action_list> (the longest list of
+actions attached to a single object) and C<max_trigger_depth> (the deepest
+recursion of cascading deletions).
+
+=item memory_usage
+
+I<XS backend only>
+
+Returns a hash reference estimating how many bytes the table occupies. The
+estimate follows perl's own data layout, but does not include allocator
+overhead, and does not include the values themselves.
+
+	lookups     The internal lookup hashes themselves
+	keys        Key objects, with their scalar and forward lookup entries
+	attributes  Attribute objects, their value hashes and lookup entries
+	reverse     The per-value hashes of reverse lookups
+	actions     Back-delete actions attached to keys, attributes and values
+	total       The sum of the above
+
+C<actions_allocated> is the size of all actions currently allocated by the
+calling thread, and may include actions belonging to other tables.
+
+C<by_type> breaks down keys and attributes by key type, each entry having
+C<keys>, C<attributes>, C<key_bytes> and C<attr_bytes>. Untyped and object keys
+are reported under the empty string.
+
+	my $usage = $table->memory_usage;
+	foreach my $kt (keys %{ $usage->{by_type} }) {
+		printf("%s: %d bytes\n", $kt, $usage->{by_type}{$kt}{key_bytes});
+	}
+
 =back
 
+=head3 Static tracepoints
+
+When F<sys/sdt.h> is present at build time (and C<HR_NO_SDT> is not set in the
+environment), the XS backend is built with USDT probes under the C<ref_store>
+provider. These cost nothing until a tracer such as C<bpftrace> attaches.
+
+	store-entry, store-return       (table, value, key length) / (table)
+	fetch-entry, fetch-return       (table, key length) / (table, found)
+	store_a-entry, store_a-return   (table, value, type) / (table)
+	freehook                        (object, refcount)
+	trigger-entry, trigger-return   (object) / (object, action count)
+	trigger-action                  (object, action type, depth)
+	attr-destroy                    (attribute, value count)
+
+=head3 Direct calls
+
+The XS backend makes C<fetch> and C<store> calls cheaper after they first run
+from a given place in the code: the call is then made directly, skipping
+perl's usual sub call setup and argument unpacking. Only the method lookup
+remains. Such a call still checks that it is calling the XS backend's method,
+and otherwise (for another backend, or a subclass overriding the method) goes
+back to being an ordinary call for good.
+
+Direct calls are not used under the debugger. Setting C<HR_NO_FASTCALL> in the
+environment before the module is loaded disables them.
+
 =head2 THREAD SAFETY
 
 C<Ref::Store> is tested as being threadsafe the XS backend.
@@ -1533,6 +1808,484 @@ though YMMV (on my machine, PP thread tests segfault).
 Thread safety is quite difficult since reference objects are keyed by their
 memory addresses, which change as those objects are duplicated.
 
+The XS backend keeps no global mutable state besides the pool of reserved
+action nodes, which is locked. Tables created in different threads are
+independent, and may be used concurrently. A single table must still only be
+used from the thread holding it, as with any other perl data.
+
+=head2 SHARED SNAPSHOTS
+
+I<XS backend only>
+
+Large tables which rarely change can be compiled into an immutable snapshot
+which lives outside of any interpreter. Every thread can query the same
+snapshot without locking and without a per-thread copy.
+
+	my $snap = $table->freeze_shared(sub { $_[0]->route_string });
+	
+	threads->create(sub {
+		my $route = $snap->fetch("some_key");
+		my @routes = $snap->fetch_a(1, "some_attr");
+	});
+	
+	#Later on, in any thread holding $table:
+	$table->freeze_shared($encoder); #$snap now sees the new contents
+
+=over
+
+=item freeze_shared($encoder)
+
+Compiles the string keys, typed keys and string attributes of the table into a
+new snapshot, and returns a handle to it. Object keys and object attributes are
+not included, as their identities are specific to an interpreter.
+
+Values are stored as strings. C<$encoder> is called with each value and should
+return its string representation; if not given, values must be references to
+plain scalars, whose contents are used. The encoder must not modify the table.
+
+Calling C<freeze_shared> again on the same table replaces the snapshot for all
+existing handles. Handles pick up the new contents on their next lookup, and
+keep working on the previous contents until then.
+
+=item $snap->fetch($key), $snap->fetch_kt($key, $type), $snap->fetch_a($attr, $type)
+
+Like their table counterparts, but return the encoded strings. C<fetch_a> in
+scalar context returns the number of values.
+
+=item $snap->generation
+
+Returns a counter which is incremented each time a new snapshot is published.
+
+=back
+
+=head2 FROZEN TABLES
+
+I<XS backend only>
+
+A server which loads a large table and then forks its workers would like the
+table's memory to stay shared between them. Lookups on the perl hashes of a
+table don't modify the hashes themselves, but C<fetch_a> does reset their
+iterators, so such pages are soon copied. Lookups also wander over every hash
+entry and key they pass.
+
+Freezing the table before forking compiles its string keys, typed keys and
+string attributes into a single compact block, the same as
+L</freeze_shared>, but holding the values themselves. C<fetch>, C<fetch_kt>,
+C<fetch_alias>, C<fetch_into>, C<lexists>, C<lexists_kt>, C<fetch_a>,
+C<fetch_a_alias> and C<fetch_a_into> then use this block, which they never
+write to. Object keys and object attributes are still looked up in the hashes,
+without writing to them. While frozen, lookups are not counted in L</stats>, and
+fetches don't mark values as used for L</max_values>.
+
+	$table->freeze;
+	for (1..32) {
+		next if fork;
+		serve($table);
+		exit;
+	}
+
+=over
+
+=item freeze
+
+Builds the lookup block, replacing any previous one. While frozen, the table
+holds a strong reference to each value in the block.
+
+=item thaw
+
+Releases the block. Any change to the table (storing, unlinking, purging,
+dissociating, exchanging values, or expiry) thaws it implicitly, so a frozen
+table never returns stale results.
+
+=item is_frozen
+
+Returns true while the table is frozen.
+
+=back
+
+Some things still write to shared pages:
+
+=over
+
+=item *
+
+Returning a value creates a new reference to it, which increments the value's
+own reference count. C<fetch_alias> and C<fetch_a_alias> return such new
+references too, rather than the stored ones.
+
+=item *
+
+Iterating over the table with C<iterinit> and C<iter> uses the iterators of the
+lookup hashes.
+
+=back
+
+Frozen tables are thawed in new threads.
+
+=head2 SHARED DIRECTORIES
+
+I<XS backend only>
+
+Tables belong to a single interpreter. A directory is a separate map of string
+(or integer) keys to short strings, which lives outside of any interpreter, so
+that every thread can see, for example, which thread owns a given session.
+
+	my $dir = Ref::Store::XS::Directory->new();
+	
+	threads->create(sub {
+		my $table = Ref::Store::XS->new();
+		$table->store($session_id, $session);
+		$table->publish($dir, $session_id, threads->tid);
+		...
+	});
+	
+	#In any thread
+	my $owner = $dir->fetch($session_id);
+
+Lookups take no locks, and only write to a slot belonging to the thread's own
+handle, so threads reading the same directory don't contend. Writers lock one of
+several stripes, picked by the key, so writers only wait for each other when
+their keys share a stripe.
+
+=over
+
+=item Ref::Store::XS::Directory->new(%options)
+
+Creates a new directory. C<buckets> is the initial number of buckets, which
+grows as needed; C<stripes> is the number of write locks, and defaults to 16.
+Both are rounded up to a power of two.
+
+Handles are duplicated into new threads, and refer to the same directory. Each
+handle should only be used by the thread which owns it.
+
+=item $dir->store($key, $payload)
+
+Stores the string C<$payload> under C<$key>, replacing any existing entry.
+
+=item $dir->fetch($key)
+
+Returns a copy of the payload stored under C<$key>, or C<undef>.
+
+=item $dir->delete($key)
+
+Removes the entry, returning true if there was one.
+
+=item $dir->count
+
+Returns the number of entries.
+
+=item $table->publish($dir, $key, $payload)
+
+Stores C<$payload> in C<$dir> under C<$key>, which must already be stored in
+the table as a plain string key. The entry is then removed along with the key,
+however that leaves the table (unlinking, purging, expiry, or its value being
+destroyed), unless the entry has since been replaced by another C<store> or
+C<publish>.
+
+Keys are not watched during global destruction, so tables should be released
+before a thread exits if their entries are to be removed.
+
+An entry stays tied to the key of the table which published it. A new thread's
+copy of the table does not withdraw the parent's entries when its own copies of
+the keys go away; publishing them again from the thread ties them to the
+thread's keys instead.
+
+=back
+
+=head2 SAVING AND LOADING
+
+I<XS backend only>
+
+Tables can be saved to a compact binary file and loaded back in a single pass,
+which is much faster than replaying the original C<store> and C<store_a> calls.
+
+	$table->save("routes.hrs", sub { $_[0]->id });
+	
+	#At startup:
+	my $table = Ref::Store->load("routes.hrs", sub { $Registry{$_[0]} });
+
+=over
+
+=item save($path, $encoder)
+
+Writes the key types, string keys, typed keys and string attributes of the
+table to C<$path>, along with the C<StrongValue> setting of each entry. Object
+keys and object attributes are not saved.
+
+C<$encoder> is called once for each distinct value and should return a string
+from which the value can be recovered. If not given, values must be references
+to plain scalars, whose contents are saved.
+
+=item Ref::Store->load($path, $decoder, %options)
+
+Creates a new table (passing C<%options> to C<new>), and populates it from a
+file written by C<save>. C<$decoder> receives each encoded string and must
+return a reference. If not given, each value is loaded as a reference to a new
+scalar holding the string.
+
+Entries which were not stored with C<StrongValue> are weak as usual, and will
+vanish as soon as the load returns unless something else references their
+values.
+
+The file is mapped into memory where possible. Files are specific to the byte
+order of the machine which wrote them.
+
+=item load_into($path, $decoder)
+
+Like C<load>, but populates an existing table.
+
+=back
+
+
+=head2 EXPIRY
+
+I<XS backend only>
+
+Keys and attributes may be given a time-to-live by passing a C<TTL> option (in
+seconds, fractions allowed) to L</store> or L</store_a>. Storing the same key or
+attribute again with a C<TTL> resets its deadline.
+
+Deadlines are kept on a timer wheel inside the table, with a resolution of
+1/16th of a second. Nothing is expired on its own; the application calls
+C<expire> periodically, for example from an event loop timer:
+
+	$table->store($session_id, $session, StrongValue => 1, TTL => 1800);
+	...
+	my $nexpired = $table->expire();
+
+=over
+
+=item expire($now)
+
+Unlinks all keys and attributes whose deadline is at or before C<$now> (in epoch
+seconds, defaulting to the current time), and returns how many were expired.
+Expired keys are removed as if by L</unlink>, and expired attributes as if by
+L</unlink_a>, so values and other lookups cascade as usual.
+
+=item ttl_pending
+
+Returns the number of keys and attributes waiting to expire.
+
+=back
+
+A key or attribute which leaves the table before its deadline (by being
+unlinked, purged or garbage collected) is taken off the wheel. Pending expiries
+are not carried over into new threads.
+
+=head2 INTEGER KEYS
+
+I<XS backend only>
+
+Plain integer keys can be stored without being turned into strings, which saves
+both the formatting and the key object otherwise created for each key. These
+live in a separate index inside the table, and are only visible through the
+C<_ik> functions:
+
+	$table->store_ik($id, $object);
+	my $object = $table->fetch_ik($id);
+
+=over
+
+=item store_ik($int, $value, %options)
+
+Like L</store>, but C<$int> is taken as an integer. Only the C<StrongValue>
+option is recognized.
+
+=item fetch_ik($int)
+
+=item unlink_ik($int)
+
+=item lexists_ik($int)
+
+Like L</fetch>, L</unlink> and L</lexists>, for integer keys.
+
+=back
+
+Integer keys are removed when their value is destroyed or purged, as with other
+keys. They are not counted towards C<max_values>, do not appear in iteration, and
+are not carried over into new threads.
+
+=head2 REMOVAL NOTIFICATIONS
+
+I<XS backend only>
+
+An application mirroring the table elsewhere (an external index, for example)
+can subscribe to keys leaving it. Removals are queued inside the table and
+handed to the callback in batches, so that mass frees don't call into perl once
+per key:
+
+	$table->on_evict(sub {
+		my ($keys,$vaddrs) = @_;
+		$index->delete_many(@$keys);
+	}, batch => 256);
+
+=over
+
+=item on_evict($callback, batch => $n)
+
+Subscribes C<$callback> to key removals, replacing any previous callback. It
+is called with two array references: the removed keys, and the addresses of
+the values they pointed to (as numbers, since the values may already be gone).
+Keys are reported as stored, so typed keys include their prefix, and object keys
+are given as the object's address.
+
+Every way a key can leave the table is reported: L</unlink>, L</purge>,
+eviction, expiry, and its value or key object being destroyed. Integer keys and
+attributes are not reported.
+
+The callback is called once C<$n> removals (default 1) are pending. It is never
+called in the middle of a table operation: removals are handed over when the
+operation which caused them returns, or, for a value or key freed outside of
+the table, once perl has finished freeing it. The callback may therefore use
+the table itself. It runs inside an C<eval>; errors are turned into warnings.
+Passing C<undef> unsubscribes, delivering anything still pending first.
+
+=item flush_evictions
+
+Calls the callback with any pending removals, regardless of the batch size, and
+returns how many were delivered.
+
+=item evictions_pending
+
+Returns the number of removals waiting to be delivered.
+
+=back
+
+Pending removals are delivered when the table is destroyed; the removal of the
+table's own contents at that point is not reported.
+
+A new thread's copy of the table is subscribed with the thread's copy of the
+callback, and reports its own removals. Removals still pending in the parent
+when the thread was created are left to the parent.
+
+=head2 ORDERED INDEXES
+
+I<XS backend only>
+
+Lookups are otherwise exact. A key type may additionally be given an ordered
+index, after which its typed keys and (non-object) attributes can be scanned by
+range or by prefix:
+
+	$table->register_kt('user');
+	$table->index_kt('user');
+	$table->store_kt("42:session:$id", 'user', $session);
+	...
+	my @sessions = $table->fetch_prefix('user', '42:session:');
+
+=over
+
+=item index_kt($type, Numeric => 1)
+
+Creates an ordered index for C<$type>, including any keys and attributes of the
+type already in the table. The index is kept up to date from then on. Keys are
+ordered by their string (without the type prefix), or, with C<Numeric>, by their
+numeric value.
+
+=item fetch_range($type, $lo, $hi)
+
+Returns the values of all keys and attributes of C<$type> between C<$lo> and
+C<$hi> inclusive, in key order. Either bound may be C<undef>, leaving that end
+open. An attribute contributes all of its values, in no particular order. In
+scalar context, the number of values is returned.
+
+=item fetch_prefix($type, $prefix)
+
+Like C<fetch_range>, for all keys and attributes beginning with C<$prefix>. Only
+available for indexes ordered by string.
+
+=item index_count($type)
+
+Returns the number of keys and attributes in the index for C<$type>.
+
+=back
+
+Indexes are not carried over into new threads.
+
+=head2 ATTRIBUTE BITMAPS
+
+I<XS backend only>
+
+By default, L</fetch_a_all> and L</fetch_a_any> combine attributes by looking
+each value of one attribute up in the others. For tables where values carry
+many attributes, and attributes have many values, the table can instead give
+each value a small integer ID, and keep the IDs of each attribute's values in a
+compressed bitmap. Intersections, unions and counts are then done many values
+at a time, and counting doesn't create any perl values at all.
+
+	my $table = Ref::Store->new(attr_bitmaps => 1);
+	...
+	my $n = $table->fetch_a_all(red => 'color', large => 'size');
+
+=over
+
+=item enable_attr_bitmaps
+
+Enables bitmaps on an existing table, building them for the attributes already
+in it. This is what the C<attr_bitmaps> option to C<new> does. Bitmaps can't be
+disabled again.
+
+=item value_id($value)
+
+Returns the ID of C<$value>, or C<undef> if it has none. A value gets an ID
+when it is first stored under an attribute. The ID of a value which is purged,
+or destroyed, is eventually given to another value.
+
+=back
+
+Bitmaps are kept in addition to the attributes' ordinary lookups, so they cost
+memory rather than saving it; they are typically a few bits per value and
+attribute. They are not carried over into new threads.
+
+=head2 LATENCY HISTOGRAMS
+
+I<XS backend only>
+
+Removing a value, key or attribute may set off a chain of further deletions,
+as its back-delete actions remove entries which in turn were holding the last
+reference to other keys, attributes or values. A table can record how long
+these chains take, to find which kinds of keys cause the slow ones.
+
+	my $table = Ref::Store->new(latency => 1);
+	...
+	my $report = $table->latency_report;
+	foreach my $kind (keys %{ $report->{cascades} }) {
+		my $c = $report->{cascades}{$kind};
+		printf("%-16s p99 %dns, %d actions, depth %d\n", $kind,
+			$c->{latency}{p99}, $c->{actions}{max}, $c->{depth}{max});
+	}
+
+=over
+
+=item enable_latency($on)
+
+Starts (or, with a false argument, stops) recording. Stopping discards what has
+been recorded so far.
+
+=item latency_report(reset => 1)
+
+Returns C<undef> if recording is not enabled. Otherwise, returns a hash
+reference with a histogram for each of C<store>, C<store_a>, C<unlink> and
+C<purge>, timing the whole operation including any deletions it sets off.
+
+C<cascades> holds the chains of deletions started by an object being freed,
+keyed by the kind of object: C<value>, C<key> (or C<key:TYPE> for typed keys),
+C<object_key>, C<attr> (or C<attr:TYPE>) and C<object_attr>. Each has
+histograms of C<latency>, C<depth> (how deeply the actions nested) and
+C<actions> (how many of them fired).
+
+Each histogram has C<count>, C<min>, C<max>, C<mean>, C<p50>, C<p90>, C<p99>
+and C<p999>. Times are in nanoseconds. Percentiles are accurate to about 6%,
+and are rounded up.
+
+With C<reset>, the histograms are cleared once they have been reported.
+
+=back
+
+Cascades are attributed to the tables whose lookups (or keys and attributes)
+the object's actions refer to, so that an object stored in several tables is
+counted by each of them. Chains set off while another one is already running
+are counted as part of the outer one. Histograms are not carried over into new
+threads.
 
 =head2 USAGE APPLICATIONS
 
@@ -63,11 +63,37 @@ use Ref::Store::XS::cfunc;
 our @ISA = qw(Ref::Store::XS::Attribute);
 *ukey           = \&HRXSATTR_encap_ukey;
 
+package Ref::Store::XS::Snapshot;
+use strict;
+use warnings;
+use Ref::Store::XS::cfunc;
+
+*fetch = *fetch_sk  = \&HRXSNAP_fetch;
+*fetch_kt           = \&HRXSNAP_fetch_kt;
+*fetch_a            = \&HRXSNAP_fetch_a;
+*generation         = \&HRXSNAP_generation;
+
+package Ref::Store::XS::Directory;
+use strict;
+use warnings;
+use Ref::Store::XS::cfunc;
+
+sub new {
+    my ($cls,%options) = @_;
+    HRXSDIR_new($cls, $options{buckets} || 0, $options{stripes} || 0);
+}
+
+*store              = \&HRXSDIR_store;
+*fetch              = \&HRXSDIR_fetch;
+*delete             = \&HRXSDIR_delete;
+*count              = \&HRXSDIR_count;
+
 package Ref::Store::XS;
 use strict;
 use warnings;
 use base qw(Ref::Store);
 use Ref::Store::XS::cfunc;
+use Devel::GlobalDestruction;
 use Log::Fu;
 
 #These two lines completely override the perl store/fetch code and utilize
@@ -77,15 +103,142 @@ use Log::Fu;
 
 *store = *store_sk  = \&HRA_store_sk;
 *fetch = *fetch_sk  = \&HRA_fetch_sk;
+*fetch_alias        = \&HRA_fetch_alias;
+*fetch_into         = \&HRA_fetch_into;
 *store_kt           = \&HRA_store_kt;
+*fetch_kt           = \&HRA_fetch_kt;
+*unlink_kt          = \&HRA_unlink_kt;
+*purgeby_kt         = \&HRA_purgeby_kt;
+*lexists_kt         = \&HRA_lexists_kt;
+*lexists = *has_key = \&HRA_lexists_sk;
+*unlink = *unlink_sk= \&HRA_unlink_sk;
+*purge              = \&HRA_purge;
+*exchange_value     = \&HRA_exchange_value;
+*rekey              = \&HRA_rekey;
+*stats              = \&HRA_stats;
+*memory_usage       = \&HRA_memory_usage;
+*ttl_pending        = \&HRA_ttl_pending;
+*set_max_values     = \&HRA_set_max_values;
+*max_values         = \&HRA_max_values;
+*store_ik           = \&HRA_store_ik;
+*fetch_ik           = \&HRA_fetch_ik;
+*unlink_ik          = \&HRA_unlink_ik;
+*lexists_ik         = \&HRA_lexists_ik;
+*flush_evictions    = \&HRA_flush_evictions;
+*evictions_pending  = \&HRA_evictions_pending;
+*fetch_prefix       = \&HRA_fetch_prefix;
+*index_count        = \&HRA_index_count;
+*enable_attr_bitmaps= \&HRA_enable_attr_bitmaps;
+*value_id           = \&HRA_value_id;
+*has_a              = \&HRA_has_a;
+*freeze             = \&HRA_freeze;
+*thaw               = \&HRA_thaw;
+*is_frozen          = \&HRA_is_frozen;
+*publish            = \&HRA_dir_publish;
 
 *store_a            = \&HRA_store_a;
 *fetch_a            = \&HRA_fetch_a;
+*fetch_a_alias      = \&HRA_fetch_a_alias;
+*fetch_a_into       = \&HRA_fetch_a_into;
 *dissoc_a           = \&HRA_dissoc_a;
 *unlink_a           = \&HRA_unlink_a;
 *attr_get           = \&HRA_attr_get;
 *ithread_store_lookup_info = \&HRA_ithread_store_lookup_info;
 
+#C-side settings follow once the keys have been rebuilt
+sub ithread_postdup {
+    my $self = shift;
+    $self->SUPER::ithread_postdup(@_);
+    HRA_ithread_restore($self);
+}
+
+sub freeze_shared {
+    my ($self,$encoder) = @_;
+    return HRA_freeze_shared($self, $encoder);
+}
+
+sub save {
+    my ($self,$path,$encoder) = @_;
+    HRA_save($self, $path, $encoder);
+}
+
+sub load_into {
+    my ($self,$path,$decoder) = @_;
+    HRA_load_into($self, $path, $decoder);
+    return $self;
+}
+
+sub reserve {
+    my ($self,%options) = @_;
+    HRA_table_reserve($self, map { $options{$_} || 0 }
+                      qw(expected_keys expected_values expected_attrs));
+}
+
+sub expire {
+    my ($self,$now) = @_;
+    return HRA_expire($self, $now || 0);
+}
+
+HRA_api_publish();
+
+#Directory containing hr_api.h, for building other XS modules against us
+sub api_include_dir {
+    (my $dir = __FILE__) =~ s/\.pm$//;
+    return $dir;
+}
+
+sub index_kt {
+    my ($self,$t,%options) = @_;
+    HRA_index_kt($self, $t, $options{Numeric} ? 1 : 0);
+}
+
+sub fetch_range {
+    my ($self,$t,$lo,$hi) = @_;
+    HRA_fetch_range($self, $t, $lo, $hi);
+}
+
+sub fetch_a_all {
+    my $self = shift;
+    return $self->SUPER::fetch_a_all(@_) unless HRA_attr_bitmaps($self);
+    HRA_fetch_a_set($self, 0, @_);
+}
+
+sub fetch_a_any {
+    my $self = shift;
+    return $self->SUPER::fetch_a_any(@_) unless HRA_attr_bitmaps($self);
+    HRA_fetch_a_set($self, 1, @_);
+}
+
+sub enable_latency {
+    my ($self,$on) = @_;
+    HRA_enable_latency($self, (!defined $on || $on) ? 1 : 0);
+}
+
+sub latency_report {
+    my ($self,%options) = @_;
+    return HRA_latency_report($self, $options{reset} ? 1 : 0);
+}
+
+sub on_evict {
+    my ($self,$cb,%options) = @_;
+    HRA_on_evict($self, $cb, $options{batch} || 1);
+}
+
+#Pending removals are delivered, and the table's own teardown isn't reported.
+#Values held by a frozen table are released while the table is still intact
+sub DESTROY {
+    my $self = shift;
+    unless(in_global_destruction) {
+        HRA_on_evict($self, undef, 0);
+        HRA_thaw($self);
+    }
+    $self->SUPER::DESTROY();
+}
+
+sub is_empty {
+    my $self = shift;
+    $self->SUPER::is_empty() && !HRA_ik_count($self);
+}
 
 sub new_key {
     my ($self,$scalar) = @_;
@@ -134,4 +287,30 @@ Ref::Store::XS - XS/C implementation of the H::R API
 No user serviceable parts inside.
 
 This backend currently handles store, fetch, and back-delete operations entirely
-in C, making it significantly fast.
\ No newline at end of file
+in C, making it significantly fast.
+
+=head2 C API
+
+Other XS modules can use tables without going through perl method calls. Once
+this module is loaded, a versioned table of C functions (store, fetch, unlink,
+purge, store_a, fetch_a, and the back-delete actions) is published in
+C<PL_modglobal>. It is described by F<hr_api.h>, which is installed alongside
+this module; C<< Ref::Store::XS->api_include_dir >> returns its directory, for
+use in a Makefile.PL:
+
+	INC => '-I' . Ref::Store::XS->api_include_dir,
+
+and in the XS code:
+
+	#include "hr_api.h"
+	static HR_API *hr_api;
+
+	BOOT:
+		load_module(PERL_LOADMOD_NOIMPORT, newSVpvs("Ref::Store::XS"), NULL);
+		hr_api = HR_API_GET();
+
+	...
+	SV *value = hr_api->fetch(table, key);
+
+C<HR_API_GET> croaks if the loaded version of this module provides an older
+API than the header describes.
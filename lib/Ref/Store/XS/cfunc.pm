@@ -5,6 +5,7 @@ use XSLoader;
 our $VERSION = '0.20';
 
 XSLoader::load 'Ref::Store', $VERSION;
+HRA_context_init();
 
 use base qw(Exporter);
 
@@ -31,16 +32,75 @@ our @EXPORT = qw(
     HRXSK_encap_ithread_postdup
     
     HRA_table_init
+    HRA_table_reserve
 	HRA_store_sk
     HRA_store_kt
+    HRA_fetch_kt
+    HRA_unlink_kt
+    HRA_purgeby_kt
+    HRA_lexists_kt
+    HRA_lexists_sk
 	HRA_fetch_sk
+    HRA_fetch_alias
+    HRA_fetch_into
+    HRA_unlink_sk
+    HRA_purge
+    HRA_exchange_value
+    HRA_rekey
     
     HRA_store_a
     HRA_fetch_a
+    HRA_fetch_a_alias
+    HRA_fetch_a_into
     HRA_dissoc_a
     HRA_unlink_a
     HRA_attr_get
     HRA_ithread_store_lookup_info
+    HRA_ithread_restore
+    HRA_freeze_shared
+    
+    HRXSNAP_fetch
+    HRXSNAP_fetch_kt
+    HRXSNAP_fetch_a
+    HRXSNAP_generation
+    HRXSDIR_new
+    HRXSDIR_store
+    HRXSDIR_fetch
+    HRXSDIR_delete
+    HRXSDIR_count
+    HRA_dir_publish
+    
+    HRA_save
+    HRA_load_into
+    HRA_stats
+    HRA_memory_usage
+    HRA_expire
+    HRA_ttl_pending
+    HRA_set_max_values
+    HRA_max_values
+    HRA_store_ik
+    HRA_fetch_ik
+    HRA_unlink_ik
+    HRA_lexists_ik
+    HRA_ik_count
+    HRA_on_evict
+    HRA_flush_evictions
+    HRA_evictions_pending
+    HRA_api_publish
+    HRA_index_kt
+    HRA_fetch_range
+    HRA_fetch_prefix
+    HRA_index_count
+    HRA_enable_attr_bitmaps
+    HRA_attr_bitmaps
+    HRA_value_id
+    HRA_has_a
+    HRA_fetch_a_set
+    HRA_freeze
+    HRA_thaw
+    HRA_is_frozen
+    HRA_enable_latency
+    HRA_latency_report
     
     HRXSATTR_unlink_value
     HRXSATTR_get_hash
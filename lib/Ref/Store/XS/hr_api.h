@@ -0,0 +1,90 @@
+#ifndef HR_API_H_
+#define HR_API_H_
+
+/*C interface to Ref::Store::XS, for use by other XS modules.
+
+ Once Ref::Store::XS is loaded, a table of function pointers is published
+ in PL_modglobal. Fetch it once (for example in BOOT:) with HR_API_GET(),
+ and call through it directly, rather than calling store/fetch as methods:
+
+    static HR_API *hr_api;
+    ...
+    BOOT:
+        load_module(PERL_LOADMOD_NOIMPORT, newSVpvs("Ref::Store::XS"), NULL);
+        hr_api = HR_API_GET();
+    ...
+    SV *value = hr_api->fetch(table, key);
+
+ 'table' is always a reference to a Ref::Store::XS object, as passed to its
+ methods. Functions returning an SV* return a new reference, which the
+ caller must release, or NULL. Errors are raised with croak(), as they
+ would be for the corresponding methods.
+
+ Members are only ever appended, and HR_API_VERSION is bumped whenever
+ they are. HR_API_GET() croaks if the loaded module provides an older
+ table than the one this header describes*/
+
+#include "EXTERN.h"
+#include "perl.h"
+
+#define HR_API_VERSION          1
+#define HR_API_MODGLOBAL_KEY    "Ref::Store::XS::API"
+
+/*Flags for store() and store_a()*/
+#define HR_API_STRONG_KEY       (1 << 0)
+#define HR_API_STRONG_ATTR      (1 << 0)
+#define HR_API_STRONG_VALUE     (1 << 1)
+
+/*Called when the object an action is attached to is destroyed. The last
+ argument is reserved*/
+typedef void (*HR_API_Callback)(SV *object, void *arg, void *reserved);
+
+typedef struct {
+    U32     version;
+
+    /*Keys. These are equivalent to store(), fetch(), unlink() and purge()*/
+    void    (*store)(SV *table, SV *key, SV *value, int flags);
+    SV*     (*fetch)(SV *table, SV *key);
+    SV*     (*unlink)(SV *table, SV *key);
+    void    (*purge)(SV *table, SV *value);
+
+    /*Attributes. fetch_a() fills 'dest' with the values, and returns how
+     many there are*/
+    void    (*store_a)(SV *table, SV *attr, char *t, SV *value, int flags);
+    UV      (*fetch_a)(SV *table, SV *attr, char *t, AV *dest);
+
+    /*Back-delete actions. When the object referenced by 'objref' is
+     destroyed, its address (ptr) or the given string (str) is deleted from
+     the hash referenced by 'hashref'*/
+    void    (*add_action_ptr)(SV *objref, SV *hashref);
+    void    (*add_action_str)(SV *objref, SV *hashref, char *key);
+    void    (*del_action_ptr)(SV *objref, SV *hashref, UV addr);
+    void    (*del_action_str)(SV *objref, SV *hashref, char *key);
+    void    (*del_action_container)(SV *objref, SV *hashref);
+
+    /*Calls 'fn' with 'arg' when the object referenced by 'objref' is
+     destroyed. A given fn and arg pair is only attached once*/
+    void    (*add_callback)(SV *objref, HR_API_Callback fn, void *arg);
+    void    (*del_callback)(SV *objref, HR_API_Callback fn, void *arg);
+} HR_API;
+
+static inline HR_API*
+hr_api_get(pTHX)
+{
+    SV **svp = hv_fetch(PL_modglobal, HR_API_MODGLOBAL_KEY,
+                        sizeof(HR_API_MODGLOBAL_KEY) - 1, 0);
+    HR_API *api;
+    if(!svp || !SvIOK(*svp)) {
+        croak("Ref::Store::XS is not loaded");
+    }
+    api = INT2PTR(HR_API*, SvIV(*svp));
+    if(api->version < HR_API_VERSION) {
+        croak("Ref::Store::XS provides API version %d, need %d",
+              (int)api->version, HR_API_VERSION);
+    }
+    return api;
+}
+
+#define HR_API_GET() hr_api_get(aTHX)
+
+#endif /*HR_API_H_*/
@@ -0,0 +1,45 @@
+/*A minimal client of the C API, built by test_c_api the way another XS
+ module would be: against hr_api.h alone, calling through the published
+ function table*/
+
+#include "hr_api.h"
+
+static HR_API *hr_api;
+
+static HR_API*
+api(void)
+{
+    if(!hr_api) {
+        hr_api = HR_API_GET();
+    }
+    return hr_api;
+}
+
+/*Counts destructions into the scalar passed to client_add_callback*/
+static void
+counter_callback(SV *object, void *arg, void *reserved)
+{
+    sv_inc((SV*)arg);
+}
+
+void client_store(SV *table, SV *key, SV *value)
+{
+    api()->store(table, key, value, 0);
+}
+
+SV *client_fetch(SV *table, SV *key)
+{
+    SV *ret = api()->fetch(table, key);
+    return ret ? ret : &PL_sv_undef;
+}
+
+SV *client_unlink(SV *table, SV *key)
+{
+    SV *ret = api()->unlink(table, key);
+    return ret ? ret : &PL_sv_undef;
+}
+
+void client_add_callback(SV *object, SV *counter)
+{
+    api()->add_callback(object, counter_callback, SvRV(counter));
+}
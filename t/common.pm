@@ -123,6 +123,31 @@ sub test_object_keys2 {
     }
     ok(!$hash->has_key($key2), "Value (OKEY) GC");
     
+    my $v = ValueObject->new();
+    my $key = KeyObject->new();
+    my $wkey = $key;
+    weaken($wkey);
+    $hash->store($key, $v);
+    undef $key;
+    ok(!$wkey, "Object key not kept alive by the table");
+    ok(!$hash->has_value($v), "Key GC removes value");
+    
+    $key = KeyObject->new();
+    $wkey = $key;
+    weaken($wkey);
+    $hash->store($key, $v, StrongKey => 1);
+    undef $key;
+    ok($wkey, "StrongKey keeps object alive");
+    is($hash->fetch($wkey), $v, "Fetch by strong key");
+    $hash->unlink($wkey);
+    ok(!$wkey, "Unlinking releases strong key");
+    
+    $key = KeyObject->new();
+    $hash->store($key, $v);
+    is($hash->unlink($key), $v, "Unlink object key");
+    ok(!$hash->has_key($key), "Object key gone after unlink");
+    $hash->store($key, $v);
+    is($hash->fetch($key), $v, "Object key stored again after unlink");
 }
 
 sub test_scalar_attr {
@@ -402,6 +427,25 @@ sub test_kt {
     $rs->store_kt(42, 'bar', $bar_obj);
     is($rs->fetch_kt(42, 'foo'), $foo_obj);
     is($rs->fetch_kt(42, 'bar'), $bar_obj);
+    ok($rs->lexists_kt(42, 'foo'), "lexists_kt");
+    ok(!$rs->lexists_kt(43, 'foo'), "lexists_kt (missing key)");
+    
+    my $long = "x" x 300;
+    $rs->store_kt($long, 'foo', $foo_obj);
+    is($rs->fetch_kt($long, 'foo'), $foo_obj, "Long typed key");
+    
+    is($rs->unlink_kt(42, 'bar'), $bar_obj, "unlink_kt returns value");
+    ok(!$rs->fetch_kt(42, 'bar'), "Typed key unlinked");
+    is($rs->fetch_kt(42, 'foo'), $foo_obj, "Same key of other type intact");
+    
+    SKIP: {
+        skip "PP Backend is crappy", 2 if $Impl =~ /PP/;
+        is($rs->purgeby_kt(42, 'foo'), $foo_obj, "purgeby_kt returns value");
+        ok(!$rs->fetch_kt($long, 'foo'), "purgeby_kt removes other keys");
+    }
+    
+    eval { $rs->fetch_kt(1, 'unregistered') };
+    ok($@, "Unregistered type dies");
 }
 
 sub test_iter {
@@ -462,6 +506,838 @@ sub misc_api {
     
 }
 
+sub test_snapshot {
+    my $rs = $Impl->new();
+    $rs->register_kt('typed');
+    my $v1 = \do { my $s = "first" };
+    my $v2 = \do { my $s = "second" };
+    my $kobj = KeyObject->new();
+    
+    $rs->store("plain", $v1);
+    $rs->store_kt(42, 'typed', $v2);
+    $rs->store($kobj, $v2);
+    $rs->store_a(1, 'typed', $_) for ($v1, $v2);
+    
+    my $snap = $rs->freeze_shared();
+    is($snap->fetch("plain"), "first", "String key in snapshot");
+    is($snap->fetch_kt(42, 'typed'), "second", "Typed key in snapshot");
+    is(scalar $snap->fetch_a(1, 'typed'), 2, "Attribute count in snapshot");
+    is_deeply([sort $snap->fetch_a(1, 'typed')], [qw(first second)],
+              "Attribute values in snapshot");
+    ok(!defined $snap->fetch("nonexistent"), "Missing key is undef");
+    
+    my $gen = $snap->generation;
+    $rs->unlink("plain");
+    is($snap->fetch("plain"), "first", "Snapshot unaffected by table changes");
+    $rs->freeze_shared(sub { uc ${$_[0]} });
+    ok($snap->generation > $gen, "Generation bumped on republish");
+    ok(!defined $snap->fetch("plain"), "Republished snapshot visible to handle");
+    is($snap->fetch_kt(42, 'typed'), "SECOND", "Encoder applied");
+}
+
+sub test_freeze {
+    my $rs = $Impl->new();
+    $rs->register_kt('typed');
+    my @values = map { ValueObject->new() } (0..3);
+    my $kobj = KeyObject->new();
+    
+    $rs->store("plain", $values[0]);
+    $rs->store_kt(42, 'typed', $values[1]);
+    $rs->store($kobj, $values[2]);
+    $rs->store_a(1, 'typed', $_) for @values[0,1];
+    
+    $rs->freeze();
+    ok($rs->is_frozen, "Table frozen");
+    is($rs->fetch("plain"), $values[0], "String key from frozen table");
+    is($rs->fetch_kt(42, 'typed'), $values[1], "Typed key from frozen table");
+    is($rs->fetch($kobj), $values[2], "Object keys still found");
+    my $misses = $rs->stats->{fetch_misses};
+    ok(!defined $rs->fetch("nonexistent"), "Missing key is undef");
+    my @missing = ($rs->fetch("nonexistent"));
+    is(scalar @missing, 1, "Missing key returns a single undef");
+    is($rs->stats->{fetch_misses}, $misses, "Frozen lookups not counted");
+    is(scalar $rs->fetch_a(1, 'typed'), 2, "Attribute count");
+    is_deeply([sort map { $_+0 } $rs->fetch_a(1, 'typed')],
+              [sort map { $_+0 } @values[0,1]], "Attribute values");
+    
+    is($rs->fetch_alias("plain"), $values[0], "Alias from frozen table");
+    my $into;
+    ok($rs->fetch_into("plain", $into) && $into == $values[0],
+       "Fetch into from frozen table");
+    ok(!$rs->fetch_into("nonexistent", $into) && !defined $into,
+       "Missing key fetched into");
+    ok($rs->lexists("plain") && !$rs->lexists("nonexistent"),
+       "Existence from frozen table");
+    ok($rs->lexists_kt(42, 'typed'), "Typed existence from frozen table");
+    is_deeply([sort map { $_+0 } $rs->fetch_a_alias(1, 'typed')],
+              [sort map { $_+0 } @values[0,1]], "Attribute aliases");
+    my @into;
+    is($rs->fetch_a_into(1, 'typed', \@into), 2, "Attribute fetch into");
+    is_deeply([sort map { $_+0 } @into],
+              [sort map { $_+0 } @values[0,1]], "Attribute values fetched into");
+    ok($rs->is_frozen, "Lookups leave the table frozen");
+    
+    my $vaddr = $values[3] + 0;
+    $rs->store("short-lived", $values[3]);
+    ok(!$rs->is_frozen, "Stores thaw the table");
+    $rs->freeze();
+    undef $values[3];
+    is($rs->fetch("short-lived") + 0, $vaddr,
+       "Frozen tables keep their values alive");
+    $rs->unlink("short-lived");
+    ok(!$rs->is_frozen, "Unlinking thaws the table");
+    ok(!defined $rs->fetch("short-lived"), "Unlinked key gone");
+    
+    $rs->freeze();
+    $rs->dissoc_a(1, 'typed', $values[0]);
+    ok(!$rs->is_frozen, "Dissociating thaws the table");
+    is(scalar $rs->fetch_a(1, 'typed'), 1, "Dissociated value gone");
+    $rs->freeze();
+    $rs->thaw();
+    ok(!$rs->is_frozen, "Explicit thaw");
+}
+
+sub test_directory {
+    my $dir = Ref::Store::XS::Directory->new(buckets => 2, stripes => 2);
+    $dir->store("session:$_", "owner$_") for (1..100);
+    is($dir->count, 100, "Entries stored");
+    is($dir->fetch("session:42"), "owner42", "Entry fetched after growth");
+    $dir->store(7, "seven");
+    is($dir->fetch("7"), "seven", "Integer keys");
+    ok($dir->delete("session:1"), "Entry deleted");
+    ok(!$dir->delete("session:1"), "Deleting twice");
+    ok(!defined $dir->fetch("session:1"), "Deleted entry gone");
+    
+    my $rs = $Impl->new();
+    my @values = map { ValueObject->new() } (0..2);
+    $rs->store("local$_", $values[$_]) for (0..2);
+    $rs->publish($dir, "local$_", "payload$_") for (0..2);
+    is($dir->fetch("local0"), "payload0", "Published entry");
+    
+    $rs->unlink("local0");
+    ok(!defined $dir->fetch("local0"), "Unlinking removes published entry");
+    $rs->purge($values[1]);
+    ok(!defined $dir->fetch("local1"), "Purging removes published entry");
+    
+    $dir->store("local2", "replaced");
+    undef $values[2];
+    is($dir->fetch("local2"), "replaced", "Replaced entries are left alone");
+    
+    eval { $rs->publish($dir, "nonexistent", 1) };
+    ok($@, "Keys must be stored before publishing");
+}
+
+sub test_persist {
+    use File::Temp qw(tempfile);
+    my (undef,$path) = tempfile(UNLINK => 1);
+    my %registry = map { $_ => ValueObject->new() } qw(first second);
+    my %names = map { $registry{$_} + 0 => $_ } keys %registry;
+    my $kobj = KeyObject->new();
+    
+    my $rs = $Impl->new();
+    $rs->register_kt('typed');
+    $rs->store("plain", $registry{first});
+    $rs->store_kt(42, 'typed', $registry{second}, StrongValue => 1);
+    $rs->store($kobj, $registry{second});
+    $rs->store_a(1, 'typed', $_) for values %registry;
+    $rs->save($path, sub { $names{$_[0] + 0} });
+    
+    my $loaded = ref($rs)->load($path, sub { $registry{$_[0]} });
+    is($loaded->fetch("plain"), $registry{first}, "String key loaded");
+    is($loaded->fetch_kt(42, 'typed'), $registry{second}, "Typed key loaded");
+    ok(!$loaded->fetch($kobj), "Object keys not saved");
+    is(scalar $loaded->fetch_a(1, 'typed'), 2, "Attributes loaded");
+    
+    $loaded->purge($registry{first});
+    ok(!$loaded->fetch("plain"), "Loaded entries are linked to their values");
+    is(scalar $loaded->fetch_a(1, 'typed'), 1, "Purge removes loaded attribute");
+    
+    my $strong = ref($rs)->load($path);
+    is(${ $strong->fetch_kt(42, 'typed') }, "second",
+       "Strong value survives without decoder");
+    ok(!$strong->fetch("plain"), "Weak value without referent is gone");
+    
+    #Corrupt copies of the file must be rejected before anything is built
+    #from their counts
+    my $saved = do {
+        open my $fh, "<", $path or die $!;
+        binmode($fh);
+        local $/;
+        <$fh>;
+    };
+    my $load_corrupt = sub {
+        my $data = shift;
+        my (undef,$cpath) = tempfile(UNLINK => 1);
+        open my $fh, ">", $cpath or die $!;
+        binmode($fh);
+        print $fh $data;
+        close($fh);
+        eval { ref($rs)->load($cpath) };
+        return $@;
+    };
+    
+    my $data = $saved;
+    substr($data, 28, 4, pack("L", 0xfffffff0));
+    like($load_corrupt->($data), qr/corrupt/, "Huge value count rejected");
+    like($load_corrupt->(substr($saved, 0, length($saved) - 8)), qr/corrupt/,
+         "Truncated file rejected");
+    
+    $data = $saved;
+    my $kpos = index($data, "plain");
+    substr($data, $kpos - 8, 4, pack("L", 1000));
+    like($load_corrupt->($data), qr/corrupt/,
+         "Prefix longer than its key rejected");
+}
+
+sub test_stats {
+    my $rs = $Impl->new();
+    $rs->register_kt('attr');
+    my $v = ValueObject->new();
+    $rs->store("k1", $v);
+    $rs->store("k2", $v);
+    $rs->store_a(1, 'attr', $v);
+    $rs->fetch("k1");
+    $rs->fetch("nonexistent");
+    
+    my $stats = $rs->stats;
+    is($stats->{stores}, 2, "Store counter");
+    is($stats->{fetch_hits}, 1, "Fetch hit counter");
+    is($stats->{fetch_misses}, 1, "Fetch miss counter");
+    is($stats->{attr_stores}, 1, "Attribute store counter");
+    is($stats->{forward_entries}, 2, "Forward entry count");
+    is($stats->{reverse_entries}, 1, "Reverse entry count");
+    ok($stats->{actions_created} >= $stats->{actions_freed},
+       "Action counters are sane");
+    
+    $rs->unlink("k1");
+    $rs->purge($v);
+    $stats = $rs->stats;
+    is($stats->{unlinks}, 1, "Unlink counter");
+    is($stats->{purges}, 1, "Purge counter");
+    ok($rs->is_empty, "Table empty after C unlink and purge");
+}
+
+sub test_memory_usage {
+    my $rs = $Impl->new();
+    $rs->register_kt('small');
+    $rs->register_kt('big');
+    my $base = $rs->memory_usage;
+    
+    my @values = map { ValueObject->new() } (1..10);
+    $rs->store_kt($_, 'small', $values[$_]) for (0..1);
+    $rs->store_kt("a much longer key string $_", 'big', $values[$_])
+        for (0..9);
+    my $kobj = KeyObject->new();
+    $rs->store($kobj, $values[0]);
+    $rs->store_a(1, 'small', $_) for @values;
+    
+    my $usage = $rs->memory_usage;
+    ok($usage->{total} > $base->{total}, "Usage grows with entries");
+    is($usage->{total},
+       $usage->{lookups} + $usage->{keys} + $usage->{attributes} +
+       $usage->{reverse} + $usage->{actions}, "Total is the sum of parts");
+    ok($usage->{actions} > 0, "Actions are accounted");
+    
+    my $by_type = $usage->{by_type};
+    is($by_type->{small}->{keys}, 2, "Key count for 'small'");
+    is($by_type->{small}->{attributes}, 1, "Attribute count for 'small'");
+    is($by_type->{big}->{keys}, 10, "Key count for 'big'");
+    is($by_type->{''}->{keys}, 1, "Object key counted as untyped");
+    ok($by_type->{big}->{key_bytes} > $by_type->{small}->{key_bytes},
+       "Larger key type reports more bytes");
+    
+    @values = ();
+    is($rs->memory_usage->{keys}, 0, "Key usage drops when values go away");
+}
+
+sub test_reserve {
+    my $rs = $Impl->new(expected_keys => 1000, expected_values => 500,
+                        expected_attrs => 100);
+    $rs->register_kt('attr');
+    my @values = map { ValueObject->new() } (1..500);
+    foreach my $i (0..999) {
+        $rs->store("key$i", $values[$i % 500]);
+    }
+    $rs->store_a($_ % 100, 'attr', $values[$_]) for (0..499);
+    is($rs->fetch("key999"), $values[499], "Fetch from pre-sized table");
+    is(scalar $rs->fetch_a(7, 'attr'), 5, "Attributes in pre-sized table");
+    
+    $rs->reserve(expected_keys => 5000);
+    is($rs->fetch("key0"), $values[0], "Entries survive reserve()");
+    
+    @values = ();
+    ok($rs->is_empty, "Pre-sized table empties normally");
+}
+
+sub test_ttl {
+    my $rs = $Impl->new();
+    $rs->register_kt('session');
+    my $now = time();
+    my $v1 = ValueObject->new();
+    my $v2 = ValueObject->new();
+    my $v3 = ValueObject->new();
+    
+    $rs->store("short", $v1, TTL => 10);
+    $rs->store("long", $v1, TTL => 100);
+    $rs->store_kt("typed", 'session', $v2, TTL => 10);
+    $rs->store_a(1, 'session', $v3, TTL => 10);
+    $rs->store("forever", $v3);
+    $rs->store("gone", $v2, TTL => 10);
+    $rs->unlink("gone");
+    is($rs->ttl_pending, 4, "Unlinked key taken off the wheel");
+    
+    is($rs->expire($now + 1), 0, "Nothing due yet");
+    is($rs->expire($now + 20), 3, "Short TTLs expired");
+    ok(!$rs->fetch("short"), "Expired key unlinked");
+    is($rs->fetch("long"), $v1, "Key with longer TTL remains");
+    ok(!$rs->fetch_kt("typed", 'session'), "Expired typed key unlinked");
+    is(scalar $rs->fetch_a(1, 'session'), 0, "Expired attribute unlinked");
+    is($rs->fetch("forever"), $v3, "Key without TTL remains");
+    
+    $rs->store("long", $v1, TTL => 1000);
+    is($rs->expire($now + 200), 0, "Storing again resets the deadline");
+    
+    undef $v1;
+    is($rs->ttl_pending, 0, "Collected key taken off the wheel");
+    
+    my $strong = ValueObject->new();
+    $rs->store("strong", $strong, StrongValue => 1, TTL => 5);
+    weaken($strong);
+    is($rs->expire($now + 3000), 1, "Strong value expired");
+    ok(!defined $strong, "Strong value released");
+}
+
+sub test_max_values {
+    my $rs = $Impl->new(max_values => 3);
+    $rs->register_kt('attr');
+    
+    my @values = map { ValueObject->new() } (1..3);
+    foreach my $i (1..3) {
+        $rs->store("key$i", $values[$i-1], StrongValue => 1);
+        $rs->store("alias$i", $values[$i-1]);
+    }
+    $rs->store_a(1, 'attr', $values[1]);
+    is($rs->max_values, 3, "Limit reported");
+    
+    #key1 and key3 are used, key2 is the oldest unused value
+    $rs->fetch("key1");
+    $rs->fetch("key3");
+    $rs->store("key4", ValueObject->new(), StrongValue => 1);
+    ok(!$rs->fetch("key2"), "Least recently used value evicted");
+    ok(!$rs->fetch("alias2"), "Eviction cascades to other keys");
+    is(scalar $rs->fetch_a(1, 'attr'), 0, "Eviction cascades to attributes");
+    ok($rs->fetch("key1") && $rs->fetch("key3") && $rs->fetch("key4"),
+       "Other values remain");
+    is($rs->stats->{evictions}, 1, "Eviction counted");
+    
+    $rs->set_max_values(1);
+    is(scalar(keys %{$rs->reverse}), 1, "Lowering the limit evicts");
+    
+    $rs->set_max_values(0);
+    $rs->store("key$_", ValueObject->new(), StrongValue => 1) for (5..8);
+    is(scalar(keys %{$rs->reverse}), 5, "Limit removed");
+}
+
+sub test_int_keys {
+    my $rs = $Impl->new();
+    my $v = ValueObject->new();
+    
+    $rs->store_ik(42, $v);
+    $rs->store_ik(-7, $v);
+    is($rs->fetch_ik(42), $v, "Fetch integer key");
+    is($rs->fetch_ik(-7), $v, "Fetch negative integer key");
+    ok(!$rs->fetch("42"), "Integer keys are separate from scalar keys");
+    ok($rs->lexists_ik(42), "lexists_ik");
+    ok(!$rs->is_empty, "Table not empty with only integer keys");
+    
+    eval { $rs->store_ik(42, ValueObject->new()) };
+    ok($@, "Storing a different value under an existing key dies");
+    
+    is($rs->unlink_ik(-7), $v, "unlink_ik returns value");
+    ok(!$rs->lexists_ik(-7), "Key gone after unlink");
+    
+    undef $v;
+    ok(!$rs->lexists_ik(42), "Key removed when value destroyed");
+    ok($rs->is_empty, "Table empty");
+    
+    my @values = map { ValueObject->new() } (1..1000);
+    $rs->store_ik($_, $values[$_ % 10]) for (0..999);
+    is(scalar(grep { $rs->fetch_ik($_) == $values[$_ % 10] } (0..999)),
+       1000, "Many keys survive growing the index");
+    $rs->unlink_ik($_) for grep { $_ % 2 } (0..999);
+    is(scalar(grep { $rs->lexists_ik($_) } (0..999)), 500,
+       "Lookups intact after deletions");
+    
+    $rs->store("other", $values[0]);
+    $rs->purge($values[0]);
+    ok(!$rs->lexists_ik(0) && !$rs->lexists_ik(10), "Purge removes integer keys");
+    ok($rs->lexists_ik(2), "Other values kept");
+    
+    $rs->store_ik(5000, ValueObject->new(), StrongValue => 1);
+    ok($rs->fetch_ik(5000), "StrongValue keeps value alive");
+    my $weak = $rs->fetch_ik(5000);
+    weaken($weak);
+    $rs->unlink_ik(5000);
+    ok(!$weak, "Unlinking releases strong value");
+    
+    my $rs2 = $Impl->new();
+    my $shared = ValueObject->new();
+    $rs->store_ik(1, $shared);
+    $rs2->store_ik(1, $shared);
+    $rs->unlink_ik(1);
+    is($rs2->fetch_ik(1), $shared, "Value keyed in two tables");
+    undef $rs2;
+    is($rs->fetch_ik(2), $values[2], "Destroying a table leaves others alone");
+}
+
+sub test_exchange_value {
+    my $rs = $Impl->new();
+    $rs->register_kt('attr');
+    my $old = ValueObject->new();
+    my $new = ValueObject->new();
+    my $okey = KeyObject->new();
+    
+    $rs->store("weak", $old);
+    $rs->store("strong", $old, StrongValue => 1);
+    $rs->store($okey, $old);
+    $rs->store_a(1, 'attr', $old);
+    $rs->store_ik(7, $old);
+    
+    $rs->exchange_value($old, $new);
+    is($rs->fetch("weak"), $new, "Scalar key moved");
+    is($rs->fetch("strong"), $new, "Strong key moved");
+    is($rs->fetch($okey), $new, "Object key moved");
+    is(($rs->fetch_a(1, 'attr'))[0], $new, "Attribute moved");
+    is($rs->fetch_ik(7), $new, "Integer key moved");
+    ok(!$rs->vexists($old), "Old value gone");
+    
+    undef $old;
+    is($rs->fetch("weak"), $new, "Old value's destruction has no effect");
+    
+    my $other = ValueObject->new();
+    $rs->store("other", $other);
+    eval { $rs->exchange_value($new, $other) };
+    ok($@, "Can't exchange into a stored value");
+    
+    my $wnew = $new;
+    weaken($wnew);
+    undef $new;
+    ok($wnew, "Strong entry holds the new value");
+    $rs->unlink("strong");
+    ok(!$wnew, "New value destroyed");
+    ok(!$rs->fetch("weak") && !$rs->fetch($okey), "Keys removed with new value");
+    is(scalar $rs->fetch_a(1, 'attr'), 0, "Attribute removed with new value");
+    ok(!$rs->lexists_ik(7), "Integer key removed with new value");
+}
+
+sub test_rekey {
+    my $rs = $Impl->new();
+    my $v = ValueObject->new();
+    $rs->store("old", $v);
+    $rs->store("alias", $v);
+    
+    is($rs->rekey("old", "new"), $v, "rekey returns value");
+    ok(!$rs->fetch("old"), "Old key gone");
+    is($rs->fetch("new"), $v, "New key stores value");
+    is($rs->rekey("new", "new"), $v, "Rekey to same key");
+    is($rs->fetch("new"), $v, "Key kept");
+    
+    my $okey = KeyObject->new();
+    $rs->rekey("new", $okey);
+    is($rs->fetch($okey), $v, "Rekey to object key");
+    
+    $rs->store("taken", ValueObject->new(), StrongValue => 1);
+    eval { $rs->rekey($okey, "taken") };
+    ok($@, "Rekey onto a different value dies");
+    is($rs->fetch($okey), $v, "Failed rekey leaves old key");
+    ok(!defined $rs->rekey("missing", "x"), "Rekey of missing key");
+}
+
+sub test_fetch_alias {
+    my $rs = $Impl->new();
+    $rs->register_kt('attr');
+    my $v = ValueObject->new();
+    my $okey = KeyObject->new();
+    $rs->store("key", $v);
+    $rs->store($okey, $v);
+    $rs->store_a(1, 'attr', $v);
+    
+    is($rs->fetch_alias("key"), $v, "fetch_alias (string key)");
+    is($rs->fetch_alias($okey), $v, "fetch_alias (object key)");
+    ok(!defined $rs->fetch_alias("missing"), "fetch_alias (missing)");
+    my $copy = $rs->fetch_alias("key");
+    ok(!isweak($copy), "Copy of alias is a strong reference");
+    
+    my $target;
+    ok($rs->fetch_into("key", $target), "fetch_into returns true");
+    is($target, $v, "fetch_into assigns value");
+    ok(!$rs->fetch_into("missing", $target), "fetch_into (missing)");
+    ok(!defined $target, "fetch_into clears target");
+    
+    my $v2 = ValueObject->new();
+    $rs->store_a(1, 'attr', $v2);
+    is_deeply([sort map { $_+0 } $rs->fetch_a_alias(1, 'attr')],
+              [sort map { $_+0 } ($v, $v2)], "fetch_a_alias");
+    is(scalar $rs->fetch_a_alias(1, 'attr'), 2, "fetch_a_alias (scalar)");
+    
+    my @values = (1..5);
+    is($rs->fetch_a_into(1, 'attr', \@values), 2, "fetch_a_into count");
+    is(scalar @values, 2, "Array truncated");
+    is_deeply([sort map { $_+0 } @values],
+              [sort map { $_+0 } ($v, $v2)], "fetch_a_into values");
+    is($rs->fetch_a_into(2, 'attr', \@values), 0, "fetch_a_into (missing)");
+    is(scalar @values, 0, "Array emptied");
+}
+
+sub test_ordered_index {
+    my $rs = $Impl->new();
+    $rs->register_kt('user');
+    $rs->register_kt('num');
+    $rs->register_kt('tag');
+    my @values = map { ValueObject->new() } (0..9);
+    
+    $rs->store_kt("42:session:$_", 'user', $values[$_]) for (0..2);
+    $rs->index_kt('user');
+    $rs->store_kt("43:session:0", 'user', $values[3]);
+    $rs->store_kt("42:profile", 'user', $values[4]);
+    $rs->store("42:session:9", $values[5]);
+    is($rs->index_count('user'), 5, "Existing and new keys indexed");
+    
+    is_deeply([$rs->fetch_prefix('user', '42:session:')], [@values[0..2]],
+              "Prefix scan, in order");
+    is(scalar $rs->fetch_prefix('user', '42:'), 4, "Prefix scan (scalar)");
+    is_deeply([$rs->fetch_range('user', '42:s', undef)], [@values[0..3]],
+              "Range with open upper bound");
+    
+    $rs->index_kt('num', Numeric => 1);
+    $rs->store_kt($_, 'num', $values[$_]) for (0..9);
+    is_deeply([$rs->fetch_range('num', 2, 10)], [@values[2..9]],
+              "Numeric range");
+    is_deeply([$rs->fetch_range('num', undef, 1)], [@values[0,1]],
+              "Numeric range with open lower bound");
+    eval { $rs->fetch_prefix('num', 1) };
+    ok($@, "No prefix scans on numeric indexes");
+    
+    $rs->unlink_kt("42:session:1", 'user');
+    undef $values[2];
+    is_deeply([$rs->fetch_prefix('user', '42:session:')], [$values[0]],
+              "Unlinked and destroyed keys leave the index");
+    
+    $rs->index_kt('tag');
+    $rs->store_a('b', 'tag', $values[7]);
+    $rs->store_a('a', 'tag', $values[6]);
+    $rs->store_a('a', 'tag', $values[8]);
+    is_deeply([sort map { $_+0 } $rs->fetch_range('tag', 'a', 'a')],
+              [sort map { $_+0 } @values[6,8]], "Attributes indexed");
+    is(($rs->fetch_range('tag', undef, undef))[-1], $values[7],
+       "Attributes ordered");
+    $rs->unlink_a('a', 'tag');
+    is($rs->index_count('tag'), 1, "Unlinked attributes leave the index");
+}
+
+sub test_attr_sets {
+    my $rs = $Impl->new(@_);
+    $rs->register_kt('color');
+    $rs->register_kt('size');
+    my @values = map { ValueObject->new() } (0..5);
+    $rs->store_a('red', 'color', $_) for @values[0..3];
+    $rs->store_a('blue', 'color', $_) for @values[4,5];
+    $rs->store_a('large', 'size', $_) for @values[1,3,5];
+    
+    my $sorted = sub { [ sort map { $_+0 } @_ ] };
+    ok($rs->has_a('red', 'color', $values[0]), "has_a");
+    ok(!$rs->has_a('blue', 'color', $values[0]), "has_a (not stored)");
+    
+    is_deeply($sorted->($rs->fetch_a_all(red => 'color', large => 'size')),
+              $sorted->(@values[1,3]), "Intersection");
+    is(scalar $rs->fetch_a_all(red => 'color', large => 'size'), 2,
+       "Intersection (scalar)");
+    is_deeply($sorted->($rs->fetch_a_any(blue => 'color', large => 'size')),
+              $sorted->(@values[1,3,4,5]), "Union");
+    is(scalar $rs->fetch_a_all(red => 'color', missing => 'color'), 0,
+       "Intersection with missing attribute");
+    is(scalar $rs->fetch_a_any(red => 'color', missing => 'color'), 4,
+       "Union with missing attribute");
+    
+    $rs->dissoc_a('large', 'size', $values[1]);
+    is_deeply([$rs->fetch_a_all(red => 'color', large => 'size')],
+              [$values[3]], "Dissociated values leave the set");
+    undef $values[3];
+    is(scalar $rs->fetch_a_all(red => 'color', large => 'size'), 0,
+       "Destroyed values leave the set");
+    eval { $rs->fetch_a_all('red') };
+    ok($@, "Attribute/type pairs required");
+}
+
+sub test_attr_bitmaps {
+    test_attr_sets(attr_bitmaps => 1);
+    
+    my $rs = $Impl->new();
+    $rs->register_kt('tag');
+    my @values = map { ValueObject->new() } (0..9999);
+    $rs->store_a($_ % 10, 'tag', $values[$_]) for (0..$#values);
+    $rs->store_a('all', 'tag', $_) for @values;
+    $rs->enable_attr_bitmaps();
+    ok(defined $rs->value_id($values[0]), "Existing values get IDs");
+    is(scalar $rs->fetch_a_all(3 => 'tag', all => 'tag'), 1000,
+       "Existing attributes get bitmaps");
+    is(scalar $rs->fetch_a_any(map { ($_, 'tag') } (0..9)), 10000,
+       "Union over many attributes");
+    
+    my $id = $rs->value_id($values[1]);
+    $rs->purge($values[1]);
+    ok(!defined $rs->value_id($values[1]), "Purged values lose their IDs");
+    my $v = ValueObject->new();
+    $rs->store_a('new', 'tag', $v);
+    is($rs->value_id($v), $id, "IDs are recycled");
+    is(scalar $rs->fetch_a_all(1 => 'tag'), 999, "Purged value left the set");
+    
+    #Enough destroyed values to have their IDs swept
+    splice(@values, 5000);
+    is(scalar $rs->fetch_a_all(all => 'tag'), 4999,
+       "Destroyed values are masked");
+    my @more = map { ValueObject->new() } (0..4999);
+    $rs->store_a('more', 'tag', $_) for @more;
+    is(scalar $rs->fetch_a_all(all => 'tag'), 4999,
+       "Recycled IDs don't inherit old attributes");
+    is(scalar $rs->fetch_a_all(more => 'tag'), 5000, "New values counted");
+    
+    $v = ValueObject->new();
+    $rs->exchange_value($more[0], $v);
+    ok($rs->has_a('more', 'tag', $v), "Exchanged value has the attribute");
+    is(scalar $rs->fetch_a_any(more => 'tag'), 5000,
+       "Exchanged value keeps its place in the set");
+}
+
+sub test_latency {
+    my $rs = $Impl->new(latency => 1);
+    $rs->register_kt('user');
+    my @values = map { ValueObject->new() } (0..99);
+    foreach my $i (0..$#values) {
+        $rs->store("k$i", $values[$i]);
+        $rs->store_kt($i, 'user', $values[$i]);
+        $rs->store_a('all', 'user', $values[$i]);
+    }
+    my $key = KeyObject->new();
+    $rs->store($key, $values[0]);
+    $rs->unlink("k1");
+    $rs->unlink_kt(2, 'user');
+    $rs->purge($values[3]);
+    undef $key;
+    splice(@values, 50);
+    
+    my $report = $rs->latency_report(reset => 1);
+    is($report->{store}{count}, 201, "Stores timed");
+    is($report->{store_a}{count}, 100, "Attribute stores timed");
+    is($report->{unlink}{count}, 2, "Unlinks timed");
+    is($report->{purge}{count}, 1, "Purges timed");
+    my $h = $report->{store};
+    ok($h->{min} <= $h->{p50} && $h->{p50} <= $h->{p99}
+       && $h->{p99} <= $h->{max}, "Percentiles are ordered");
+    
+    my $c = $report->{cascades};
+    is($c->{value}{latency}{count}, 50, "Destroyed values recorded");
+    ok($c->{value}{actions}{min} >= 3, "Actions counted");
+    ok($c->{value}{depth}{max} >= 2, "Nested deletions counted");
+    ok($c->{key}, "Key cascades recorded");
+    ok($c->{'key:user'}, "Typed key cascades recorded by type");
+    ok($c->{object_key}, "Object key cascades recorded");
+    
+    $report = $rs->latency_report();
+    is($report->{store}{count}, 0, "Reset clears operations");
+    ok(!%{$report->{cascades}}, "Reset clears cascades");
+    
+    $rs->enable_latency(0);
+    ok(!defined $rs->latency_report, "No report once disabled");
+    $rs->enable_latency();
+    undef $rs;
+    @values = ();
+    ok(1, "Values outliving their table");
+}
+
+{
+    package HRTests::FetchOverride;
+    our @ISA = ('Ref::Store::XS');
+    sub fetch { "overridden" }
+}
+
+sub test_fastcall {
+    require Ref::Store::PP;
+    my @tables = ($Impl->new(), $Impl->new(), Ref::Store::PP->new(),
+                  HRTests::FetchOverride->new(), $Impl->new());
+    my @values = map { ValueObject->new() } (0..$#tables);
+    
+    #The same call sites see each kind of table in turn
+    foreach my $round (1..3) {
+        foreach my $i (0..$#tables) {
+            my $ret = $tables[$i]->store("key", $values[$i], StrongValue => 1);
+            ok(!defined $ret, "Store returns nothing") if $i != 2;
+        }
+        foreach my $i (0..$#tables) {
+            my $expected = $i == 3 ? "overridden" : $values[$i];
+            is($tables[$i]->fetch("key"), $expected, "Fetch from table $i");
+        }
+    }
+    
+    my $rs = $tables[0];
+    foreach (1..3) {
+        my @list = ($rs->fetch("key"), $rs->fetch("missing"));
+        is(scalar @list, 2, "One value per fetch in list context");
+        ok(!defined $list[1], "Missing key is undef");
+        $rs->fetch("key");
+        my @none = $rs->store("other", $values[0]);
+        is(scalar @none, 0, "Store returns an empty list");
+        eval { $rs->fetch() };
+        ok($@, "Wrong number of arguments still dies");
+    }
+    is($rs->fetch("other"), $values[0], "Stored from the list context call");
+}
+
+sub test_c_api {
+    my $dir = Ref::Store::XS->api_include_dir;
+    ok(-e "$dir/hr_api.h", "API header installed alongside module");
+    ok(Ref::Store::XS::HRA_api_publish() >= 1, "API version published");
+    
+    #A client module, built against the installed header
+    SKIP : {
+        skip "Inline::C is needed to build the API client", 8
+            unless eval { require Inline; require Inline::C; 1 };
+        require File::Temp;
+        my $code = do {
+            open my $fh, "<", __DIR__ . "/api_client.c" or die $!;
+            local $/;
+            <$fh>;
+        };
+        Inline->bind(C => $code, INC => "-I$dir",
+                     DIRECTORY => File::Temp::tempdir(CLEANUP => 1));
+        
+        my $rs = $Impl->new();
+        my $v = ValueObject->new();
+        client_store($rs, "api_key", $v);
+        is($rs->fetch("api_key"), $v, "Stored through the API");
+        is(client_fetch($rs, "api_key"), $v, "Fetched through the API");
+        ok(!defined client_fetch($rs, "nonexistent"), "API fetch miss");
+        is(client_unlink($rs, "api_key"), $v, "Unlinked through the API");
+        ok(!defined $rs->fetch("api_key"), "Key gone after API unlink");
+        ok(!defined client_unlink($rs, "api_key"), "API unlink miss");
+        
+        my $destroyed = 0;
+        my $obj = ValueObject->new();
+        client_add_callback($obj, \$destroyed);
+        client_add_callback($obj, \$destroyed);
+        is($destroyed, 0, "Callback not yet called");
+        undef $obj;
+        is($destroyed, 1, "Callback called once on destruction");
+    }
+}
+
+sub test_on_evict {
+    my $rs = $Impl->new();
+    my (@batches,@keys,@vaddrs);
+    my $v1 = ValueObject->new();
+    my $v2 = ValueObject->new();
+    my $okey = KeyObject->new();
+    $rs->store("existing", $v1);
+    
+    my $cb = sub {
+        my ($keys,$vaddrs) = @_;
+        push @batches, scalar @$keys;
+        push @keys, @$keys;
+        push @vaddrs, @$vaddrs;
+    };
+    $rs->on_evict($cb, batch => 2);
+    
+    $rs->store("new", $v1);
+    $rs->store($okey, $v2);
+    $rs->store("other", $v2);
+    
+    $rs->unlink("existing");
+    is($rs->evictions_pending, 1, "Unlink queued");
+    ok(!@batches, "Nothing delivered before the batch is full");
+    
+    my $v1addr = $v1 + 0;
+    undef $v1;
+    is_deeply(\@batches, [2], "Batch delivered");
+    is_deeply([sort @keys], [qw(existing new)], "Keys reported");
+    is_deeply(\@vaddrs, [$v1addr, $v1addr], "Value addresses reported");
+    
+    $rs->on_evict($cb, batch => 10);
+    $rs->purge($v2);
+    is($rs->evictions_pending, 2, "Purge queued");
+    is($rs->flush_evictions, 2, "Flush delivers pending removals");
+    is_deeply([sort @keys[2,3]], [sort($okey+0, "other")],
+              "Object keys reported by address");
+    is($rs->flush_evictions, 0, "Nothing left to flush");
+    
+    my $v3 = ValueObject->new();
+    my $v4 = ValueObject->new();
+    $rs->store("from", $v3);
+    $rs->exchange_value($v3, $v4);
+    $rs->unlink("from");
+    $rs->flush_evictions();
+    is($vaddrs[-1], $v4+0, "Exchanged value reported");
+    
+    $rs->store("last", $v4);
+    $rs->on_evict(undef);
+    $rs->unlink("last");
+    is($rs->evictions_pending, 0, "Unsubscribed");
+    is(scalar @keys, 5, "No removals reported after unsubscribing");
+    
+    my $rs2 = $Impl->new();
+    my $n = 0;
+    $rs2->on_evict(sub { $n += @{$_[0]} }, batch => 100);
+    $rs2->store("key$_", $v4) for (1..10);
+    $rs2->unlink("key1");
+    undef $rs2;
+    is($n, 1, "Pending removals delivered on destruction, teardown not reported");
+    
+    my $rs3 = $Impl->new();
+    my $delivered = 0;
+    $rs3->on_evict(sub { $delivered++ }, batch => 10);
+    $rs3->store("errsv", $v4);
+    $rs3->unlink("errsv");
+    $@ = "pending error";
+    $rs3->flush_evictions();
+    ok($delivered, "Removal delivered");
+    is($@, "pending error", "Delivery leaves \$@ alone");
+    
+    $rs3->on_evict(sub { die "from callback" }, batch => 10);
+    $rs3->store("errsv", $v4);
+    $rs3->unlink("errsv");
+    {
+        local $SIG{__WARN__} = sub {};
+        $rs3->flush_evictions();
+    }
+    is($@, "pending error", "Callback errors don't leak into \$@");
+    
+    my $rs4 = $Impl->new();
+    my $va = ValueObject->new();
+    my $vb = ValueObject->new();
+    my $vc = ValueObject->new();
+    my @seen;
+    $rs4->store("a1", $va);
+    $rs4->store("a2", $va);
+    $rs4->store("b1", $vb);
+    $rs4->store("c1", $vc);
+    $rs4->on_evict(sub {
+        my ($keys) = @_;
+        push @seen, @$keys;
+        foreach my $k (@$keys) {
+            $rs4->purge($va) if $k eq 'b1';
+            $rs4->unlink("a2") if $k eq 'a1';
+            $rs4->store("late", $vb) if $k eq 'c1';
+        }
+    }, batch => 1);
+    $rs4->unlink("b1");
+    is_deeply([sort @seen], [qw(a1 a2 b1)], "Re-entrant callback removals delivered");
+    ok(!$rs4->vexists($va), "Table consistent after re-entrant purge");
+    undef $vc;
+    is($seen[-1], "c1", "Removal from a free delivered");
+    ok($rs4->fetch("late") == $vb, "Store from within a free's callback");
+    $rs4->unlink("late");
+    is($seen[-1], "late", "Stored key watched");
+}
+
 sub test_all {
     eval "require $Impl";
     subtest "Simple Scalar Keys"            => \&test_scalar_key;
@@ -476,6 +1352,9 @@ sub test_all {
 
     subtest "Duplicate Errors"              => \&test_oexcl;
     subtest "Typed Keys"                    => \&test_kt;
+    subtest "Capacity Hints"                => \&test_reserve;
+    subtest "Rekey"                         => \&test_rekey;
+    subtest "Attribute Sets"                => \&test_attr_sets;
     
     SKIP : {
         skip "PP Backend is crappy", 2 unless $Impl !~ /PP/;
@@ -491,6 +1370,91 @@ sub test_all {
         subtest "Iteration"                 => \&test_iter;
     }
     
+    SKIP : {
+        skip "Only implemented in XS", 1 unless $Impl =~ /XS/;
+        subtest "Shared Snapshots"          => \&test_snapshot;
+    }
+    
+    SKIP : {
+        skip "Only implemented in XS", 1 unless $Impl =~ /XS/;
+        subtest "Frozen Tables"             => \&test_freeze;
+    }
+    
+    SKIP : {
+        skip "Only implemented in XS", 1 unless $Impl =~ /XS/;
+        subtest "Shared Directories"        => \&test_directory;
+    }
+    
+    SKIP : {
+        skip "Only implemented in XS", 1 unless $Impl =~ /XS/;
+        subtest "Save and Load"             => \&test_persist;
+    }
+    
+    SKIP : {
+        skip "Only implemented in XS", 1 unless $Impl =~ /XS/;
+        subtest "Statistics"                => \&test_stats;
+    }
+    
+    SKIP : {
+        skip "Only implemented in XS", 1 unless $Impl =~ /XS/;
+        subtest "Memory Usage"              => \&test_memory_usage;
+    }
+    
+    SKIP : {
+        skip "Only implemented in XS", 1 unless $Impl =~ /XS/;
+        subtest "Expiry"                    => \&test_ttl;
+    }
+    
+    SKIP : {
+        skip "Only implemented in XS", 1 unless $Impl =~ /XS/;
+        subtest "Bounded Tables"            => \&test_max_values;
+    }
+    
+    SKIP : {
+        skip "Only implemented in XS", 1 unless $Impl =~ /XS/;
+        subtest "Integer Keys"              => \&test_int_keys;
+    }
+    
+    SKIP : {
+        skip "Only implemented in XS", 1 unless $Impl =~ /XS/;
+        subtest "Exchange Value"            => \&test_exchange_value;
+    }
+    
+    SKIP : {
+        skip "Only implemented in XS", 1 unless $Impl =~ /XS/;
+        subtest "Aliasing Fetch"            => \&test_fetch_alias;
+    }
+    
+    SKIP : {
+        skip "Only implemented in XS", 1 unless $Impl =~ /XS/;
+        subtest "Removal Notifications"     => \&test_on_evict;
+    }
+    
+    SKIP : {
+        skip "Only implemented in XS", 1 unless $Impl =~ /XS/;
+        subtest "C API"                     => \&test_c_api;
+    }
+    
+    SKIP : {
+        skip "Only implemented in XS", 1 unless $Impl =~ /XS/;
+        subtest "Ordered Indexes"           => \&test_ordered_index;
+    }
+    
+    SKIP : {
+        skip "Only implemented in XS", 1 unless $Impl =~ /XS/;
+        subtest "Attribute Bitmaps"         => \&test_attr_bitmaps;
+    }
+    
+    SKIP : {
+        skip "Only implemented in XS", 1 unless $Impl =~ /XS/;
+        subtest "Latency Histograms"        => \&test_latency;
+    }
+    
+    SKIP : {
+        skip "Only implemented in XS", 1 unless $Impl =~ /XS/;
+        subtest "Direct Calls"              => \&test_fastcall;
+    }
+    
     if($Impl =~ /XS/) {
         threads_test_all();
     } else {
@@ -150,6 +150,115 @@ sub threads_test_attr {
     ok($thr->join(), "Attribute Object");
 }
 
+sub threads_test_snapshot {
+    note "Testing threads (Shared snapshots)";
+    my $table = $Impl->new();
+    $table->store_sk("some_key", \"some_value", StrongValue => 1);
+    my $snap = $table->freeze_shared();
+    my $thr = threads->create(sub {
+        my $ok = $snap->fetch("some_key") eq "some_value";
+        sleep(1) while $snap->generation < 2;
+        return $ok && $snap->fetch("some_key") eq "other_value";
+    });
+    $table->unlink("some_key");
+    $table->store_sk("some_key", \"other_value", StrongValue => 1);
+    $table->freeze_shared();
+    ok($thr->join(), "Snapshot shared and republished across threads");
+}
+
+sub threads_test_parallel {
+    note "Testing threads (independent tables in parallel)";
+    my $nthreads = 4;
+    my $fn = sub {
+        my $id = shift;
+        my $table = $Impl->new();
+        $table->register_kt('ATTR');
+        foreach my $round (1..25) {
+            my @values = map { ValueObject->new() } (0..49);
+            foreach my $i (0..$#values) {
+                $table->store_sk("$id:$i", $values[$i]);
+                $table->store_sk($values[$i], $values[($i + 1) % @values]);
+                $table->store_a($i % 5, 'ATTR', $values[$i]);
+            }
+            foreach my $i (0..$#values) {
+                return 0 unless $table->fetch_sk("$id:$i") == $values[$i];
+            }
+            return 0 unless scalar $table->fetch_a(0, 'ATTR') == 10;
+            $table->purge($values[0]);
+            return 0 if $table->fetch_sk("$id:0");
+            @values = ();
+            return 0 unless $table->is_empty;
+        }
+        return 1;
+    };
+    my @thrs = map { threads->create($fn, $_) } (1..$nthreads);
+    ok($fn->(0), "Table used in parent while threads run");
+    is(scalar(grep { $_->join() } @thrs), $nthreads,
+       "Independent tables used concurrently");
+}
+
+sub threads_test_directory {
+    note "Testing threads (shared directories)";
+    my $dir = Ref::Store::XS::Directory->new();
+    my @thrs = map {
+        my $id = $_;
+        threads->create(sub {
+            my $table = $Impl->new();
+            my @values = map { ValueObject->new() } (0..99);
+            foreach my $i (0..$#values) {
+                $table->store("$id:$i", $values[$i]);
+                $table->publish($dir, "$id:$i", $id);
+            }
+            my $ok = 1;
+            foreach my $i (0..$#values) {
+                $ok &&= $dir->fetch("$id:$i") eq $id;
+            }
+            undef $table;
+            $ok &&= !defined $dir->fetch("$id:0");
+            return $ok;
+        });
+    } (1..4);
+    $dir->store("parent", "here");
+    is(scalar(grep { $_->join() } @thrs), 4,
+       "Threads publish and withdraw their own entries");
+    is($dir->count, 1, "Only the parent's entry remains");
+}
+
+sub threads_test_subscriptions {
+    note "Testing threads (removal notifications and publishing)";
+    my $table = $Impl->new();
+    my $dir = Ref::Store::XS::Directory->new();
+    my $v = ValueObject->new();
+    my @removed;
+    $table->store("sub_key", $v);
+    $table->store("pub_key", $v);
+    $table->publish($dir, "pub_key", "parent");
+    $table->on_evict(sub { push @removed, @{$_[0]} });
+    my $thr = threads->create(sub {
+        $table->unlink("sub_key");
+        $table->unlink("pub_key");
+        return "@removed" eq "sub_key pub_key"
+            && $dir->fetch("pub_key") eq "parent";
+    });
+    ok($thr->join(), "Clone reports its own removals, parent's entry stays");
+    ok(!@removed, "Parent's subscription not triggered by the clone");
+    $table->unlink("pub_key");
+    ok(!defined $dir->fetch("pub_key"), "Parent's key still withdraws its entry");
+}
+
+sub threads_test_max_values {
+    note "Testing threads (bounded tables)";
+    my $table = $Impl->new(max_values => 2);
+    my @values = map { ValueObject->new() } (0..2);
+    $table->store("bounded$_", $values[$_]) for (0..1);
+    my $thr = threads->create(sub {
+        return 0 unless $table->max_values == 2;
+        $table->store("bounded2", $values[2]);
+        return scalar(grep { $table->fetch("bounded$_") } (0..2)) == 2;
+    });
+    ok($thr->join(), "Limit kept and enforced in the clone");
+}
+
 sub threads_test_all {
     SKIP: {
         skip "Perl not threaded", 4 unless $can_use_threads;
@@ -160,6 +269,11 @@ sub threads_test_all {
         threads_test_attr();
         threads_test_attr_encap_single();
         threads_test_attr_encap_multi();
+        threads_test_snapshot();
+        threads_test_parallel();
+        threads_test_directory();
+        threads_test_subscriptions();
+        threads_test_max_values();
     }
 }
 
@@ -173,6 +287,11 @@ our @EXPORT = qw(
     threads_test_attr_encap_single
     threads_test_attr_encap_multi
     threads_test_attr_encap
+    threads_test_snapshot
+    threads_test_parallel
+    threads_test_directory
+    threads_test_subscriptions
+    threads_test_max_values
     threads_test_all
 );
 